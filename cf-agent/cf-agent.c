@@ -45,6 +45,7 @@
 #include <verify_files_utils.h>
 #include <verify_vars.h>
 #include <addr_lib.h>
+#include <file_lib.h>                    /* SetCloseOnExec */
 #include <files_names.h>
 #include <files_interfaces.h>
 #include <files_repository.h>
@@ -118,6 +119,19 @@ static const Rlist *ACCESSLIST = NULL; /* GLOBAL_P */
 static int CFA_BACKGROUND = 0; /* GLOBAL_X */
 static int CFA_BACKGROUND_LIMIT = 1; /* GLOBAL_P */
 
+#ifndef __MINGW32__
+/* A files promise running in a child process (background => "true") */
+typedef struct
+{
+    pid_t pid;
+    int fd;                        /* read end of the pipe with the results */
+    StringSet *paths;                     /* files it can touch, see PromisePaths() */
+    unsigned long class_serial;      /* EvalContextGlobalClassSerial() at the fork */
+} BackgroundPromise;
+
+static Seq *BACKGROUND_PROMISES = NULL; /* GLOBAL_X */
+#endif
+
 static Item *PROCESSREFRESH = NULL; /* GLOBAL_P */
 
 static const char *const AGENT_TYPESEQUENCE[] =
@@ -165,7 +179,7 @@ static int AutomaticBootstrap(GenericAgentConfig *config);
 static void BannerStatusEnd(PromiseResult status, const char *type, char *name);
 static void BannerStatusBegin(const char *type, char *name);
 static PromiseResult DefaultVarPromise(EvalContext *ctx, const Promise *pp);
-static void WaitForBackgroundProcesses();
+static void WaitForBackgroundProcesses(EvalContext *ctx);
 
 /*******************************************************************/
 /* Command line options                                            */
@@ -221,6 +235,7 @@ static const struct option OPTIONS[] =
     {"skip-bootstrap-service-start", no_argument, 0, 0 },
     {"skip-db-check", optional_argument, 0, 0 },
     {"simulate", required_argument, 0, 0},
+    {"validate-in-process", no_argument, 0, 0},
     {NULL, 0, 0, '\0'}
 };
 
@@ -257,6 +272,7 @@ static const char *const HINTS[] =
     "Do not start CFEngine services as part of the bootstrap process",
     "Do not run database integrity checks and repairs at startup",
     "Run in simulate mode, either 'manifest', 'manifest-full' or 'diff'",
+    "Validate changed policy while loading it instead of running cf-promises",
     NULL
 };
 
@@ -353,7 +369,7 @@ int main(int argc, char *argv[])
     /* Wait for background processes before generating reports because
      * GenerateReports() does nothing if it detects multiple cf-agent processes
      * running. */
-    WaitForBackgroundProcesses();
+    WaitForBackgroundProcesses(ctx);
 
     GenerateReports(config, ctx);
 
@@ -795,6 +811,10 @@ static GenericAgentConfig *CheckOpts(int argc, char **argv)
                     DoCleanupAndExit(EXIT_FAILURE);
                 }
             }
+            else if (StringEqual(option_name, "validate-in-process"))
+            {
+                config->validate_in_process = true;
+            }
             break;
         }
         default:
@@ -1599,6 +1619,28 @@ static void AllClassesReport(const EvalContext *ctx)
     }
 }
 
+/**
+ * Vars and classes promises are evaluated in every pass, but once they stop
+ * changing anything their outcome only changes when some class or variable
+ * does. Don't expand them again until then.
+ */
+static PromiseResult ExpandAgentPromise(EvalContext *ctx, const Promise *pp)
+{
+    PromiseResult result;
+    if (EvalContextPromiseIsUnchanged(ctx, pp, &result))
+    {
+        Log(LOG_LEVEL_DEBUG,
+            "Skipping %s promise with promiser '%s', nothing changed since its last evaluation (pass %d)",
+            PromiseGetPromiseType(pp), pp->promiser, EvalContextGetPass(ctx));
+        return result;
+    }
+
+    const unsigned long generation = EvalContextGetStateGeneration(ctx);
+    result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+    EvalContextPromiseEvaluated(ctx, pp, generation, result);
+    return result;
+}
+
 PromiseResult ScheduleAgentOperations(EvalContext *ctx, const Bundle *bp)
 // NB - this function can be called recursively through "methods"
 {
@@ -1648,7 +1690,7 @@ PromiseResult ScheduleAgentOperationsNormalOrder(EvalContext *ctx, const Bundle
 
                 EvalContextSetPass(ctx, pass);
 
-                PromiseResult promise_result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+                PromiseResult promise_result = ExpandAgentPromise(ctx, pp);
                 result = PromiseResultUpdate(result, promise_result);
 
                 if (EvalAborted(ctx) || BundleAbort(ctx))
@@ -1735,7 +1777,7 @@ PromiseResult ScheduleAgentOperationsTopDownOrder(EvalContext *ctx, const Bundle
 
             EvalContextStackPushBundleSectionFrame(ctx, parent_section);
 
-            PromiseResult promise_result = ExpandPromise(ctx, pp, KeepAgentPromise, NULL);
+            PromiseResult promise_result = ExpandAgentPromise(ctx, pp);
             result = PromiseResultUpdate(result, promise_result);
             if (EvalAborted(ctx) || BundleAbort(ctx))
             {
@@ -2220,43 +2262,361 @@ static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const
 
 #else /* !__MINGW32__ */
 
+/*
+ * Background files promises run in child processes. The child sends back
+ * what it changed in the parts of the EvalContext the rest of the run can
+ * see, one record per line:
+ *
+ *   =\t<kept>\t<repaired>\t<not kept>   promise counters
+ *   +\t<class>\t<tags>                   soft class defined
+ *   -\t<class>                           soft class undefined
+ *
+ * with qualified class names. The parent merges the records when it waits
+ * for the child, which happens at deterministic points only: before a files
+ * promise on an overlapping path is evaluated, before a new child is started
+ * for the children which already exited, and at the end of the run. A class
+ * the parent defined again after the fork is not undefined by the child.
+ */
+
+/**
+ * @return the part of #promiser before anything that could be a regular
+ *         expression, all files the promise can touch start with it
+ */
+static char *PathPrefix(const char *promiser)
+{
+    return xstrndup(promiser, strcspn(promiser, ".*+?()[]{}|^$\\"));
+}
+
+/**
+ * @return the path prefixes of the files #pp can touch: the promiser, and the
+ *         copy_from or link_from source, rename newname and template files
+ */
+static StringSet *PromisePaths(const Promise *pp)
+{
+    StringSet *paths = StringSetNew();
+    StringSetAdd(paths, PathPrefix(pp->promiser));
+
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (cp->rval.type != RVAL_TYPE_SCALAR ||
+            !(StringEqual(cp->lval, "source") ||
+              StringEqual(cp->lval, "newname") ||
+              StringEqual(cp->lval, "edit_template")))
+        {
+            continue;
+        }
+
+        const char *path = RvalScalarValue(cp->rval);
+        if (StringEqual(cp->lval, "newname") && !IsAbsoluteFileName(path))
+        {
+            /* Renamed within the directory of the promiser */
+            char *dir = PathPrefix(pp->promiser);
+            ChopLastNode(dir);
+            StringSetAdd(paths, dir);
+        }
+        else
+        {
+            StringSetAdd(paths, PathPrefix(path));
+        }
+    }
+
+    return paths;
+}
+
+static bool PathsOverlap(const StringSet *a, const StringSet *b)
+{
+    StringSetIterator it_a = StringSetIteratorInit((StringSet *) a);
+    const char *path_a;
+    while ((path_a = StringSetIteratorNext(&it_a)) != NULL)
+    {
+        StringSetIterator it_b = StringSetIteratorInit((StringSet *) b);
+        const char *path_b;
+        while ((path_b = StringSetIteratorNext(&it_b)) != NULL)
+        {
+            if (StringStartsWith(path_a, path_b) || StringStartsWith(path_b, path_a))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static StringSet *SoftClassesSnapshot(const EvalContext *ctx)
+{
+    StringSet *classes = StringSetNew();
+    ClassTableIterator *iter = EvalContextClassTableIteratorNewGlobal(ctx, NULL, false, true);
+    Class *cls;
+    while ((cls = ClassTableIteratorNext(iter)) != NULL)
+    {
+        StringSetAdd(classes, StringFormat("%s:%s", (cls->ns != NULL) ? cls->ns : "default",
+                                           cls->name));
+    }
+    ClassTableIteratorDestroy(iter);
+    return classes;
+}
+
+static void SendBackgroundResults(FILE *out, const EvalContext *ctx, const StringSet *classes_before,
+                                  int pr_kept, int pr_repaired, int pr_notkept)
+{
+    fprintf(out, "=\t%d\t%d\t%d\n",
+            PR_KEPT - pr_kept, PR_REPAIRED - pr_repaired, PR_NOTKEPT - pr_notkept);
+
+    StringSet *classes_after = SoftClassesSnapshot(ctx);
+
+    ClassTableIterator *iter = EvalContextClassTableIteratorNewGlobal(ctx, NULL, false, true);
+    Class *cls;
+    while ((cls = ClassTableIteratorNext(iter)) != NULL)
+    {
+        char *name = StringFormat("%s:%s", (cls->ns != NULL) ? cls->ns : "default", cls->name);
+        if (!StringSetContains(classes_before, name))
+        {
+            if (cls->tags != NULL)
+            {
+                Buffer *tags = StringSetToBuffer(cls->tags, ',');
+                fprintf(out, "+\t%s\t%s\n", name, BufferData(tags));
+                BufferDestroy(tags);
+            }
+            else
+            {
+                fprintf(out, "+\t%s\t\n", name);
+            }
+        }
+        free(name);
+    }
+    ClassTableIteratorDestroy(iter);
+
+    StringSetIterator it = StringSetIteratorInit((StringSet *) classes_before);
+    const char *name;
+    while ((name = StringSetIteratorNext(&it)) != NULL)
+    {
+        if (!StringSetContains(classes_after, name))
+        {
+            fprintf(out, "-\t%s\n", name);
+        }
+    }
+
+    StringSetDestroy(classes_after);
+}
+
+static void ReadBackgroundResults(EvalContext *ctx, BackgroundPromise *bg)
+{
+    FILE *in = fdopen(bg->fd, "r");
+    if (in == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Could not read the results of background process %ju (fdopen: %s)",
+            (uintmax_t) bg->pid, GetErrorStr());
+        close(bg->fd);
+    }
+    else
+    {
+        size_t line_size = CF_BUFSIZE;
+        char *line = xmalloc(line_size);
+        while (CfReadLine(&line, &line_size, in) > 0)
+        {
+            char *fields[4] = { line, NULL, NULL, NULL };
+            for (int i = 1; i < 4; i++)
+            {
+                char *tab = strchr(fields[i - 1], '\t');
+                if (tab == NULL)
+                {
+                    break;
+                }
+                *tab = '\0';
+                fields[i] = tab + 1;
+            }
+
+            if (StringEqual(fields[0], "=") && fields[3] != NULL)
+            {
+                PR_KEPT += atoi(fields[1]);
+                PR_REPAIRED += atoi(fields[2]);
+                PR_NOTKEPT += atoi(fields[3]);
+            }
+            else if (StringEqual(fields[0], "+") && fields[2] != NULL)
+            {
+                EvalContextClassPutSoft(ctx, fields[1], CONTEXT_SCOPE_NAMESPACE, fields[2]);
+            }
+            else if (StringEqual(fields[0], "-") && fields[1] != NULL)
+            {
+                ClassRef ref = ClassRefParse(fields[1]);
+                if (!EvalContextHeapRemoveSoftIfOlder(ctx, ref.ns, ref.name, bg->class_serial))
+                {
+                    Log(LOG_LEVEL_VERBOSE,
+                        "Not undefining class '%s' for background process %ju, it was defined again since",
+                        fields[1], (uintmax_t) bg->pid);
+                }
+                ClassRefDestroy(ref);
+            }
+            else
+            {
+                Log(LOG_LEVEL_ERR, "Unexpected result '%s' from background process %ju",
+                    line, (uintmax_t) bg->pid);
+            }
+        }
+        free(line);
+        fclose(in);
+    }
+}
+
+static void MergeBackgroundResults(EvalContext *ctx, BackgroundPromise *bg)
+{
+    ReadBackgroundResults(ctx, bg);
+
+    int status;
+    if (waitpid(bg->pid, &status, 0) == bg->pid)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Background process %ju terminated", (uintmax_t) bg->pid);
+    }
+}
+
+static void BackgroundPromiseDestroy(void *ptr)
+{
+    BackgroundPromise *bg = ptr;
+    StringSetDestroy(bg->paths);
+    free(bg);
+}
+
+/**
+ * Waits for the background promises which may touch any of #paths, or
+ * files under them, and merges their results.
+ */
+static void WaitForConflictingBackgroundPromises(EvalContext *ctx, const StringSet *paths)
+{
+    for (size_t i = 0; BACKGROUND_PROMISES != NULL && i < SeqLength(BACKGROUND_PROMISES); )
+    {
+        BackgroundPromise *bg = SeqAt(BACKGROUND_PROMISES, i);
+        if (PathsOverlap(paths, bg->paths))
+        {
+            Log(LOG_LEVEL_VERBOSE, "Waiting for background process %ju working on overlapping files",
+                (uintmax_t) bg->pid);
+            MergeBackgroundResults(ctx, bg);
+            SeqRemove(BACKGROUND_PROMISES, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/**
+ * Merges the results of the background promises whose process already
+ * exited, so that they no longer count against max_children.
+ */
+static void ReapFinishedBackgroundPromises(EvalContext *ctx)
+{
+    for (size_t i = 0; BACKGROUND_PROMISES != NULL && i < SeqLength(BACKGROUND_PROMISES); )
+    {
+        BackgroundPromise *bg = SeqAt(BACKGROUND_PROMISES, i);
+        int status;
+        if (waitpid(bg->pid, &status, WNOHANG) == bg->pid)
+        {
+            /* The pipe still holds everything the child wrote */
+            ReadBackgroundResults(ctx, bg);
+            Log(LOG_LEVEL_VERBOSE, "Background process %ju terminated", (uintmax_t) bg->pid);
+            SeqRemove(BACKGROUND_PROMISES, i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
 static PromiseResult ParallelFindAndVerifyFilesPromises(EvalContext *ctx, const Promise *pp)
 {
     int background = PromiseGetConstraintAsBoolean(ctx, "background", pp);
-    pid_t child = 1;
     PromiseResult result = PROMISE_RESULT_SKIPPED;
 
+    StringSet *paths = PromisePaths(pp);
+    WaitForConflictingBackgroundPromises(ctx, paths);
+
     if (background)
     {
-        if (CFA_BACKGROUND < CFA_BACKGROUND_LIMIT)
+        if (BACKGROUND_PROMISES == NULL)
+        {
+            BACKGROUND_PROMISES = SeqNew(CFA_BACKGROUND_LIMIT, BackgroundPromiseDestroy);
+        }
+        ReapFinishedBackgroundPromises(ctx);
+
+        int fds[2];
+        if ((int) SeqLength(BACKGROUND_PROMISES) >= CFA_BACKGROUND_LIMIT)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Promised parallel execution promised but exceeded the max number of promised background tasks, so serializing");
+            background = 0;
+        }
+        else if (pipe(fds) == -1)
+        {
+            Log(LOG_LEVEL_ERR, "Could not create a pipe for background process, so serializing (pipe: %s)",
+                GetErrorStr());
+            background = 0;
+        }
+        else
         {
             CFA_BACKGROUND++;
             Log(LOG_LEVEL_VERBOSE, "Spawning new process...");
-            child = fork();
 
+            StringSet *classes_before = SoftClassesSnapshot(ctx);
+            const unsigned long class_serial = EvalContextGlobalClassSerial(ctx);
+            const int pr_kept = PR_KEPT, pr_repaired = PR_REPAIRED, pr_notkept = PR_NOTKEPT;
+
+            pid_t child = fork();
             if (child == 0)
             {
                 ALARM_PID = -1;
+                close(fds[0]);
+                for (size_t i = 0; i < SeqLength(BACKGROUND_PROMISES); i++)
+                {
+                    close(((BackgroundPromise *) SeqAt(BACKGROUND_PROMISES, i))->fd);
+                }
+
+                FindAndVerifyFilesPromises(ctx, pp);
 
-                result = PromiseResultUpdate(result, FindAndVerifyFilesPromises(ctx, pp));
+                FILE *out = fdopen(fds[1], "w");
+                if (out != NULL)
+                {
+                    SendBackgroundResults(out, ctx, classes_before,
+                                          pr_kept, pr_repaired, pr_notkept);
+                    fclose(out);
+                }
 
                 Log(LOG_LEVEL_VERBOSE, "Exiting backgrounded promise");
                 PromiseRef(LOG_LEVEL_VERBOSE, pp);
                 _exit(EXIT_SUCCESS);
-                // TODO: need to solve this
             }
-        }
-        else
-        {
-            Log(LOG_LEVEL_VERBOSE, "Promised parallel execution promised but exceeded the max number of promised background tasks, so serializing");
-            background = 0;
+
+            StringSetDestroy(classes_before);
+            close(fds[1]);
+
+            if (child == -1)
+            {
+                Log(LOG_LEVEL_ERR, "Could not fork background process, so serializing (fork: %s)",
+                    GetErrorStr());
+                close(fds[0]);
+                background = 0;
+            }
+            else
+            {
+                SetCloseOnExec(fds[0], true);
+
+                BackgroundPromise *bg = xmalloc(sizeof(BackgroundPromise));
+                bg->pid = child;
+                bg->fd = fds[0];
+                bg->paths = paths;
+                bg->class_serial = class_serial;
+                paths = NULL;
+                SeqAppend(BACKGROUND_PROMISES, bg);
+            }
         }
     }
-    else
+
+    if (!background)
     {
         result = PromiseResultUpdate(result, FindAndVerifyFilesPromises(ctx, pp));
     }
 
+    StringSetDestroy(paths);
     return result;
 }
 
@@ -2440,13 +2800,26 @@ static int AutomaticBootstrap(ARG_UNUSED GenericAgentConfig *config)
 
 #endif // Avahi
 
-static void WaitForBackgroundProcesses()
+static void WaitForBackgroundProcesses(EvalContext *ctx)
 {
 #ifdef __MINGW32__
     /* no fork() on Windows */
+    UNUSED(ctx);
     return;
 #else
     Log(LOG_LEVEL_VERBOSE, "Waiting for background processes");
+
+    /* First the files promises, their results still count for this run. */
+    if (BACKGROUND_PROMISES != NULL)
+    {
+        for (size_t i = 0; i < SeqLength(BACKGROUND_PROMISES); i++)
+        {
+            MergeBackgroundResults(ctx, SeqAt(BACKGROUND_PROMISES, i));
+        }
+        SeqDestroy(BACKGROUND_PROMISES);
+        BACKGROUND_PROMISES = NULL;
+    }
+
     bool have_children = true;
     while (have_children)
     {
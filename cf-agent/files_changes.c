@@ -33,6 +33,7 @@
 #include <actuator.h>
 #include <eval_context.h>
 #include <known_dirs.h>
+#include <verify_files_hashes.h>                     /* HashFileSequential */
 
 bool IsChangeSilenced(const Attributes *attr, FileChangeSilence categories)
 {
@@ -84,11 +85,34 @@ void RecordFileChange(EvalContext *ctx, const Promise *pp, const Attributes *att
 #define CHANGES_HASH_STRING_LEN 7
 #define CHANGES_HASH_FILE_NAME_OFFSET  CHANGES_HASH_STRING_LEN+1
 
+/*
+  Besides the digest, the "H" entry records the stat() information of the
+  file when it was hashed, the file is only hashed again once it changes.
+  Entries written by older versions only hold the digest, they are read with
+  have_stat unset.
+*/
 typedef struct
 {
     unsigned char mess_digest[EVP_MAX_MD_SIZE + 1];     /* Content digest */
+    unsigned char have_stat;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
 } ChecksumValue;
 
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+# define STAT_MTIME_NS(sb) ((int64_t) (sb)->st_mtim.tv_sec * 1000000000 + (sb)->st_mtim.tv_nsec)
+# define STAT_CTIME_NS(sb) ((int64_t) (sb)->st_ctim.tv_sec * 1000000000 + (sb)->st_ctim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+# define STAT_MTIME_NS(sb) ((int64_t) (sb)->st_mtimespec.tv_sec * 1000000000 + (sb)->st_mtimespec.tv_nsec)
+# define STAT_CTIME_NS(sb) ((int64_t) (sb)->st_ctimespec.tv_sec * 1000000000 + (sb)->st_ctimespec.tv_nsec)
+#else
+# define STAT_MTIME_NS(sb) ((int64_t) (sb)->st_mtime * 1000000000)
+# define STAT_CTIME_NS(sb) ((int64_t) (sb)->st_ctime * 1000000000)
+#endif
+
 static bool GetDirectoryListFromDatabase(CF_DB *db, const char * path, Seq *files);
 static bool FileChangesSetDirectoryList(CF_DB *db, const char *path, const Seq *files, bool *change);
 
@@ -123,7 +147,8 @@ static void DeleteIndexKey(char *key)
     free(key);
 }
 
-static ChecksumValue *NewHashValue(unsigned char digest[EVP_MAX_MD_SIZE + 1])
+static ChecksumValue *NewHashValue(unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                                   const struct stat *sb)
 {
     ChecksumValue *chk_val;
 
@@ -131,25 +156,49 @@ static ChecksumValue *NewHashValue(unsigned char digest[EVP_MAX_MD_SIZE + 1])
 
     memcpy(chk_val->mess_digest, digest, EVP_MAX_MD_SIZE + 1);
 
+    /* Timestamps have a limited resolution, a file modified in the current
+     * second could change again without stat() telling, so it is hashed
+     * again next time. */
+    const time_t now = time(NULL);
+    if (sb != NULL && sb->st_mtime < now && sb->st_ctime < now)
+    {
+        chk_val->have_stat = 1;
+        chk_val->dev = sb->st_dev;
+        chk_val->ino = sb->st_ino;
+        chk_val->size = sb->st_size;
+        chk_val->mtime_ns = STAT_MTIME_NS(sb);
+        chk_val->ctime_ns = STAT_CTIME_NS(sb);
+    }
+
     return chk_val;
 }
 
+static bool HashValueMatchesStat(const ChecksumValue *chk_val, const struct stat *sb)
+{
+    return chk_val->have_stat &&
+        chk_val->dev == (uint64_t) sb->st_dev &&
+        chk_val->ino == (uint64_t) sb->st_ino &&
+        chk_val->size == (int64_t) sb->st_size &&
+        chk_val->mtime_ns == STAT_MTIME_NS(sb) &&
+        chk_val->ctime_ns == STAT_CTIME_NS(sb);
+}
+
 static void DeleteHashValue(ChecksumValue *chk_val)
 {
     free(chk_val);
 }
 
-static bool ReadHash(CF_DB *dbp, HashMethod type, const char *name, unsigned char digest[EVP_MAX_MD_SIZE + 1])
+static bool ReadHash(CF_DB *dbp, HashMethod type, const char *name, ChecksumValue *chk_val)
 {
     char *key;
     int size;
-    ChecksumValue chk_val;
 
     key = NewIndexKey(type, name, &size);
 
-    if (ReadComplexKeyDB(dbp, key, size, (void *) &chk_val, sizeof(ChecksumValue)))
+    /* Older, shorter entries leave the rest of the value zeroed */
+    memset(chk_val, 0, sizeof(ChecksumValue));
+    if (ReadComplexKeyDB(dbp, key, size, (void *) chk_val, sizeof(ChecksumValue)))
     {
-        memcpy(digest, chk_val.mess_digest, EVP_MAX_MD_SIZE + 1);
         DeleteIndexKey(key);
         return true;
     }
@@ -160,14 +209,15 @@ static bool ReadHash(CF_DB *dbp, HashMethod type, const char *name, unsigned cha
     }
 }
 
-static int WriteHash(CF_DB *dbp, HashMethod type, const char *name, unsigned char digest[EVP_MAX_MD_SIZE + 1])
+static int WriteHash(CF_DB *dbp, HashMethod type, const char *name, unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                     const struct stat *sb)
 {
     char *key;
     ChecksumValue *value;
     int ret, keysize;
 
     key = NewIndexKey(type, name, &keysize);
-    value = NewHashValue(digest);
+    value = NewHashValue(digest, sb);
     ret = WriteComplexKeyDB(dbp, key, keysize, value, sizeof(ChecksumValue));
     DeleteIndexKey(key);
     DeleteHashValue(value);
@@ -489,13 +539,14 @@ static bool FileChangesSetDirectoryList(CF_DB *db, const char *path, const Seq *
 }
 
 /**
+ * @brief Hashes #filename, unless its stat() information shows it did not
+ *        change since the digest in the database was computed
  * @return %false if #filename never seen before, and adds a checksum to the
  *         database; %true if hashes do not match and also updates database to
  *         the new value if #update is true.
  */
 bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
                                    const char *filename,
-                                   unsigned char digest[EVP_MAX_MD_SIZE + 1],
                                    HashMethod type,
                                    const Attributes *attr,
                                    const Promise *pp,
@@ -504,7 +555,10 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
     assert(attr != NULL);
 
     const int size = HashSizeFromId(type);
-    unsigned char dbdigest[EVP_MAX_MD_SIZE + 1];
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    ChecksumValue stored;
+    struct stat sb;
+    bool hashed = false;
     CF_DB *dbp;
     bool found;
     bool different;
@@ -518,10 +572,22 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
         return false;
     }
 
-    if (ReadHash(dbp, type, filename, dbdigest))
+    found = ReadHash(dbp, type, filename, &stored);
+
+    if (found && !attr->change.paranoid_hashing &&
+        stat(filename, &sb) != -1 && HashValueMatchesStat(&stored, &sb))
+    {
+        Log(LOG_LEVEL_DEBUG, "File '%s' did not change since it was last hashed", filename);
+        memcpy(digest, stored.mess_digest, EVP_MAX_MD_SIZE + 1);
+    }
+    else
+    {
+        hashed = HashFileSequential(filename, digest, type, &sb);
+    }
+
+    if (found)
     {
-        found = true;
-        different = (memcmp(digest, dbdigest, size) != 0);
+        different = (memcmp(digest, stored.mess_digest, size) != 0);
         if (different && !IsChangeSilenced(attr, FILE_CHANGE_SILENCE_CONTENT))
         {
             Log(LOG_LEVEL_INFO, "Hash '%s' for '%s' changed!", HashNameFromId(type), filename);
@@ -556,7 +622,7 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
                              HashPrintSafe(buffer, sizeof(buffer), digest, type, true));
             *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
 
-            WriteHash(dbp, type, filename, digest);
+            WriteHash(dbp, type, filename, digest, hashed ? &sb : NULL);
             ret = found;
         }
         else
@@ -572,6 +638,14 @@ bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
         RecordNoChange(ctx, pp, attr, "File hash for %s is correct", filename);
         *result = PromiseResultUpdate(*result, PROMISE_RESULT_NOOP);
         ret = false;
+
+        /* Same content, but touched or recorded without stat() information,
+         * remember the new one to avoid hashing the file again next time. */
+        if (hashed && !HashValueMatchesStat(&stored, &sb) &&
+            (EVAL_MODE == EVAL_MODE_NORMAL) && (attr->transaction.action != cfa_warn))
+        {
+            WriteHash(dbp, type, filename, digest, &sb);
+        }
     }
 
     CloseDB(dbp);
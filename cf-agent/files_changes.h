@@ -54,7 +54,6 @@ typedef enum
 bool FileChangesLogChange(const char *file, FileState status, char *msg, const Promise *pp);
 bool FileChangesCheckAndUpdateHash(EvalContext *ctx,
                                    const char *filename,
-                                   unsigned char digest[EVP_MAX_MD_SIZE + 1],
                                    HashMethod type,
                                    const Attributes *attr,
                                    const Promise *pp,
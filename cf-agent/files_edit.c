@@ -177,6 +177,7 @@ end:
     if (ec != NULL)
     {
         DeleteItemList(ec->file_start);
+        MapDestroy(ec->line_index.lines);
         free(ec->changes_filename);
         free(ec);
     }
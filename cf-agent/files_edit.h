@@ -27,6 +27,7 @@
 
 #include <cf3.defs.h>
 #include <file_lib.h>
+#include <map.h>
 
 #ifdef HAVE_LIBXML2
 #include <libxml/parser.h>
@@ -41,11 +42,23 @@
                                    copy equal to the copied template file - not the
                                    copied + edited file. */
 
+/* Index of the lines of EditContext::file_start used by edit_line. It is
+ * valid as long as num_edits matches the one of the EditContext, insertions
+ * made by edit_line keep it up to date, any other edit invalidates it. */
+typedef struct
+{
+    Map *lines;                 /* line -> first Item with that content */
+    Item *tail;                 /* last Item of file_start */
+    Item *before_tail;          /* Item preceding tail */
+    int num_edits;
+} EditLineIndex;
+
 typedef struct
 {
     char *filename;
     char *changes_filename;
     Item *file_start;
+    EditLineIndex line_index;
     int num_edits;
     int pass;  // Current convergence pass (1 to CF_DONEPASSES-1)
 #ifdef HAVE_LIBXML2
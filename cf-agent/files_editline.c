@@ -100,6 +100,136 @@ static PromiseResult HandleSelectRegionFailure(EvalContext *ctx, const Promise *
 static bool MultiLineString(char *s);
 static bool InsertFileAtLocation(EvalContext *ctx, Item **start, Item *begin_ptr, Item *end_ptr, Item *location, Item *prev, const Attributes *a, const Promise *pp, EditContext *edcontext, PromiseResult *result);
 
+/*****************************************************************************/
+/* Line index                                                                */
+/*****************************************************************************/
+
+/* Looking for a line in the file used to be a walk over the whole list with
+ * a comparison on each line, which made inserting many lines into big files
+ * quadratic. The index (see EditLineIndex) is built when first needed and
+ * after edits other than insertions. */
+
+static EditLineIndex *GetValidLineIndex(EditContext *edcontext)
+{
+    EditLineIndex *index = &(edcontext->line_index);
+    if ((index->lines == NULL) || (index->num_edits != edcontext->num_edits))
+    {
+        return NULL;
+    }
+    return index;
+}
+
+static EditLineIndex *GetLineIndex(EditContext *edcontext)
+{
+    EditLineIndex *index = GetValidLineIndex(edcontext);
+    if (index != NULL)
+    {
+        return index;
+    }
+
+    index = &(edcontext->line_index);
+    MapDestroy(index->lines);
+    index->lines = MapNew(StringHash_untyped, StringEqual_untyped, NULL, NULL);
+    index->tail = NULL;
+    index->before_tail = NULL;
+
+    for (Item *ip = edcontext->file_start; ip != NULL; ip = ip->next)
+    {
+        if ((ip->name != NULL) && !MapHasKey(index->lines, ip->name))
+        {
+            MapInsert(index->lines, ip->name, ip);
+        }
+        index->before_tail = index->tail;
+        index->tail = ip;
+    }
+
+    index->num_edits = edcontext->num_edits;
+    return index;
+}
+
+static bool FileHasLine(EditContext *edcontext, const char *line)
+{
+    return MapHasKey(GetLineIndex(edcontext)->lines, line);
+}
+
+/**
+ * @brief Checks if the first line of the (possibly multi-line) #chunk is in
+ *        the file, a chunk can only be in the file if it is
+ */
+static bool FileHasFirstLine(EditContext *edcontext, const char *chunk)
+{
+    const char *nl = strchr(chunk, '\n');
+    if (nl == NULL)
+    {
+        return FileHasLine(edcontext, chunk);
+    }
+
+    char *first_line = xstrndup(chunk, nl - chunk);
+    bool ret = FileHasLine(edcontext, first_line);
+    free(first_line);
+    return ret;
+}
+
+/**
+ * @brief Records #item, just inserted after #prev (NULL if at the start of
+ *        the file), in the index if it was valid before the insertion
+ */
+static void LineIndexAdd(EditContext *edcontext, EditLineIndex *index, Item *prev, Item *item)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+
+    if (!MapHasKey(index->lines, item->name))
+    {
+        MapInsert(index->lines, item->name, item);
+    }
+
+    if (prev == index->tail)
+    {
+        index->before_tail = index->tail;
+        index->tail = item;
+    }
+    else if (prev == index->before_tail)
+    {
+        index->before_tail = item;
+    }
+
+    index->num_edits = edcontext->num_edits;
+}
+
+static void EditPrependLine(EditContext *edcontext, Item **start, const char *line)
+{
+    assert(start == &(edcontext->file_start));
+
+    EditLineIndex *index = GetValidLineIndex(edcontext);
+    PrependItemList(start, line);
+    (edcontext->num_edits)++;
+    LineIndexAdd(edcontext, index, NULL, *start);
+}
+
+/**
+ * @brief Same as InsertAfter(), also counting the edit and keeping the line
+ *        index up to date
+ */
+static void EditInsertLineAfter(EditContext *edcontext, Item **start, Item *after, const char *line)
+{
+    assert(start == &(edcontext->file_start));
+
+    EditLineIndex *index = GetValidLineIndex(edcontext);
+    if ((index != NULL) && ((*start == NULL) || (after == NULL)))
+    {
+        /* InsertAfter() appends to the file in this case, the index knows
+         * where the end is without walking the list. */
+        after = index->tail;
+    }
+
+    InsertAfter(start, after, line);
+    (edcontext->num_edits)++;
+    LineIndexAdd(edcontext, index, after, (after != NULL) ? after->next : *start);
+}
+
 /*****************************************************************************/
 /* Level                                                                     */
 /*****************************************************************************/
@@ -1096,6 +1226,29 @@ static bool InsertMultipleLinesToRegion(EvalContext *ctx, Item **start, Item *be
          * begin_ptr.
          * As a bonus Redmine #7640 is fixed as we are not interested in
          * matching values outside of the region we are iterating over. */
+        if (!allow_multi_lines && (begin_ptr != NULL) && !FileHasFirstLine(edcontext, pp->promiser))
+        {
+            /* The chunk cannot be anywhere in the region, only look for the
+             * last line of the region. */
+            ip = begin_ptr;
+            if (end_ptr == NULL)
+            {
+                const EditLineIndex *index = GetLineIndex(edcontext);
+                ip = index->tail;
+                prev = (ip == begin_ptr) ? NULL : index->before_tail;
+            }
+            else
+            {
+                while ((ip->next != NULL) && (ip->next != end_ptr))
+                {
+                    prev = ip;
+                    ip = ip->next;
+                }
+            }
+
+            return InsertMultipleLinesAtLocation(ctx, start, begin_ptr, end_ptr, ip, prev, a, pp, edcontext, result);
+        }
+
         for (ip = begin_ptr; ip != NULL; ip = ip->next)
         {
             if (!allow_multi_lines && MatchRegion(ctx, pp->promiser, ip, end_ptr, false))
@@ -1901,8 +2054,23 @@ static bool MatchPolicy(EvalContext *ctx, const char *camel, const char *haystac
     return ok;
 }
 
-static bool IsItemInRegion(EvalContext *ctx, const char *item, const Item *begin_ptr, const Item *end_ptr, Rlist *insert_match, const Promise *pp)
+static bool IsItemInRegion(EvalContext *ctx, EditContext *edcontext, const char *item,
+                           const Item *begin_ptr, const Item *end_ptr, Rlist *insert_match, const Promise *pp)
 {
+    if (insert_match == NULL)
+    {
+        /* Without an insert_match policy the lines have to be equal, so only
+         * look at the region if the line is somewhere in the file. */
+        if (!FileHasLine(edcontext, item))
+        {
+            return false;
+        }
+        if ((item[0] != '\0') && (begin_ptr == edcontext->file_start) && (end_ptr == NULL))
+        {
+            return true;
+        }
+    }
+
     for (const Item *ip = begin_ptr; ((ip != end_ptr) && (ip != NULL)); ip = ip->next)
     {
         if (MatchPolicy(ctx, item, ip->name, insert_match, pp))
@@ -1969,7 +2137,7 @@ static bool InsertFileAtLocation(EvalContext *ctx, Item **start, Item *begin_ptr
             continue;
         }
 
-        if (!preserve_block && IsItemInRegion(ctx, BufferData(exp), begin_ptr, end_ptr, a->insert_match, pp))
+        if (!preserve_block && IsItemInRegion(ctx, edcontext, BufferData(exp), begin_ptr, end_ptr, a->insert_match, pp))
         {
             RecordNoChange(ctx, pp, a, "Promised file line '%s' exists within file '%s'",
                            BufferData(exp), edcontext->filename);
@@ -2081,7 +2249,7 @@ static bool InsertCompoundLineAtLocation(EvalContext *ctx, const char *chunk, It
             continue;
         }
 
-        if (!preserve_block && IsItemInRegion(ctx, buf, begin_ptr, end_ptr, a->insert_match, pp))
+        if (!preserve_block && IsItemInRegion(ctx, edcontext, buf, begin_ptr, end_ptr, a->insert_match, pp))
         {
             RecordNoChange(ctx, pp, a,
                            "Promised chunk '%s' exists within selected region of '%s'",
@@ -2181,8 +2349,7 @@ static bool InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start,
                 }
                 else
                 {
-                    PrependItemList(start, newline);
-                    (edcontext->num_edits)++;
+                    EditPrependLine(edcontext, start, newline);
                     RecordChange(ctx, pp, a, "Inserted the promised line '%s' into '%s'",
                                  newline, edcontext->filename);
                     *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -2199,8 +2366,7 @@ static bool InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start,
                 }
                 else
                 {
-                    PrependItemList(start, newline);
-                    (edcontext->num_edits)++;
+                    EditPrependLine(edcontext, start, newline);
                     RecordChange(ctx, pp, a, "Prepended the promised line '%s' to %s", newline,
                                  edcontext->filename);
                     *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -2233,8 +2399,7 @@ static bool InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start,
             }
             else
             {
-                InsertAfter(start, prev, newline);
-                (edcontext->num_edits)++;
+                EditInsertLineAfter(edcontext, start, prev, newline);
                 RecordChange(ctx, pp, a, "Inserted the promised line '%s' into '%s' before locator",
                              newline, edcontext->filename);
                 *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
@@ -2259,11 +2424,10 @@ static bool InsertLineAtLocation(EvalContext *ctx, char *newline, Item **start,
             }
             else
             {
-                InsertAfter(start, location, newline);
+                EditInsertLineAfter(edcontext, start, location, newline);
                 RecordChange(ctx, pp, a, "Inserted the promised line '%s' into '%s' after locator",
                              newline, edcontext->filename);
                 *result = PromiseResultUpdate(*result, PROMISE_RESULT_CHANGE);
-                (edcontext->num_edits)++;
                 return true;
             }
         }
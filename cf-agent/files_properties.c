@@ -46,7 +46,7 @@ static const char *const SKIPFILES[] =
 };
 
 /* TODO rework to accept only one param: path+nodename */
-static bool ConsiderFile(const char *nodename, const char *path, struct stat *stat)
+static bool ConsiderFile(const char *nodename, const char *path, const struct stat *stat)
 {
     int i;
 
@@ -108,6 +108,11 @@ bool ConsiderLocalFile(const char *filename, const char *directory)
     }
 }
 
+bool ConsiderLocalFileStat(const char *filename, const char *directory, const struct stat *sb)
+{
+    return ConsiderFile(filename, directory, sb);
+}
+
 bool ConsiderAbstractFile(const char *filename, const char *directory, const FileCopy *fc, AgentConnection *conn)
 {
     /* First check if the file should be avoided, e.g. ".." - before sending
@@ -36,6 +36,12 @@ void AddFilenameToListOfSuspicious(const char *filename);
  */
 bool ConsiderLocalFile(const char *filename, const char *path);
 
+/*
+ * Same as ConsiderLocalFile(), with #sb being the result of lstat() of
+ * #filename done by the caller (NULL if it failed).
+ */
+bool ConsiderLocalFileStat(const char *filename, const char *path, const struct stat *sb);
+
 bool ConsiderAbstractFile(const char *nodename, const char *path, const FileCopy *fc, AgentConnection *conn);
 
 #endif
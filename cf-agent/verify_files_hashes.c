@@ -34,6 +34,80 @@
 #include <misc_lib.h>
 #include <eval_context.h>
 #include <known_dirs.h>
+#include <file_lib.h>                                         /* safe_open */
+
+/* Hashing is bound by I/O, big reads keep the number of system calls low. */
+#define HASH_FILE_BUFFER_SIZE (1024 * 1024)
+
+bool HashFileSequential(const char *filename, unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                        HashMethod type, struct stat *sb)
+{
+    assert(sb != NULL);
+
+    const EVP_MD *const md = HashDigestFromId(type);
+    if (md == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Could not determine function for file hashing (type=%d)", (int) type);
+        return false;
+    }
+
+    const int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        Log(LOG_LEVEL_INFO, "Cannot open file '%s' for hashing. (open: %s)",
+            filename, GetErrorStr());
+        return false;
+    }
+
+    if (fstat(fd, sb) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Cannot stat file '%s' for hashing. (fstat: %s)",
+            filename, GetErrorStr());
+        close(fd);
+        return false;
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+    /* Let the kernel read ahead aggressively, the file is read only once. */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if (context == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Could not allocate openssl hash context");
+        close(fd);
+        return false;
+    }
+    EVP_DigestInit(context, md);
+
+    unsigned char *buffer = xmalloc(HASH_FILE_BUFFER_SIZE);
+    bool success = true;
+    ssize_t len;
+    while ((len = read(fd, buffer, HASH_FILE_BUFFER_SIZE)) != 0)
+    {
+        if (len == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            Log(LOG_LEVEL_ERR, "Failed to read file '%s' for hashing. (read: %s)",
+                filename, GetErrorStr());
+            success = false;
+            break;
+        }
+        EVP_DigestUpdate(context, buffer, len);
+    }
+
+    unsigned int digest_len;
+    EVP_DigestFinal(context, digest, &digest_len);
+
+    free(buffer);
+    EVP_MD_CTX_free(context);
+    close(fd);
+    return success;
+}
 
 bool CompareFileHashes(const char *file1, const char *file2, const struct stat *sstat, const struct stat *dstat, const FileCopy *fc, AgentConnection *conn)
 {
@@ -48,8 +122,15 @@ bool CompareFileHashes(const char *file1, const char *file2, const struct stat *
 
     if (conn == NULL)
     {
-        HashFile(file1, digest1, CF_DEFAULT_DIGEST, false);
-        HashFile(file2, digest2, CF_DEFAULT_DIGEST, false);
+        struct stat sb;
+        if (!HashFileSequential(file1, digest1, CF_DEFAULT_DIGEST, &sb) ||
+            !HashFileSequential(file2, digest2, CF_DEFAULT_DIGEST, &sb))
+        {
+            /* Not comparable, so treat them as different */
+            Log(LOG_LEVEL_VERBOSE, "Could not hash '%s' or '%s', assuming they differ",
+                file1, file2);
+            return true;
+        }
 
         for (i = 0; i < EVP_MAX_MD_SIZE; i++)
         {
@@ -28,6 +28,15 @@
 #ifndef CFENGINE_VERIFY_FILES_HASHES_H
 #define CFENGINE_VERIFY_FILES_HASHES_H
 
+/**
+ * @brief Like HashFile(), but reads the file in large sequential chunks
+ * @param sb set to the stat() information of the hashed file, taken before
+ *           reading it
+ * @return %false if the file could not be read, #digest is then undefined
+ */
+bool HashFileSequential(const char *filename, unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                        HashMethod type, struct stat *sb);
+
 bool CompareFileHashes(const char *file1, const char *file2, const struct stat *sstat, const struct stat *dstat, const FileCopy *fc, AgentConnection *conn);
 bool CompareBinaryFiles(const char *file1, const char *file2, const struct stat *sstat, const struct stat *dstat, const FileCopy *fc, AgentConnection *conn);
 
@@ -56,6 +56,7 @@
 #include <comparray.h>
 #include <string_lib.h>
 #include <files_lib.h>
+#include <file_lib.h>                   /* safe_open(), IsFileSep() */
 #include <rlist.h>
 #include <policy.h>
 #include <scope.h>
@@ -66,7 +67,7 @@
 #include <retcode.h>
 #include <cf-agent-enterprise-stubs.h>
 #include <conn_cache.h>
-#include <stat_cache.h>                      /* remote_stat,StatCacheLookup */
+#include <stat_cache.h>    /* remote_stat,StatCacheLookup,StatCacheFetchManifest */
 #include <known_dirs.h>
 #include <changes_chroot.h>     /* PrepareChangesChroot(), RecordFileChangedInChroot() */
 #include <unix.h>               /* GetGroupName(), GetUserName() */
@@ -93,10 +94,12 @@ static PromiseResult VerifyCopy(EvalContext *ctx, const char *source, char *dest
                                 CompressedArray **inode_cache, AgentConnection *conn);
 static PromiseResult TouchFile(EvalContext *ctx, char *path, const Attributes *attr, const Promise *pp);
 static PromiseResult VerifyFileAttributes(EvalContext *ctx, const char *file, const struct stat *dstat, const Attributes *attr, const Promise *pp);
+#ifdef __MINGW32__
 static bool PushDirState(EvalContext *ctx, const Promise *pp, const Attributes *attr, char *name, const struct stat *sb, PromiseResult *result);
 static bool PopDirState(EvalContext *ctx, const Promise *pp, const Attributes *attr, int goback, char *name, const struct stat *sb,
                         DirectoryRecursion r, PromiseResult *result);
 static bool CheckLinkSecurity(const struct stat *sb, const char *name);
+#endif
 static bool CompareForFileCopy(char *sourcefile, char *destfile, const struct stat *ssb, const struct stat *dsb, const FileCopy *fc, AgentConnection *conn);
 static void FileAutoDefine(EvalContext *ctx, char *destfile);
 static void TruncateFile(const char *name);
@@ -2833,17 +2836,169 @@ bool HandleFileObstruction(EvalContext *ctx, const char *path, const struct stat
     return true;
 }
 
+/* Directory being walked by DepthSearch(). Subdirectories are opened relative
+ * to the descriptor of their parent and checked against the stat data their
+ * entry was selected with, so the walk does not depend on the path of the
+ * directory not being swapped under our feet. */
+typedef struct
+{
+#ifndef __MINGW32__
+    int fd;
+    DIR *dirp;
+#else
+    Dir *dirh;
+#endif
+} SearchDir;
+
+/**
+ * @brief Opens directory #name for DepthSearch() and makes it the current
+ *        working directory (the leaf operations expect it to be the parent
+ *        directory of the leaf)
+ * @param parent directory containing #name as #nodename, NULL for the root
+ *               of the search
+ * @param sb stat data of the directory #name was selected with
+ * @return false if the directory could not be opened
+ */
+static bool OpenSearchDir(EvalContext *ctx, const Promise *pp, const Attributes *attr,
+                          ARG_UNUSED const SearchDir *parent, char *name, ARG_UNUSED const char *nodename,
+                          const struct stat *sb, SearchDir *dir, PromiseResult *result)
+{
+#ifndef __MINGW32__
+    const char *changes_name = ToChangesPath(name);
+    int fd;
+    if (parent == NULL)
+    {
+        fd = safe_open(changes_name, O_RDONLY);
+    }
+    else
+    {
+        /* Links to directories were already checked by the caller and are
+         * only ever followed with travlinks. */
+        const int nofollow = attr->recursion.travlinks ? 0 : O_NOFOLLOW;
+        fd = openat(parent->fd, nodename, O_RDONLY | O_DIRECTORY | nofollow);
+    }
+
+    if (fd == -1)
+    {
+        RecordFailure(ctx, pp, attr, "Could not open directory '%s' (mode '%04jo', open: %s)",
+                      name, (uintmax_t)(sb->st_mode & 07777), GetErrorStr());
+        *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
+        return false;
+    }
+
+    struct stat security;
+    if (fstat(fd, &security) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Could not stat directory '%s' after opening. (fstat: %s)",
+            name, GetErrorStr());
+    }
+    else if ((sb->st_dev != security.st_dev) || (sb->st_ino != security.st_ino))
+    {
+        Log(LOG_LEVEL_ERR,
+            "SERIOUS SECURITY ALERT: path race exploited in recursion to '%s'. Not safe for agent to continue - aborting",
+            name);
+        close(fd);
+        FatalError(ctx, "Not safe to continue");
+    }
+
+    if (fchdir(fd) == -1)
+    {
+        RecordFailure(ctx, pp, attr, "Could not change to directory '%s' (fchdir: %s)",
+                      name, GetErrorStr());
+        *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
+        close(fd);
+        return false;
+    }
+
+    dir->dirp = fdopendir(fd);
+    if (dir->dirp == NULL)
+    {
+        Log(LOG_LEVEL_INFO, "Could not open existing directory '%s'. (fdopendir: %s)", name, GetErrorStr());
+        close(fd);
+        return false;
+    }
+    dir->fd = fd;
+#else
+    if (!PushDirState(ctx, pp, attr, name, sb, result))
+    {
+        /* PushDirState() reports errors and updates 'result' in case of failures */
+        return false;
+    }
+
+    if ((dir->dirh = DirOpen(".")) == NULL)
+    {
+        Log(LOG_LEVEL_INFO, "Could not open existing directory '%s'. (opendir: %s)", name, GetErrorStr());
+        return false;
+    }
+#endif
+    return true;
+}
+
+static const struct dirent *ReadSearchDir(SearchDir *dir)
+{
+#ifndef __MINGW32__
+    return readdir(dir->dirp);
+#else
+    return DirRead(dir->dirh);
+#endif
+}
+
+/**
+ * @brief lstat()s, or stat()s if #follow is true, entry #nodename of #dir
+ */
+static int StatSearchEntry(ARG_UNUSED const SearchDir *dir, const char *nodename, struct stat *sb, bool follow)
+{
+#ifndef __MINGW32__
+    return fstatat(dir->fd, nodename, sb, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+    return follow ? stat(nodename, sb) : lstat(nodename, sb);
+#endif
+}
+
+/**
+ * @brief Gets back to #dir after a search of one of its subdirectories
+ * @return true if it is safe for the agent to continue execution
+ */
+static bool ReturnToSearchDir(EvalContext *ctx, const Promise *pp, const Attributes *attr,
+                              ARG_UNUSED const SearchDir *dir, ARG_UNUSED int goback, char *name,
+                              ARG_UNUSED const struct stat *sb,
+                              PromiseResult *result)
+{
+#ifndef __MINGW32__
+    /* The descriptor always refers to the directory we opened, no matter
+     * what happened to its path in the meantime. */
+    if (fchdir(dir->fd) == -1)
+    {
+        RecordFailure(ctx, pp, attr,
+                      "Error in backing out of recursive descent securely to '%s'. (fchdir: %s)",
+                      name, GetErrorStr());
+        *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
+        return false;
+    }
+    return true;
+#else
+    return PopDirState(ctx, pp, attr, goback, name, sb, attr->recursion, result);
+#endif
+}
+
+static void CloseSearchDir(SearchDir *dir)
+{
+#ifndef __MINGW32__
+    closedir(dir->dirp);                         /* also closes dir->fd */
+#else
+    DirClose(dir->dirh);
+#endif
+}
+
+static bool DepthSearchDir(EvalContext *ctx, const SearchDir *parent, char *name,
+                           const char *nodename, const struct stat *sb, int rlevel,
+                           const Attributes *attr, const Promise *pp, dev_t rootdevice,
+                           PromiseResult *result);
+
 bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel, const Attributes *attr,
                 const Promise *pp, dev_t rootdevice, PromiseResult *result)
 {
     assert(attr != NULL);
-    Dir *dirh;
-    int goback;
-    const struct dirent *dirp;
-    struct stat lsb;
-    Seq *db_file_set = NULL;
-    Seq *selected_files = NULL;
-    bool retval = true;
 
     if (!attr->havedepthsearch)  /* if the search is trivial, make sure that we are in the parent dir of the leaf */
     {
@@ -2874,6 +3029,21 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
         }
     }
 
+    return DepthSearchDir(ctx, NULL, name, NULL, sb, rlevel, attr, pp, rootdevice, result);
+}
+
+static bool DepthSearchDir(EvalContext *ctx, const SearchDir *parent, char *name,
+                           const char *nodename, const struct stat *sb, int rlevel,
+                           const Attributes *attr, const Promise *pp, dev_t rootdevice,
+                           PromiseResult *result)
+{
+    int goback;
+    const struct dirent *dirp;
+    struct stat lsb;
+    Seq *db_file_set = NULL;
+    Seq *selected_files = NULL;
+    bool retval = true;
+
     if (rlevel > CF_RECURSION_LIMIT)
     {
         RecordWarning(ctx, pp, attr,
@@ -2883,15 +3053,10 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
         return false;
     }
 
-    if (!PushDirState(ctx, pp, attr, name, sb, result))
+    SearchDir dir;
+    if (!OpenSearchDir(ctx, pp, attr, parent, name, nodename, sb, &dir, result))
     {
-        /* PushDirState() reports errors and updates 'result' in case of failures */
-        return false;
-    }
-
-    if ((dirh = DirOpen(".")) == NULL)
-    {
-        Log(LOG_LEVEL_INFO, "Could not open existing directory '%s'. (opendir: %s)", name, GetErrorStr());
+        /* OpenSearchDir() reports errors and updates 'result' in case of failures */
         return false;
     }
 
@@ -2904,32 +3069,44 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
                           "Failed to get directory listing for recording file changes in '%s'", name);
             *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
             SeqDestroy(db_file_set);
+            CloseSearchDir(&dir);
             return false;
         }
         selected_files = SeqNew(1, &free);
     }
 
+    /* The entries are appended to the directory path, build it only once. */
     char path[CF_BUFSIZE];
-    for (dirp = DirRead(dirh); dirp != NULL; dirp = DirRead(dirh))
+    size_t prefix_len = strlcpy(path, name, sizeof(path));
+    if ((prefix_len > 0) && (prefix_len < sizeof(path) - 1) && !IsFileSep(path[prefix_len - 1]))
+    {
+        path[prefix_len++] = FILE_SEPARATOR;
+        path[prefix_len] = '\0';
+    }
+
+    for (dirp = ReadSearchDir(&dir); dirp != NULL; dirp = ReadSearchDir(&dir))
     {
-        if (!ConsiderLocalFile(dirp->d_name, name))
+        const bool have_stat = (StatSearchEntry(&dir, dirp->d_name, &lsb, false) != -1);
+        const int stat_errno = errno;
+        if (!ConsiderLocalFileStat(dirp->d_name, name, have_stat ? &lsb : NULL))
         {
             continue;
         }
 
-        size_t total_len = strlcpy(path, name, sizeof(path));
-        if ((total_len >= sizeof(path)) || (JoinPaths(path, sizeof(path), dirp->d_name) == NULL))
+        if ((prefix_len >= sizeof(path)) ||
+            (strlcpy(path + prefix_len, dirp->d_name, sizeof(path) - prefix_len) >= sizeof(path) - prefix_len))
         {
             RecordFailure(ctx, pp, attr,
                           "Internal limit reached in DepthSearch(), path too long: '%s' + '%s'",
-                          path, dirp->d_name);
+                          name, dirp->d_name);
             *result = PromiseResultUpdate(*result, PROMISE_RESULT_FAIL);
             retval = false;
             goto end;
         }
 
-        if (lstat(dirp->d_name, &lsb) == -1)
+        if (!have_stat)
         {
+            errno = stat_errno;
             Log(LOG_LEVEL_VERBOSE, "Recurse was looking at '%s' when an error occurred. (lstat: %s)", path, GetErrorStr());
             continue;
         }
@@ -2959,7 +3136,7 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
 
             /* if so, hide the difference by replacing with actual object */
 
-            if (stat(dirp->d_name, &lsb) == -1)
+            if (StatSearchEntry(&dir, dirp->d_name, &lsb, true) == -1)
             {
                 RecordFailure(ctx, pp, attr,
                               "Recurse was working on '%s' when this failed. (stat: %s)",
@@ -2985,8 +3162,9 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
             if ((attr->recursion.depth > 1) && (rlevel <= attr->recursion.depth))
             {
                 Log(LOG_LEVEL_VERBOSE, "Entering '%s', level %d", path, rlevel);
-                goback = DepthSearch(ctx, path, &lsb, rlevel + 1, attr, pp, rootdevice, result);
-                if (!PopDirState(ctx, pp, attr, goback, name, sb, attr->recursion, result))
+                goback = DepthSearchDir(ctx, &dir, path, dirp->d_name, &lsb, rlevel + 1,
+                                        attr, pp, rootdevice, result);
+                if (!ReturnToSearchDir(ctx, pp, attr, &dir, goback, name, sb, result))
                 {
                     FatalError(ctx, "Not safe to continue");
                 }
@@ -3033,10 +3211,11 @@ bool DepthSearch(EvalContext *ctx, char *name, const struct stat *sb, int rlevel
 end:
     SeqDestroy(selected_files);
     SeqDestroy(db_file_set);
-    DirClose(dirh);
+    CloseSearchDir(&dir);
     return retval;
 }
 
+#ifdef __MINGW32__
 static bool PushDirState(EvalContext *ctx, const Promise *pp, const Attributes *attr, char *name, const struct stat *sb, PromiseResult *result)
 {
     const char *changes_name = (ToChangesPath(name));
@@ -3120,6 +3299,7 @@ static bool CheckLinkSecurity(const struct stat *sb, const char *name)
 
     return true;
 }
+#endif /* __MINGW32__ */
 
 static PromiseResult VerifyCopiedFileAttributes(EvalContext *ctx, const char *src, const char *dest, const struct stat *sstat,
                                                 const struct stat *dstat, const Attributes *a, const Promise *pp)
@@ -3309,6 +3489,21 @@ static PromiseResult CopyFileSources(EvalContext *ctx, char *destination, const
 
         Log(LOG_LEVEL_VERBOSE, "Entering directory '%s'", source);
 
+        if (conn != NULL)
+        {
+            /* Get the whole tree in one request if the server can, instead
+             * of listing and statting it file by file. */
+            const Stat *cached = StatCacheLookup(conn, source, conn->this_server);
+            if (cached == NULL || cached->cf_dirlist == NULL)
+            {
+                const FileComparator compare = attr->copy.compare;
+                const bool digests = (compare == FILE_COMPARATOR_CHECKSUM ||
+                                      compare == FILE_COMPARATOR_HASH ||
+                                      compare == FILE_COMPARATOR_BINARY);
+                StatCacheFetchManifest(conn, source, attr->recursion.depth, digests);
+            }
+        }
+
         result = PromiseResultUpdate(
             result, SourceSearchAndCopy(ctx, source, destination,
                                         attr->recursion.depth, attr, pp,
@@ -3375,9 +3570,15 @@ static ProtocolVersion DecideProtocol(const EvalContext *ctx,
     }
 }
 
+/**
+ * @param have_fallback whether there are other servers to try after
+ *                      #servername, so that it can be skipped if it was
+ *                      unreachable recently
+ */
 static AgentConnection *FileCopyConnectionOpen(const EvalContext *ctx,
                                                const char *servername,
-                                               const FileCopy *fc, bool background)
+                                               const FileCopy *fc, bool background,
+                                               bool have_fallback)
 {
     ConnectionFlags flags = {
         .protocol_version = DecideProtocol(ctx, fc->protocol_version),
@@ -3404,6 +3605,11 @@ static AgentConnection *FileCopyConnectionOpen(const EvalContext *ctx,
         {
             return conn;
         }
+        else if (have_fallback && ConnCache_IsOffline(servername, port, flags))
+        {
+            /* Failed recently, don't wait for the timeout again. */
+            return NULL;
+        }
         else                    /* not found, open and cache new connection */
         {
             int err = 0;
@@ -3415,12 +3621,8 @@ static AgentConnection *FileCopyConnectionOpen(const EvalContext *ctx,
 
             if (conn == NULL)                           /* Couldn't connect */
             {
-                /* Allocate and add to the cache as failure. */
-                conn = NewAgentConn(servername, port, flags);
-                conn->conn_info->status = CONNECTIONINFO_STATUS_NOT_ESTABLISHED;
-
-                ConnCache_Add(conn, CONNCACHE_STATUS_OFFLINE);
-
+                /* Remember the failure so that we don't retry right away. */
+                ConnCache_MarkOffline(servername, port, flags);
                 return NULL;
             }
             else
@@ -3485,7 +3687,8 @@ PromiseResult ScheduleCopyOperation(EvalContext *ctx, char *destination, const A
         }
 
         conn = FileCopyConnectionOpen(ctx, servername, &(attr->copy),
-                                      attr->transaction.background);
+                                      attr->transaction.background,
+                                      rp->next != NULL);
         if (conn == NULL)
         {
             Log(LOG_LEVEL_INFO, "Unable to establish connection to '%s'",
@@ -3694,15 +3897,12 @@ PromiseResult ScheduleLinkChildrenOperation(EvalContext *ctx, char *destination,
 static PromiseResult VerifyFileIntegrity(EvalContext *ctx, const char *file, const Attributes *attr, const Promise *pp)
 {
     assert(attr != NULL);
-    unsigned char digest1[EVP_MAX_MD_SIZE + 1];
 
     if ((attr->change.report_changes != FILE_CHANGE_REPORT_CONTENT_CHANGE) && (attr->change.report_changes != FILE_CHANGE_REPORT_ALL))
     {
         return PROMISE_RESULT_NOOP;
     }
 
-    memset(digest1, 0, EVP_MAX_MD_SIZE + 1);
-
     PromiseResult result = PROMISE_RESULT_NOOP;
     bool changed = false;
 
@@ -3715,9 +3915,7 @@ static PromiseResult VerifyFileIntegrity(EvalContext *ctx, const char *file, con
      * "Content changed" on the next run (CFE-3725). */
     assert(attr->change.hash != HASH_METHOD_BEST);
 
-    HashFile(file, digest1, attr->change.hash, false);
-
-    changed = FileChangesCheckAndUpdateHash(ctx, file, digest1, attr->change.hash, attr, pp, &result);
+    changed = FileChangesCheckAndUpdateHash(ctx, file, attr->change.hash, attr, pp, &result);
 
     if (changed && MakingInternalChanges(ctx, pp, attr, &result, "record integrity changes in '%s'", file))
     {
@@ -36,6 +36,8 @@
 #include <eval_context.h>
 #include <regex.h> // CompileRegex()
 #include <buffer.h> // BufferData()
+#include <map.h>
+#include <set.h>
 
 #include <cf3.defs.h>
 #include <verify_methods.h>
@@ -57,6 +59,9 @@
 /* Use pw_scan() and gr_scan() to implement fgetpwent() and
  * fgetgrent() on FreeBSD. */
 #include <libutil.h>
+
+struct group *fgetgrent(FILE *stream);
+struct passwd *fgetpwent(FILE *stream);
 #endif
 
 #define CFUSR_CHECKBIT(v,p) ((v) & (1UL << (p)))
@@ -206,45 +211,367 @@ end:
 }
 #endif // _AIX
 
+/*
+ * Snapshot of the local account database (/etc/passwd, /etc/group and
+ * /etc/shadow), indexed by name and gid. It is read once and kept between
+ * users promises, until one of them changes accounts or one of the files is
+ * replaced or modified by something else.
+ *
+ * The files are read with fgetpwent() and friends instead of getpwnam() and
+ * friends, to guarantee that only local accounts are seen, and not for
+ * example accounts from LDAP.
+ */
+
+typedef struct
+{
+    bool exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+} AccountFileId;
+
+typedef struct
+{
+    char *name;
+    gid_t gid;
+} LocalGroup;
+
+typedef struct
+{
+    AccountFileId passwd_id;
+    AccountFileId group_id;
+    AccountFileId shadow_id;
+
+    Map *users;                 /* user name -> struct passwd * */
+    Map *groups_by_name;        /* group name -> LocalGroup * */
+    Map *groups_by_gid;         /* gid -> LocalGroup *, not owned */
+    Map *memberships;           /* user name -> StringSet of secondary groups */
+#if HAVE_FGETSPENT
+    Map *shadow;                /* user name -> password hash, NULL if no shadow */
+#endif
+} LocalAccounts;
+
+static LocalAccounts *LOCAL_ACCOUNTS = NULL; /* GLOBAL_X */
+
+static void AccountFileIdGet(const char *path, AccountFileId *id)
+{
+    struct stat statbuf;
+    if (stat(path, &statbuf) == -1)
+    {
+        *id = (AccountFileId) { .exists = false };
+        return;
+    }
+
+    *id = (AccountFileId) {
+        .exists = true,
+        .dev = statbuf.st_dev,
+        .ino = statbuf.st_ino,
+        .size = statbuf.st_size,
+        .mtime = statbuf.st_mtime,
+    };
+}
+
+static bool AccountFileIdEqual(const AccountFileId *a, const AccountFileId *b)
+{
+    if (!a->exists || !b->exists)
+    {
+        return (a->exists == b->exists);
+    }
+    return (a->dev == b->dev && a->ino == b->ino &&
+            a->size == b->size && a->mtime == b->mtime);
+}
+
+static void PasswdDestroy_untyped(void *p)
+{
+    struct passwd *pw = p;
+    if (pw != NULL)
+    {
+        free(pw->pw_name);
+        free(pw->pw_passwd);
+        free(pw->pw_gecos);
+        free(pw->pw_dir);
+        free(pw->pw_shell);
+#ifdef __FreeBSD__
+        free(pw->pw_class);
+#endif
+        free(pw);
+    }
+}
+
+static struct passwd *PasswdCopy(const struct passwd *pw)
+{
+    struct passwd *copy = xmemdup(pw, sizeof(*pw));
+    copy->pw_name = SafeStringDuplicate(pw->pw_name);
+    copy->pw_passwd = SafeStringDuplicate(pw->pw_passwd);
+    copy->pw_gecos = SafeStringDuplicate(pw->pw_gecos);
+    copy->pw_dir = SafeStringDuplicate(pw->pw_dir);
+    copy->pw_shell = SafeStringDuplicate(pw->pw_shell);
+#ifdef __FreeBSD__
+    copy->pw_class = SafeStringDuplicate(pw->pw_class);
+#endif
+    return copy;
+}
+
+static void LocalGroupDestroy_untyped(void *p)
+{
+    LocalGroup *group = p;
+    if (group != NULL)
+    {
+        free(group->name);
+        free(group);
+    }
+}
+
+static void StringSetDestroy_untyped(void *p)
+{
+    StringSetDestroy(p);
+}
+
+static char *GidToString(unsigned long gid)
+{
+    return StringFormat("%lu", gid);
+}
+
+static void LocalAccountsDestroy(LocalAccounts *accounts)
+{
+    if (accounts != NULL)
+    {
+        MapDestroy(accounts->users);
+        MapDestroy(accounts->groups_by_gid);
+        MapDestroy(accounts->groups_by_name);
+        MapDestroy(accounts->memberships);
+#if HAVE_FGETSPENT
+        if (accounts->shadow != NULL)
+        {
+            MapDestroy(accounts->shadow);
+        }
+#endif
+        free(accounts);
+    }
+}
+
+static bool LocalAccountsLoadUsers(LocalAccounts *accounts)
+{
+    FILE *fptr = safe_fopen("/etc/passwd", "r");
+    if (!fptr)
+    {
+        Log(LOG_LEVEL_ERR, "Could not open '/etc/passwd': %s", GetErrorStr());
+        return false;
+    }
+
+    struct passwd *passwd_info;
+    while ((passwd_info = fgetpwent(fptr)))
+    {
+        /* The first entry wins, as with getpwnam() */
+        if (!MapHasKey(accounts->users, passwd_info->pw_name))
+        {
+            MapInsert(accounts->users, xstrdup(passwd_info->pw_name), PasswdCopy(passwd_info));
+        }
+#ifdef __FreeBSD__
+        free(passwd_info);
+#endif
+    }
+
+    fclose(fptr);
+    return true;
+}
+
+static bool LocalAccountsLoadGroups(LocalAccounts *accounts)
+{
+    FILE *fptr = safe_fopen("/etc/group", "r");
+    if (!fptr)
+    {
+        Log(LOG_LEVEL_ERR, "Could not open '/etc/group': %s", GetErrorStr());
+        return false;
+    }
+
+    bool ret = true;
+    while (true)
+    {
+        errno = 0;
+        struct group *group_info = fgetgrent(fptr);
+        if (!group_info)
+        {
+            // Documentation among Unices is conflicting on return codes. When there
+            // are no more entries, this happens:
+            // Linux = ENOENT
+            // AIX = ESRCH
+            if (errno && errno != ENOENT && errno != ESRCH)
+            {
+                Log(LOG_LEVEL_ERR, "Error while getting group list. (fgetgrent: '%s')", GetErrorStr());
+                ret = false;
+            }
+            break;
+        }
+
+        if (!MapHasKey(accounts->groups_by_name, group_info->gr_name))
+        {
+            LocalGroup *group = xmalloc(sizeof(LocalGroup));
+            group->name = xstrdup(group_info->gr_name);
+            group->gid = group_info->gr_gid;
+            MapInsert(accounts->groups_by_name, xstrdup(group->name), group);
+
+            char *gid = GidToString(group->gid);
+            if (MapHasKey(accounts->groups_by_gid, gid))
+            {
+                free(gid);
+            }
+            else
+            {
+                MapInsert(accounts->groups_by_gid, gid, group);
+            }
+        }
+
+        // At least on FreeBSD, gr_mem can be NULL:
+        for (int i = 0; group_info->gr_mem != NULL && group_info->gr_mem[i] != NULL; i++)
+        {
+            StringSet *groups = MapGet(accounts->memberships, group_info->gr_mem[i]);
+            if (groups == NULL)
+            {
+                groups = StringSetNew();
+                MapInsert(accounts->memberships, xstrdup(group_info->gr_mem[i]), groups);
+            }
+            StringSetAdd(groups, xstrdup(group_info->gr_name));
+        }
+#ifdef __FreeBSD__
+        free(group_info);
+#endif
+    }
+
+    fclose(fptr);
+    return ret;
+}
+
 #if HAVE_FGETSPENT
-// Uses fgetspent() instead of getspnam(), to guarantee that the returned user
-// is a local user, and not for example from LDAP.
-static struct spwd *GetSpEntry(const char *puser)
+static bool LocalAccountsLoadShadow(LocalAccounts *accounts)
 {
+    if (!accounts->shadow_id.exists)
+    {
+        accounts->shadow = NULL;
+        return true;
+    }
+
     FILE *fptr = safe_fopen("/etc/shadow", "r");
     if (!fptr)
     {
         Log(LOG_LEVEL_ERR, "Could not open '/etc/shadow': %s", GetErrorStr());
-        return NULL;
+        return false;
     }
 
+    accounts->shadow = MapNew(StringHash_untyped, StringEqual_untyped, free, free);
+
     struct spwd *spwd_info;
-    bool found = false;
     while ((spwd_info = fgetspent(fptr)))
     {
-        if (strcmp(puser, spwd_info->sp_namp) == 0)
+        if (!MapHasKey(accounts->shadow, spwd_info->sp_namp))
         {
-            found = true;
-            break;
+            MapInsert(accounts->shadow, xstrdup(spwd_info->sp_namp),
+                      SafeStringDuplicate(spwd_info->sp_pwdp));
         }
     }
 
     fclose(fptr);
+    return true;
+}
+#endif // HAVE_FGETSPENT
 
-    if (found)
+static LocalAccounts *LocalAccountsLoad(void)
+{
+    LocalAccounts *accounts = xcalloc(1, sizeof(LocalAccounts));
+    AccountFileIdGet("/etc/passwd", &accounts->passwd_id);
+    AccountFileIdGet("/etc/group", &accounts->group_id);
+    AccountFileIdGet("/etc/shadow", &accounts->shadow_id);
+
+    accounts->users = MapNew(StringHash_untyped, StringEqual_untyped,
+                             free, PasswdDestroy_untyped);
+    accounts->groups_by_name = MapNew(StringHash_untyped, StringEqual_untyped,
+                                      free, LocalGroupDestroy_untyped);
+    accounts->groups_by_gid = MapNew(StringHash_untyped, StringEqual_untyped,
+                                     free, NULL);
+    accounts->memberships = MapNew(StringHash_untyped, StringEqual_untyped,
+                                   free, StringSetDestroy_untyped);
+
+    if (!LocalAccountsLoadUsers(accounts) ||
+        !LocalAccountsLoadGroups(accounts)
+#if HAVE_FGETSPENT
+        || !LocalAccountsLoadShadow(accounts)
+#endif
+        )
     {
-        return spwd_info;
+        LocalAccountsDestroy(accounts);
+        return NULL;
     }
-    else
+
+    Log(LOG_LEVEL_DEBUG, "Loaded %zu local users and %zu local groups",
+        MapSize(accounts->users), MapSize(accounts->groups_by_name));
+    return accounts;
+}
+
+/**
+ * Makes sure LOCAL_ACCOUNTS reflects the account files. Must only be called
+ * between promises, entries returned by the lookups below are freed when the
+ * snapshot is reloaded.
+ */
+static bool LocalAccountsRefresh(void)
+{
+    if (LOCAL_ACCOUNTS != NULL)
     {
-        // Failure to find the user means we just set errno to zero.
-        // Perhaps not optimal, but we cannot pass ENOENT, because the fopen might
-        // fail for this reason, and that should not be treated the same.
-        errno = 0;
+        AccountFileId passwd_id, group_id, shadow_id;
+        AccountFileIdGet("/etc/passwd", &passwd_id);
+        AccountFileIdGet("/etc/group", &group_id);
+        AccountFileIdGet("/etc/shadow", &shadow_id);
+
+        if (AccountFileIdEqual(&passwd_id, &LOCAL_ACCOUNTS->passwd_id) &&
+            AccountFileIdEqual(&group_id, &LOCAL_ACCOUNTS->group_id) &&
+            AccountFileIdEqual(&shadow_id, &LOCAL_ACCOUNTS->shadow_id))
+        {
+            return true;
+        }
+
+        Log(LOG_LEVEL_DEBUG, "Local account files changed, reloading them");
+        LocalAccountsDestroy(LOCAL_ACCOUNTS);
+    }
+
+    LOCAL_ACCOUNTS = LocalAccountsLoad();
+    return (LOCAL_ACCOUNTS != NULL);
+}
+
+static void LocalAccountsInvalidate(void)
+{
+    LocalAccountsDestroy(LOCAL_ACCOUNTS);
+    LOCAL_ACCOUNTS = NULL;
+}
+
+static const struct passwd *GetPwEntry(const char *puser)
+{
+    assert(LOCAL_ACCOUNTS != NULL);
+    return MapGet(LOCAL_ACCOUNTS->users, puser);
+}
+
+static const LocalGroup *GetGroupByName(const char *name)
+{
+    assert(LOCAL_ACCOUNTS != NULL);
+    return MapGet(LOCAL_ACCOUNTS->groups_by_name, name);
+}
+
+static const LocalGroup *GetGroupByGid(const char *key)
+{
+    assert(LOCAL_ACCOUNTS != NULL);
+
+    unsigned long gid;
+    int ret = StringToUlong(key, &gid);
+    if (ret != 0)
+    {
+        LogStringToLongError(key, "GetGroupByGid", ret);
         return NULL;
     }
+
+    char *gid_str = GidToString(gid);
+    const LocalGroup *group = MapGet(LOCAL_ACCOUNTS->groups_by_gid, gid_str);
+    free(gid_str);
+    return group;
 }
-#endif // HAVE_FGETSPENT
 
 static bool GetPasswordHash(const char *puser, const struct passwd *passwd_info, const char **result)
 {
@@ -255,32 +582,20 @@ static bool GetPasswordHash(const char *puser, const struct passwd *passwd_info,
     if (strlen(passwd_info->pw_passwd) <= 4)
     {
 #ifdef HAVE_FGETSPENT
-        struct stat statbuf;
-        if (stat("/etc/shadow", &statbuf) == 0)
+        assert(LOCAL_ACCOUNTS != NULL);
+        if (LOCAL_ACCOUNTS->shadow != NULL)
         {
             Log(LOG_LEVEL_VERBOSE, "Getting user '%s' password hash from shadow database.", puser);
 
-            struct spwd *spwd_info;
-            errno = 0;
-            spwd_info = GetSpEntry(puser);
-            if (!spwd_info)
-            {
-                if (errno)
-                {
-                    Log(LOG_LEVEL_ERR, "Could not get information from user shadow database: %s", GetErrorStr());
-                    return false;
-                }
-                else
-                {
-                    Log(LOG_LEVEL_ERR, "Could not find user when checking password.");
-                    return false;
-                }
-            }
-            else if (spwd_info)
+            const char *hash = MapGet(LOCAL_ACCOUNTS->shadow, puser);
+            if (hash == NULL)
             {
-                *result = spwd_info->sp_pwdp;
-                return true;
+                Log(LOG_LEVEL_ERR, "Could not find user when checking password.");
+                return false;
             }
+
+            *result = hash;
+            return true;
         }
 
 #elif defined(_AIX)
@@ -918,104 +1233,40 @@ static void TransformGidsToGroups(StringSet **list);
 static bool GetGroupInfo (const char *user, const User *u, StringSet **groups_to_set, StringSet **groups_missing, StringSet **current_secondary_groups)
 {
     assert(u != NULL);
-    bool ret = true;
-    struct group *group_info;
+    assert(LOCAL_ACCOUNTS != NULL);
 
-    FILE *fptr = safe_fopen("/etc/group", "r");
-    if (!fptr)
-    {
-        Log(LOG_LEVEL_ERR, "Could not open '/etc/group': %s", GetErrorStr());
-        return false;
-    }
-
-    StringSet *wanted_groups = StringSetNew();
     if (u->groups_secondary_given)
     {
+        StringSet *wanted_groups = StringSetNew();
         for (Rlist *ptr = u->groups_secondary; ptr != NULL; ptr = ptr->next)
         {
-            StringSetAdd(*groups_missing, xstrdup(RvalScalarValue(ptr->val)));
             StringSetAdd(wanted_groups, xstrdup(RvalScalarValue(ptr->val)));
         }
-        TransformGidsToGroups(groups_missing);
         TransformGidsToGroups(&wanted_groups);
-    }
-
-    while (true)
-    {
-        errno = 0;
-        // Use fgetgrent() instead of getgrent(), to guarantee that the
-        // returned group is a local group, and not for example from LDAP.
-        group_info = fgetgrent(fptr);
-        if (!group_info)
-        {
-            // Documentation among Unices is conflicting on return codes. When there
-            // are no more entries, this happens:
-            // Linux = ENOENT
-            // AIX = ESRCH
-            if (errno && errno != ENOENT && errno != ESRCH)
-            {
-                Log(LOG_LEVEL_ERR, "Error while getting group list. (fgetgrent: '%s')", GetErrorStr());
-                ret = false;
-            }
-            break;
-        }
-
-        if (StringSetContains(wanted_groups, group_info->gr_name))
-        {
-            StringSetRemove(*groups_missing, group_info->gr_name);
-        }
 
-        // At least on FreeBSD, gr_mem can be NULL:
-        if (group_info->gr_mem != NULL)
+        StringSetIterator it = StringSetIteratorInit(wanted_groups);
+        const char *group_name;
+        while ((group_name = StringSetIteratorNext(&it)) != NULL)
         {
-            bool found = false;
-            for (int i = 0; !found && group_info->gr_mem[i] != NULL; i++)
+            if (GetGroupByName(group_name) != NULL)
             {
-                if (strcmp(user, group_info->gr_mem[i]) == 0)
-                {
-                    found = true;
-                    StringSetAdd(*current_secondary_groups, xstrdup(group_info->gr_name));
-                    if (StringSetContains(wanted_groups, group_info->gr_name))
-                    {
-                        StringSetAdd(*groups_to_set, xstrdup(group_info->gr_name));
-                    }
-                }
+                StringSetAdd(*groups_to_set, xstrdup(group_name));
             }
-            if (!found && StringSetContains(wanted_groups, group_info->gr_name))
+            else
             {
-                StringSetAdd(*groups_to_set, xstrdup(group_info->gr_name));
+                StringSetAdd(*groups_missing, xstrdup(group_name));
             }
         }
-#ifdef __FreeBSD__
-        free(group_info);
-#endif
+        StringSetDestroy(wanted_groups);
     }
 
-    StringSetDestroy(wanted_groups);
-    fclose(fptr);
-
-    return ret;
-}
-
-static bool EqualGid(const char *key, const struct group *entry)
-{
-    assert(entry != NULL);
-
-    unsigned long gid;
-    int ret = StringToUlong(key, &gid);
-    if (ret != 0)
+    const StringSet *member_of = MapGet(LOCAL_ACCOUNTS->memberships, user);
+    if (member_of != NULL)
     {
-        LogStringToLongError(key, "EqualGid", ret);
-        return false;
+        StringSetJoin(*current_secondary_groups, member_of, xstrdup);
     }
 
-    return (gid == entry->gr_gid);
-}
-
-static bool EqualGroupName(const char *key, const struct group *entry)
-{
-    assert(entry != NULL);
-    return (strcmp(key, entry->gr_name) == 0);
+    return true;
 }
 
 #ifdef __FreeBSD__
@@ -1055,48 +1306,6 @@ struct group *fgetgrent(FILE *stream)
 }
 #endif
 
-// Uses fgetgrent() instead of getgrnam(), to guarantee that the returned group
-// is a local group, and not for example from LDAP.
-static struct group *GetGrEntry(const char *key,
-                                bool (*equal_fn)(const char *key, const struct group *entry))
-{
-    FILE *fptr = safe_fopen("/etc/group", "r");
-    if (!fptr)
-    {
-        Log(LOG_LEVEL_ERR, "Could not open '/etc/group': %s", GetErrorStr());
-        return NULL;
-    }
-
-    struct group *group_info;
-    bool found = false;
-    while ((group_info = fgetgrent(fptr)))
-    {
-        if (equal_fn(key, group_info))
-        {
-            found = true;
-            break;
-        }
-#ifdef __FreeBSD__
-        free(group_info);
-#endif
-    }
-
-    fclose(fptr);
-
-    if (found)
-    {
-        return group_info;
-    }
-    else
-    {
-        // Failure to find the user means we just set errno to zero.
-        // Perhaps not optimal, but we cannot pass ENOENT, because the fopen might
-        // fail for this reason, and that should not be treated the same.
-        errno = 0;
-        return NULL;
-    }
-}
-
 static void TransformGidsToGroups(StringSet **list)
 {
     StringSet *new_list = StringSetNew();
@@ -1111,43 +1320,20 @@ static void TransformGidsToGroups(StringSet **list)
             continue;
         }
         // In groups vs gids, groups take precedence. So check if it exists.
-        struct group *group_info = GetGrEntry(data, &EqualGroupName);
-        if (!group_info)
+        if (GetGroupByName(data) != NULL)
         {
-            if (errno == 0)
-            {
-                group_info = GetGrEntry(data, &EqualGid);
-                if (!group_info)
-                {
-                    if (errno != 0)
-                    {
-                        Log(LOG_LEVEL_ERR, "Error while checking group name '%s': %s", data, GetErrorStr());
-                        StringSetDestroy(new_list);
-                        return;
-                    }
-                    // Neither group nor gid is found. This will lead to an error later, but we don't
-                    // handle that here.
-                }
-                else
-                {
-                    // Replace gid with group name.
-                    StringSetAdd(new_list, xstrdup(group_info->gr_name));
-                }
-            }
-            else
-            {
-                Log(LOG_LEVEL_ERR, "Error while checking group name '%s': '%s'", data, GetErrorStr());
-                StringSetDestroy(new_list);
-                return;
-            }
+            StringSetAdd(new_list, xstrdup(data));
+            continue;
         }
-        else
+
+        const LocalGroup *group = GetGroupByGid(data);
+        if (group != NULL)
         {
-            StringSetAdd(new_list, xstrdup(data));
+            // Replace gid with group name.
+            StringSetAdd(new_list, xstrdup(group->name));
         }
-#ifdef __FreeBSD__
-        free(group_info);
-#endif
+        // Neither group nor gid is found. This will lead to an error later, but we don't
+        // handle that here.
     }
     StringSet *old_list = *list;
     *list = new_list;
@@ -1217,17 +1403,8 @@ static bool VerifyIfUserNeedsModifs(const char *puser, const User *u,
                                    strspn(u->group_primary, "0123456789"));
 
         // We try name first, even if it looks like a gid. Only fall back to gid.
-        errno = 0;
-        struct group *group_info = GetGrEntry(u->group_primary,
-                                              &EqualGroupName);
-        if (group_info == NULL && errno != 0)
-        {
-            Log(LOG_LEVEL_ERR,
-                "Could not obtain information about group '%s': %s",
-                u->group_primary, GetErrorStr());
-            CFUSR_SETBIT(*changemap, i_group);
-        }
-        else if (group_info == NULL)
+        const LocalGroup *group = GetGroupByName(u->group_primary);
+        if (group == NULL)
         {
             if (group_could_be_gid)
             {
@@ -1252,15 +1429,11 @@ static bool VerifyIfUserNeedsModifs(const char *puser, const User *u,
         }
         else
         {
-            if (group_info->gr_gid != passwd_info->pw_gid)
+            if (group->gid != passwd_info->pw_gid)
             {
                 CFUSR_SETBIT(*changemap, i_group);
             }
         }
-
-#ifdef __FreeBSD__
-        free(group_info);
-#endif
     }
 
     ////////////////////////////////////////////
@@ -1274,7 +1447,7 @@ static bool VerifyIfUserNeedsModifs(const char *puser, const User *u,
     }
 }
 
-static bool SupportsOption(const char *cmd, const char *option)
+static bool ProbeOption(const char *cmd, const char *option)
 {
     bool supports_option = false;
     char help_argument[] = " --help";
@@ -1310,6 +1483,29 @@ static bool SupportsOption(const char *cmd, const char *option)
     return supports_option;
 }
 
+static bool SupportsOption(const char *cmd, const char *option)
+{
+    /* Asking the tools for help is a process spawn, and the answer doesn't
+     * change during the run. */
+    static Map *supported_options = NULL; /* GLOBAL_X */
+    if (supported_options == NULL)
+    {
+        supported_options = MapNew(StringHash_untyped, StringEqual_untyped, free, NULL);
+    }
+
+    char *key = StringFormat("%s %s", cmd, option);
+    if (MapHasKey(supported_options, key))
+    {
+        bool supports_option = (MapGet(supported_options, key) != NULL);
+        free(key);
+        return supports_option;
+    }
+
+    bool supports_option = ProbeOption(cmd, option);
+    MapInsert(supported_options, key, supports_option ? (void *) supported_options : NULL);
+    return supports_option;
+}
+
 #ifdef HAVE_USERADD
 static bool DoCreateUserUsingUseradd(const char *puser, const User *u, enum cfopaction action,
                          EvalContext *ctx, const Attributes *a, const Promise *pp)
@@ -1804,58 +2000,17 @@ struct passwd *fgetpwent(FILE *stream)
 }
 #endif
 
-// Uses fgetpwent() instead of getpwnam(), to guarantee that the returned user
-// is a local user, and not for example from LDAP.
-static struct passwd *GetPwEntry(const char *puser)
-{
-    FILE *fptr = safe_fopen("/etc/passwd", "r");
-    if (!fptr)
-    {
-        Log(LOG_LEVEL_ERR, "Could not open '/etc/passwd': %s", GetErrorStr());
-        return NULL;
-    }
-
-    struct passwd *passwd_info;
-    bool found = false;
-    while ((passwd_info = fgetpwent(fptr)))
-    {
-        if (strcmp(puser, passwd_info->pw_name) == 0)
-        {
-            found = true;
-            break;
-        }
-#ifdef __FreeBSD__
-        free(passwd_info);
-#endif
-    }
-
-    fclose(fptr);
-
-    if (found)
-    {
-        return passwd_info;
-    }
-    else
-    {
-        // Failure to find the user means we just set errno to zero.
-        // Perhaps not optimal, but we cannot pass ENOENT, because the fopen might
-        // fail for this reason, and that should not be treated the same.
-        errno = 0;
-        return NULL;
-    }
-}
-
 void VerifyOneUsersPromise (const char *puser, const User *u, PromiseResult *result, enum cfopaction action,
                             EvalContext *ctx, const Attributes *a, const Promise *pp)
 {
     assert(u != NULL);
 
-    struct passwd *passwd_info = GetPwEntry(puser);
-    if (!passwd_info && errno != 0)
+    if (!LocalAccountsRefresh())
     {
         Log(LOG_LEVEL_ERR, "Could not get information from user database.");
         return;
     }
+    const struct passwd *passwd_info = GetPwEntry(puser);
 
     bool res;
     if (u->policy == USER_STATE_PRESENT || u->policy == USER_STATE_LOCKED)
@@ -1932,7 +2087,10 @@ void VerifyOneUsersPromise (const char *puser, const User *u, PromiseResult *res
             *result = PROMISE_RESULT_NOOP;
         }
     }
-#ifdef __FreeBSD__
-    free(passwd_info);
-#endif
+
+    /* The accounts changed, or may have changed partially */
+    if (*result == PROMISE_RESULT_CHANGE || *result == PROMISE_RESULT_FAIL)
+    {
+        LocalAccountsInvalidate();
+    }
 }
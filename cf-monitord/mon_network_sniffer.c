@@ -35,6 +35,16 @@
 #include <addr_lib.h>
 #include <known_dirs.h>
 
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <poll.h>
+#endif
+
 typedef enum
 {
     IP_TYPES_ICMP,
@@ -68,6 +78,11 @@ static const char *const TCPNAMES[CF_NETATTR] =
 static bool TCPDUMP = false;
 static bool TCPPAUSE = false;
 static FILE *TCPPIPE = NULL;
+#ifdef __linux__
+/* Used instead of the tcpdump pipe where we can read packets ourselves */
+static int PACKET_SOCKET = -1;
+static int PACKET_IFINDEX = 0;
+#endif
 
 static Item *NETIN_DIST[CF_NETATTR] = { NULL };
 static Item *NETOUT_DIST[CF_NETATTR] = { NULL };
@@ -77,11 +92,23 @@ static Item *NETOUT_DIST[CF_NETATTR] = { NULL };
 static void Sniff(Item *ip_addresses, long iteration, double *cf_this);
 static void AnalyzeArrival(Item *ip_addresses, long iteration, char *arrival, double *cf_this);
 static void DePort(char *address);
+#ifdef __linux__
+static bool PacketSocketOpen(void);
+static void PacketSocketSniff(Item *ip_addresses, long iteration, double *cf_this);
+#endif
 
 /* Implementation */
 
 void MonNetworkSnifferSniff(Item *ip_addresses, long iteration, double *cf_this)
 {
+#ifdef __linux__
+    if (TCPDUMP && PACKET_SOCKET != -1)
+    {
+        PacketSocketSniff(ip_addresses, iteration, cf_this);
+        return;
+    }
+#endif
+
     if (TCPDUMP)
     {
         Sniff(ip_addresses, iteration, cf_this);
@@ -100,6 +127,13 @@ void MonNetworkSnifferOpen(void)
 
     if (TCPDUMP)
     {
+#ifdef __linux__
+        if (PacketSocketOpen())
+        {
+            return;
+        }
+#endif
+
         struct stat statbuf;
         char buffer[CF_MAXVARSIZE];
 
@@ -421,6 +455,287 @@ static void AnalyzeArrival(Item *ip_addresses, long iteration, char *arrival, do
 
 /******************************************************************************/
 
+#ifdef __linux__
+
+/* Only the network and transport headers are needed, tell the kernel not to
+ * copy the payload */
+#define PACKET_SNAPLEN 128
+
+/* Returns the index of the interface tcpdump captures on when none is given,
+ * the first one which is up and not a loopback, or 0 if there is none */
+static unsigned int PacketSocketInterface(char *name, size_t name_size)
+{
+    struct ifaddrs *ifaddrs;
+    if (getifaddrs(&ifaddrs) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not list network interfaces (getifaddrs: %s)",
+            GetErrorStr());
+        return 0;
+    }
+
+    unsigned int index = 0;
+    for (const struct ifaddrs *ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next)
+    {
+        /* Each interface is listed once with an AF_PACKET address */
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_PACKET ||
+            (ifa->ifa_flags & IFF_UP) == 0 || (ifa->ifa_flags & IFF_LOOPBACK) != 0)
+        {
+            continue;
+        }
+
+        index = ((const struct sockaddr_ll *) ifa->ifa_addr)->sll_ifindex;
+        strlcpy(name, ifa->ifa_name, name_size);
+        break;
+    }
+
+    freeifaddrs(ifaddrs);
+    return index;
+}
+
+static bool PacketSocketOpen(void)
+{
+    char ifname[IF_NAMESIZE] = "";
+    const unsigned int ifindex = PacketSocketInterface(ifname, sizeof(ifname));
+    if (ifindex == 0)
+    {
+        Log(LOG_LEVEL_VERBOSE, "No network interface to read packets from, using tcpdump instead");
+        return false;
+    }
+
+    int sd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    if (sd == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not open packet socket, using tcpdump instead (socket: %s)",
+            GetErrorStr());
+        return false;
+    }
+
+    /* Accept IPv4 and IPv6 packets, truncated to PACKET_SNAPLEN */
+    struct sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, PACKET_SNAPLEN),
+    };
+    struct sock_fprog filter =
+    {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not attach filter to packet socket, using tcpdump instead (setsockopt: %s)",
+            GetErrorStr());
+        close(sd);
+        return false;
+    }
+
+    /* Only count packets on the interface tcpdump would have used */
+    struct sockaddr_ll addr =
+    {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = ifindex,
+    };
+    if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not bind packet socket to interface '%s', using tcpdump instead (bind: %s)",
+            ifname, GetErrorStr());
+        close(sd);
+        return false;
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "Reading network packets from interface '%s' with a packet socket", ifname);
+    PACKET_SOCKET = sd;
+    PACKET_IFINDEX = ifindex;
+    return true;
+}
+
+static void PacketSocketClose(void)
+{
+    close(PACKET_SOCKET);
+    PACKET_SOCKET = -1;
+    PACKET_IFINDEX = 0;
+    TCPDUMP = false;
+}
+
+static void CountDirectedPacket(Item *ip_addresses, char *src, char *dest, IPTypes type,
+                                enum observables in, enum observables out, double *cf_this)
+{
+    if (IsInterfaceAddress(ip_addresses, dest))
+    {
+        cf_this[in]++;
+        IncrementCounter(&(NETIN_DIST[type]), src);
+    }
+    else if (IsInterfaceAddress(ip_addresses, src))
+    {
+        cf_this[out]++;
+        IncrementCounter(&(NETOUT_DIST[type]), dest);
+    }
+}
+
+/* Classifies packets like AnalyzeArrival() does with tcpdump output */
+
+static void AnalyzePacket(Item *ip_addresses, long iteration, unsigned short protocol,
+                          const unsigned char *packet, size_t length, double *cf_this)
+{
+    char src[INET6_ADDRSTRLEN];
+    char dest[INET6_ADDRSTRLEN];
+    unsigned char ip_proto;
+    const unsigned char *l4;
+    size_t l4_length;
+
+    if (protocol == ETH_P_IP)
+    {
+        const size_t header_length = (packet[0] & 0x0f) * 4;
+        if (length < 20 || (packet[0] >> 4) != 4 || header_length < 20 || header_length > length)
+        {
+            return;
+        }
+
+        ip_proto = packet[9];
+        inet_ntop(AF_INET, packet + 12, src, sizeof(src));
+        inet_ntop(AF_INET, packet + 16, dest, sizeof(dest));
+
+        /* Only the first fragment has the transport header */
+        const bool fragment = (((packet[6] & 0x1f) << 8) | packet[7]) != 0;
+        l4 = packet + header_length;
+        l4_length = fragment ? 0 : length - header_length;
+    }
+    else if (protocol == ETH_P_IPV6)
+    {
+        if (length < 40 || (packet[0] >> 4) != 6)
+        {
+            return;
+        }
+
+        /* Extension headers are not followed */
+        ip_proto = packet[6];
+        inet_ntop(AF_INET6, packet + 8, src, sizeof(src));
+        inet_ntop(AF_INET6, packet + 24, dest, sizeof(dest));
+        l4 = packet + 40;
+        l4_length = length - 40;
+    }
+    else
+    {
+        return;
+    }
+
+    if (ip_proto == IPPROTO_TCP && l4_length >= 14)
+    {
+        const unsigned char flags = l4[13];
+        if (flags & 0x02)                                            /* SYN */
+        {
+            Log(LOG_LEVEL_DEBUG, "%ld: TCP new connection from '%s' to '%s'", iteration, src, dest);
+            CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_TCP_SYN,
+                                ob_tcpsyn_in, ob_tcpsyn_out, cf_this);
+        }
+        else if (flags & 0x01)                                       /* FIN */
+        {
+            Log(LOG_LEVEL_DEBUG, "%ld: TCP end connection from '%s' to '%s'", iteration, src, dest);
+            CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_TCP_FIN,
+                                ob_tcpfin_in, ob_tcpfin_out, cf_this);
+        }
+        else
+        {
+            Log(LOG_LEVEL_DEBUG, "%ld: TCP established from '%s' to '%s'", iteration, src, dest);
+            CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_TCP_ACK,
+                                ob_tcpack_in, ob_tcpack_out, cf_this);
+        }
+    }
+    else if (ip_proto == IPPROTO_UDP && l4_length >= 4)
+    {
+        const unsigned int src_port = (l4[0] << 8) | l4[1];
+        const unsigned int dest_port = (l4[2] << 8) | l4[3];
+        if (src_port == 53 || dest_port == 53)
+        {
+            Log(LOG_LEVEL_DEBUG, "%ld: DNS packet from '%s' to '%s'", iteration, src, dest);
+            CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_DNS,
+                                ob_dns_in, ob_dns_out, cf_this);
+        }
+        else
+        {
+            Log(LOG_LEVEL_DEBUG, "%ld: UDP packet from '%s' to '%s'", iteration, src, dest);
+            CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_UDP,
+                                ob_udp_in, ob_udp_out, cf_this);
+        }
+    }
+    else if (ip_proto == IPPROTO_ICMP || ip_proto == IPPROTO_ICMPV6)
+    {
+        Log(LOG_LEVEL_DEBUG, "%ld: ICMP packet from '%s' to '%s'", iteration, src, dest);
+        CountDirectedPacket(ip_addresses, src, dest, IP_TYPES_ICMP,
+                            ob_icmp_in, ob_icmp_out, cf_this);
+    }
+    else
+    {
+        Log(LOG_LEVEL_DEBUG, "%ld: Miscellaneous packet (protocol %d) from '%s'", iteration, ip_proto, src);
+        cf_this[ob_tcpmisc_in]++;
+        IncrementCounter(&(NETIN_DIST[IP_TYPES_TCP_MISC]), src);
+    }
+}
+
+static void PacketSocketSniff(Item *ip_addresses, long iteration, double *cf_this)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    const time_t end = time(NULL) + SLEEPTIME;
+    time_t now;
+
+    Log(LOG_LEVEL_VERBOSE, "Reading from packet socket...");
+
+    while (!IsPendingTermination() && (now = time(NULL)) < end)
+    {
+        struct pollfd pfd = { .fd = PACKET_SOCKET, .events = POLLIN };
+        const int ret = poll(&pfd, 1, (end - now) * 1000);
+        if (ret == -1 && errno != EINTR)
+        {
+            Log(LOG_LEVEL_ERR, "Unable to wait for network packets, stopping (poll: %s)",
+                GetErrorStr());
+            PacketSocketClose();
+            return;
+        }
+        if (ret <= 0)
+        {
+            continue;
+        }
+
+        /* Process everything queued before waiting again */
+        for (;;)
+        {
+            struct sockaddr_ll from;
+            socklen_t from_length = sizeof(from);
+            const ssize_t length = recvfrom(PACKET_SOCKET, packet, sizeof(packet), MSG_DONTWAIT,
+                                            (struct sockaddr *) &from, &from_length);
+            if (length == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    Log(LOG_LEVEL_ERR, "Unable to read network packets, stopping (recvfrom: %s)",
+                        GetErrorStr());
+                    PacketSocketClose();
+                    return;
+                }
+                break;
+            }
+
+            /* Packets queued before bind() may come from other interfaces */
+            if (from.sll_ifindex != PACKET_IFINDEX)
+            {
+                continue;
+            }
+
+            AnalyzePacket(ip_addresses, iteration, ntohs(from.sll_protocol),
+                          packet, length, cf_this);
+        }
+    }
+}
+
+#endif /* __linux__ */
+
+/******************************************************************************/
+
 static void SaveTCPEntropyData(Item *list, int i, char *inout)
 {
     Item *ip;
@@ -133,8 +133,8 @@ static const char *const HINTS[] =
     "Enable basic information output",
     "Minimum TLS version to use",
     "TLS ciphers to use (comma-separated list)",
-    "Specify CFEngine protocol to use. Possible values: 'classic', 'tls', 'cookie', 'filestream', 'leech2', 'latest' (default)",
-    "Print rsync performance statistics to stderr",
+    "Specify CFEngine protocol to use. Possible values: 'classic', 'tls', 'cookie', 'filestream', 'leech2', 'manifest', 'latest' (default)",
+    "Print rsync and transfer throughput statistics to stderr",
     NULL
 };
 
@@ -783,6 +783,29 @@ static void *CFNetGetFile(void *arg)
     return NULL;
 }
 
+static double ElapsedSeconds(const struct timespec *start,
+                             const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Prints the size of the files fetched and the throughput achieved
+ *        to stderr (wall clock time, including the STAT round trips)
+ */
+static void CFNetPrintThroughput(uintmax_t n_files, uintmax_t n_bytes,
+                                 double seconds)
+{
+    const double mib_per_s = (seconds > 0.0) ?
+        (n_bytes / seconds) / (1024.0 * 1024.0) : 0.0;
+    fprintf(stderr,
+            "Transfer statistics:\n"
+            "  %ju files, %ju bytes in %.3f seconds\n"
+            "  %.2f MiB/s\n",
+            n_files, n_bytes, seconds, mib_per_s);
+}
+
 typedef struct _CFNetThreadData {
     pthread_t    id;
     GetFileData *data;
@@ -919,6 +942,9 @@ static int CFNetGet(ARG_UNUSED CFNetOptions *opts, const char *hostname, char **
         }
     }
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     bool failure = false;
     for (int i = 0; !failure && (i < n_threads); i++)
     {
@@ -943,6 +969,25 @@ static int CFNetGet(ARG_UNUSED CFNetOptions *opts, const char *hostname, char **
         }
     }
 
+    if (opts->print_stats)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        uintmax_t n_files = 0, n_bytes = 0;
+        for (int i = 0; i < n_threads; i++)
+        {
+            struct stat sb;
+            if (threads[i]->data->ret &&
+                stat(threads[i]->data->local_file, &sb) == 0)
+            {
+                n_files++;
+                n_bytes += sb.st_size;
+            }
+        }
+        CFNetPrintThroughput(n_files, n_bytes, ElapsedSeconds(&start, &end));
+    }
+
     for (int i = 0; i < n_threads; i++)
     {
         free(threads[i]->data);
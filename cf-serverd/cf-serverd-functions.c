@@ -856,6 +856,7 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
 
     PrepareServer(sd);
     CollectCallStart(COLLECT_INTERVAL);
+    ServerReactorStart();
 
     while (!IsPendingTermination())
     {
@@ -918,6 +919,7 @@ int StartServer(EvalContext *ctx, Policy **policy, GenericAgentConfig *config)
         YieldCurrentLock(thislock); // can we do this one first too ?
     }
 
+    ServerReactorStop();
     PolicyDestroy(server_cfengine_policy);
 
     return threads_left;
@@ -51,6 +51,10 @@
 
 #include "server_classic.h"                    /* BusyWithClassicConnection */
 
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
 
 /*
   The only exported function in this file is the following, used only in
@@ -87,6 +91,7 @@ static void PurgeOldConnections(Item **list, time_t now);
 static void *HandleConnection(void *conn);
 static ServerConnectionState *NewConn(EvalContext *ctx, ConnectionInfo *info);
 static void DeleteConn(ServerConnectionState *conn);
+static bool ReactorAddConnection(ServerConnectionState *conn);
 
 /****************************************************************************/
 
@@ -205,6 +210,11 @@ static void SpawnConnection(EvalContext *ctx, const char *ipaddr, ConnectionInfo
     int sd_accepted = ConnectionInfoSocket(info);
     strlcpy(conn->ipaddr, ipaddr, CF_MAX_IP_LEN );
 
+    if (ReactorAddConnection(conn))
+    {
+        return;
+    }
+
     Log(LOG_LEVEL_VERBOSE,
         "New connection (from %s, sd %d), spawning new thread...",
         conn->ipaddr, sd_accepted);
@@ -280,22 +290,17 @@ static char *LogHook(LoggingPrivContext *log_ctx,
 /* TRIES: counts the number of consecutive connections dropped. */
 static int TRIES = 0;
 
-static void *HandleConnection(void *c)
+/**
+ * Sets the logging prefix of the calling thread to the IP address of the
+ * connection, #aligned_ipaddr and #log_ctx must remain valid until the
+ * context is unset.
+ */
+static void SetConnectionLogContext(const ServerConnectionState *conn,
+                                    char *aligned_ipaddr, size_t aligned_size,
+                                    LoggingPrivContext *log_ctx)
 {
-    ServerConnectionState *conn = c;
-    int ret;
-
-    /* Set logging prefix to be the IP address for all of thread's lifetime. */
-    /* These stack-allocated variables should be valid for all the lifetime of
-     * the thread. */
-    char aligned_ipaddr[CF_MAX_IP_LEN + 2];
-    LoggingPrivContext log_ctx = {
-        .log_hook = LogHook,
-        .param = aligned_ipaddr
-    };
-
-    strlcpy(aligned_ipaddr, conn->ipaddr, sizeof(aligned_ipaddr));
-    strlcat(aligned_ipaddr, "> ",         sizeof(aligned_ipaddr));
+    strlcpy(aligned_ipaddr, conn->ipaddr, aligned_size);
+    strlcat(aligned_ipaddr, "> ",         aligned_size);
     /* Pad with enough spaces for IPv4 addresses to be aligned. Max chars are
      * 15 for the address plus two for "> " == 17. */
     size_t len;
@@ -305,10 +310,20 @@ static void *HandleConnection(void *c)
     }
     aligned_ipaddr[len] = '\0';
 
-    LoggingPrivSetContext(&log_ctx);
-
-    Log(LOG_LEVEL_INFO, "Accepting connection");
+    *log_ctx = (LoggingPrivContext) {
+        .log_hook = LogHook,
+        .param = aligned_ipaddr
+    };
+    LoggingPrivSetContext(log_ctx);
+}
 
+/**
+ * Counts the connection in ACTIVE_THREADS unless there are already too many.
+ *
+ * @return false if the connection must be dropped
+ */
+static bool ConnectionAdmit(ServerConnectionState *conn)
+{
     /* We test if number of active threads is greater than max, if so we deny
        connection, if it happened too many times within a short timeframe then we
        kill ourself.TODO this test should be done *before* spawning the thread. */
@@ -334,19 +349,35 @@ static void *HandleConnection(void *c)
             ACTIVE_THREADS, CFD_MAXPROCESSES);
 
         ThreadUnlock(cft_server_children);
-        goto conndone;
+        return false;
     }
 
     ACTIVE_THREADS++;
     TRIES = 0;
     ThreadUnlock(cft_server_children);
 
-    DisableSendDelays(ConnectionInfoSocket(conn->conn_info));
+    return true;
+}
+
+/* 20 times the connect() timeout should be enough to avoid MD5
+ * computation timeouts on big files on old slow Solaris 8 machines. */
+#define CONNECTION_RECEIVE_TIMEOUT (CONNTIMEOUT * 20)
+
+/**
+ * Decides the protocol and establishes the session of an admitted
+ * connection, up to the point where it is ready to serve requests.
+ *
+ * @param handshake_timeout receive timeout in seconds until the session is
+ *                          established, CONNECTION_RECEIVE_TIMEOUT after
+ * @return false if the connection must be closed
+ */
+static bool ConnectionEstablish(ServerConnectionState *conn, time_t handshake_timeout)
+{
+    int ret;
 
-    /* 20 times the connect() timeout should be enough to avoid MD5
-     * computation timeouts on big files on old slow Solaris 8 machines. */
+    DisableSendDelays(ConnectionInfoSocket(conn->conn_info));
     SetReceiveTimeout(ConnectionInfoSocket(conn->conn_info),
-                      CONNTIMEOUT * 20 * 1000);
+                      handshake_timeout * 1000);
 
     if (conn->conn_info->status != CONNECTIONINFO_STATUS_ESTABLISHED)
     {
@@ -354,7 +385,7 @@ static void *HandleConnection(void *c)
         bool success = ServerTLSPeek(conn->conn_info);
         if (!success)
         {
-            goto dethread;
+            return false;
         }
     }
 
@@ -366,7 +397,7 @@ static void *HandleConnection(void *c)
         bool established = ServerTLSSessionEstablish(conn, NULL);
         if (!established)
         {
-            goto dethread;
+            return false;
         }
     }
     else if (ProtocolIsClassic(protocol_version))
@@ -377,74 +408,752 @@ static void *HandleConnection(void *c)
         {
             Log(LOG_LEVEL_INFO,
                 "Connection is not using latest protocol, denying");
-            goto dethread;
+            return false;
         }
     }
     else
     {
         UnexpectedError("HandleConnection: ProtocolVersion %d!",
                         ConnectionInfoProtocolVersion(conn->conn_info));
-        goto dethread;
+        return false;
     }
 
+    /* New protocol does DNS reverse look up of the connected
+     * IP address, to check hostname access_rules. */
+    if (ProtocolIsTLS(protocol_version) && NEED_REVERSE_LOOKUP)
+    {
+        ret = getnameinfo((const struct sockaddr *) &conn->conn_info->ss,
+                          conn->conn_info->ss_len,
+                          conn->revdns, sizeof(conn->revdns),
+                          NULL, 0, NI_NAMEREQD);
+        if (ret != 0)
+        {
+            Log(LOG_LEVEL_INFO,
+                "Reverse lookup failed (getnameinfo: %s)!",
+                gai_strerror(ret));
+        }
+        else
+        {
+            Log(LOG_LEVEL_INFO,
+                "Hostname (reverse looked up): %s",
+                conn->revdns);
+        }
+    }
 
-    /* =========================  MAIN LOOPS  ========================= */
-    if (ProtocolIsTLS(protocol_version))
+    if (handshake_timeout != CONNECTION_RECEIVE_TIMEOUT)
+    {
+        SetReceiveTimeout(ConnectionInfoSocket(conn->conn_info),
+                          CONNECTION_RECEIVE_TIMEOUT * 1000);
+    }
+    return true;
+}
+
+/**
+ * Closes the connection, and stops counting it in ACTIVE_THREADS if it was
+ * admitted.
+ */
+static void ConnectionRelease(ServerConnectionState *conn, bool admitted)
+{
+    if (admitted)
+    {
+        ThreadLock(cft_server_children);
+        ACTIVE_THREADS--;
+        ThreadUnlock(cft_server_children);
+    }
+
+    if (conn->conn_info->is_call_collect)
     {
-        /* New protocol does DNS reverse look up of the connected
-         * IP address, to check hostname access_rules. */
-        if (NEED_REVERSE_LOOKUP)
+        CollectCallMarkProcessed();
+    }
+    DeleteConn(conn);
+}
+
+static void *HandleConnection(void *c)
+{
+    ServerConnectionState *conn = c;
+
+    /* Set logging prefix to be the IP address for all of thread's lifetime. */
+    /* These stack-allocated variables should be valid for all the lifetime of
+     * the thread. */
+    char aligned_ipaddr[CF_MAX_IP_LEN + 2];
+    LoggingPrivContext log_ctx;
+    SetConnectionLogContext(conn, aligned_ipaddr, sizeof(aligned_ipaddr), &log_ctx);
+
+    Log(LOG_LEVEL_INFO, "Accepting connection");
+
+    const bool admitted = ConnectionAdmit(conn);
+    if (admitted && ConnectionEstablish(conn, CONNECTION_RECEIVE_TIMEOUT))
+    {
+        /* =========================  MAIN LOOPS  ========================= */
+        ProtocolVersion protocol_version = ConnectionInfoProtocolVersion(conn->conn_info);
+        if (ProtocolIsTLS(protocol_version))
         {
-            ret = getnameinfo((const struct sockaddr *) &conn->conn_info->ss,
-                              conn->conn_info->ss_len,
-                              conn->revdns, sizeof(conn->revdns),
-                              NULL, 0, NI_NAMEREQD);
-            if (ret != 0)
+            while (BusyWithNewProtocol(conn->ctx, conn))
             {
-                Log(LOG_LEVEL_INFO,
-                    "Reverse lookup failed (getnameinfo: %s)!",
-                    gai_strerror(ret));
             }
-            else
+        }
+        else if (ProtocolIsClassic(protocol_version))
+        {
+            while (BusyWithClassicConnection(conn->ctx, conn))
             {
-                Log(LOG_LEVEL_INFO,
-                    "Hostname (reverse looked up): %s",
-                    conn->revdns);
             }
         }
+        else
+        {
+            assert(!"Bogus protocol version - but we checked that already !");
+        }
+        /* ============================================================ */
+
+        Log(LOG_LEVEL_INFO, "Closing connection, terminating thread");
+    }
+
+    ConnectionRelease(conn, admitted);
+    return NULL;
+}
+
+/*********************************************************************/
+/* Reactor                                                           */
+/*********************************************************************/
 
-        while (BusyWithNewProtocol(conn->ctx, conn))
+/*
+ * Instead of a thread per connection, connections can be handled by a
+ * reactor thread waiting with epoll() for the connections to become
+ * readable, and a fixed pool of worker threads serving them. A connection
+ * only occupies a worker while its session is being established or a
+ * request is being served, idle connections cost no thread.
+ *
+ * Connections are admitted (counted against maxconnections) when they are
+ * accepted, and closed if they send nothing within CONNTIMEOUT. Still, the
+ * TLS handshake is done with blocking reads, so a slow client ties up a
+ * worker for up to CONNTIMEOUT per read, and legacy protocol connections
+ * keep their worker for their whole lifetime.
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_WORKERS_PER_CPU 4
+#define REACTOR_MIN_WORKERS 8
+#define REACTOR_MAX_WORKERS 1024
+#define REACTOR_METRICS_INTERVAL SECONDS_PER_MINUTE
+
+typedef struct ReadyConnection_
+{
+    ServerConnectionState *conn;
+    struct ReadyConnection_ *next;
+} ReadyConnection;
+
+typedef struct
+{
+    size_t count;
+    double total;                                               /* seconds */
+    double max;
+} CommandLatency;
+
+typedef struct
+{
+    ServerConnectionState *head;
+    ServerConnectionState *tail;
+} IdleList;
+
+static struct
+{
+    int epoll_fd;
+    bool running;
+    pthread_t loop_thread;
+    pthread_t *workers;
+    size_t num_workers;
+
+    /* Connections ready to be served, in FIFO order */
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    ReadyConnection *head;
+    ReadyConnection *tail;
+
+    /* Connections waiting in epoll, protected by lock, each list in order
+     * of the deadlines: the ones whose session is not established yet, and
+     * the ones waiting for their next request */
+    IdleList pending;
+    IdleList idle;
+
+    /* Metrics, protected by lock, since the last time they were logged */
+    size_t queue_depth;
+    size_t queue_depth_max;
+    size_t busy_workers;
+    CommandLatency latency[PROTOCOL_COMMAND_BAD + 1];
+} REACTOR = {                                                  /* GLOBAL_X */
+    .epoll_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t GetNumberOfWorkers(void)
+{
+    const char *const workers_var = getenv("CF_SERVERD_WORKERS");
+    if (workers_var != NULL)
+    {
+        long workers;
+        int ret = StringToLong(workers_var, &workers);
+        if ((ret == 0) && (workers >= 0) && (workers <= REACTOR_MAX_WORKERS))
         {
+            return (size_t) workers;
         }
+        Log(LOG_LEVEL_WARNING,
+            "$CF_SERVERD_WORKERS = '%s' doesn't specify a valid number of workers, "
+            "falling back to the default", workers_var);
     }
-    else if (ProtocolIsClassic(protocol_version))
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        cpus = 1;
+    }
+
+    /* Workers block on the network while serving requests, so there are
+     * more of them than CPUs. */
+    return MAX(REACTOR_MIN_WORKERS, (size_t) cpus * REACTOR_WORKERS_PER_CPU);
+}
+
+static void ReactorPushReady(ServerConnectionState *conn)
+{
+    ReadyConnection *ready = xmalloc(sizeof(ReadyConnection));
+    ready->conn = conn;
+    ready->next = NULL;
+
+    pthread_mutex_lock(&REACTOR.lock);
+    if (REACTOR.tail == NULL)
+    {
+        REACTOR.head = ready;
+    }
+    else
+    {
+        REACTOR.tail->next = ready;
+    }
+    REACTOR.tail = ready;
+
+    REACTOR.queue_depth++;
+    REACTOR.queue_depth_max = MAX(REACTOR.queue_depth_max, REACTOR.queue_depth);
+    pthread_cond_signal(&REACTOR.ready_cond);
+    pthread_mutex_unlock(&REACTOR.lock);
+}
+
+/**
+ * @return the next connection to serve, NULL if the reactor was stopped
+ */
+static ServerConnectionState *ReactorPopReady(void)
+{
+    pthread_mutex_lock(&REACTOR.lock);
+    while (REACTOR.running && (REACTOR.head == NULL))
+    {
+        pthread_cond_wait(&REACTOR.ready_cond, &REACTOR.lock);
+    }
+
+    ServerConnectionState *conn = NULL;
+    ReadyConnection *ready = REACTOR.head;
+    if (REACTOR.running && (ready != NULL))
+    {
+        REACTOR.head = ready->next;
+        if (REACTOR.head == NULL)
+        {
+            REACTOR.tail = NULL;
+        }
+        REACTOR.queue_depth--;
+        REACTOR.busy_workers++;
+        conn = ready->conn;
+        free(ready);
+    }
+    pthread_mutex_unlock(&REACTOR.lock);
+
+    return conn;
+}
+
+static void ReactorRecordLatency(int command, double seconds)
+{
+    if ((command < 0) || (command > PROTOCOL_COMMAND_BAD))
+    {
+        command = PROTOCOL_COMMAND_BAD;
+    }
+
+    pthread_mutex_lock(&REACTOR.lock);
+    CommandLatency *latency = &REACTOR.latency[command];
+    latency->count++;
+    latency->total += seconds;
+    latency->max = MAX(latency->max, seconds);
+    pthread_mutex_unlock(&REACTOR.lock);
+}
+
+static void ReactorLogMetrics(void)
+{
+    pthread_mutex_lock(&REACTOR.lock);
+
+    if ((REACTOR.queue_depth_max == 0) && (REACTOR.busy_workers == 0) &&
+        (REACTOR.latency[PROTOCOL_COMMAND_BAD].count == 0))
     {
-        while (BusyWithClassicConnection(conn->ctx, conn))
+        bool idle = true;
+        for (int i = 0; i < PROTOCOL_COMMAND_BAD; i++)
+        {
+            idle = idle && (REACTOR.latency[i].count == 0);
+        }
+        if (idle)
         {
+            pthread_mutex_unlock(&REACTOR.lock);
+            return;
         }
     }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Server metrics: %zu connections waiting for a worker (max %zu), %zu workers busy",
+        REACTOR.queue_depth, REACTOR.queue_depth_max, REACTOR.busy_workers);
+    for (int i = 0; i <= PROTOCOL_COMMAND_BAD; i++)
+    {
+        const CommandLatency *latency = &REACTOR.latency[i];
+        if (latency->count > 0)
+        {
+            Log(LOG_LEVEL_VERBOSE,
+                "Server metrics: %-9s %zu requests, %.2f ms average, %.2f ms max",
+                (PROTOCOL_NEW[i] != NULL) ? PROTOCOL_NEW[i] : "(bad)",
+                latency->count, latency->total * 1000 / latency->count,
+                latency->max * 1000);
+        }
+    }
+
+    REACTOR.queue_depth_max = REACTOR.queue_depth;
+    memset(REACTOR.latency, 0, sizeof(REACTOR.latency));
+
+    pthread_mutex_unlock(&REACTOR.lock);
+}
+
+static IdleList *ReactorIdleList(const ServerConnectionState *conn)
+{
+    return conn->established ? &REACTOR.idle : &REACTOR.pending;
+}
+
+/**
+ * Adds the connection to the list of idle connections. Like the receive
+ * timeout of a connection served by its own thread, it is closed if no
+ * request is received in time. Connections not established yet only get
+ * CONNTIMEOUT, so that clients that connect and send nothing do not keep
+ * their file descriptor.
+ */
+static void ReactorIdleAdd(ServerConnectionState *conn)
+{
+    IdleList *list = ReactorIdleList(conn);
+
+    pthread_mutex_lock(&REACTOR.lock);
+    conn->idle = true;
+    conn->deadline = time(NULL) +
+        (conn->established ? CONNECTION_RECEIVE_TIMEOUT : CONNTIMEOUT);
+    conn->idle_prev = list->tail;
+    conn->idle_next = NULL;
+    if (list->tail == NULL)
+    {
+        list->head = conn;
+    }
     else
     {
-        assert(!"Bogus protocol version - but we checked that already !");
+        list->tail->idle_next = conn;
     }
-    /* ============================================================ */
+    list->tail = conn;
+    pthread_mutex_unlock(&REACTOR.lock);
+}
 
-    Log(LOG_LEVEL_INFO, "Closing connection, terminating thread");
+/* Must be called with REACTOR.lock held */
+static void ReactorIdleRemoveLocked(ServerConnectionState *conn)
+{
+    if (!conn->idle)
+    {
+        return;
+    }
 
-  dethread:
-    ThreadLock(cft_server_children);
-    ACTIVE_THREADS--;
-    ThreadUnlock(cft_server_children);
+    IdleList *list = ReactorIdleList(conn);
+    if (conn->idle_prev == NULL)
+    {
+        list->head = conn->idle_next;
+    }
+    else
+    {
+        conn->idle_prev->idle_next = conn->idle_next;
+    }
+    if (conn->idle_next == NULL)
+    {
+        list->tail = conn->idle_prev;
+    }
+    else
+    {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    }
+    conn->idle_prev = conn->idle_next = NULL;
+    conn->idle = false;
+}
 
-  conndone:
-    if (conn->conn_info->is_call_collect)
+static void ReactorIdleRemove(ServerConnectionState *conn)
+{
+    pthread_mutex_lock(&REACTOR.lock);
+    ReactorIdleRemoveLocked(conn);
+    pthread_mutex_unlock(&REACTOR.lock);
+}
+
+/**
+ * @return the first connection of the lists past its deadline, removed from
+ *         its list, or NULL
+ */
+static ServerConnectionState *ReactorIdlePopExpired(time_t now)
+{
+    pthread_mutex_lock(&REACTOR.lock);
+    ServerConnectionState *conn = REACTOR.pending.head;
+    if ((conn == NULL) || (conn->deadline > now))
     {
-        CollectCallMarkProcessed();
+        conn = REACTOR.idle.head;
+    }
+    if ((conn != NULL) && (conn->deadline <= now))
+    {
+        ReactorIdleRemoveLocked(conn);
+    }
+    else
+    {
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&REACTOR.lock);
+    return conn;
+}
+
+/**
+ * Closes the idle connections past their deadline. Only called from the
+ * reactor thread, so none of them can be reported ready at the same time.
+ */
+static void ReactorCloseExpired(time_t now)
+{
+    ServerConnectionState *conn;
+    while ((conn = ReactorIdlePopExpired(now)) != NULL)
+    {
+        /* Also drops a notification not returned by epoll_wait() yet */
+        epoll_ctl(REACTOR.epoll_fd, EPOLL_CTL_DEL,
+                  ConnectionInfoSocket(conn->conn_info), NULL);
+
+        char aligned_ipaddr[CF_MAX_IP_LEN + 2];
+        LoggingPrivContext log_ctx;
+        SetConnectionLogContext(conn, aligned_ipaddr, sizeof(aligned_ipaddr), &log_ctx);
+        Log(LOG_LEVEL_INFO, "Closing connection, timed out waiting for %s",
+            conn->established ? "a request" : "the session to be established");
+        ConnectionRelease(conn, true);
+        LoggingPrivSetContext(NULL);
+    }
+}
+
+/**
+ * (Re)arms the one-shot notification of the connection becoming readable.
+ */
+static bool ReactorWatch(ServerConnectionState *conn, int op)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = conn
+    };
+
+    /* Before arming, the notification may come right away */
+    ReactorIdleAdd(conn);
+    if (epoll_ctl(REACTOR.epoll_fd, op, ConnectionInfoSocket(conn->conn_info), &event) == -1)
+    {
+        Log(LOG_LEVEL_ERR, "Failed to watch connection (epoll_ctl: %s)",
+            GetErrorStr());
+        ReactorIdleRemove(conn);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Hands a newly accepted connection over to the reactor, unless it is not
+ * running.
+ *
+ * @return false if the connection must be served by its own thread
+ */
+static bool ReactorAddConnection(ServerConnectionState *conn)
+{
+    if (!REACTOR.running)
+    {
+        return false;
+    }
+
+    /* Counted right away, it holds a file descriptor from now on */
+    if (!ConnectionAdmit(conn))
+    {
+        ConnectionRelease(conn, false);
+        return true;
+    }
+
+    if (!ReactorWatch(conn, EPOLL_CTL_ADD))
+    {
+        ConnectionRelease(conn, true);
+        return true;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "New connection (from %s, sd %d), waiting for its first request",
+        conn->ipaddr, ConnectionInfoSocket(conn->conn_info));
+    return true;
+}
+
+/**
+ * Serves the requests of an established TLS connection until there is no
+ * more data to read.
+ *
+ * @return false if the connection must be closed
+ */
+static bool ServeReadyRequests(ServerConnectionState *conn)
+{
+    SSL *ssl = ConnectionInfoSSL(conn->conn_info);
+    bool keep_open;
+
+    /* Data already decrypted by OpenSSL won't wake epoll() up */
+    do
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        conn->command = PROTOCOL_COMMAND_BAD;
+
+        keep_open = BusyWithNewProtocol(conn->ctx, conn);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ReactorRecordLatency(conn->command,
+                             (end.tv_sec - start.tv_sec) +
+                             (end.tv_nsec - start.tv_nsec) / 1e9);
+    } while (keep_open && (ssl != NULL) && (SSL_pending(ssl) > 0));
+
+    return keep_open;
+}
+
+static void ServeReadyConnection(ServerConnectionState *conn)
+{
+    char aligned_ipaddr[CF_MAX_IP_LEN + 2];
+    LoggingPrivContext log_ctx;
+    SetConnectionLogContext(conn, aligned_ipaddr, sizeof(aligned_ipaddr), &log_ctx);
+
+    bool keep_open = false;
+    if (conn->established)
+    {
+        keep_open = ServeReadyRequests(conn);
+    }
+    else
+    {
+        Log(LOG_LEVEL_INFO, "Accepting connection");
+
+        conn->established = ConnectionEstablish(conn, CONNTIMEOUT);
+        if (conn->established &&
+            ProtocolIsClassic(ConnectionInfoProtocolVersion(conn->conn_info)))
+        {
+            /* Stops at the next request when the reactor is stopped */
+            while (REACTOR.running && BusyWithClassicConnection(conn->ctx, conn))
+            {
+            }
+        }
+        else if (conn->established)
+        {
+            SSL *ssl = ConnectionInfoSSL(conn->conn_info);
+            keep_open = ((ssl == NULL) || (SSL_pending(ssl) == 0) ||
+                         ServeReadyRequests(conn));
+        }
+    }
+
+    if (!keep_open || !ReactorWatch(conn, EPOLL_CTL_MOD))
+    {
+        Log(LOG_LEVEL_INFO, "Closing connection");
+        ConnectionRelease(conn, true);
+    }
+
+    LoggingPrivSetContext(NULL);
+}
+
+static void *ReactorWorker(ARG_UNUSED void *arg)
+{
+    ServerConnectionState *conn;
+    while ((conn = ReactorPopReady()) != NULL)
+    {
+        ServeReadyConnection(conn);
+
+        pthread_mutex_lock(&REACTOR.lock);
+        REACTOR.busy_workers--;
+        pthread_mutex_unlock(&REACTOR.lock);
+    }
+    return NULL;
+}
+
+static void *ReactorLoop(ARG_UNUSED void *arg)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    time_t last_metrics = time(NULL);
+
+    while (REACTOR.running)
+    {
+        int n = epoll_wait(REACTOR.epoll_fd, events, REACTOR_MAX_EVENTS, 1000);
+        if (n == -1 && errno != EINTR)
+        {
+            Log(LOG_LEVEL_ERR, "Error while waiting for requests (epoll_wait: %s)",
+                GetErrorStr());
+            sleep(1);
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            /* Errors and hang-ups are detected by the worker reading */
+            ReactorIdleRemove(events[i].data.ptr);
+            ReactorPushReady(events[i].data.ptr);
+        }
+
+        /* epoll_wait() times out every second at least */
+        const time_t now = time(NULL);
+        ReactorCloseExpired(now);
+
+        if (now - last_metrics >= REACTOR_METRICS_INTERVAL)
+        {
+            ReactorLogMetrics();
+            last_metrics = now;
+        }
     }
-    DeleteConn(conn);
     return NULL;
 }
 
+static bool StartReactorThread(pthread_t *tid, void *(*routine)(void *))
+{
+    int ret = pthread_create(tid, NULL, routine, NULL);
+    if (ret != 0)
+    {
+        errno = ret;
+        Log(LOG_LEVEL_ERR, "Unable to start server thread. (pthread_create: %s)",
+            GetErrorStr());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Makes the reactor threads exit and waits for them. The workers first
+ * finish serving the connection they are busy with.
+ */
+static void ReactorJoinThreads(bool loop_started)
+{
+    pthread_mutex_lock(&REACTOR.lock);
+    REACTOR.running = false;
+    pthread_cond_broadcast(&REACTOR.ready_cond);
+    pthread_mutex_unlock(&REACTOR.lock);
+
+    if (loop_started)
+    {
+        pthread_join(REACTOR.loop_thread, NULL);
+    }
+    for (size_t i = 0; i < REACTOR.num_workers; i++)
+    {
+        pthread_join(REACTOR.workers[i], NULL);
+    }
+
+    free(REACTOR.workers);
+    REACTOR.workers = NULL;
+    REACTOR.num_workers = 0;
+}
+
+/**
+ * Closes the connections left in the reactor, once its threads are gone.
+ */
+static void ReactorCloseAll(void)
+{
+    while (REACTOR.head != NULL)
+    {
+        ReadyConnection *ready = REACTOR.head;
+        REACTOR.head = ready->next;
+        ConnectionRelease(ready->conn, true);
+        free(ready);
+    }
+    REACTOR.tail = NULL;
+    REACTOR.queue_depth = 0;
+
+    IdleList *lists[] = { &REACTOR.pending, &REACTOR.idle };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        while (lists[i]->head != NULL)
+        {
+            ServerConnectionState *conn = lists[i]->head;
+            ReactorIdleRemoveLocked(conn);
+            ConnectionRelease(conn, true);
+        }
+    }
+}
+
+bool ServerReactorStart(void)
+{
+    const size_t num_workers = GetNumberOfWorkers();
+    if (num_workers == 0)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Using a thread per connection");
+        return false;
+    }
+
+    REACTOR.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (REACTOR.epoll_fd == -1)
+    {
+        Log(LOG_LEVEL_ERR,
+            "Failed to create the epoll instance, using a thread per connection (epoll_create1: %s)",
+            GetErrorStr());
+        return false;
+    }
+
+    REACTOR.running = true;
+    REACTOR.workers = xcalloc(num_workers, sizeof(pthread_t));
+    while ((REACTOR.num_workers < num_workers) &&
+           StartReactorThread(&REACTOR.workers[REACTOR.num_workers], ReactorWorker))
+    {
+        REACTOR.num_workers++;
+    }
+
+    if ((REACTOR.num_workers == 0) ||
+        !StartReactorThread(&REACTOR.loop_thread, ReactorLoop))
+    {
+        Log(LOG_LEVEL_ERR, "Failed to start the reactor, using a thread per connection");
+        ReactorJoinThreads(false);
+        close(REACTOR.epoll_fd);
+        REACTOR.epoll_fd = -1;
+        return false;
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "Serving connections with %zu worker threads",
+        REACTOR.num_workers);
+    return true;
+}
+
+void ServerReactorStop(void)
+{
+    if (!REACTOR.running)
+    {
+        return;
+    }
+
+    ReactorLogMetrics();
+
+    /* Waits for the requests being served, legacy protocol connections are
+     * closed after their current request. */
+    ReactorJoinThreads(true);
+    ReactorCloseAll();
+
+    close(REACTOR.epoll_fd);
+    REACTOR.epoll_fd = -1;
+}
+
+#else  /* !HAVE_SYS_EPOLL_H */
+
+static bool ReactorAddConnection(ARG_UNUSED ServerConnectionState *conn)
+{
+    return false;
+}
+
+bool ServerReactorStart(void)
+{
+    return false;
+}
+
+void ServerReactorStop(void)
+{
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
 
 /***************************************************************/
 /* Toolkit/Class: conn                                         */
@@ -124,6 +124,14 @@ struct ServerConnectionState_
     EvalContext *ctx;
 
     bool dump_reports;
+
+    /* Only used when connections are served by the reactor: */
+    bool established;                  /* ready to serve requests */
+    int command;                       /* ProtocolCommandNew being served */
+    bool idle;                         /* waiting in epoll for a request */
+    time_t deadline;                   /* closed if still idle by then */
+    ServerConnectionState *idle_prev;
+    ServerConnectionState *idle_next;
 };
 
 typedef struct
@@ -139,6 +147,15 @@ typedef struct
 /* Used in cf-serverd-functions.c. */
 void ServerEntryPoint(EvalContext *ctx, const char *ipaddr, ConnectionInfo *info);
 
+/**
+ * Starts serving the new connections with a pool of worker threads woken up
+ * by epoll(), instead of a thread per connection.
+ *
+ * @return false if connections are served with a thread each
+ */
+bool ServerReactorStart(void);
+void ServerReactorStop(void);
+
 
 AgentConnection *ExtractCallBackChannel(ServerConnectionState *conn);
 
@@ -33,7 +33,7 @@
 #include <string_lib.h>                      /* StringMatchFull TODO REMOVE */
 #include <misc_lib.h>
 #include <file_lib.h>
-#include <regex.h>
+#include <regex_cache.h>                     /* RegexCacheStringMatchFull */
 
 
 struct acl *paths_acl;
@@ -92,7 +92,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
         {
             if (FuzzySetMatch(StrList_At(acl->admit.ips, i), ipaddr) == 0 ||
                 /* Legacy regex matching, TODO DEPRECATE */
-                StringMatchFull(StrList_At(acl->admit.ips, i), ipaddr))
+                RegexCacheStringMatchFull(StrList_At(acl->admit.ips, i), ipaddr))
             {
                 rule = StrList_At(acl->admit.ips, i);
                 break;
@@ -120,7 +120,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
         {
             for (size_t i = 0; i < StrList_Len(acl->admit.hostnames); i++)
             {
-                if (StringMatchFull(StrList_At(acl->admit.hostnames, i),
+                if (RegexCacheStringMatchFull(StrList_At(acl->admit.hostnames, i),
                                     hostname))
                 {
                     pos = i;
@@ -198,7 +198,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
         {
             if (FuzzySetMatch(StrList_At(acl->deny.ips, i), ipaddr) == 0 ||
                 /* Legacy regex matching, TODO DEPRECATE */
-                StringMatchFull(StrList_At(acl->deny.ips, i), ipaddr))
+                RegexCacheStringMatchFull(StrList_At(acl->deny.ips, i), ipaddr))
             {
                 rule = StrList_At(acl->deny.ips, i);
                 break;
@@ -227,7 +227,7 @@ static bool access_CheckResource(const struct resource_acl *acl,
         {
             for (size_t i = 0; i < StrList_Len(acl->deny.hostnames); i++)
             {
-                if (StringMatchFull(StrList_At(acl->deny.hostnames, i),
+                if (RegexCacheStringMatchFull(StrList_At(acl->deny.hostnames, i),
                                     hostname))
                 {
                     pos = i;
@@ -405,7 +405,7 @@ bool acl_CheckRegex(const struct acl *acl, const char *req_string,
         const char *regex = acl->resource_names->list[i]->str;
 
         /* Does this ACL matches the req_string? */
-        if (StringMatchFull(regex, req_string))
+        if (RegexCacheStringMatchFull(regex, req_string))
         {
             const struct resource_acl *racl = &acl->acls[i];
 
@@ -55,6 +55,7 @@ static const int CF_NOSIZE = -1;
 #include <stat_cache.h>                            /* struct Stat */
 #include <unix.h>                                  /* GetUserID() */
 #include <file_stream.h>
+#include <server_file_cache.h>                     /* ServerFileCacheHashFile */
 #include "server_access.h"
 
 
@@ -727,35 +728,38 @@ void CfEncryptGetFile(ServerFileGetState *args)
     close(fd);
 }
 
-int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
+/**
+ * Fills #reply with the "OK: ..." line describing the (translated) path
+ * #filename, as sent in reply to STAT. Symlinks are described by their
+ * target, #linkbuf gets the link value (empty if not a link) and #statbuf
+ * the stat information used.
+ *
+ * @return false with an error message starting with "BAD:" in #reply.
+ */
+static bool StatFileReply(const char *filename, char *reply, size_t reply_size,
+                          char linkbuf[CF_BUFSIZE], struct stat *statbuf)
 /* Because we do not know the size or structure of remote datatypes,*/
 /* the simplest way to transfer the data is to convert them into */
 /* plain text and interpret them on the other side. */
 {
-    assert(conn != NULL);
     Stat cfst;
-    struct stat statbuf, statlinkbuf;
-    char linkbuf[CF_BUFSIZE], filename[CF_BUFSIZE - 128];
+    struct stat statlinkbuf;
     int islink = false;
 
-    TranslatePath(ofilename, filename, sizeof(filename));
-
     memset(&cfst, 0, sizeof(Stat));
 
     if (strlen(ReadLastNode(filename)) > CF_MAXLINKSIZE)
     {
-        snprintf(sendbuffer, CF_MSGSIZE, "BAD: Filename suspiciously long [%s]", filename);
-        Log(LOG_LEVEL_ERR, "%s", sendbuffer);
-        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
-        return -1;
+        snprintf(reply, reply_size, "BAD: Filename suspiciously long [%s]", filename);
+        Log(LOG_LEVEL_ERR, "%s", reply);
+        return false;
     }
 
-    if (lstat(filename, &statbuf) == -1)
+    if (lstat(filename, statbuf) == -1)
     {
-        snprintf(sendbuffer, CF_MSGSIZE, "BAD: unable to stat file %s", filename);
-        Log(LOG_LEVEL_VERBOSE, "%s. (lstat: %s)", sendbuffer, GetErrorStr());
-        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
-        return -1;
+        snprintf(reply, reply_size, "BAD: unable to stat file %s", filename);
+        Log(LOG_LEVEL_VERBOSE, "%s. (lstat: %s)", reply, GetErrorStr());
+        return false;
     }
 
     cfst.cf_readlink = NULL;
@@ -765,19 +769,18 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
     memset(linkbuf, 0, CF_BUFSIZE);
 
 #ifndef __MINGW32__                   // windows doesn't support symbolic links
-    if (S_ISLNK(statbuf.st_mode))
+    if (S_ISLNK(statbuf->st_mode))
     {
         islink = true;
         cfst.cf_type = FILE_TYPE_LINK; /* pointless - overwritten */
-        cfst.cf_lmode = statbuf.st_mode & 07777;
-        cfst.cf_nlink = statbuf.st_nlink;
+        cfst.cf_lmode = statbuf->st_mode & 07777;
+        cfst.cf_nlink = statbuf->st_nlink;
 
         if (readlink(filename, linkbuf, CF_BUFSIZE - 1) == -1)
         {
-            strcpy(sendbuffer, "BAD: unable to read link");
-            Log(LOG_LEVEL_ERR, "%s. (readlink: %s)", sendbuffer, GetErrorStr());
-            SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
-            return -1;
+            strlcpy(reply, "BAD: unable to read link", reply_size);
+            Log(LOG_LEVEL_ERR, "%s. (readlink: %s)", reply, GetErrorStr());
+            return false;
         }
 
         Log(LOG_LEVEL_DEBUG, "readlink '%s'", linkbuf);
@@ -788,64 +791,64 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
     if (islink && (stat(filename, &statlinkbuf) != -1))       /* linktype=copy used by agent */
     {
         Log(LOG_LEVEL_DEBUG, "Getting size of link deref '%s'", linkbuf);
-        statbuf.st_size = statlinkbuf.st_size;
-        statbuf.st_mode = statlinkbuf.st_mode;
-        statbuf.st_uid = statlinkbuf.st_uid;
-        statbuf.st_gid = statlinkbuf.st_gid;
-        statbuf.st_mtime = statlinkbuf.st_mtime;
-        statbuf.st_ctime = statlinkbuf.st_ctime;
+        statbuf->st_size = statlinkbuf.st_size;
+        statbuf->st_mode = statlinkbuf.st_mode;
+        statbuf->st_uid = statlinkbuf.st_uid;
+        statbuf->st_gid = statlinkbuf.st_gid;
+        statbuf->st_mtime = statlinkbuf.st_mtime;
+        statbuf->st_ctime = statlinkbuf.st_ctime;
     }
 
 #endif /* !__MINGW32__ */
 
-    if (S_ISDIR(statbuf.st_mode))
+    if (S_ISDIR(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_DIR;
     }
 
-    if (S_ISREG(statbuf.st_mode))
+    if (S_ISREG(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_REGULAR;
     }
 
-    if (S_ISSOCK(statbuf.st_mode))
+    if (S_ISSOCK(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_SOCK;
     }
 
-    if (S_ISCHR(statbuf.st_mode))
+    if (S_ISCHR(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_CHAR_;
     }
 
-    if (S_ISBLK(statbuf.st_mode))
+    if (S_ISBLK(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_BLOCK;
     }
 
-    if (S_ISFIFO(statbuf.st_mode))
+    if (S_ISFIFO(statbuf->st_mode))
     {
         cfst.cf_type = FILE_TYPE_FIFO;
     }
 
-    cfst.cf_mode = statbuf.st_mode & 07777;
-    cfst.cf_uid = statbuf.st_uid & 0xFFFFFFFF;
-    cfst.cf_gid = statbuf.st_gid & 0xFFFFFFFF;
-    cfst.cf_size = statbuf.st_size;
-    cfst.cf_atime = statbuf.st_atime;
-    cfst.cf_mtime = statbuf.st_mtime;
-    cfst.cf_ctime = statbuf.st_ctime;
-    cfst.cf_ino = statbuf.st_ino;
-    cfst.cf_dev = statbuf.st_dev;
+    cfst.cf_mode = statbuf->st_mode & 07777;
+    cfst.cf_uid = statbuf->st_uid & 0xFFFFFFFF;
+    cfst.cf_gid = statbuf->st_gid & 0xFFFFFFFF;
+    cfst.cf_size = statbuf->st_size;
+    cfst.cf_atime = statbuf->st_atime;
+    cfst.cf_mtime = statbuf->st_mtime;
+    cfst.cf_ctime = statbuf->st_ctime;
+    cfst.cf_ino = statbuf->st_ino;
+    cfst.cf_dev = statbuf->st_dev;
     cfst.cf_readlink = linkbuf;
 
     if (cfst.cf_nlink == CF_NOSIZE)
     {
-        cfst.cf_nlink = statbuf.st_nlink;
+        cfst.cf_nlink = statbuf->st_nlink;
     }
 
     /* Is file sparse? */
-    if (statbuf.st_size > ST_NBYTES(statbuf))
+    if (statbuf->st_size > ST_NBYTES(*statbuf))
     {
         cfst.cf_makeholes = 1;  /* must have a hole to get checksum right */
     }
@@ -854,7 +857,7 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
         cfst.cf_makeholes = 0;
     }
 
-    memset(sendbuffer, 0, CF_MSGSIZE);
+    memset(reply, 0, reply_size);
 
     /* send as plain text */
 
@@ -864,13 +867,30 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
         (uintmax_t) cfst.cf_uid, (uintmax_t) cfst.cf_gid, (intmax_t) cfst.cf_size,
         (intmax_t) cfst.cf_atime, (intmax_t) cfst.cf_mtime);
 
-    snprintf(sendbuffer, CF_MSGSIZE,
+    snprintf(reply, reply_size,
              "OK: %d %ju %ju %ju %ju %jd %jd %jd %jd %d %d %d %jd",
              cfst.cf_type, (uintmax_t) cfst.cf_mode, (uintmax_t) cfst.cf_lmode,
              (uintmax_t) cfst.cf_uid, (uintmax_t) cfst.cf_gid,   (intmax_t) cfst.cf_size,
              (intmax_t) cfst.cf_atime, (intmax_t) cfst.cf_mtime, (intmax_t) cfst.cf_ctime,
              cfst.cf_makeholes, cfst.cf_ino, cfst.cf_nlink, (intmax_t) cfst.cf_dev);
 
+    return true;
+}
+
+int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
+{
+    assert(conn != NULL);
+    struct stat statbuf;
+    char linkbuf[CF_BUFSIZE], filename[CF_BUFSIZE - 128];
+
+    TranslatePath(ofilename, filename, sizeof(filename));
+
+    if (!StatFileReply(filename, sendbuffer, CF_MSGSIZE, linkbuf, &statbuf))
+    {
+        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+        return -1;
+    }
+
     SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
 
     memset(sendbuffer, 0, CF_MSGSIZE);
@@ -882,15 +902,10 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename)
         SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
         return -1;
     }
-    if (cfst.cf_readlink != NULL)
-    {
-        NDEBUG_UNUSED int ret = snprintf(sendbuffer, CF_MSGSIZE, "OK:%s", linkbuf);
-        assert(ret > 0 && ret < CF_MSGSIZE);
-    }
-    else
-    {
-        strcpy(sendbuffer, "OK:");
-    }
+
+    /* Empty for anything but symlinks */
+    NDEBUG_UNUSED int ret = snprintf(sendbuffer, CF_MSGSIZE, "OK:%s", linkbuf);
+    assert(ret > 0 && ret < CF_MSGSIZE);
 
     SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
     return 0;
@@ -906,7 +921,7 @@ bool CompareLocalHash(const char *filename, const unsigned char digest[EVP_MAX_M
 
     unsigned char file_digest[EVP_MAX_MD_SIZE + 1] = { 0 };
     /* TODO connection might timeout if this takes long! */
-    HashFile(translated_filename, file_digest, CF_DEFAULT_DIGEST, false);
+    ServerFileCacheHashFile(translated_filename, file_digest, CF_DEFAULT_DIGEST);
 
     if (HashesMatch(digest, file_digest, CF_DEFAULT_DIGEST))
     {
@@ -1052,6 +1067,245 @@ int CfOpenDirectory(ServerConnectionState *conn, char *sendbuffer, char *oldDirn
 
 /**************************************************************/
 
+/* Limits of a MANIFEST reply, deeper directories are not listed and the
+ * client asks for them with OPENDIR. The depth also bounds the stack used
+ * by the recursion, connection threads only get 1MB. */
+#define MANIFEST_MAX_DEPTH 32
+#define MANIFEST_MAX_ENTRIES 100000
+
+/* Sent instead of a digest for directories followed by all their entries. */
+#define MANIFEST_LISTED "LISTED"
+
+typedef struct
+{
+    ServerConnectionState *conn;
+    bool digests;
+    size_t entries;
+    bool truncated;
+    size_t offset;
+    char buffer[CF_MSGSIZE];
+    /* Scratch space for the record being added */
+    char reply[CF_MSGSIZE];
+    char linkbuf[CF_BUFSIZE];
+} ManifestState;
+
+static bool ManifestFlush(ManifestState *state, char status)
+{
+    if (SendTransaction(state->conn->conn_info, state->buffer,
+                        state->offset, status) == -1)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Sending manifest failed. (send: %s)",
+            GetErrorStr());
+        return false;
+    }
+    state->offset = 0;
+    return true;
+}
+
+/**
+ * Records are four NUL-terminated strings: the path relative to the
+ * requested directory, the STAT reply, the digest (or MANIFEST_LISTED) and
+ * the link value. Records never span transactions.
+ */
+static bool ManifestAppendRecord(ManifestState *state, const char *relpath,
+                                 const char *reply, const char *extra,
+                                 const char *link)
+{
+    const char *const fields[] = { relpath, reply, extra, link };
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        len += strlen(fields[i]) + 1;
+    }
+
+    if (len > sizeof(state->buffer))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Manifest record of '%s' too long", relpath);
+        state->truncated = true;
+        return false;
+    }
+
+    if (state->offset + len > sizeof(state->buffer) &&
+        !ManifestFlush(state, CF_MORE))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        const size_t field_len = strlen(fields[i]) + 1;
+        memcpy(state->buffer + state->offset, fields[i], field_len);
+        state->offset += field_len;
+    }
+
+    return true;
+}
+
+/**
+ * Adds the record of #path and, for directories, the records of all the
+ * entries below it, down to #depth levels.
+ *
+ * @return false if the manifest can't be continued.
+ */
+static bool ManifestAddEntry(ManifestState *state, const char *path,
+                             const char *relpath, int depth)
+{
+    if (state->entries >= MANIFEST_MAX_ENTRIES)
+    {
+        state->truncated = true;
+        return false;
+    }
+
+    struct stat sb;
+    if (!StatFileReply(path, state->reply, sizeof(state->reply),
+                       state->linkbuf, &sb))
+    {
+        return true;                                 /* vanished, skip */
+    }
+
+    const bool is_dir = S_ISDIR(sb.st_mode) && state->linkbuf[0] == '\0';
+
+    /* Same checks as if the client asked for each entry on its own */
+    if (!StringEqual(relpath, "."))
+    {
+        char aclpath[CF_BUFSIZE];
+        int ret = snprintf(aclpath, sizeof(aclpath), "%s%s",
+                           path, is_dir ? "/" : "");
+        if (ret < 0 || (size_t) ret >= sizeof(aclpath) ||
+            !acl_CheckPath(paths_acl, aclpath,
+                           state->conn->ipaddr, state->conn->revdns,
+                           KeyPrintableHash(ConnectionInfoKey(state->conn->conn_info))))
+        {
+            Log(LOG_LEVEL_DEBUG, "Leaving '%s' out of manifest", path);
+            return true;
+        }
+    }
+
+    Dir *dirh = NULL;
+    char digest_string[CF_HOSTKEY_STRING_SIZE] = "";
+    const char *extra = "";
+
+    if (is_dir && depth > 0)
+    {
+        dirh = DirOpen(path);
+        if (dirh != NULL)
+        {
+            extra = MANIFEST_LISTED;
+        }
+    }
+    else if (state->digests && S_ISREG(sb.st_mode))
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+        ServerFileCacheHashFile(path, digest, CF_DEFAULT_DIGEST);
+        HashPrintSafe(digest_string, sizeof(digest_string), digest,
+                      CF_DEFAULT_DIGEST, true);
+        extra = digest_string;
+    }
+
+    if (!ManifestAppendRecord(state, relpath, state->reply, extra,
+                              state->linkbuf))
+    {
+        if (dirh != NULL)
+        {
+            DirClose(dirh);
+        }
+        return false;
+    }
+    state->entries++;
+
+    if (dirh == NULL)
+    {
+        return true;
+    }
+
+    bool ok = true;
+    const struct dirent *dirp;
+    for (dirp = DirRead(dirh); ok && dirp != NULL; dirp = DirRead(dirh))
+    {
+        if (StringEqual(dirp->d_name, ".") || StringEqual(dirp->d_name, ".."))
+        {
+            continue;
+        }
+
+        char child_path[CF_BUFSIZE];
+        char child_relpath[CF_BUFSIZE];
+        const bool is_root = StringEqual(relpath, ".");
+        int ret1 = snprintf(child_path, sizeof(child_path), "%s%s%s", path,
+                            StringEndsWith(path, "/") ? "" : "/", dirp->d_name);
+        int ret2 = snprintf(child_relpath, sizeof(child_relpath), "%s%s%s",
+                            is_root ? "" : relpath, is_root ? "" : "/",
+                            dirp->d_name);
+        if (ret1 < 0 || (size_t) ret1 >= sizeof(child_path) ||
+            ret2 < 0 || (size_t) ret2 >= sizeof(child_relpath))
+        {
+            /* The listing would miss an entry */
+            state->truncated = true;
+            ok = false;
+            break;
+        }
+
+        ok = ManifestAddEntry(state, child_path, child_relpath, depth - 1);
+    }
+
+    DirClose(dirh);
+    return ok;
+}
+
+/**
+ * Sends the manifest of the whole tree below #oldDirname in reply to
+ * MANIFEST: the STAT reply of every entry, and digests of regular files if
+ * #digests is set, so that the client gets in one request what would
+ * otherwise take an OPENDIR per directory and a STAT and MD5 per file.
+ * Ends with a CFD_TERMINATOR record, with "OK:" or "BAD: ..." if the
+ * manifest had to be cut short.
+ */
+int CfManifestDirectory(ServerConnectionState *conn, char *sendbuffer,
+                        char *oldDirname, int maxdepth, bool digests)
+{
+    char dirname[CF_BUFSIZE - 128];
+
+    TranslatePath(oldDirname, dirname, sizeof(dirname));
+
+    if (!IsAbsoluteFileName(dirname))
+    {
+        strcpy(sendbuffer, "BAD: request to access a non-absolute filename");
+        SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE);
+        return -1;
+    }
+
+    if (strlen(dirname) > 1)
+    {
+        PathRemoveTrailingSlash(dirname, strlen(dirname));
+    }
+
+    ManifestState *state = xcalloc(1, sizeof(ManifestState));
+    state->conn = conn;
+    state->digests = digests;
+
+    /* Clients ask for CF_INFINITY levels with depth_search => "inf", the
+     * levels below the limit are left to OPENDIR */
+    const bool ok = ManifestAddEntry(state, dirname, ".",
+                                     MIN(maxdepth, MANIFEST_MAX_DEPTH));
+    if (!ok && !state->truncated)
+    {
+        /* Connection broken, already logged */
+        free(state);
+        return -1;
+    }
+
+    const char *status = state->truncated ? "BAD: manifest truncated" : "OK:";
+    bool sent = ManifestAppendRecord(state, CFD_TERMINATOR, status, "", "") &&
+        ManifestFlush(state, CF_DONE);
+
+    Log(LOG_LEVEL_VERBOSE, "Sent manifest of %zu entries of '%s'%s",
+        state->entries, dirname, state->truncated ? " (truncated)" : "");
+
+    free(state);
+    return sent ? 0 : -1;
+}
+
+/**************************************************************/
+
 int CfSecOpenDirectory(ServerConnectionState *conn, char *sendbuffer, char *dirname)
 {
     Dir *dirh;
@@ -48,6 +48,8 @@ int StatFile(ServerConnectionState *conn, char *sendbuffer, char *ofilename);
 void ReplyServerContext(ServerConnectionState *conn, int encrypted, Item *classes);
 int CfOpenDirectory(ServerConnectionState *conn, char *sendbuffer, char *oldDirname);
 int CfSecOpenDirectory(ServerConnectionState *conn, char *sendbuffer, char *dirname);
+int CfManifestDirectory(ServerConnectionState *conn, char *sendbuffer,
+                        char *oldDirname, int maxdepth, bool digests);
 void GetServerLiteral(EvalContext *ctx, ServerConnectionState *conn, char *sendbuffer, char *recvbuffer, int encrypted);
 bool GetServerQuery(ServerConnectionState *conn, char *recvbuffer, int encrypted);
 bool CompareLocalHash(const char *filename, const unsigned char digest[EVP_MAX_MD_SIZE + 1],
@@ -0,0 +1,171 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+
+#include <server_file_cache.h>
+
+#include <map.h>
+#include <string_lib.h>                          /* StringHash_untyped */
+#include <mutex.h>                                          /* ThreadLock */
+#include <logging.h>
+#include <alloc.h>
+
+/* The cache is simply emptied when it grows beyond this many files. */
+#define SERVER_FILE_CACHE_MAX_ENTRIES 16384
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    HashMethod type;
+    unsigned char digest[EVP_MAX_MD_SIZE + 1];
+} ServerFileCacheEntry;
+
+static Map *FILE_CACHE = NULL; /* GLOBAL_X */
+static ServerFileCacheStats STATS = { 0 }; /* GLOBAL_X */
+static pthread_mutex_t file_cache_mutex = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+static bool EntryMatches(const ServerFileCacheEntry *entry, const struct stat *sb,
+                         HashMethod type)
+{
+    return entry->dev == sb->st_dev && entry->ino == sb->st_ino &&
+        entry->size == sb->st_size &&
+        entry->mtime == sb->st_mtime && entry->ctime == sb->st_ctime &&
+        entry->type == type;
+}
+
+static bool SameFileState(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size &&
+        a->st_mtime == b->st_mtime && a->st_ctime == b->st_ctime;
+}
+
+/* Timestamps only have a resolution of one second, a file modified during
+ * the current second could change again without stat() telling. */
+static bool IsCacheable(const struct stat *sb)
+{
+    const time_t now = time(NULL);
+    return S_ISREG(sb->st_mode) && sb->st_mtime < now && sb->st_ctime < now;
+}
+
+static bool CacheLookup(const char *filename, const struct stat *sb, HashMethod type,
+                        unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    bool found = false;
+
+    ThreadLock(&file_cache_mutex);
+    ServerFileCacheEntry *entry = (FILE_CACHE != NULL) ? MapGet(FILE_CACHE, filename) : NULL;
+    if (entry == NULL)
+    {
+        STATS.misses++;
+    }
+    else if (EntryMatches(entry, sb, type))
+    {
+        memcpy(digest, entry->digest, EVP_MAX_MD_SIZE + 1);
+        STATS.hits++;
+        found = true;
+    }
+    else
+    {
+        MapRemove(FILE_CACHE, filename);
+        STATS.invalidations++;
+    }
+    ThreadUnlock(&file_cache_mutex);
+
+    return found;
+}
+
+static void CacheStore(const char *filename, const struct stat *sb, HashMethod type,
+                       const unsigned char digest[EVP_MAX_MD_SIZE + 1])
+{
+    ServerFileCacheEntry *entry = xmalloc(sizeof(ServerFileCacheEntry));
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    entry->size = sb->st_size;
+    entry->mtime = sb->st_mtime;
+    entry->ctime = sb->st_ctime;
+    entry->type = type;
+    memcpy(entry->digest, digest, EVP_MAX_MD_SIZE + 1);
+
+    ThreadLock(&file_cache_mutex);
+    if (FILE_CACHE == NULL)
+    {
+        FILE_CACHE = MapNew(StringHash_untyped, StringEqual_untyped, free, free);
+    }
+    else if (MapSize(FILE_CACHE) >= SERVER_FILE_CACHE_MAX_ENTRIES)
+    {
+        Log(LOG_LEVEL_VERBOSE, "File digest cache full (%d files), emptying it",
+            SERVER_FILE_CACHE_MAX_ENTRIES);
+        MapClear(FILE_CACHE);
+    }
+    MapInsert(FILE_CACHE, xstrdup(filename), entry);
+    ThreadUnlock(&file_cache_mutex);
+}
+
+void ServerFileCacheHashFile(const char *filename,
+                             unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                             HashMethod type)
+{
+    struct stat before;
+    if (stat(filename, &before) == -1 || !IsCacheable(&before))
+    {
+        HashFile(filename, digest, type, false);
+        return;
+    }
+
+    if (CacheLookup(filename, &before, type, digest))
+    {
+        Log(LOG_LEVEL_DEBUG, "Using cached digest of '%s'", filename);
+        return;
+    }
+
+    HashFile(filename, digest, type, false);
+
+    /* Only remember the digest if the file did not change while hashing. */
+    struct stat after;
+    if (stat(filename, &after) != -1 && SameFileState(&before, &after))
+    {
+        CacheStore(filename, &after, type, digest);
+    }
+}
+
+void ServerFileCacheClear(void)
+{
+    ThreadLock(&file_cache_mutex);
+    if (FILE_CACHE != NULL)
+    {
+        MapDestroy(FILE_CACHE);
+        FILE_CACHE = NULL;
+    }
+    ThreadUnlock(&file_cache_mutex);
+}
+
+const ServerFileCacheStats *ServerFileCacheGetStats(void)
+{
+    return &STATS;
+}
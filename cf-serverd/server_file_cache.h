@@ -0,0 +1,62 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+
+#ifndef CFENGINE_SERVER_FILE_CACHE_H
+#define CFENGINE_SERVER_FILE_CACHE_H
+
+/*
+ * Digests of the files served by cf-serverd, shared by all the connection
+ * threads. Clients keep asking about the same files, so a digest is
+ * remembered as long as stat() tells the file was not replaced or modified
+ * since it was computed.
+ */
+
+#include <platform.h>
+#include <hash.h>
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t invalidations;
+} ServerFileCacheStats;
+
+/**
+ * @brief Like HashFile(), but answers from the cache when the file did not
+ *        change since its digest was computed
+ * @param filename translated path of a file
+ */
+void ServerFileCacheHashFile(const char *filename,
+                             unsigned char digest[EVP_MAX_MD_SIZE + 1],
+                             HashMethod type);
+
+/**
+ * @brief Drops all the cached digests
+ */
+void ServerFileCacheClear(void);
+
+const ServerFileCacheStats *ServerFileCacheGetStats(void);
+
+#endif
@@ -696,7 +696,9 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
 
     /* TODO break recvbuffer here: command, param1, param2 etc. */
 
-    switch (GetCommandNew(recvbuffer))
+    const ProtocolCommandNew command = GetCommandNew(recvbuffer);
+    conn->command = command;
+    switch (command)
     {
     case PROTOCOL_COMMAND_EXEC:
     {
@@ -841,6 +843,62 @@ bool BusyWithNewProtocol(EvalContext *ctx, ServerConnectionState *conn)
         CfOpenDirectory(conn, sendbuffer, filename);
         return true;
     }
+    case PROTOCOL_COMMAND_MANIFEST:
+    {
+        if (!ProtocolSupportsManifest(ConnectionInfoProtocolVersion(conn->conn_info)))
+        {
+            goto protocol_error;
+        }
+
+        int maxdepth, digests;
+        memset(filename, 0, sizeof(filename));
+        int ret = sscanf(recvbuffer, "MANIFEST %d %d %[^\n]",
+                         &maxdepth, &digests, filename);
+        if (ret != 3 || maxdepth < 0 || (digests != 0 && digests != 1))
+        {
+            goto protocol_error;
+        }
+
+        Log(LOG_LEVEL_VERBOSE, "%14s %8s %s",
+            "Received:", "MANIFEST", filename);
+
+        /* sizeof()-1 because we need one extra byte for
+           appending '/' afterwards. */
+        size_t zret = ShortcutsExpand(filename, sizeof(filename) - 1,
+                                      SERVER_ACCESS.path_shortcuts,
+                                      conn->ipaddr, conn->revdns,
+                                      KeyPrintableHash(ConnectionInfoKey(conn->conn_info)));
+        if (zret == (size_t) -1)
+        {
+            goto protocol_error;
+        }
+
+        zret = PreprocessRequestPath(filename, sizeof(filename) - 1);
+        if (zret == (size_t) -1)
+        {
+            RefuseAccess(conn, recvbuffer);
+            return true;
+        }
+
+        /* Like OPENDIR, MANIFEST *must* be directory. */
+        PathAppendTrailingSlash(filename, strlen(filename));
+
+        Log(LOG_LEVEL_VERBOSE, "%14s %8s %s",
+            "Translated to:", "MANIFEST", filename);
+
+        if (acl_CheckPath(paths_acl, filename,
+                          conn->ipaddr, conn->revdns,
+                          KeyPrintableHash(ConnectionInfoKey(conn->conn_info)))
+            == false)
+        {
+            Log(LOG_LEVEL_INFO, "access denied to MANIFEST: %s", filename);
+            RefuseAccess(conn, recvbuffer);
+            return true;
+        }
+
+        CfManifestDirectory(conn, sendbuffer, filename, maxdepth, digests == 1);
+        return true;
+    }
     case PROTOCOL_COMMAND_SYNCH:
     {
         long time_no_see = 0;
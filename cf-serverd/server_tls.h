@@ -47,6 +47,7 @@ typedef enum
     PROTOCOL_COMMAND_CALL_ME_BACK,
     PROTOCOL_COMMAND_COOKIE,
     PROTOCOL_COMMAND_GETPATCH,
+    PROTOCOL_COMMAND_MANIFEST,
     PROTOCOL_COMMAND_BAD
 } ProtocolCommandNew;
 
@@ -64,6 +65,7 @@ static const char *const PROTOCOL_NEW[PROTOCOL_COMMAND_BAD + 1] =
     "SCALLBACK",
     "COOKIE",
     "GETPATCH",
+    "MANIFEST",
     NULL
 };
 
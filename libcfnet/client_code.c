@@ -30,7 +30,7 @@
 #include <net.h>                      /* SendTransaction,ReceiveTransaction */
 #include <openssl/err.h>                                   /* ERR_get_error */
 #include <protocol.h>                              /* ProtocolIsUndefined() */
-#include <tls_client.h>               /* TLSTry */
+#include <tls_client.h>        /* TLSTry,TLSClientSaveSession */
 #include <tls_generic.h>              /* TLSVerifyPeer */
 #include <dir.h>
 #include <unix.h>
@@ -46,6 +46,7 @@
 #include <printsize.h>                                         /* PRINTSIZE */
 #include <lastseen.h>                                            /* LastSaw */
 #include <file_stream.h>
+#include <stat_cache.h>                                  /* StatCacheLookup */
 
 
 #define CFENGINE_SERVICE "cfengine"
@@ -138,7 +139,7 @@ int TLSConnect(ConnectionInfo *conn_info, bool trust_server, const Rlist *restri
 {
     int ret;
 
-    ret = TLSTry(conn_info);
+    ret = TLSTry(conn_info, ipaddr);
     if (ret == -1)
     {
         return -1;
@@ -329,6 +330,11 @@ void DisconnectServer(AgentConnection *conn)
         if (conn->conn_info->protocol >= CF_PROTOCOL_TLS &&
             conn->conn_info->ssl != NULL)
         {
+            /* Only keep sessions with servers we trust. */
+            if (conn->conn_info->status == CONNECTIONINFO_STATUS_ESTABLISHED)
+            {
+                TLSClientSaveSession(conn->conn_info, conn->remoteip);
+            }
             SSL_shutdown(conn->conn_info->ssl);
         }
 
@@ -341,6 +347,30 @@ void DisconnectServer(AgentConnection *conn)
 
 /*********************************************************************/
 
+static Item *DirListFromManifest(const Seq *entries)
+{
+    Item *start = NULL, *end = NULL;
+    const size_t length = SeqLength(entries);
+    for (size_t i = 0; i < length; i++)
+    {
+        Item *ip = xcalloc(1, sizeof(Item));
+        ip->name = (char *) AllocateDirentForFilename(SeqAt(entries, i));
+
+        if (start == NULL)  /* First element */
+        {
+            start = ip;
+            end = ip;
+        }
+        else
+        {
+            end->next = ip;
+            end = ip;
+        }
+    }
+
+    return start;
+}
+
 /* Returning NULL (an empty list) does not mean empty directory but ERROR,
  * since every directory has to contain at least . and .. */
 Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
@@ -351,6 +381,13 @@ Item *RemoteDirList(const char *dirname, bool encrypt, AgentConnection *conn)
     char out[CF_BUFSIZE];
     int cipherlen = 0, tosend;
 
+    /* Already listed in a manifest, see StatCacheFetchManifest() */
+    const Stat *cached = StatCacheLookup(conn, dirname, conn->this_server);
+    if (cached != NULL && cached->cf_dirlist != NULL)
+    {
+        return DirListFromManifest(cached->cf_dirlist);
+    }
+
     if (strlen(dirname) > CF_BUFSIZE - 20)
     {
         Log(LOG_LEVEL_ERR, "Directory name too long");
@@ -488,6 +525,16 @@ bool CompareHashNet(const char *file1, const char *file2, bool encrypt, AgentCon
 
     HashFile(file2, d, CF_DEFAULT_DIGEST, false);
 
+    /* The digest of the remote file might have come with a manifest */
+    const Stat *cached = StatCacheLookup(conn, file1, conn->this_server);
+    if (cached != NULL && cached->cf_digest != NULL)
+    {
+        char local_digest[CF_HOSTKEY_STRING_SIZE];
+        HashPrintSafe(local_digest, sizeof(local_digest), d,
+                      CF_DEFAULT_DIGEST, true);
+        return !StringEqual(local_digest, cached->cf_digest);
+    }
+
     memset(recvbuffer, 0, CF_BUFSIZE);
 
     /* We encrypt only for CLASSIC protocol. The TLS protocol is always over
@@ -21,14 +21,13 @@
   (COSL) may apply to this file if you as a licensee so wish it. See
   included file COSL.txt.
 */
-
-
 #include <platform.h>
 #include <conn_cache.h>
 
 #include <cfnet.h>                                     /* AgentConnection */
 #include <client_code.h>                               /* DisconnectServer */
 #include <sequence.h>                                  /* Seq */
+#include <map.h>                                       /* Map */
 #include <mutex.h>                                     /* ThreadLock */
 #include <communication.h>                             /* Hostname2IPString */
 #include <misc_lib.h>                                  /* CF_ASSERT */
@@ -38,31 +37,87 @@
 /**
    Global cache for connections to servers, currently only used in cf-agent.
 
-   @note THREAD-SAFETY: yes this connection cache *is* thread-safe, but is
-         extremely slow if used intensely from multiple threads. It needs to
-         be redesigned from scratch for that, not a priority for
-         single-threaded cf-agent!
+   Connections are grouped in pools, one for every (server, port, connection
+   flags) tuple, so finding the connections to a server does not depend on
+   how many other servers we are connected to. Every pool also remembers if
+   the server could not be reached, so that copy_from promises falling back
+   to other servers don't wait for the connection timeout over and over.
+
+   @note THREAD-SAFETY: yes this connection cache *is* thread-safe, but all
+         access goes through a single lock, so it is still not meant to be
+         used intensely from multiple threads.
 */
 
 
+/* How long to consider a server offline after failing to connect to it,
+ * doubled with every further failure in a row up to the maximum. */
+#define CONNCACHE_OFFLINE_RETRY_SECONDS 5
+#define CONNCACHE_OFFLINE_RETRY_MAX_SECONDS 300
+
+
 typedef struct
 {
     AgentConnection *conn;
     enum ConnCacheStatus status; /* TODO unify with conn->conn_info->status */
 } ConnCache_entry;
 
+typedef struct
+{
+    Seq *entries;                                       /* ConnCache_entry */
+    time_t offline_since;             /* 0 if the last connection worked */
+    unsigned int failures;             /* consecutive failed connections */
+} ConnCache_pool;
+
 
 static pthread_mutex_t cft_conncache = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
 
-static Seq *conn_cache = NULL;
+static Map *conn_cache = NULL;                      /* key -> ConnCache_pool */
+
+
+static void ConnCachePoolDestroy(void *ptr)
+{
+    ConnCache_pool *pool = ptr;
+    SeqDestroy(pool->entries);
+    free(pool);
+}
+
+static char *ConnCacheKey(const char *server, const char *port,
+                          ConnectionFlags flags)
+{
+    return StringFormat("%s %s %d%d%d%d%d", server, (port != NULL) ? port : "",
+                        (int) flags.protocol_version, flags.cache_connection,
+                        flags.force_ipv4, flags.trust_server,
+                        flags.off_the_record);
+}
+
+/* Must be called with cft_conncache locked. */
+static ConnCache_pool *ConnCacheGetPool(const char *server, const char *port,
+                                        ConnectionFlags flags, bool create)
+{
+    char *key = ConnCacheKey(server, port, flags);
+    ConnCache_pool *pool = MapGet(conn_cache, key);
+
+    if (pool == NULL && create)
+    {
+        pool = xcalloc(1, sizeof(ConnCache_pool));
+        pool->entries = SeqNew(4, free);
+        MapInsert(conn_cache, key, pool);
+    }
+    else
+    {
+        free(key);
+    }
 
+    return pool;
+}
 
 void ConnCache_Init()
 {
     ThreadLock(&cft_conncache);
 
     assert(conn_cache == NULL);
-    conn_cache = SeqNew(100, free);
+    conn_cache = MapNew(StringHash_untyped, StringEqual_untyped,
+                        free, ConnCachePoolDestroy);
 
     ThreadUnlock(&cft_conncache);
 }
@@ -71,34 +126,30 @@ void ConnCache_Destroy()
 {
     ThreadLock(&cft_conncache);
 
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+    MapIterator it = MapIteratorInit(conn_cache);
+    MapKeyValue *item;
+    while ((item = MapIteratorNext(&it)) != NULL)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
+        ConnCache_pool *pool = item->value;
+        for (size_t i = 0; i < SeqLength(pool->entries); i++)
+        {
+            ConnCache_entry *svp = SeqAt(pool->entries, i);
 
-        CF_ASSERT(svp != NULL,
-                  "Destroy: NULL ConnCache_entry!");
-        CF_ASSERT(svp->conn != NULL,
-                  "Destroy: NULL connection in ConnCache_entry!");
+            CF_ASSERT(svp != NULL,
+                      "Destroy: NULL ConnCache_entry!");
+            CF_ASSERT(svp->conn != NULL,
+                      "Destroy: NULL connection in ConnCache_entry!");
 
-        DisconnectServer(svp->conn);
+            DisconnectServer(svp->conn);
+        }
     }
 
-    SeqDestroy(conn_cache);
+    MapDestroy(conn_cache);
     conn_cache = NULL;
 
     ThreadUnlock(&cft_conncache);
 }
 
-static bool ConnCacheEntryMatchesConnection(ConnCache_entry *entry,
-                                            const char *server,
-                                            const char *port,
-                                            ConnectionFlags flags)
-{
-    return ConnectionFlagsEqual(&flags, &entry->conn->flags) &&
-           StringEqual(port, entry->conn->this_port)     &&
-           StringEqual(server, entry->conn->this_server);
-}
-
 AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
                                             const char *port,
                                             ConnectionFlags flags)
@@ -106,9 +157,11 @@ AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
     ThreadLock(&cft_conncache);
 
     AgentConnection *ret_conn = NULL;
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+    ConnCache_pool *pool = ConnCacheGetPool(server, port, flags, false);
+    const size_t length = (pool != NULL) ? SeqLength(pool->entries) : 0;
+    for (size_t i = 0; i < length; i++)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
+        ConnCache_entry *svp = SeqAt(pool->entries, i);
 
         CF_ASSERT(svp != NULL,
                   "FindIdle: NULL ConnCache_entry!");
@@ -134,45 +187,42 @@ AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
                 "FindIdle: connection %p is marked as broken.",
                 svp->conn);
         }
-        else if (ConnCacheEntryMatchesConnection(svp, server, port, flags))
+        else if (svp->conn->conn_info->sd >= 0)
         {
-            if (svp->conn->conn_info->sd >= 0)
+            assert(svp->status == CONNCACHE_STATUS_IDLE);
+
+            // Check connection state before returning it
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(svp->conn->conn_info->sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
             {
-                assert(svp->status == CONNCACHE_STATUS_IDLE);
-
-                // Check connection state before returning it
-                int error = 0;
-                socklen_t len = sizeof(error);
-                if (getsockopt(svp->conn->conn_info->sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
-                {
-                    Log(LOG_LEVEL_DEBUG, "FindIdle: found connection to '%s' but could not get socket status, skipping.",
-                        server);
-                    svp->status = CONNCACHE_STATUS_BROKEN;
-                    continue;
-                }
-                if (error != 0)
-                {
-                    Log(LOG_LEVEL_DEBUG, "FindIdle: found connection to '%s' but connection is broken, skipping.",
-                        server);
-                    svp->status = CONNCACHE_STATUS_BROKEN;
-                    continue;
-                }
-
-                Log(LOG_LEVEL_VERBOSE, "FindIdle:"
-                    " found connection to '%s' already open and ready.",
+                Log(LOG_LEVEL_DEBUG, "FindIdle: found connection to '%s' but could not get socket status, skipping.",
                     server);
-
-                svp->status = CONNCACHE_STATUS_BUSY;
-                ret_conn = svp->conn;
-                break;
+                svp->status = CONNCACHE_STATUS_BROKEN;
+                continue;
             }
-            else
+            if (error != 0)
             {
-                Log(LOG_LEVEL_VERBOSE, "FindIdle:"
-                    " connection to '%s' has invalid socket descriptor %d!",
-                    server, svp->conn->conn_info->sd);
+                Log(LOG_LEVEL_DEBUG, "FindIdle: found connection to '%s' but connection is broken, skipping.",
+                    server);
                 svp->status = CONNCACHE_STATUS_BROKEN;
+                continue;
             }
+
+            Log(LOG_LEVEL_VERBOSE, "FindIdle:"
+                " found connection to '%s' already open and ready.",
+                server);
+
+            svp->status = CONNCACHE_STATUS_BUSY;
+            ret_conn = svp->conn;
+            break;
+        }
+        else
+        {
+            Log(LOG_LEVEL_VERBOSE, "FindIdle:"
+                " connection to '%s' has invalid socket descriptor %d!",
+                server, svp->conn->conn_info->sd);
+            svp->status = CONNCACHE_STATUS_BROKEN;
         }
     }
 
@@ -195,9 +245,12 @@ void ConnCache_MarkNotBusy(AgentConnection *conn)
     ThreadLock(&cft_conncache);
 
     bool found = false;
-    for (size_t i = 0; i < SeqLength(conn_cache); i++)
+    ConnCache_pool *pool = ConnCacheGetPool(conn->this_server, conn->this_port,
+                                            conn->flags, false);
+    const size_t length = (pool != NULL) ? SeqLength(pool->entries) : 0;
+    for (size_t i = 0; i < length; i++)
     {
-        ConnCache_entry *svp = SeqAt(conn_cache, i);
+        ConnCache_entry *svp = SeqAt(pool->entries, i);
 
         CF_ASSERT(svp != NULL,
                   "MarkNotBusy: NULL ConnCache_entry!");
@@ -232,11 +285,71 @@ void ConnCache_MarkNotBusy(AgentConnection *conn)
 /* First time we open a connection, so store it. */
 void ConnCache_Add(AgentConnection *conn, enum ConnCacheStatus status)
 {
+    ThreadLock(&cft_conncache);
+
+    ConnCache_pool *pool = ConnCacheGetPool(conn->this_server, conn->this_port,
+                                            conn->flags, true);
+    if (status == CONNCACHE_STATUS_OFFLINE)
+    {
+        pool->failures++;
+        pool->offline_since = time(NULL);
+    }
+    else
+    {
+        pool->failures = 0;
+        pool->offline_since = 0;
+    }
+
     ConnCache_entry *svp = xmalloc(sizeof(*svp));
     svp->status = status;
     svp->conn = conn;
+    SeqAppend(pool->entries, svp);
 
+    ThreadUnlock(&cft_conncache);
+}
+
+void ConnCache_MarkOffline(const char *server, const char *port,
+                           ConnectionFlags flags)
+{
     ThreadLock(&cft_conncache);
-    SeqAppend(conn_cache, svp);
+
+    ConnCache_pool *pool = ConnCacheGetPool(server, port, flags, true);
+    pool->failures++;
+    pool->offline_since = time(NULL);
+
     ThreadUnlock(&cft_conncache);
 }
+
+static time_t ConnCacheRetryDelay(unsigned int failures)
+{
+    time_t delay = CONNCACHE_OFFLINE_RETRY_SECONDS;
+    for (unsigned int i = 1; i < failures && delay < CONNCACHE_OFFLINE_RETRY_MAX_SECONDS; i++)
+    {
+        delay *= 2;
+    }
+    return MIN(delay, CONNCACHE_OFFLINE_RETRY_MAX_SECONDS);
+}
+
+bool ConnCache_IsOffline(const char *server, const char *port,
+                         ConnectionFlags flags)
+{
+    ThreadLock(&cft_conncache);
+
+    bool offline = false;
+    ConnCache_pool *pool = ConnCacheGetPool(server, port, flags, false);
+    if (pool != NULL && pool->offline_since != 0)
+    {
+        const time_t delay = ConnCacheRetryDelay(pool->failures);
+        offline = (time(NULL) - pool->offline_since < delay);
+        if (offline)
+        {
+            Log(LOG_LEVEL_VERBOSE, "Server '%s' port %s was unreachable less than %jd seconds ago"
+                " (%u failed attempt(s) in a row), not trying it again yet",
+                server, port, (intmax_t) delay, pool->failures);
+        }
+    }
+
+    ThreadUnlock(&cft_conncache);
+
+    return offline;
+}
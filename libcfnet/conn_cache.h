@@ -45,6 +45,10 @@ AgentConnection *ConnCache_FindIdleMarkBusy(const char *server,
                                             ConnectionFlags flags);
 void ConnCache_MarkNotBusy(AgentConnection *conn);
 void ConnCache_Add(AgentConnection *conn, enum ConnCacheStatus status);
+void ConnCache_MarkOffline(const char *server, const char *port,
+                           ConnectionFlags flags);
+bool ConnCache_IsOffline(const char *server, const char *port,
+                         ConnectionFlags flags);
 void ConnCache_IsBusy(AgentConnection *conn);
 
 
@@ -41,10 +41,11 @@ typedef enum
     CF_PROTOCOL_COOKIE = 3,
     CF_PROTOCOL_FILESTREAM = 4,
     CF_PROTOCOL_LEECH2 = 5,
+    CF_PROTOCOL_MANIFEST = 6,
 } ProtocolVersion;
 
 /* We use CF_PROTOCOL_LATEST as the default for new connections. */
-#define CF_PROTOCOL_LATEST CF_PROTOCOL_LEECH2
+#define CF_PROTOCOL_LATEST CF_PROTOCOL_MANIFEST
 
 static inline const char *ProtocolVersionString(const ProtocolVersion p)
 {
@@ -60,6 +61,8 @@ static inline const char *ProtocolVersionString(const ProtocolVersion p)
         return "filestream";
     case CF_PROTOCOL_LEECH2:
         return "leech2";
+    case CF_PROTOCOL_MANIFEST:
+        return "manifest";
     default:
         return "undefined";
     }
@@ -100,6 +103,11 @@ static inline bool ProtocolSupportsLeech2(const ProtocolVersion p)
     return (p >= CF_PROTOCOL_LEECH2);
 }
 
+static inline bool ProtocolSupportsManifest(const ProtocolVersion p)
+{
+    return (p >= CF_PROTOCOL_MANIFEST);
+}
+
 static inline bool ProtocolTerminateCSV(const ProtocolVersion p)
 {
     return (p < CF_PROTOCOL_COOKIE);
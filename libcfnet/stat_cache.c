@@ -27,12 +27,15 @@
 #include <stat_cache.h>
 
 #include <cfnet.h>                            /* AgentConnection */
+#include <cf3.defs.h>                         /* CFD_TERMINATOR */
 #include <net.h>                              /* {Send,Receive}Transaction */
 #include <client_protocol.h>                  /* BadProtoReply,OKProtoReply */
 #include <alloc.h>                            /* xmemdup */
 #include <logging.h>                          /* Log */
 #include <crypto.h>                           /* EncryptString */
 #include <misc_lib.h>                         /* ProgrammingError */
+#include <map.h>                              /* Map */
+#include <string_lib.h>                       /* StringEqual */
 
 static void NewStatCache(Stat *data, AgentConnection *conn)
 {
@@ -48,10 +51,44 @@ void DestroyStatCache(Stat *data)
         free(data->cf_readlink);
         free(data->cf_filename);
         free(data->cf_server);
+        free(data->cf_digest);
+        SeqDestroy(data->cf_dirlist);
         free(data);
     }
 }
 
+/**
+ * @brief Completes #cfst, freshly parsed from a STAT reply for #file, and
+ *        adds it to the cache. The cache takes over the strings in #cfst.
+ * @return false if the reply carried an invalid file type
+ */
+static bool StatCacheAdd(AgentConnection *conn, const char *file, Stat *cfst)
+{
+    mode_t file_type = FileTypeToMode(cfst->cf_type);
+    if (file_type == 0)
+    {
+        Log(LOG_LEVEL_ERR, "Invalid file type identifier for file %s:%s, %u",
+            conn->this_server, file, cfst->cf_type);
+        free(cfst->cf_readlink);
+        free(cfst->cf_digest);
+        return false;
+    }
+
+    cfst->cf_mode |= file_type;
+
+    cfst->cf_filename = xstrdup(file);
+    cfst->cf_server = xstrdup(conn->this_server);
+    cfst->cf_failed = false;
+
+    if (cfst->cf_lmode != 0)
+    {
+        cfst->cf_lmode |= (mode_t) S_IFLNK;
+    }
+
+    NewStatCache(cfst, conn);
+    return true;
+}
+
 /**
  * @brief Find remote stat information for #file in cache and
  *        return it in #statbuf.
@@ -224,7 +261,7 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
         return -1;
     }
 
-    Stat cfst;
+    Stat cfst = { 0 };
 
     ret = StatParseResponse(recvbuffer, &cfst);
     if (!ret)
@@ -255,27 +292,11 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
         cfst.cf_readlink = NULL;
     }
 
-    mode_t file_type = FileTypeToMode(cfst.cf_type);
-    if (file_type == 0)
+    if (!StatCacheAdd(conn, file, &cfst))
     {
-        Log(LOG_LEVEL_ERR, "Invalid file type identifier for file %s:%s, %u",
-            conn->this_server, file, cfst.cf_type);
         return -1;
     }
 
-    cfst.cf_mode |= file_type;
-
-    cfst.cf_filename = xstrdup(file);
-    cfst.cf_server = xstrdup(conn->this_server);
-    cfst.cf_failed = false;
-
-    if (cfst.cf_lmode != 0)
-    {
-        cfst.cf_lmode |= (mode_t) S_IFLNK;
-    }
-
-    NewStatCache(&cfst, conn);
-
     if ((cfst.cf_lmode != 0) && (strcmp(stattype, "link") == 0))
     {
         statbuf->st_mode = cfst.cf_lmode;
@@ -300,6 +321,226 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
 
 /*********************************************************************/
 
+/* Sent by the server instead of a digest for the directories which are
+ * followed by all their entries in the manifest. */
+#define MANIFEST_LISTED "LISTED"
+
+static const char *ManifestNextField(const char **pos, const char *end)
+{
+    const char *field = *pos;
+    const char *nul = memchr(field, '\0', end - field);
+    if (nul == NULL)
+    {
+        return NULL;
+    }
+    *pos = nul + 1;
+    return field;
+}
+
+/**
+ * @brief Adds the manifest record of #relpath, relative to #dirname, to
+ *        the stat cache and to the listing of its parent directory
+ * @param listings directory listings of this manifest, by path
+ */
+static bool ManifestAddRecord(AgentConnection *conn, Map *listings,
+                              const char *dirname, const char *relpath,
+                              const char *reply, const char *extra,
+                              const char *link)
+{
+    const size_t dirname_len = strlen(dirname);
+    const bool slash = (dirname_len > 0 && dirname[dirname_len - 1] == '/');
+
+    char path[CF_BUFSIZE];
+    int ret;
+    if (StringEqual(relpath, "."))
+    {
+        ret = snprintf(path, sizeof(path), "%s", dirname);
+    }
+    else
+    {
+        ret = snprintf(path, sizeof(path), "%s%s%s",
+                       dirname, slash ? "" : "/", relpath);
+    }
+    if (ret < 0 || (size_t) ret >= sizeof(path))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Path too long in manifest of '%s'", dirname);
+        return false;
+    }
+
+    Stat cfst = { 0 };
+    if (!StatParseResponse(reply, &cfst))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Cannot read manifest record of '%s'", path);
+        return false;
+    }
+
+    const bool listed = StringEqual(extra, MANIFEST_LISTED);
+    cfst.cf_readlink = (link[0] != '\0') ? xstrdup(link) : NULL;
+    cfst.cf_digest = (!listed && extra[0] != '\0') ? xstrdup(extra) : NULL;
+
+    if (!StatCacheAdd(conn, path, &cfst))
+    {
+        return false;
+    }
+
+    if (!StringEqual(relpath, "."))
+    {
+        const char *basename = strrchr(relpath, '/');
+        char parent[CF_BUFSIZE];
+        if (basename == NULL)
+        {
+            basename = relpath;
+            strlcpy(parent, dirname, sizeof(parent));
+        }
+        else
+        {
+            basename++;
+            const size_t parent_len = strlen(path) - strlen(basename) - 1;
+            memcpy(parent, path, parent_len);
+            parent[parent_len] = '\0';
+        }
+
+        Seq *entries = MapGet(listings, parent);
+        if (entries != NULL)
+        {
+            SeqAppend(entries, xstrdup(basename));
+        }
+    }
+
+    if (listed)
+    {
+        /* Like OPENDIR replies, listings always contain these. */
+        Seq *entries = SeqNew(16, free);
+        SeqAppend(entries, xstrdup("."));
+        SeqAppend(entries, xstrdup(".."));
+
+        /* The entry just added is the head of the cache */
+        conn->cache->cf_dirlist = entries;
+        MapInsert(listings, xstrdup(path), entries);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Fills the stat cache with the whole tree under #dirname, sent by
+ *        the server in reply to a single MANIFEST request, instead of one
+ *        OPENDIR and one or two STAT requests per file
+ * @param maxdepth how many levels of directories to list
+ * @param digests also get the digests of the files, for CompareHashNet()
+ * @return false if the manifest could not be fetched completely, then
+ *         whatever is missing is requested file by file as usual
+ */
+bool StatCacheFetchManifest(AgentConnection *conn, const char *dirname,
+                            int maxdepth, bool digests)
+{
+    assert(conn != NULL);
+    assert(dirname != NULL);
+
+    if (!ProtocolSupportsManifest(ConnectionInfoProtocolVersion(conn->conn_info)))
+    {
+        return false;
+    }
+
+    if (strlen(dirname) > CF_BUFSIZE - 40)
+    {
+        Log(LOG_LEVEL_ERR, "Directory name too long");
+        return false;
+    }
+
+    char sendbuffer[CF_BUFSIZE];
+    snprintf(sendbuffer, sizeof(sendbuffer), "MANIFEST %d %d %s",
+             maxdepth, digests ? 1 : 0, dirname);
+
+    if (SendTransaction(conn->conn_info, sendbuffer, 0, CF_DONE) == -1)
+    {
+        return false;
+    }
+
+    Stat *const old_head = conn->cache;
+    Map *listings = MapNew(StringHash_untyped, StringEqual_untyped, free, NULL);
+    bool complete = false;
+    bool broken = false;
+    bool first = true;
+
+    char recvbuffer[CF_BUFSIZE];
+    while (true)
+    {
+        const int nbytes = ReceiveTransaction(conn->conn_info, recvbuffer, NULL);
+        if (nbytes == -1)
+        {
+            /* TODO mark connection in the cache as closed. */
+            break;
+        }
+
+        if (first && (FailedProtoReply(recvbuffer) || BadProtoReply(recvbuffer)))
+        {
+            Log(LOG_LEVEL_VERBOSE, "Server refused manifest of '%s': %s",
+                dirname, recvbuffer);
+            break;
+        }
+        first = false;
+
+        /* Keep reading until the end of the manifest even if a record is
+         * not usable, the connection must stay in sync. Records never
+         * span transactions. */
+        const char *pos = recvbuffer;
+        const char *end = recvbuffer + nbytes;
+        bool terminated = false;
+        while (pos < end)
+        {
+            const char *relpath = ManifestNextField(&pos, end);
+            const char *reply = (relpath != NULL) ? ManifestNextField(&pos, end) : NULL;
+            const char *extra = (reply != NULL) ? ManifestNextField(&pos, end) : NULL;
+            const char *link = (extra != NULL) ? ManifestNextField(&pos, end) : NULL;
+            if (link == NULL)
+            {
+                Log(LOG_LEVEL_ERR, "Malformed manifest of '%s' from '%s'",
+                    dirname, conn->this_server);
+                broken = true;
+                terminated = true;
+                break;
+            }
+
+            if (StringEqual(relpath, CFD_TERMINATOR))
+            {
+                complete = OKProtoReply(reply);
+                terminated = true;
+                break;
+            }
+
+            if (!broken)
+            {
+                broken = !ManifestAddRecord(conn, listings, dirname,
+                                            relpath, reply, extra, link);
+            }
+        }
+
+        if (terminated)
+        {
+            break;
+        }
+    }
+
+    MapDestroy(listings);
+
+    if (!complete || broken)
+    {
+        /* Listings might be missing entries, drop them. The stat
+         * information received is still good. */
+        for (Stat *sp = conn->cache; sp != old_head; sp = sp->next)
+        {
+            SeqDestroy(sp->cf_dirlist);
+            sp->cf_dirlist = NULL;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/*********************************************************************/
+
 /* TODO only a server_name is not enough for stat'ing of files... */
 const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
                             const char *server_name)
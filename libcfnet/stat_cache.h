@@ -26,6 +26,7 @@
 
 #include <platform.h>
 #include <cfnet.h>
+#include <sequence.h>
 
 
 typedef enum
@@ -59,6 +60,8 @@ struct Stat_
     int cf_nlink;               /* Number of hard links */
     int cf_ino;                 /* inode number on server */
     dev_t cf_dev;               /* device number */
+    char *cf_digest;            /* printable digest, if sent in a manifest */
+    Seq *cf_dirlist;            /* directory entries, if sent in a manifest */
     Stat *next;
 };
 
@@ -67,6 +70,8 @@ int cf_remote_stat(AgentConnection *conn, bool encrypt, const char *file,
                    struct stat *statbuf, const char *stattype);
 const Stat *StatCacheLookup(const AgentConnection *conn, const char *file_name,
                             const char *server_name);
+bool StatCacheFetchManifest(AgentConnection *conn, const char *dirname,
+                            int maxdepth, bool digests);
 mode_t FileTypeToMode(const FileType type);
 bool StatParseResponse(const char *const buf, Stat *statbuf);
 
@@ -71,34 +71,29 @@ static bool __ProtocolSendMessage(
         header |= (1 << 1);
     }
 
-    /* Send header */
+    /* Send header and payload with a single TLSSend() so that each message
+     * goes out in one TLS record rather than two, which halves the number of
+     * records (and their MAC and framing overhead) when streaming files */
+    char send_buffer[PROTOCOL_HEADER_SIZE + PROTOCOL_MESSAGE_SIZE];
     header = htons(header);
-    int ret = TLSSend(conn, (char *) &header, PROTOCOL_HEADER_SIZE);
-    if (ret != PROTOCOL_HEADER_SIZE)
+    memcpy(send_buffer, &header, PROTOCOL_HEADER_SIZE);
+    if (len > 0)
+    {
+        memcpy(send_buffer + PROTOCOL_HEADER_SIZE, msg, len);
+    }
+
+    const int total = PROTOCOL_HEADER_SIZE + (int) len;
+    int ret = TLSSend(conn, send_buffer, total);
+    if (ret != total)
     {
         Log(LOG_LEVEL_ERR,
-            "Failed to send message header during stream: "
+            "Failed to send message during stream: "
             "Expected to send %d bytes, but sent %d bytes",
-            PROTOCOL_HEADER_SIZE,
+            total,
             ret);
         return false;
     }
 
-    if (len > 0)
-    {
-        /* Send payload */
-        ret = TLSSend(conn, msg, len);
-        if (ret != (int) len)
-        {
-            Log(LOG_LEVEL_ERR,
-                "Failed to send message payload during stream: "
-                "Expected to send %zu bytes, but sent %d bytes",
-                len,
-                ret);
-            return false;
-        }
-    }
-
     return true;
 }
 
@@ -31,6 +31,9 @@
 
 #include <logging.h>
 #include <misc_lib.h>
+#include <file_lib.h>                                  /* safe_open, FullWrite */
+#include <files_lib.h>                                 /* MakeParentDirectory */
+#include <known_dirs.h>                                         /* GetStateDir */
 
 #include <tls_client.h>
 #include <tls_generic.h>
@@ -55,6 +58,13 @@ extern RSA *PRIVKEY, *PUBKEY;
  */
 static SSL_CTX *SSLCLIENTCONTEXT = NULL;
 static X509 *SSLCLIENTCERT = NULL;
+/* Digest of our own key, part of the names of the stored sessions so that
+ * sessions established with an old key are never resumed. */
+static char *SSLCLIENTKEYHASH = NULL;
+
+/* Upper limit for the size of a stored session (it holds the certificate of
+ * the server). */
+#define TLS_SESSION_MAX_SIZE (CF_BUFSIZE * 4)
 
 
 bool TLSClientIsInitialized()
@@ -137,6 +147,8 @@ bool TLSClientInitialize(const char *tls_min_version,
         goto err3;
     }
 
+    SSLCLIENTKEYHASH = GetPubkeyDigest(PUBKEY);
+
     is_initialised = true;
     return true;
 
@@ -175,6 +187,141 @@ void TLSDeInitialize()
         SSL_CTX_free(SSLCLIENTCONTEXT);
         SSLCLIENTCONTEXT = NULL;
     }
+
+    free(SSLCLIENTKEYHASH);
+    SSLCLIENTKEYHASH = NULL;
+}
+
+static void GetTLSSessionPath(char *filename, size_t max_size, const char *ipaddr)
+{
+    assert(SSLCLIENTKEYHASH != NULL);
+
+    xsnprintf(filename, max_size, "%s%ctls_sessions%c%s_%s", GetStateDir(),
+              FILE_SEPARATOR, FILE_SEPARATOR, ipaddr, SSLCLIENTKEYHASH);
+
+    /* IPv6 addresses and key digests have characters not allowed in file
+     * names everywhere. */
+    char *name = strrchr(filename, FILE_SEPARATOR) + 1;
+    for (char *c = name; *c != '\0'; c++)
+    {
+        if (*c == ':' || *c == '%' || *c == '=')
+        {
+            *c = '_';
+        }
+    }
+    MapName(filename);
+}
+
+/**
+ * @return the session stored by TLSClientSaveSession() for the server at
+ *         #ipaddr, or NULL if there is none
+ */
+static SSL_SESSION *TLSClientLoadSession(const char *ipaddr)
+{
+    char filename[PATH_MAX];
+    GetTLSSessionPath(filename, sizeof(filename), ipaddr);
+
+    int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    unsigned char data[TLS_SESSION_MAX_SIZE];
+    ssize_t size = FullRead(fd, (char *) data, sizeof(data));
+    close(fd);
+    if (size <= 0 || (size_t) size == sizeof(data))
+    {
+        return NULL;
+    }
+
+    const unsigned char *p = data;
+    SSL_SESSION *session = d2i_SSL_SESSION(NULL, &p, size);
+    if (session == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Ignoring corrupted TLS session file '%s'", filename);
+        unlink(filename);
+    }
+
+    return session;
+}
+
+/**
+ * @brief Stores the TLS session of an established connection, so that the
+ *        next connection to the same server, possibly from another agent
+ *        run, can resume it instead of doing a full handshake.
+ * @note Only call this for connections whose peer passed the trust checks.
+ */
+void TLSClientSaveSession(const ConnectionInfo *conn_info, const char *ipaddr)
+{
+    assert(conn_info != NULL);
+
+    if (conn_info->ssl == NULL || SSLCLIENTKEYHASH == NULL || NULL_OR_EMPTY(ipaddr))
+    {
+        return;
+    }
+
+    /* With TLS 1.3 the session ticket arrives after the handshake, so the
+     * current session may differ from the one after SSL_connect(). */
+    SSL_SESSION *session = SSL_get1_session(conn_info->ssl);
+    if (session == NULL)
+    {
+        return;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!SSL_SESSION_is_resumable(session))
+    {
+        SSL_SESSION_free(session);
+        return;
+    }
+#endif
+
+    int size = i2d_SSL_SESSION(session, NULL);
+    if (size <= 0 || size >= TLS_SESSION_MAX_SIZE)
+    {
+        SSL_SESSION_free(session);
+        return;
+    }
+    unsigned char *data = xmalloc(size);
+    unsigned char *p = data;
+    i2d_SSL_SESSION(session, &p);
+    SSL_SESSION_free(session);
+
+    char filename[PATH_MAX];
+    GetTLSSessionPath(filename, sizeof(filename), ipaddr);
+    if (!MakeParentDirectory(filename, true, NULL))
+    {
+        free(data);
+        return;
+    }
+
+    /* The session holds the master secret of the connection, nobody but us
+     * may read it. Write a temporary file and rename it, several agents may
+     * be connected to the same server. */
+    char tmp_filename[PATH_MAX];
+    xsnprintf(tmp_filename, sizeof(tmp_filename), "%s.%ju.tmp", filename,
+              (uintmax_t) getpid());
+
+    bool success = false;
+    int fd = safe_open_create_perms(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                                    S_IRUSR | S_IWUSR);
+    if (fd != -1)
+    {
+        success = (FullWrite(fd, (const char *) data, size) == size);
+        success = (close(fd) == 0) && success;
+        success = success && (rename(tmp_filename, filename) == 0);
+        if (!success)
+        {
+            unlink(tmp_filename);
+        }
+    }
+    free(data);
+
+    if (!success)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to store the TLS session in '%s' (%s)",
+            filename, GetErrorStr());
+    }
 }
 
 
@@ -304,11 +451,13 @@ int TLSClientIdentificationDialog(ConnectionInfo *conn_info,
 /**
  * We directly initiate a TLS handshake with the server. If the server is old
  * version (does not speak TLS) the connection will be denied.
+ * @param ipaddr address of the server, to resume the session stored for it
+ *        by TLSClientSaveSession(), or NULL to always do a full handshake
  * @note the socket file descriptor in #conn_info must be connected and *not*
  *       non-blocking
  * @return -1 in case of error
  */
-int TLSTry(ConnectionInfo *conn_info)
+int TLSTry(ConnectionInfo *conn_info, const char *ipaddr)
 {
     assert(conn_info != NULL);
 
@@ -331,6 +480,18 @@ int TLSTry(ConnectionInfo *conn_info)
     /* Pass conn_info inside the ssl struct for TLSVerifyCallback(). */
     SSL_set_ex_data(conn_info->ssl, CONNECTIONINFO_SSL_IDX, conn_info);
 
+    if (ipaddr != NULL)
+    {
+        SSL_SESSION *session = TLSClientLoadSession(ipaddr);
+        if (session != NULL)
+        {
+            /* If the server doesn't know the session anymore, we just get a
+             * full handshake. */
+            SSL_set_session(conn_info->ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+
     /* Initiate the TLS handshake over the already open TCP socket. */
     SSL_set_fd(conn_info->ssl, conn_info->sd);
 
@@ -373,7 +534,8 @@ int TLSTry(ConnectionInfo *conn_info)
         SSL_get_version(conn_info->ssl),
         SSL_get_cipher_name(conn_info->ssl),
         SSL_get_cipher_version(conn_info->ssl));
-    Log(LOG_LEVEL_VERBOSE, "TLS session established, checking trust...");
+    Log(LOG_LEVEL_VERBOSE, "TLS session %s, checking trust...",
+        SSL_session_reused(conn_info->ssl) ? "resumed" : "established");
 
     return 0;
 }
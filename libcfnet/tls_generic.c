@@ -952,21 +952,24 @@ void TLSSetDefaultOptions(SSL_CTX *ssl_ctx, const char *min_version)
         options |= tls_disable_flags[v];
     }
 
-    /* No session resumption or renegotiation for now. */
+    /* No session resumption on renegotiation. */
     options |= SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
 
-#ifdef SSL_OP_NO_TICKET
-    /* Disable another way of resumption, session tickets (RFC 5077). */
-    options |= SSL_OP_NO_TICKET;
-#endif
-
     SSL_CTX_set_options(ssl_ctx, options);
 
 
-    /* Disable both server-side and client-side session caching, to
-       complement the previous options. Safe for now, might enable for
-       performance in the future. */
-    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    /* Allow resuming sessions, both by session ID and by session tickets
+     * (RFC 5077), so that returning agents skip the RSA operations of a
+     * full handshake. The peer certificate is part of the session, so the
+     * key checks done after the handshake (TLSVerifyPeer()) work the same on
+     * resumed sessions. The server keeps the sessions it issued in memory,
+     * the client stores the session of each server itself, see
+     * TLSClientSaveSession(). */
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ssl_ctx,
+                                   (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+                                   strlen(TLS_SESSION_ID_CONTEXT));
+    SSL_CTX_set_timeout(ssl_ctx, TLS_SESSION_TIMEOUT);
 
 
     /* Never bother with retransmissions, SSL_write() should
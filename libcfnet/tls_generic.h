@@ -36,6 +36,10 @@
 
 extern int CONNECTIONINFO_SSL_IDX;
 
+/* Resumed TLS sessions, see TLSSetDefaultOptions(). */
+#define TLS_SESSION_ID_CONTEXT "CFEngine"
+#define TLS_SESSION_TIMEOUT 3600                                 /* seconds */
+
 
 bool TLSGenericInitialize(void);
 int TLSVerifyCallback(X509_STORE_CTX *ctx, void *arg);
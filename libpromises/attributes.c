@@ -1017,6 +1017,7 @@ FileChange GetChangeMgtConstraints(const EvalContext *ctx, const Promise *pp)
     }
 
     c.report_diffs = PromiseGetConstraintAsBoolean(ctx, "report_diffs", pp);
+    c.paranoid_hashing = PromiseGetConstraintAsBoolean(ctx, "paranoid_hashing", pp);
     return c;
 }
 
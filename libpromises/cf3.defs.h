@@ -442,6 +442,7 @@ typedef enum
     COMMON_CONTROL_PACKAGE_INVENTORY,
     COMMON_CONTROL_PACKAGE_MODULE,
     COMMON_CONTROL_EVALUATION_ORDER,
+    COMMON_CONTROL_PERSISTENT_FUNCTION_CACHE_TTL,
     COMMON_CONTROL_MAX
 } CommonControl;
 
@@ -1137,6 +1138,7 @@ typedef struct
     FileChangeReport report_changes;
     int report_diffs;
     int update;
+    int paranoid_hashing;
     FileChangeSilence silence;
 } FileChange;
 
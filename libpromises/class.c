@@ -26,7 +26,8 @@
 #include <map.h>
 #include <alloc.h>
 #include <string_lib.h> /* String*() */
-#include <regex.h>      /* CompileRegex,StringMatchFullWithPrecompiledRegex */
+#include <regex.h>      /* StringMatchFullWithPrecompiledRegex */
+#include <regex_cache.h> /* RegexCacheGet */
 #include <files_names.h>
 
 
@@ -38,23 +39,95 @@ static void ClassDestroy_untyped(void *p)
 }
 
 
+/* Jenkins one-at-a-time hash of "ns:name", computed without building the
+ * qualified name. NULL #ns is the default namespace. */
+static unsigned int ClassHash(const char *ns, const char *name)
+{
+    assert(name != NULL);
+
+    if (ns == NULL)
+    {
+        ns = "default";
+    }
+
+    unsigned int h = 0;
+    for (const char *c = ns; *c != '\0'; c++)
+    {
+        h += (unsigned char) *c;
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+
+    h += (unsigned char) ':';
+    h += (h << 10);
+    h ^= (h >> 6);
+
+    for (const char *c = name; *c != '\0'; c++)
+    {
+        h += (unsigned char) *c;
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+
+    h += (h << 3);
+    h ^= (h >> 11);
+    h += (h << 15);
+
+    return h;
+}
+
+static unsigned int ClassHash_untyped(const void *cls,
+                                      unsigned int seed ARG_UNUSED)
+{
+    return ((const Class *) cls)->hash;
+}
+
+static bool ClassKeyEqual_untyped(const void *a, const void *b)
+{
+    const Class *cls_a = a;
+    const Class *cls_b = b;
+
+    return (cls_a->hash == cls_b->hash &&
+            StringEqual(cls_a->name, cls_b->name) &&
+            StringSafeEqual(cls_a->ns, cls_b->ns));
+}
+
+static void ClassKeyDestroy_untyped(ARG_UNUSED void *p)
+{
+    /* The key is the class itself, destroyed as the value. */
+}
+
 /**
    Define ClassMap.
-   Key: a string which is always the fully qualified class name,
-        for example "default:127_0_0_1"
+   Key: the class itself, hashed and compared by namespace and name, so that
+        lookups need neither allocate nor build the qualified name. The map
+        keeps the key and the value of an entry together when replacing it.
 */
 
-TYPED_MAP_DECLARE(Class, char *, Class *)
+TYPED_MAP_DECLARE(Class, Class *, Class *)
 
-TYPED_MAP_DEFINE(Class, char *, Class *,
-                 StringHash_untyped,
-                 StringEqual_untyped,
-                 free,
+TYPED_MAP_DEFINE(Class, Class *, Class *,
+                 ClassHash_untyped,
+                 ClassKeyEqual_untyped,
+                 ClassKeyDestroy_untyped,
                  ClassDestroy_untyped)
 
+/* Stack key for looking up or removing the class #name in #ns. */
+static inline Class ClassKey(const char *ns, const char *name)
+{
+    if (ns != NULL && StringEqual(ns, "default"))
+    {
+        ns = NULL;
+    }
+
+    return (Class) { .ns = (char *) ns, .name = (char *) name,
+                     .hash = ClassHash(ns, name) };
+}
+
 struct ClassTable_
 {
     ClassMap *classes;
+    unsigned long serial;                       /* of the last class put */
 };
 
 struct ClassTableIterator_
@@ -93,6 +166,7 @@ static void ClassInit(Class *cls,
         StringSetAdd(cls->tags, xstrdup("hardclass"));
     }
     cls->comment = SafeStringDuplicate(comment);
+    cls->hash = ClassHash(cls->ns, cls->name);
 }
 
 static void ClassDestroySoft(Class *cls)
@@ -120,6 +194,7 @@ ClassTable *ClassTableNew(void)
     ClassTable *table = xmalloc(sizeof(*table));
 
     table->classes = ClassMapNew();
+    table->serial = 0;
 
     return table;
 }
@@ -148,28 +223,20 @@ bool ClassTablePut(ClassTable *table,
 
     Class *cls = xmalloc(sizeof(*cls));
     ClassInit(cls, ns, name, is_soft, scope, tags, comment);
+    cls->serial = ++table->serial;
 
     /* (cls->name != name) because canonification has happened. */
-    char *fullname = StringConcatenate(3, ns, ":", cls->name);
-
-    Log(LOG_LEVEL_DEBUG, "Setting %sclass: %s",
+    Log(LOG_LEVEL_DEBUG, "Setting %sclass: %s:%s",
         is_soft ? "" : "hard ",
-        fullname);
+        ns, cls->name);
 
-    return ClassMapInsert(table->classes, fullname, cls);
+    return ClassMapInsert(table->classes, cls, cls);
 }
 
 Class *ClassTableGet(const ClassTable *table, const char *ns, const char *name)
 {
-    if (ns == NULL)
-    {
-        ns = "default";
-    }
-
-    char fullname[ strlen(ns) + 1 + strlen(name) + 1 ];
-    xsnprintf(fullname, sizeof(fullname), "%s:%s", ns, name);
-
-    return ClassMapGet(table->classes, fullname);
+    Class key = ClassKey(ns, name);
+    return ClassMapGet(table->classes, &key);
 }
 
 Class *ClassTableMatch(const ClassTable *table, const char *regex)
@@ -177,11 +244,12 @@ Class *ClassTableMatch(const ClassTable *table, const char *regex)
     ClassTableIterator *it = ClassTableIteratorNew(table, NULL, true, true);
     Class *cls = NULL;
 
-    Regex *pattern = CompileRegex(regex);
+    Regex *pattern = RegexCacheGet(regex);
     if (pattern == NULL)
     {
         // TODO: perhaps pcre has can give more info on this error?
         Log(LOG_LEVEL_ERR, "Unable to pcre compile regex '%s'", regex);
+        ClassTableIteratorDestroy(it);
         return NULL;
     }
 
@@ -205,7 +273,7 @@ Class *ClassTableMatch(const ClassTable *table, const char *regex)
         }
     }
 
-    RegexDestroy(pattern);
+    RegexCacheRelease(pattern);
 
     ClassTableIteratorDestroy(it);
     return cls;
@@ -213,15 +281,8 @@ Class *ClassTableMatch(const ClassTable *table, const char *regex)
 
 bool ClassTableRemove(ClassTable *table, const char *ns, const char *name)
 {
-    if (ns == NULL)
-    {
-        ns = "default";
-    }
-
-    char fullname[ strlen(ns) + 1 + strlen(name) + 1 ];
-    xsnprintf(fullname, sizeof(fullname), "%s:%s", ns, name);
-
-    return ClassMapRemove(table->classes, fullname);
+    Class key = ClassKey(ns, name);
+    return ClassMapRemove(table->classes, &key);
 }
 
 bool ClassTableClear(ClassTable *table)
@@ -231,6 +292,11 @@ bool ClassTableClear(ClassTable *table)
     return has_classes;
 }
 
+unsigned long ClassTableSerial(const ClassTable *table)
+{
+    return table->serial;
+}
+
 ClassTableIterator *ClassTableIteratorNew(const ClassTable *table,
                                           const char *ns,
                                           bool is_hard, bool is_soft)
@@ -36,6 +36,9 @@ typedef struct
     bool is_soft;
     StringSet *tags;
     char *comment;
+
+    unsigned int hash;                 /* hash of the qualified name */
+    unsigned long serial;           /* ClassTableSerial() when defined */
 } Class;
 
 
@@ -53,6 +56,12 @@ bool ClassTableRemove(ClassTable *table, const char *ns, const char *name);
 
 bool ClassTableClear(ClassTable *table);
 
+/**
+ * @return the serial number of the last class put in #table, every class
+ *         put gets a higher one than the classes put before it
+ */
+unsigned long ClassTableSerial(const ClassTable *table);
+
 ClassTableIterator *ClassTableIteratorNew(const ClassTable *table, const char *ns, bool is_hard, bool is_soft);
 Class *ClassTableIteratorNext(ClassTableIterator *iter);
 void ClassTableIteratorDestroy(ClassTableIterator *iter);
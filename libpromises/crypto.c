@@ -42,6 +42,7 @@
 #include <bootstrap.h>
 #include <misc_lib.h>                   /* UnexpectedError,ProgrammingError */
 #include <file_lib.h>
+#include <map.h>
 
 #ifdef DARWIN
 // On Mac OSX 10.7 and later, majority of functions in /usr/include/openssl/crypto.h
@@ -361,6 +362,86 @@ RSA *HavePublicKeyByIP(const char *username, const char *ipaddress)
 
 static const char *const pub_passphrase = "public";
 
+/* Public keys already read from ppkeys, by file name. cf-serverd looks up the
+ * key of every connecting host, so keep them in memory and only stat() the
+ * files to notice when they change. */
+typedef struct
+{
+    RSA *key;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+} CachedPublicKey;
+
+static Map *PUBLIC_KEYS = NULL;                                 /* GLOBAL_X */
+static pthread_mutex_t public_keys_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+static void CachedPublicKeyDestroy(void *ptr)
+{
+    CachedPublicKey *cached = ptr;
+    RSA_free(cached->key);
+    free(cached);
+}
+
+static bool CachedPublicKeyIsCurrent(const CachedPublicKey *cached,
+                                     const struct stat *sb)
+{
+    return (cached->dev == sb->st_dev && cached->ino == sb->st_ino &&
+            cached->size == sb->st_size && cached->mtime == sb->st_mtime &&
+            cached->ctime == sb->st_ctime);
+}
+
+/**
+ * @return a copy of the key read from #filename before, or NULL if it was
+ *         not read yet or the file changed since
+ */
+static RSA *PublicKeyCacheGet(const char *filename, const struct stat *sb)
+{
+    RSA *key = NULL;
+
+    ThreadLock(&public_keys_lock);
+    if (PUBLIC_KEYS != NULL)
+    {
+        const CachedPublicKey *cached = MapGet(PUBLIC_KEYS, filename);
+        if (cached != NULL && CachedPublicKeyIsCurrent(cached, sb))
+        {
+            key = RSAPublicKey_dup(cached->key);
+        }
+    }
+    ThreadUnlock(&public_keys_lock);
+
+    return key;
+}
+
+static void PublicKeyCachePut(const char *filename, const struct stat *sb,
+                              const RSA *key)
+{
+    RSA *copy = RSAPublicKey_dup((RSA *) key);
+    if (copy == NULL)
+    {
+        return;
+    }
+
+    CachedPublicKey *cached = xmalloc(sizeof(CachedPublicKey));
+    cached->key = copy;
+    cached->dev = sb->st_dev;
+    cached->ino = sb->st_ino;
+    cached->size = sb->st_size;
+    cached->mtime = sb->st_mtime;
+    cached->ctime = sb->st_ctime;
+
+    ThreadLock(&public_keys_lock);
+    if (PUBLIC_KEYS == NULL)
+    {
+        PUBLIC_KEYS = MapNew(StringHash_untyped, StringEqual_untyped,
+                             free, CachedPublicKeyDestroy);
+    }
+    MapInsert(PUBLIC_KEYS, xstrdup(filename), cached);
+    ThreadUnlock(&public_keys_lock);
+}
+
 /**
  * @brief Search for a key:
  *        1. username-hash.pub
@@ -415,6 +496,12 @@ RSA *HavePublicKey(const char *username, const char *ipaddress, const char *dige
         }
     }
 
+    newkey = PublicKeyCacheGet(newname, &statbuf);
+    if (newkey != NULL)
+    {
+        return newkey;
+    }
+
     FILE *fp = safe_fopen(newname, "r");
     if (fp == NULL)
     {
@@ -447,6 +534,8 @@ RSA *HavePublicKey(const char *username, const char *ipaddress, const char *dige
         }
     }
 
+    PublicKeyCachePut(newname, &statbuf, newkey);
+
     return newkey;
 }
 
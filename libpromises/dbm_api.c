@@ -120,6 +120,7 @@ static const char *const DB_PATHS_STATEDIR[] = {
     [dbid_packages_installed] = "packages_installed",
     [dbid_packages_updates] = "packages_updates",
     [dbid_cookies] = "nova_cookies",
+    [dbid_function_cache] = "cf_function_cache",
 };
 
 /*
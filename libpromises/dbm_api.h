@@ -59,6 +59,7 @@ typedef enum
     dbid_packages_installed = 21, // new package promise installed packages list
     dbid_packages_updates   = 22, // new package promise list of available updates
     dbid_cookies            = 23, // Enterprise reporting cookies for duplicate host detection
+    dbid_function_cache     = 24, // Results of expensive functions kept across runs
 
     dbid_max
 } dbid;
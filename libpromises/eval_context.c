@@ -51,6 +51,7 @@
 #include <map.h>
 #include <conversion.h>                               /* DataTypeIsIterable */
 #include <cleanup.h>
+#include <function_cache.h>
 
 /* If we need to put a scoped variable into a special scope, use the string
  * below to replace the original scope separator.
@@ -110,6 +111,80 @@ TYPED_MAP_DEFINE(RemoteVarPromises, char *, Seq *,
                  SeqDestroy_untyped)
 
 
+/**
+   Define ClassExpressionMap.
+   Key:   class expression, as written in the policy (char *)
+   Value: the expression compiled by CheckClassExpression()
+ */
+
+/* Expressions expanded from variables, e.g. "$(item)_ok" iterated over a big
+ * list, can fill the map up, it is simply emptied when it gets this big. */
+#define CLASS_EXPRESSIONS_MAX 4096
+
+typedef struct
+{
+    Expression *expr;           /* NULL if the expression is invalid */
+    bool has_whitespace;        /* names separated only by whitespace */
+    /* Value of the expression when ctx->class_generation was #generation */
+    unsigned long generation;
+    ExpressionValue value;
+} CompiledClassExpression;
+
+static void CompiledClassExpressionDestroy_untyped(void *p)
+{
+    CompiledClassExpression *compiled = p;
+    if (compiled != NULL)
+    {
+        FreeExpression(compiled->expr);
+        free(compiled);
+    }
+}
+
+TYPED_MAP_DECLARE(ClassExpression, char *, CompiledClassExpression *)
+
+TYPED_MAP_DEFINE(ClassExpression, char *, CompiledClassExpression *,
+                 StringHash_untyped,
+                 StringEqual_untyped,
+                 free,
+                 CompiledClassExpressionDestroy_untyped)
+
+
+/**
+   Define PromiseEvaluationMap.
+   Key:   promise from the policy (const Promise *, not owned)
+   Value: outcome of its last evaluation, see EvalContextPromiseIsUnchanged()
+ */
+
+typedef struct
+{
+    /* Whether the outcome depends only on classes and variables */
+    bool eligible;
+    /* Bundle invocation and ctx->state_generation at the last evaluation,
+     * 0 if the evaluation changed the state */
+    unsigned long invocation;
+    unsigned long generation;
+    PromiseResult result;
+} PromiseEvaluation;
+
+static unsigned PromisePointerHash_untyped(const void *p, unsigned seed)
+{
+    const uintptr_t value = (uintptr_t) p;
+    return (unsigned) ((value >> 4) ^ (value >> 20)) ^ seed;
+}
+
+static bool PromisePointerEqual_untyped(const void *a, const void *b)
+{
+    return a == b;
+}
+
+TYPED_MAP_DECLARE(PromiseEvaluation, const Promise *, PromiseEvaluation *)
+
+TYPED_MAP_DEFINE(PromiseEvaluation, const Promise *, PromiseEvaluation *,
+                 PromisePointerHash_untyped,
+                 PromisePointerEqual_untyped,
+                 NULL,
+                 free)
+
 static Regex *context_expression_whitespace_rx = NULL;
 
 #include <policy.h>
@@ -152,6 +227,8 @@ struct EvalContext_
     Item *heap_abort_current_bundle;
 
     Seq *stack;
+    /* Last popped promise iteration frame, reused by the next push */
+    StackFrame *spare_iteration_frame;
 
     ClassTable *global_classes;
     VariableTable *global_variables;
@@ -161,6 +238,22 @@ struct EvalContext_
     StringSet *promise_lock_cache;
     StringSet *dependency_handles;
     FuncCacheMap *function_cache;
+    /* Written by CheckClassExpression() although it takes a const context,
+     * only ever from #class_expressions_thread */
+    ClassExpressionMap *class_expressions;
+    pthread_t class_expressions_thread;
+    /* Incremented whenever the set of classes visible to class expressions
+     * may have changed, see CheckClassExpression(). */
+    unsigned long class_generation;
+    /* Incremented whenever classes or variables outside of the promise,
+     * body and match scopes change, see EvalContextPromiseIsUnchanged(). */
+    unsigned long state_generation;
+    /* Number of bundle frames pushed so far */
+    unsigned long bundle_invocations;
+    PromiseEvaluationMap *promise_evaluations;
+    /* Seconds results are kept in the persistent function cache, 0 if it is
+     * disabled. */
+    time_t persistent_function_cache_ttl;
 
     uid_t uid;
     uid_t gid;
@@ -204,6 +297,64 @@ struct EvalContext_
     EvalOrder agent_eval_order;
 };
 
+/* The set of defined classes changed, as opposed to only the visible part
+ * of it as with bundle and body frames pushed and popped. */
+static inline void ClassesChanged(EvalContext *ctx)
+{
+    ctx->class_generation++;
+    ctx->state_generation++;
+}
+
+static bool RvalIsEqual(Rval a, Rval b)
+{
+    if (a.type != b.type)
+    {
+        return false;
+    }
+
+    switch (a.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return StringEqual(RvalScalarValue(a), RvalScalarValue(b));
+
+    case RVAL_TYPE_LIST:
+        /* Inconclusive for unexpanded lists, which count as different */
+        return RlistEqual(RvalRlistValue(a), RvalRlistValue(b));
+
+    case RVAL_TYPE_CONTAINER:
+        {
+            Writer *wa = StringWriter();
+            Writer *wb = StringWriter();
+            JsonWriteCompact(wa, RvalContainerValue(a));
+            JsonWriteCompact(wb, RvalContainerValue(b));
+            const bool equal = StringEqual(StringWriterData(wa), StringWriterData(wb));
+            WriterClose(wa);
+            WriterClose(wb);
+            return equal;
+        }
+
+    case RVAL_TYPE_FNCALL:
+    case RVAL_TYPE_NOPROMISEE:
+    default:
+        return false;
+    }
+}
+
+/* Variables in the 'this', 'body' and 'match' scopes are reset for every
+ * promise and don't count as state that promises depend on. */
+static bool IsStateScope(const char *scope)
+{
+    switch (SpecialScopeFromString(scope))
+    {
+    case SPECIAL_SCOPE_THIS:
+    case SPECIAL_SCOPE_BODY:
+    case SPECIAL_SCOPE_MATCH:
+        return false;
+    default:
+        return true;
+    }
+}
+
 void EvalContextSetConfig(EvalContext *ctx, const GenericAgentConfig *config)
 {
     assert(ctx != NULL);
@@ -517,6 +668,7 @@ static void EvalContextStackFrameAddSoft(EvalContext *ctx, const char *context,
                   CONTEXT_SCOPE_BUNDLE,
                   NULL_OR_EMPTY(tags) ? NULL : StringSetFromString(tags, ','),
                   NULL);
+    ClassesChanged(ctx);
 
     if (!BundleAborted(ctx))
     {
@@ -535,43 +687,44 @@ static void EvalContextStackFrameAddSoft(EvalContext *ctx, const char *context,
 static ExpressionValue EvalTokenAsClass(const char *classname, void *param)
 {
     const EvalContext *ctx = param;
-    ClassRef ref = ClassRefParse(classname);
-    if (ClassRefIsQualified(ref))
-    {
-        if (strcmp(ref.ns, NamespaceDefault()) == 0)
-        {
-            if (EvalContextHeapContainsHard(ctx, ref.name))
-            {
-                ClassRefDestroy(ref);
-                return EXPRESSION_VALUE_TRUE;
-            }
-        }
-    }
-    else
+
+    /* Called for every name in every class expression evaluated, so the
+     * name is split in place instead of using ClassRefParse(). */
+    const char *name_start = strchr(classname, ':');
+    if (name_start != NULL)
     {
-        if (EvalContextHeapContainsHard(ctx, ref.name))
+        const size_t ns_len = name_start - classname;
+        char ns[ns_len + 1];
+        memcpy(ns, classname, ns_len);
+        ns[ns_len] = '\0';
+        const char *name = name_start + 1;
+
+        if ((strcmp(ns, NamespaceDefault()) == 0) &&
+            EvalContextHeapContainsHard(ctx, name))
         {
-            ClassRefDestroy(ref);
             return EXPRESSION_VALUE_TRUE;
         }
 
-        const char *ns = EvalContextCurrentNamespace(ctx);
-        if (ns)
-        {
-            ClassRefQualify(&ref, ns);
-        }
-        else
-        {
-            ClassRefQualify(&ref, NamespaceDefault());
-        }
+        bool classy = (strcmp("any", name) == 0 ||
+                       EvalContextHeapContainsSoft(ctx, ns, name) ||
+                       EvalContextStackFrameContainsSoft(ctx, name));
+        return (ExpressionValue) classy; // ExpressionValue extends bool
     }
 
-    assert(ClassRefIsQualified(ref));
-    bool classy = (strcmp("any", ref.name) == 0 ||
-                   EvalContextHeapContainsSoft(ctx, ref.ns, ref.name) ||
-                   EvalContextStackFrameContainsSoft(ctx, ref.name));
+    if (EvalContextHeapContainsHard(ctx, classname))
+    {
+        return EXPRESSION_VALUE_TRUE;
+    }
 
-    ClassRefDestroy(ref);
+    const char *ns = EvalContextCurrentNamespace(ctx);
+    if (ns == NULL)
+    {
+        ns = NamespaceDefault();
+    }
+
+    bool classy = (strcmp("any", classname) == 0 ||
+                   EvalContextHeapContainsSoft(ctx, ns, classname) ||
+                   EvalContextStackFrameContainsSoft(ctx, classname));
     return (ExpressionValue) classy; // ExpressionValue extends bool
 }
 
@@ -594,17 +747,8 @@ bool ClassCharIsWhitespace(char ch)
     return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
 }
 
-ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context)
+static CompiledClassExpression *CompileClassExpression(const char *context)
 {
-    assert(context != NULL);
-    ParseResult res;
-
-    if (!context)
-    {
-        // TODO: Remove this, seems like a hack
-        return EXPRESSION_VALUE_TRUE;
-    }
-
     if (context_expression_whitespace_rx == NULL)
     {
         context_expression_whitespace_rx = CompileRegex(CFENGINE_REGEX_WHITESPACE_IN_CONTEXTS);
@@ -613,34 +757,106 @@ ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context
     if (context_expression_whitespace_rx == NULL)
     {
         Log(LOG_LEVEL_ERR, "The context expression whitespace regular expression could not be compiled, aborting.");
-        return EXPRESSION_VALUE_ERROR;
+        return NULL;
     }
 
+    CompiledClassExpression *compiled = xcalloc(1, sizeof(CompiledClassExpression));
+
     if (StringMatchFullWithPrecompiledRegex(context_expression_whitespace_rx, context))
     {
-        Log(LOG_LEVEL_ERR, "class expressions can't be separated by whitespace without an intervening operator in expression '%s'", context);
-        return EXPRESSION_VALUE_ERROR;
+        compiled->has_whitespace = true;
+        return compiled;
     }
 
     Buffer *condensed = BufferNewFrom(context, strlen(context));
     BufferRewrite(condensed, &ClassCharIsWhitespace, true);
-    res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
+    ParseResult res = ParseExpression(BufferData(condensed), 0, BufferSize(condensed));
     BufferDestroy(condensed);
 
-    if (!res.result)
+    compiled->expr = res.result;
+    return compiled;
+}
+
+static ExpressionValue EvalCompiledClassExpression(const EvalContext *ctx, const char *context,
+                                                   const CompiledClassExpression *compiled)
+{
+    if (compiled->has_whitespace)
+    {
+        Log(LOG_LEVEL_ERR, "class expressions can't be separated by whitespace without an intervening operator in expression '%s'", context);
+        return EXPRESSION_VALUE_ERROR;
+    }
+
+    if (!compiled->expr)
     {
         Log(LOG_LEVEL_ERR, "Couldn't find any class matching '%s'", context);
         return EXPRESSION_VALUE_ERROR;
     }
-    else
+
+    return EvalExpression(compiled->expr,
+                          &EvalTokenAsClass, &EvalVarRef,
+                          (void *)ctx); // controlled cast. None of these should modify EvalContext
+}
+
+/**
+ * Class expressions are compiled once per distinct expression string and the
+ * value is kept until the classes visible to the expression may have changed,
+ * which is tracked by ctx->class_generation.
+ *
+ * The cache is only used by the thread that created the context. Other
+ * threads, like the cf-serverd workers checking access rules, compile and
+ * evaluate the expression every time instead of racing on the cache.
+ */
+ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context)
+{
+    assert(context != NULL);
+
+    if (!context)
     {
-        ExpressionValue r = EvalExpression(res.result,
-                                           &EvalTokenAsClass, &EvalVarRef,
-                                           (void *)ctx); // controlled cast. None of these should modify EvalContext
+        // TODO: Remove this, seems like a hack
+        return EXPRESSION_VALUE_TRUE;
+    }
 
-        FreeExpression(res.result);
-        return r;
+    if (!pthread_equal(pthread_self(), ctx->class_expressions_thread))
+    {
+        CompiledClassExpression *compiled = CompileClassExpression(context);
+        if (compiled == NULL)
+        {
+            return EXPRESSION_VALUE_ERROR;
+        }
+        const ExpressionValue value = EvalCompiledClassExpression(ctx, context, compiled);
+        CompiledClassExpressionDestroy_untyped(compiled);
+        return value;
+    }
+
+    ClassExpressionMap *const cache = ctx->class_expressions;
+    CompiledClassExpression *compiled = ClassExpressionMapGet(cache, context);
+    if (compiled == NULL)
+    {
+        compiled = CompileClassExpression(context);
+        if (compiled == NULL)
+        {
+            return EXPRESSION_VALUE_ERROR;
+        }
+        if (ClassExpressionMapSize(cache) >= CLASS_EXPRESSIONS_MAX)
+        {
+            ClassExpressionMapClear(cache);
+        }
+        ClassExpressionMapInsert(cache, xstrdup(context), compiled);
+    }
+
+    if (compiled->expr == NULL)
+    {
+        /* Invalid, reported every time */
+        return EvalCompiledClassExpression(ctx, context, compiled);
+    }
+
+    if (compiled->generation != ctx->class_generation)
+    {
+        compiled->value = EvalCompiledClassExpression(ctx, context, compiled);
+        compiled->generation = ctx->class_generation;
     }
+
+    return compiled->value;
 }
 
 /**********************************************************************/
@@ -1124,6 +1340,12 @@ EvalContext *EvalContextNew(void)
 
     ctx->promise_lock_cache = StringSetNew();
     ctx->function_cache = FuncCacheMapNew();
+    ctx->class_expressions = ClassExpressionMapNew();
+    ctx->class_expressions_thread = pthread_self();
+    ctx->class_generation = 1;
+    ctx->state_generation = 1;
+    ctx->bundle_invocations = 0;
+    ctx->promise_evaluations = PromiseEvaluationMapNew();
 
     EvalContextSetupMissionPortalLogHook(ctx);
 
@@ -1171,6 +1393,7 @@ void EvalContextDestroy(EvalContext *ctx)
         RlistDestroy(ctx->args);
 
         SeqDestroy(ctx->stack);
+        StackFrameDestroy(ctx->spare_iteration_frame);
 
         ClassTableDestroy(ctx->global_classes);
         VariableTableDestroy(ctx->global_variables);
@@ -1180,6 +1403,8 @@ void EvalContextDestroy(EvalContext *ctx)
         StringSetDestroy(ctx->promise_lock_cache);
 
         FuncCacheMapDestroy(ctx->function_cache);
+        ClassExpressionMapDestroy(ctx->class_expressions);
+        PromiseEvaluationMapDestroy(ctx->promise_evaluations);
 
         FreePackagePromiseContext(ctx->package_promise_context);
 
@@ -1239,11 +1464,13 @@ static bool EvalContextStackFrameContainsSoft(const EvalContext *ctx, const char
 
 bool EvalContextHeapRemoveSoft(EvalContext *ctx, const char *ns, const char *name)
 {
+    ClassesChanged(ctx);
     return ClassTableRemove(ctx->global_classes, ns, name);
 }
 
 bool EvalContextHeapRemoveHard(EvalContext *ctx, const char *name)
 {
+    ClassesChanged(ctx);
     return ClassTableRemove(ctx->global_classes, NULL, name);
 }
 
@@ -1256,6 +1483,16 @@ void EvalContextClear(EvalContext *ctx)
     StringSetClear(ctx->promise_lock_cache);
     SeqClear(ctx->stack);
     FuncCacheMapClear(ctx->function_cache);
+    PromiseEvaluationMapClear(ctx->promise_evaluations);
+    StringSetClear(ctx->dependency_handles);
+    StringSetClear(ctx->bundle_names);
+    /* Refers to the promises of the policy that was evaluated */
+    if (ctx->remote_var_promises != NULL)
+    {
+        RemoteVarPromisesMapDestroy(ctx->remote_var_promises);
+        ctx->remote_var_promises = NULL;
+    }
+    ClassesChanged(ctx);
 }
 
 Rlist *EvalContextGetPromiseCallerMethods(EvalContext *ctx) {
@@ -1424,23 +1661,67 @@ static StackFrame *StackFrameNewPromise(const Promise *owner, bool profiling, Ev
     return frame;
 }
 
-static StackFrame *StackFrameNewPromiseIteration(Promise *owner, const PromiseIterator *iter_ctx)
+static StackFrame *StackFrameNewPromiseIteration(EvalContext *ctx, Promise *owner, const PromiseIterator *iter_ctx)
 {
-    StackFrame *frame = StackFrameNew(STACK_FRAME_TYPE_PROMISE_ITERATION, true);
+    /* A frame is pushed and popped for every iteration of every promise, so
+     * the last one popped is kept, with its (emptied) log message buffer */
+    StackFrame *frame = ctx->spare_iteration_frame;
+    if (frame != NULL)
+    {
+        ctx->spare_iteration_frame = NULL;
+        assert(frame->type == STACK_FRAME_TYPE_PROMISE_ITERATION);
+        assert(frame->path == NULL && frame->event == NULL);
+        assert(RingBufferLength(frame->data.promise_iteration.log_messages) == 0);
+        frame->inherits_previous = true;
+        frame->override_immutable = false;
+    }
+    else
+    {
+        frame = StackFrameNew(STACK_FRAME_TYPE_PROMISE_ITERATION, true);
+        frame->data.promise_iteration.log_messages = RingBufferNew(5, NULL, free);
+    }
 
     frame->data.promise_iteration.owner = owner;
     frame->data.promise_iteration.iter_ctx = iter_ctx;
-    frame->data.promise_iteration.log_messages = RingBufferNew(5, NULL, free);
 
     return frame;
 }
 
+/**
+ * Removes the last frame, which is a promise iteration frame, from the stack
+ * and keeps it for reuse if there is no spare frame yet.
+ */
+static void EvalContextStackRecyclePromiseIterationFrame(EvalContext *ctx)
+{
+    const size_t last = SeqLength(ctx->stack) - 1;
+    StackFrame *frame = SeqAt(ctx->stack, last);
+    assert(frame->type == STACK_FRAME_TYPE_PROMISE_ITERATION);
+
+    if (ctx->spare_iteration_frame != NULL || frame->event != NULL)
+    {
+        SeqRemove(ctx->stack, last);
+        return;
+    }
+
+    SeqSoftRemove(ctx->stack, last);
+
+    PromiseDestroy(frame->data.promise_iteration.owner);
+    frame->data.promise_iteration.owner = NULL;
+    frame->data.promise_iteration.iter_ctx = NULL;
+    RingBufferClear(frame->data.promise_iteration.log_messages);
+    free(frame->path);
+    frame->path = NULL;
+
+    ctx->spare_iteration_frame = frame;
+}
+
 void EvalContextStackFrameRemoveSoft(EvalContext *ctx, const char *context)
 {
     StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
     assert(frame);
 
     ClassTableRemove(frame->data.bundle.classes, frame->data.bundle.owner->ns, context);
+    ClassesChanged(ctx);
 }
 
 static void EvalContextStackPushFrame(EvalContext *ctx, StackFrame *frame)
@@ -1459,6 +1740,14 @@ static void EvalContextStackPushFrame(EvalContext *ctx, StackFrame *frame)
 
     SeqAppend(ctx->stack, frame);
 
+    /* Bundle and body frames change the current namespace and the bundle
+     * classes visible to class expressions */
+    if (frame->type == STACK_FRAME_TYPE_BUNDLE ||
+        frame->type == STACK_FRAME_TYPE_BODY)
+    {
+        ctx->class_generation++;
+    }
+
     assert(!frame->path);
     frame->path = EvalContextStackPath(ctx);
 
@@ -1472,6 +1761,7 @@ void EvalContextStackPushBundleFrame(EvalContext *ctx, const Bundle *owner, cons
     assert(!LastStackFrame(ctx, 0) || LastStackFrame(ctx, 0)->type == STACK_FRAME_TYPE_PROMISE_ITERATION);
 
     StackFrame *frame = StackFrameNewBundle(owner, inherits_previous, ctx->profiling, calling_bundle, EvalContextGetLastEventFrame(ctx));
+    frame->data.bundle.invocation = ++ctx->bundle_invocations;
     EvalContextStackPushFrame(ctx, frame);
 
     if (RlistLen(args) > 0)
@@ -1480,7 +1770,10 @@ void EvalContextStackPushBundleFrame(EvalContext *ctx, const Bundle *owner, cons
         if (caller)
         {
             VariableTable *table = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE)->data.bundle.vars;
-            VariableTableClear(table, NULL, NULL, NULL);
+            if (VariableTableClear(table, NULL, NULL, NULL))
+            {
+                ctx->state_generation++;
+            }
         }
 
         ScopeAugment(ctx, owner, caller, args);
@@ -1493,6 +1786,10 @@ void EvalContextStackPushBundleFrame(EvalContext *ctx, const Bundle *owner, cons
         {
             Rval var_rval = VariableGetRval(var, true);
             Rval retval = ExpandPrivateRval(ctx, owner->ns, owner->name, var_rval.item, var_rval.type);
+            if (!RvalIsEqual(var_rval, retval))
+            {
+                ctx->state_generation++;
+            }
             VariableSetRval(var, retval);
         }
         VariableTableIteratorDestroy(iter);
@@ -1638,7 +1935,7 @@ Promise *EvalContextStackPushPromiseIterationFrame(EvalContext *ctx, const Promi
         return NULL;
     }
 
-    EvalContextStackPushFrame(ctx, StackFrameNewPromiseIteration(pexp, iter_ctx));
+    EvalContextStackPushFrame(ctx, StackFrameNewPromiseIteration(ctx, pexp, iter_ctx));
     LoggingPrivSetLevels(CalculateLogLevel(pexp), CalculateReportLevel(pexp));
 
     return pexp;
@@ -1658,6 +1955,12 @@ void EvalContextStackPopFrame(EvalContext *ctx)
         EvalContextAppendEventFrame(ctx, last_event);
     }
 
+    if (last_frame_type == STACK_FRAME_TYPE_BUNDLE ||
+        last_frame_type == STACK_FRAME_TYPE_BODY)
+    {
+        ctx->class_generation++;
+    }
+
     switch (last_frame_type)
     {
     case STACK_FRAME_TYPE_BUNDLE:
@@ -1683,7 +1986,14 @@ void EvalContextStackPopFrame(EvalContext *ctx)
         break;
     }
 
-    SeqRemove(ctx->stack, SeqLength(ctx->stack) - 1);
+    if (last_frame_type == STACK_FRAME_TYPE_PROMISE_ITERATION)
+    {
+        EvalContextStackRecyclePromiseIterationFrame(ctx);
+    }
+    else
+    {
+        SeqRemove(ctx->stack, SeqLength(ctx->stack) - 1);
+    }
 
     last_frame = LastStackFrame(ctx, 0);
     if (last_frame)
@@ -1701,6 +2011,8 @@ void EvalContextStackPopFrame(EvalContext *ctx)
 
 bool EvalContextClassRemove(EvalContext *ctx, const char *ns, const char *name)
 {
+    ClassesChanged(ctx);
+
     for (size_t i = 0; i < SeqLength(ctx->stack); i++)
     {
         StackFrame *frame = SeqAt(ctx->stack, i);
@@ -1813,6 +2125,8 @@ static bool EvalContextClassPutTagsSet(EvalContext *ctx, const char *ns, const c
 
     Nova_ClassHistoryAddContextName(ctx->all_classes, name);
 
+    ClassesChanged(ctx);
+
     switch (scope)
     {
     case CONTEXT_SCOPE_BUNDLE:
@@ -2263,7 +2577,7 @@ const char *EvalContextVariableGetSpecialString(
     return (type_out == CF_DATA_TYPE_STRING) ? result : NULL;
 }
 
-bool EvalContextVariableRemoveSpecial(const EvalContext *ctx, SpecialScope scope, const char *lval)
+bool EvalContextVariableRemoveSpecial(EvalContext *ctx, SpecialScope scope, const char *lval)
 {
     switch (scope)
     {
@@ -2344,10 +2658,15 @@ static VariableTable *GetVariableTableForScope(const EvalContext *ctx,
     }
 }
 
-bool EvalContextVariableRemove(const EvalContext *ctx, const VarRef *ref)
+bool EvalContextVariableRemove(EvalContext *ctx, const VarRef *ref)
 {
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
-    return VariableTableRemove(table, ref);
+    const bool removed = VariableTableRemove(table, ref);
+    if (removed && IsStateScope(ref->scope))
+    {
+        ctx->state_generation++;
+    }
+    return removed;
 }
 
 static bool IsVariableSelfReferential(const VarRef *ref, const void *value, RvalType rval_type)
@@ -2488,6 +2807,16 @@ bool EvalContextVariablePutTagsSetWithComment(EvalContext *ctx,
 
     Rval rval = (Rval) { (void *)value, DataTypeToRvalType(type) };
     VariableTable *table = GetVariableTableForScope(ctx, ref->ns, ref->scope);
+    if (IsStateScope(ref->scope))
+    {
+        const Variable *existing = VariableTableGet(table, ref);
+        if (existing == NULL || VariableGetType(existing) != type ||
+            !RvalIsEqual(VariableGetRval(existing, true), rval))
+        {
+            ctx->state_generation++;
+        }
+    }
+
     const Promise *pp = EvalContextStackCurrentPromise(ctx);
     VariableTablePut(table, ref, &rval, type, tags, SafeStringDuplicate(comment), pp ? pp->org_pp : pp);
     return true;
@@ -2719,6 +3048,23 @@ StringSet *EvalContextClassTags(const EvalContext *ctx, const char *ns, const ch
     return cls->tags;
 }
 
+unsigned long EvalContextGlobalClassSerial(const EvalContext *ctx)
+{
+    return ClassTableSerial(ctx->global_classes);
+}
+
+bool EvalContextHeapRemoveSoftIfOlder(EvalContext *ctx, const char *ns, const char *name,
+                                      unsigned long serial)
+{
+    const Class *cls = ClassTableGet(ctx->global_classes, ns, name);
+    if (cls == NULL || !cls->is_soft || cls->serial > serial)
+    {
+        return false;
+    }
+
+    return EvalContextHeapRemoveSoft(ctx, ns, name);
+}
+
 StringSet *EvalContextVariableTags(const EvalContext *ctx, const VarRef *ref)
 {
     Variable *var = VariableResolve(ctx, ref);
@@ -2957,6 +3303,130 @@ void EvalContextFunctionCachePut(EvalContext *ctx,
     FuncCacheMapInsert(ctx->function_cache, key, rval_copy);
 }
 
+void EvalContextSetPersistentFunctionCacheTTL(EvalContext *ctx, time_t ttl)
+{
+    assert(ctx != NULL);
+    ctx->persistent_function_cache_ttl = ttl;
+}
+
+bool EvalContextPersistentFunctionCacheGet(const EvalContext *ctx,
+                                           const FnCall *fp,
+                                           const Rlist *args, Rval *rval_out)
+{
+    assert(ctx != NULL);
+    assert(fp != NULL);
+
+    if ((ctx->persistent_function_cache_ttl <= 0) ||
+        !FunctionCacheIsPersistent(fp))
+    {
+        return false;
+    }
+
+    return FunctionCacheGet(fp, args, ctx->persistent_function_cache_ttl, rval_out);
+}
+
+void EvalContextPersistentFunctionCachePut(const EvalContext *ctx,
+                                           const FnCall *fp,
+                                           const Rlist *args, const Rval *rval)
+{
+    assert(ctx != NULL);
+    assert(fp != NULL);
+    assert(rval != NULL);
+
+    if ((ctx->persistent_function_cache_ttl <= 0) ||
+        !FunctionCacheIsPersistent(fp))
+    {
+        return;
+    }
+
+    FunctionCachePut(fp, args, *rval);
+}
+
+unsigned long EvalContextGetStateGeneration(const EvalContext *ctx)
+{
+    assert(ctx != NULL);
+    return ctx->state_generation;
+}
+
+/* Constraints making the outcome depend on more than classes and variables:
+ * the evaluation pass, other promises, persistent state and randomness. */
+static const char *const STATEFUL_CONSTRAINTS[] =
+    { "unless", "with", "depends_on", "persistence", "dist", NULL };
+
+static bool PromiseDependsOnlyOnState(const Promise *pp)
+{
+    const char *promise_type = PromiseGetPromiseType(pp);
+    if (!StringEqual(promise_type, "vars") && !StringEqual(promise_type, "classes"))
+    {
+        return false;
+    }
+
+    if (PromiseContainsFnCall(pp))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (cp->references_body || IsStrIn(cp->lval, STATEFUL_CONSTRAINTS))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static unsigned long CurrentBundleInvocation(const EvalContext *ctx)
+{
+    const StackFrame *frame = LastStackFrameByType(ctx, STACK_FRAME_TYPE_BUNDLE);
+    return (frame != NULL) ? frame->data.bundle.invocation : 0;
+}
+
+bool EvalContextPromiseIsUnchanged(EvalContext *ctx, const Promise *pp, PromiseResult *result)
+{
+    assert(ctx != NULL);
+    assert(pp != NULL);
+    assert(result != NULL);
+
+    const PromiseEvaluation *evaluation = PromiseEvaluationMapGet(ctx->promise_evaluations, pp);
+    if (evaluation == NULL || !evaluation->eligible ||
+        evaluation->generation != ctx->state_generation ||
+        evaluation->invocation != CurrentBundleInvocation(ctx))
+    {
+        return false;
+    }
+
+    *result = evaluation->result;
+    return true;
+}
+
+void EvalContextPromiseEvaluated(EvalContext *ctx, const Promise *pp,
+                                 unsigned long generation_before, PromiseResult result)
+{
+    assert(ctx != NULL);
+    assert(pp != NULL);
+
+    PromiseEvaluation *evaluation = PromiseEvaluationMapGet(ctx->promise_evaluations, pp);
+    if (evaluation == NULL)
+    {
+        evaluation = xmalloc(sizeof(PromiseEvaluation));
+        evaluation->eligible = PromiseDependsOnlyOnState(pp);
+        PromiseEvaluationMapInsert(ctx->promise_evaluations, pp, evaluation);
+    }
+
+    /* Evaluating the promise again only gives the same outcome if it saw the
+     * state it left behind, i.e. if it did not change anything itself. A
+     * failed promise is evaluated again to report the failure. */
+    const bool unchanged = (generation_before == ctx->state_generation) &&
+        (result == PROMISE_RESULT_NOOP || result == PROMISE_RESULT_SKIPPED);
+
+    evaluation->invocation = CurrentBundleInvocation(ctx);
+    evaluation->generation = unchanged ? generation_before : 0;
+    evaluation->result = result;
+}
+
 /* cfPS and associated machinery */
 
 
@@ -71,6 +71,9 @@ typedef struct
 
     ClassTable *classes;
     VariableTable *vars;
+
+    /* Distinguishes this invocation of the bundle from others */
+    unsigned long invocation;
 } StackFrameBundle;
 
 typedef struct
@@ -172,6 +175,20 @@ bool EvalContextClassRemove(EvalContext *ctx, const char *ns, const char *name);
 void EvalContextStackFrameRemoveSoft(EvalContext *ctx, const char *context);
 StringSet *EvalContextClassTags(const EvalContext *ctx, const char *ns, const char *name);
 
+/**
+ * @return the serial number of the last global class defined, the classes
+ *         defined later get higher ones
+ */
+unsigned long EvalContextGlobalClassSerial(const EvalContext *ctx);
+
+/**
+ * @brief Removes the global soft class #ns:#name unless it was defined after
+ *        EvalContextGlobalClassSerial() returned #serial
+ * @return whether the class was removed
+ */
+bool EvalContextHeapRemoveSoftIfOlder(EvalContext *ctx, const char *ns, const char *name,
+                                      unsigned long serial);
+
 ClassTableIterator *EvalContextClassTableIteratorNewGlobal(const EvalContext *ctx, const char *ns, bool is_hard, bool is_soft);
 ClassTableIterator *EvalContextClassTableIteratorNewLocal(const EvalContext *ctx);
 
@@ -227,8 +244,8 @@ const void *EvalContextVariableGetSpecial(const EvalContext *ctx, const SpecialS
 const char *EvalContextVariableGetSpecialString(const EvalContext *ctx, const SpecialScope scope, const char *varname);
 const void *EvalContextVariableGet(const EvalContext *ctx, const VarRef *ref, DataType *type_out);
 const Promise *EvalContextVariablePromiseGet(const EvalContext *ctx, const VarRef *ref);
-bool EvalContextVariableRemoveSpecial(const EvalContext *ctx, SpecialScope scope, const char *lval);
-bool EvalContextVariableRemove(const EvalContext *ctx, const VarRef *ref);
+bool EvalContextVariableRemoveSpecial(EvalContext *ctx, SpecialScope scope, const char *lval);
+bool EvalContextVariableRemove(EvalContext *ctx, const VarRef *ref);
 StringSet *EvalContextVariableTags(const EvalContext *ctx, const VarRef *ref);
 bool EvalContextVariableClearMatch(EvalContext *ctx);
 VariableTableIterator *EvalContextVariableTableIteratorNew(const EvalContext *ctx, const char *ns, const char *scope, const char *lval);
@@ -239,6 +256,34 @@ void EvalContextPromiseLockCachePut(EvalContext *ctx, const char *key);
 void EvalContextPromiseLockCacheRemove(EvalContext *ctx, const char *key);
 bool EvalContextFunctionCacheGet(const EvalContext *ctx, const FnCall *fp, const Rlist *args, Rval *rval_out);
 void EvalContextFunctionCachePut(EvalContext *ctx, const FnCall *fp, const Rlist *args, const Rval *rval);
+void EvalContextSetPersistentFunctionCacheTTL(EvalContext *ctx, time_t ttl);
+bool EvalContextPersistentFunctionCacheGet(const EvalContext *ctx, const FnCall *fp, const Rlist *args, Rval *rval_out);
+void EvalContextPersistentFunctionCachePut(const EvalContext *ctx, const FnCall *fp, const Rlist *args, const Rval *rval);
+
+/**
+ * @brief Counter incremented whenever classes or variables that promises may
+ *        depend on change
+ */
+unsigned long EvalContextGetStateGeneration(const EvalContext *ctx);
+
+/**
+ * @brief Whether evaluating #pp again in the current bundle would have the
+ *        same outcome as its last evaluation, because none of the classes and
+ *        variables changed since then
+ *
+ * Only applies to vars and classes promises without function calls, which
+ * depend on nothing but classes and variables.
+ *
+ * @param result set to the result of the last evaluation if unchanged
+ */
+bool EvalContextPromiseIsUnchanged(EvalContext *ctx, const Promise *pp, PromiseResult *result);
+
+/**
+ * @brief Records that #pp was evaluated with #result
+ * @param generation_before EvalContextGetStateGeneration() before the evaluation
+ */
+void EvalContextPromiseEvaluated(EvalContext *ctx, const Promise *pp,
+                                 unsigned long generation_before, PromiseResult result);
 
 const void  *EvalContextVariableControlCommonGet(const EvalContext *ctx, CommonControl lval);
 
@@ -264,6 +309,11 @@ Seq *EvalContextResolveBodyExpression(const EvalContext *ctx, const Policy *poli
 
 /* - Parsing/evaluating expressions - */
 void ValidateClassSyntax(const char *str);
+/**
+ * @note Although #ctx is const, the thread that created it caches the
+ *       compiled expression and its value in it. Other threads do not touch
+ *       the cache, but must still not run this while the context changes.
+ */
 ExpressionValue CheckClassExpression(const EvalContext *ctx, const char *context);
 static inline bool IsDefinedClass(const EvalContext *ctx, const char *context)
 {
@@ -42,6 +42,7 @@
 #include <string_lib.h>
 #include <conversion.h>
 #include <verify_classes.h>
+#include <map.h>
 
 /**
  * VARIABLES AND PROMISE EXPANSION
@@ -271,8 +272,14 @@ PromiseResult ExpandPromise(EvalContext *ctx, const Promise *pp,
     }
 
     /* 1. Copy the promise while expanding '@' slists and body arguments
-     *    (including body inheritance). */
-    Promise *pcopy = DeRefCopyPromise(ctx, pp);
+     *    (including body inheritance). Promises with nothing to expand,
+     *    e.g. with only literal constraints, are used as they are. */
+    Promise *pcopy_owned = NULL;
+    if (PromiseNeedsDeRefCopy(pp))
+    {
+        pcopy_owned = DeRefCopyPromise(ctx, pp);
+    }
+    const Promise *pcopy = (pcopy_owned != NULL) ? pcopy_owned : pp;
 
     EvalContextStackPushPromiseFrame(ctx, pcopy);
     PromiseIterator *iterctx = PromiseIteratorNew(pcopy);
@@ -309,7 +316,7 @@ PromiseResult ExpandPromise(EvalContext *ctx, const Promise *pp,
 
     EvalContextStackPopFrame(ctx);
     PromiseIteratorDestroy(iterctx);
-    PromiseDestroy(pcopy);
+    PromiseDestroy(pcopy_owned);
 
     return result;
 }
@@ -514,26 +521,346 @@ Rval ExpandBundleReference(EvalContext *ctx,
     return RvalNew(NULL, RVAL_TYPE_NOPROMISEE);
 }
 
+/*
+ * Scalar expansion templates
+ *
+ * The same policy strings are expanded over and over: in every pass, for
+ * every iteration and in every function call argument. Instead of scanning
+ * each string for references every time, it is compiled once into a
+ * sequence of literal segments and references. The parsed VarRef of a
+ * reference is kept too, for the namespace and scope it was last expanded
+ * in, so expanding a string usually boils down to a few variable lookups
+ * and copies.
+ *
+ * Templates are cached by the contents of the string, in a process-wide cache.
+ * Expanding a string writes to its template (see ExpandSegmentGetRef()) and
+ * a full cache is dropped as a whole, so the cache is used only by the
+ * thread which first expanded a string. Other threads compile nothing and
+ * expand strings the uncompiled way. ExpandScalar() must also not be called
+ * again while a template is being appended, which holds as variable lookups
+ * never expand anything.
+ */
+
+#define EXPAND_TEMPLATE_CACHE_MAX 16384
+#define EXPAND_TEMPLATE_MAX_LENGTH CF_BUFSIZE
+
+typedef enum
+{
+    EXPAND_SEGMENT_LITERAL,
+    EXPAND_SEGMENT_REFERENCE,   /* $(name) */
+    EXPAND_SEGMENT_NESTED,      /* $(name_$(other)) */
+} ExpandSegmentType;
+
+typedef struct ExpandTemplate_ ExpandTemplate;
+
+typedef struct
+{
+    ExpandSegmentType type;
+    char *text;                 /* literal text or the name referenced */
+    size_t len;
+    char bracket;               /* '(' or '{' */
+    bool expandable;            /* name is never looked up, see IsExpandable() */
+    ExpandTemplate *inner;      /* compiled name of a nested reference */
+    VarRef *ref;                /* name parsed in ref_ns and ref_scope */
+    char *ref_ns;
+    char *ref_scope;
+} ExpandSegment;
+
+struct ExpandTemplate_
+{
+    char *string;
+    Seq *segments;              /* NULL if the string could not be compiled */
+};
+
+static Map *EXPAND_TEMPLATES = NULL; /* GLOBAL_X */
+static pthread_t EXPAND_TEMPLATES_THREAD; /* GLOBAL_X */
+static pthread_once_t EXPAND_TEMPLATES_ONCE = PTHREAD_ONCE_INIT; /* GLOBAL_X */
+
+static void ExpandTemplateDestroy(ExpandTemplate *tmpl);
+
+static void ExpandSegmentDestroy(void *ptr)
+{
+    ExpandSegment *seg = ptr;
+    if (seg != NULL)
+    {
+        free(seg->text);
+        ExpandTemplateDestroy(seg->inner);
+        VarRefDestroy(seg->ref);
+        free(seg->ref_ns);
+        free(seg->ref_scope);
+        free(seg);
+    }
+}
+
+static void ExpandTemplateDestroy(ExpandTemplate *tmpl)
+{
+    if (tmpl != NULL)
+    {
+        SeqDestroy(tmpl->segments);
+        free(tmpl->string);
+        free(tmpl);
+    }
+}
+
+static void ExpandTemplateDestroy_untyped(void *ptr)
+{
+    ExpandTemplateDestroy(ptr);
+}
+
+static ExpandSegment *ExpandTemplateAddSegment(ExpandTemplate *tmpl,
+                                               ExpandSegmentType type,
+                                               const char *text, size_t len)
+{
+    ExpandSegment *seg = xcalloc(1, sizeof(ExpandSegment));
+    seg->type = type;
+    seg->text = xstrndup(text, len);
+    seg->len = len;
+    SeqAppend(tmpl->segments, seg);
+    return seg;
+}
+
 /**
- * Expand a #string into Buffer #out, returning the pointer to the string
- * itself, inside the Buffer #out. If #out is NULL then the buffer will be
- * created and destroyed internally.
+ * Splits #string the same way ExpandScalarUncompiled() does.
  *
- * @retval NULL something went wrong
+ * @return the template, which has no segments if #string contains a broken
+ *         reference; these are left to ExpandScalarUncompiled()
  */
-char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
-                   const char *string, Buffer *out)
+static ExpandTemplate *ExpandTemplateCompile(const char *string)
 {
-    bool out_belongs_to_us = false;
+    ExpandTemplate *tmpl = xcalloc(1, sizeof(ExpandTemplate));
+    tmpl->string = xstrdup(string);
+    tmpl->segments = SeqNew(4, ExpandSegmentDestroy);
 
-    if (out == NULL)
+    Buffer *current_item = BufferNew();
+    bool broken = false;
+
+    for (const char *sp = string; *sp != '\0'; sp++)
     {
-        out               = BufferNew();
-        out_belongs_to_us = true;
+        BufferClear(current_item);
+        ExtractScalarPrefix(current_item, sp, strlen(sp));
+
+        if (BufferSize(current_item) > 0)
+        {
+            ExpandTemplateAddSegment(tmpl, EXPAND_SEGMENT_LITERAL,
+                                     BufferData(current_item),
+                                     BufferSize(current_item));
+        }
+        sp += BufferSize(current_item);
+        if (*sp == '\0')
+        {
+            break;
+        }
+
+        BufferClear(current_item);
+        const char bracket = sp[1];
+        if (!ExtractScalarReference(current_item, sp, strlen(sp), true))
+        {
+            broken = true;
+            break;
+        }
+        sp += BufferSize(current_item) + 2;
+
+        const char *name = BufferData(current_item);
+        if (IsCf3VarString(name))
+        {
+            ExpandTemplate *inner = ExpandTemplateCompile(name);
+            if (inner->segments == NULL)
+            {
+                ExpandTemplateDestroy(inner);
+                broken = true;
+                break;
+            }
+
+            ExpandSegment *seg = ExpandTemplateAddSegment(
+                tmpl, EXPAND_SEGMENT_NESTED, name, BufferSize(current_item));
+            seg->bracket = bracket;
+            seg->inner = inner;
+        }
+        else
+        {
+            ExpandSegment *seg = ExpandTemplateAddSegment(
+                tmpl, EXPAND_SEGMENT_REFERENCE, name, BufferSize(current_item));
+            seg->bracket = bracket;
+            seg->expandable = IsExpandable(name);
+        }
     }
 
-    assert(string != NULL);
-    assert(out != NULL);
+    BufferDestroy(current_item);
+
+    if (broken)
+    {
+        SeqDestroy(tmpl->segments);
+        tmpl->segments = NULL;
+    }
+
+    return tmpl;
+}
+
+static void ExpandTemplatesInit(void)
+{
+    EXPAND_TEMPLATES = MapNew(StringHash_untyped, StringEqual_untyped,
+                              NULL, ExpandTemplateDestroy_untyped);
+    EXPAND_TEMPLATES_THREAD = pthread_self();
+}
+
+/**
+ * @return the compiled template of #string, or NULL when called from
+ *         another thread than the one owning the cache
+ */
+static ExpandTemplate *ExpandTemplateGet(const char *string)
+{
+    pthread_once(&EXPAND_TEMPLATES_ONCE, ExpandTemplatesInit);
+    if (!pthread_equal(pthread_self(), EXPAND_TEMPLATES_THREAD))
+    {
+        return NULL;
+    }
+
+    ExpandTemplate *tmpl = MapGet(EXPAND_TEMPLATES, string);
+    if (tmpl == NULL)
+    {
+        /* Strings built at run time (e.g. from iterated values) can fill the
+         * cache up, just start over when it's full. This destroys all the
+         * templates, which is only safe because no other thread uses them
+         * and none is held across calls. */
+        if (MapSize(EXPAND_TEMPLATES) >= EXPAND_TEMPLATE_CACHE_MAX)
+        {
+            MapClear(EXPAND_TEMPLATES);
+        }
+
+        tmpl = ExpandTemplateCompile(string);
+        MapInsert(EXPAND_TEMPLATES, tmpl->string, tmpl);
+    }
+
+    return tmpl;
+}
+
+static const VarRef *ExpandSegmentGetRef(ExpandSegment *seg,
+                                         const char *ns, const char *scope)
+{
+    assert(seg->type == EXPAND_SEGMENT_REFERENCE);
+
+    if (seg->ref == NULL ||
+        !StringSafeEqual(seg->ref_ns, ns) ||
+        !StringSafeEqual(seg->ref_scope, scope))
+    {
+        VarRefDestroy(seg->ref);
+        free(seg->ref_ns);
+        free(seg->ref_scope);
+
+        seg->ref = VarRefParseFromNamespaceAndScope(seg->text, ns, scope,
+                                                    CF_NS, '.');
+        seg->ref_ns = (ns == NULL) ? NULL : xstrdup(ns);
+        seg->ref_scope = (scope == NULL) ? NULL : xstrdup(scope);
+    }
+
+    return seg->ref;
+}
+
+/**
+ * Appends the value of the variable #ref to #out if it is a scalar.
+ *
+ * @return false if there is no such variable or it has no scalar value
+ */
+static bool ExpandAppendVariable(const EvalContext *ctx, const VarRef *ref,
+                                 Buffer *out)
+{
+    DataType value_type;
+    const void *value = EvalContextVariableGet(ctx, ref, &value_type);
+
+    switch (DataTypeToRvalType(value_type))
+    {
+    case RVAL_TYPE_SCALAR:
+        assert(value != NULL);
+        BufferAppendString(out, value);
+        return true;
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        assert(value != NULL);
+        const JsonElement *jvalue = value;      /* instead of casts */
+        if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
+        {
+            BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
+            return true;
+        }
+        return false;
+    }
+    default:
+        /* TODO Log() */
+        return false;
+    }
+}
+
+static void ExpandTemplateAppend(const EvalContext *ctx,
+                                 const char *ns, const char *scope,
+                                 ExpandTemplate *tmpl, Buffer *out)
+{
+    assert(tmpl->segments != NULL);
+
+    const size_t length = SeqLength(tmpl->segments);
+    for (size_t i = 0; i < length; i++)
+    {
+        ExpandSegment *seg = SeqAt(tmpl->segments, i);
+
+        if (seg->type == EXPAND_SEGMENT_LITERAL)
+        {
+            BufferAppend(out, seg->text, seg->len);
+            continue;
+        }
+
+        const char *name = seg->text;
+        Buffer *inner_name = NULL;
+        bool expandable = seg->expandable;
+
+        if (seg->type == EXPAND_SEGMENT_NESTED)
+        {
+            inner_name = BufferNew();
+            ExpandTemplateAppend(ctx, ns, scope, seg->inner, inner_name);
+            name = BufferData(inner_name);
+            expandable = IsExpandable(name);
+        }
+
+        bool done = false;
+        if (!expandable)
+        {
+            if (seg->type == EXPAND_SEGMENT_REFERENCE)
+            {
+                done = ExpandAppendVariable(ctx, ExpandSegmentGetRef(seg, ns, scope),
+                                            out);
+            }
+            else
+            {
+                VarRef *ref = VarRefParseFromNamespaceAndScope(name, ns, scope,
+                                                               CF_NS, '.');
+                done = ExpandAppendVariable(ctx, ref, out);
+                VarRefDestroy(ref);
+            }
+        }
+
+        if (!done)
+        {
+            if (seg->bracket == '{')
+            {
+                BufferAppendF(out, "${%s}", name);
+            }
+            else
+            {
+                BufferAppendF(out, "$(%s)", name);
+            }
+        }
+
+        BufferDestroy(inner_name);
+    }
+}
+
+/**
+ * Expands #string by scanning it for references, used for strings which
+ * are not compiled into templates.
+ */
+static void ExpandScalarUncompiled(const EvalContext *ctx,
+                                   const char *ns, const char *scope,
+                                   const char *string, Buffer *out)
+{
     Buffer *current_item = BufferNew();
 
     for (const char *sp = string; *sp != '\0'; sp++)
@@ -566,32 +893,12 @@ char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
             VarRef *ref = VarRefParseFromNamespaceAndScope(
                 BufferData(current_item),
                 ns, scope, CF_NS, '.');
-            DataType value_type;
-            const void *value = EvalContextVariableGet(ctx, ref, &value_type);
+            const bool done = ExpandAppendVariable(ctx, ref, out);
             VarRefDestroy(ref);
 
-            switch (DataTypeToRvalType(value_type))
+            if (done)
             {
-            case RVAL_TYPE_SCALAR:
-                assert(value != NULL);
-                BufferAppendString(out, value);
                 continue;
-                break;
-
-            case RVAL_TYPE_CONTAINER:
-            {
-                assert(value != NULL);
-                const JsonElement *jvalue = value;      /* instead of casts */
-                if (JsonGetElementType(jvalue) == JSON_ELEMENT_TYPE_PRIMITIVE)
-                {
-                    BufferAppendString(out, JsonPrimitiveGetAsString(jvalue));
-                    continue;
-                }
-                break;
-            }
-            default:
-                /* TODO Log() */
-                break;
             }
         }
 
@@ -606,6 +913,50 @@ char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
     }
 
     BufferDestroy(current_item);
+}
+
+/**
+ * Expand a #string into Buffer #out, returning the pointer to the string
+ * itself, inside the Buffer #out. If #out is NULL then the buffer will be
+ * created and destroyed internally.
+ *
+ * @retval NULL something went wrong
+ */
+char *ExpandScalar(const EvalContext *ctx, const char *ns, const char *scope,
+                   const char *string, Buffer *out)
+{
+    bool out_belongs_to_us = false;
+
+    if (out == NULL)
+    {
+        out               = BufferNew();
+        out_belongs_to_us = true;
+    }
+
+    assert(string != NULL);
+    assert(out != NULL);
+
+    if (strchr(string, '$') == NULL)
+    {
+        BufferAppendString(out, string);
+    }
+    else
+    {
+        ExpandTemplate *tmpl = NULL;
+        if (strlen(string) < EXPAND_TEMPLATE_MAX_LENGTH)
+        {
+            tmpl = ExpandTemplateGet(string);
+        }
+
+        if (tmpl != NULL && tmpl->segments != NULL)
+        {
+            ExpandTemplateAppend(ctx, ns, scope, tmpl, out);
+        }
+        else
+        {
+            ExpandScalarUncompiled(ctx, ns, scope, string, out);
+        }
+    }
 
     LogDebug(LOG_MOD_EXPAND,
              "Expanded scalar '%s' to '%s' using %s namespace and %s scope.",
@@ -757,7 +1108,7 @@ static int PointerCmp(const void *a, const void *b, ARG_UNUSED void *user_data)
     }
 }
 
-static void RemoveRemotelyInjectedVars(const EvalContext *ctx, const Bundle *bundle)
+static void RemoveRemotelyInjectedVars(EvalContext *ctx, const Bundle *bundle)
 {
     const Seq *remote_var_promises = EvalContextGetRemoteVarPromises(ctx, bundle->name);
     if ((remote_var_promises == NULL) || SeqLength(remote_var_promises) == 0)
@@ -1000,6 +1351,21 @@ static void ResolveControlBody(EvalContext *ctx, GenericAgentConfig *config,
                                      cache_system_functions);
         }
 
+        if (StringEqual(lval, CFG_CONTROLBODY[COMMON_CONTROL_PERSISTENT_FUNCTION_CACHE_TTL].lval))
+        {
+            long ttl = IntFromString(RvalScalarValue(evaluated_rval));
+            if ((ttl == CF_NOINT) || (ttl < 0))
+            {
+                Log(LOG_LEVEL_ERR, "Invalid persistent_function_cache_ttl '%s'",
+                    RvalScalarValue(evaluated_rval));
+            }
+            else
+            {
+                Log(LOG_LEVEL_VERBOSE, "SET persistent_function_cache_ttl %ld", ttl);
+                EvalContextSetPersistentFunctionCacheTTL(ctx, (time_t) ttl * SECONDS_PER_MINUTE);
+            }
+        }
+
         if (strcmp(lval, CFG_CONTROLBODY[COMMON_CONTROL_PROTOCOL_VERSION].lval) == 0)
         {
             config->protocol_version = ProtocolVersionParse(
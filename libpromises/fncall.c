@@ -424,6 +424,24 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
 
             return (FnCallResult) { FNCALL_SUCCESS, RvalCopy(cached_rval) };
         }
+
+        if (EvalContextPersistentFunctionCacheGet(ctx, fp, expargs, &cached_rval))
+        {
+            if (LogGetGlobalLevel() >= LOG_LEVEL_DEBUG)
+            {
+                Log(LOG_LEVEL_DEBUG,
+                    "Using result cached by a previous run for function: %s",
+                    fncall_string);
+                WriterClose(fncall_writer);
+            }
+            if (fp_type->options & FNCALL_OPTION_CACHED)
+            {
+                EvalContextFunctionCachePut(ctx, fp, expargs, &cached_rval);
+            }
+            RlistDestroy(expargs);
+
+            return (FnCallResult) { FNCALL_SUCCESS, cached_rval };
+        }
     }
 
     if (LogGetGlobalLevel() >= LOG_LEVEL_DEBUG)
@@ -457,6 +475,8 @@ FnCallResult FnCallEvaluate(EvalContext *ctx, const Policy *policy, FnCall *fp,
         EvalContextFunctionCachePut(ctx, fp, expargs, &result.rval);
     }
 
+    EvalContextPersistentFunctionCachePut(ctx, fp, expargs, &result.rval);
+
     RlistDestroy(expargs);
 
     return result;
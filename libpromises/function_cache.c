@@ -0,0 +1,457 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <function_cache.h>
+
+#include <dbm_api.h>
+#include <fncall.h>
+#include <rlist.h>
+#include <hash.h>
+#include <json.h>
+#include <writer.h>
+#include <string_lib.h>
+
+/* Value of FunctionCacheable.file_arg for functions not reading a file given
+ * as an argument. */
+#define NO_FILE_ARG -1
+/* Value of FunctionCacheable.file_arg for functions listing the files
+ * matching the glob patterns given as arguments. */
+#define GLOB_ARGS -2
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+# define STAT_MTIME_NS(sb) ((intmax_t) (sb)->st_mtim.tv_sec * 1000000000 + (sb)->st_mtim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+# define STAT_MTIME_NS(sb) ((intmax_t) (sb)->st_mtimespec.tv_sec * 1000000000 + (sb)->st_mtimespec.tv_nsec)
+#else
+# define STAT_MTIME_NS(sb) ((intmax_t) (sb)->st_mtime * 1000000000)
+#endif
+
+typedef struct
+{
+    const char *name;
+    /* Index of the argument naming the file the function reads. */
+    int file_arg;
+    /* Fixed file the function reads. */
+    const char *file;
+    /* Database the function reads, dbid_max if none. */
+    dbid db;
+} FunctionCacheable;
+
+/* Functions not listed here are never cached across runs. Functions running
+ * commands or talking to the network have nothing to check, their entries
+ * only expire with the TTL. findfiles() is only cached for patterns matching
+ * in a single directory, whose mtime tells when its entries change. */
+static const FunctionCacheable PERSISTENT_FUNCTIONS[] =
+{
+    { "execresult",             NO_FILE_ARG, NULL,          dbid_max },
+    { "execresult_as_data",     NO_FILE_ARG, NULL,          dbid_max },
+    { "returnszero",            NO_FILE_ARG, NULL,          dbid_max },
+    { "findfiles",              GLOB_ARGS,   NULL,          dbid_max },
+    { "url_get",                NO_FILE_ARG, NULL,          dbid_max },
+    { "readfile",               0,           NULL,          dbid_max },
+    { "readjson",               0,           NULL,          dbid_max },
+    { "readyaml",               0,           NULL,          dbid_max },
+    { "readdata",               0,           NULL,          dbid_max },
+    { "readcsv",                0,           NULL,          dbid_max },
+    { "readenvfile",            0,           NULL,          dbid_max },
+    { "readstringlist",         0,           NULL,          dbid_max },
+    { "readintlist",            0,           NULL,          dbid_max },
+    { "readreallist",           0,           NULL,          dbid_max },
+    { "getusers",               NO_FILE_ARG, "/etc/passwd", dbid_max },
+    { "packagesmatching",       NO_FILE_ARG, NULL,          dbid_packages_installed },
+    { "packageupdatesmatching", NO_FILE_ARG, NULL,          dbid_packages_updates },
+    { NULL,                     NO_FILE_ARG, NULL,          dbid_max },
+};
+
+static FunctionCacheStats STATS = { 0 }; /* GLOBAL_X */
+
+/* Reference to the database held until FunctionCacheClose(), so that every
+ * lookup only begins and commits a transaction instead of opening the
+ * database again. */
+static CF_DB *PINNED_DB = NULL; /* GLOBAL_X */
+static pid_t PINNED_DB_PID = 0; /* GLOBAL_X */
+
+static bool FunctionCacheOpenDB(CF_DB **dbp)
+{
+    if (PINNED_DB == NULL)
+    {
+        if (!OpenDB(&PINNED_DB, dbid_function_cache))
+        {
+            PINNED_DB = NULL;
+            return false;
+        }
+        PINNED_DB_PID = getpid();
+    }
+    else if (PINNED_DB_PID != getpid())
+    {
+        /* Inherited through fork(), the database must not be used here */
+        return false;
+    }
+
+    return OpenDB(dbp, dbid_function_cache);
+}
+
+void FunctionCacheClose(void)
+{
+    if (PINNED_DB != NULL && PINNED_DB_PID == getpid())
+    {
+        CloseDB(PINNED_DB);
+        PINNED_DB = NULL;
+    }
+}
+
+static const FunctionCacheable *FunctionCacheableGet(const char *name)
+{
+    for (const FunctionCacheable *fc = PERSISTENT_FUNCTIONS; fc->name != NULL; fc++)
+    {
+        if (StringEqual(fc->name, name))
+        {
+            return fc;
+        }
+    }
+
+    return NULL;
+}
+
+bool FunctionCacheIsPersistent(const FnCall *fp)
+{
+    assert(fp != NULL);
+    return (FunctionCacheableGet(fp->name) != NULL);
+}
+
+/**
+ * The key is the name of the function followed by the digest of its
+ * arguments, which can be arbitrarily long.
+ */
+static char *FunctionCacheKey(const FnCall *fp, const Rlist *args)
+{
+    JsonElement *json_args = RvalToJson((Rval) { (Rlist *) args, RVAL_TYPE_LIST });
+    Writer *w = StringWriter();
+    JsonWriteCompact(w, json_args);
+    JsonDestroy(json_args);
+
+    const char *data = StringWriterData(w);
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+    HashString(data, strlen(data), digest, HASH_METHOD_SHA256);
+    WriterClose(w);
+
+    char hashbuffer[CF_HOSTKEY_STRING_SIZE];
+    HashPrintSafe(hashbuffer, sizeof(hashbuffer), digest, HASH_METHOD_SHA256, true);
+
+    char *key;
+    xasprintf(&key, "%s(%s)", fp->name, SkipHashType(hashbuffer));
+    return key;
+}
+
+static void WriteFileStamp(Writer *w, const char *path)
+{
+    struct stat sb;
+    if (stat(path, &sb) == -1)
+    {
+        WriterWriteF(w, "%s:-;", path);
+        return;
+    }
+
+    WriterWriteF(w, "%s:%ju:%ju:%jd:%jd;", path,
+                 (uintmax_t) sb.st_dev, (uintmax_t) sb.st_ino,
+                 (intmax_t) sb.st_size, STAT_MTIME_NS(&sb));
+}
+
+/**
+ * Stamps the directory #pattern matches files in.
+ *
+ * @return false if #pattern can match files in more than one directory
+ */
+static bool WriteGlobStamp(Writer *w, const char *pattern)
+{
+    const char *last_sep = strrchr(pattern, '/');
+    if (last_sep == NULL || strstr(last_sep, "**") != NULL)
+    {
+        return false;
+    }
+
+    char *dir = xstrndup(pattern, last_sep - pattern);
+    const bool single_dir = (strpbrk(dir, "*?[{") == NULL);
+    if (single_dir)
+    {
+        WriteFileStamp(w, (dir[0] == '\0') ? "/" : dir);
+    }
+    free(dir);
+
+    return single_dir;
+}
+
+/**
+ * @return the identity and modification time of all the files the result of
+ *         the function depends on, an empty string if it depends on none, or
+ *         NULL if the result cannot be cached
+ */
+static char *FunctionCacheStamp(const FunctionCacheable *fc, const Rlist *args)
+{
+    Writer *w = StringWriter();
+
+    if (fc->file_arg == GLOB_ARGS)
+    {
+        for (const Rlist *arg = args; arg != NULL; arg = arg->next)
+        {
+            if ((arg->val.type != RVAL_TYPE_SCALAR) ||
+                !WriteGlobStamp(w, RlistScalarValue(arg)))
+            {
+                WriterClose(w);
+                return NULL;
+            }
+        }
+    }
+    else if (fc->file_arg != NO_FILE_ARG)
+    {
+        const Rlist *arg = args;
+        for (int i = 0; (arg != NULL) && (i < fc->file_arg); i++)
+        {
+            arg = arg->next;
+        }
+        if ((arg != NULL) && (arg->val.type == RVAL_TYPE_SCALAR))
+        {
+            WriteFileStamp(w, RlistScalarValue(arg));
+        }
+    }
+
+    if (fc->file != NULL)
+    {
+        WriteFileStamp(w, fc->file);
+    }
+
+    if (fc->db != dbid_max)
+    {
+        Seq *db_names = SearchExistingSubDBNames(fc->db);
+        const size_t length = SeqLength(db_names);
+        for (size_t i = 0; i < length; i++)
+        {
+            char *db_path = DBIdToSubPath(fc->db, SeqAt(db_names, i));
+            WriteFileStamp(w, db_path);
+            free(db_path);
+        }
+        SeqDestroy(db_names);
+    }
+
+    return StringWriterClose(w);
+}
+
+static bool RvalFromCacheJson(const char *type, JsonElement *value, Rval *rval_out)
+{
+    if (StringEqual(type, "s") &&
+        (JsonGetElementType(value) == JSON_ELEMENT_TYPE_PRIMITIVE))
+    {
+        *rval_out = RvalNew(JsonPrimitiveGetAsString(value), RVAL_TYPE_SCALAR);
+        return true;
+    }
+    else if (StringEqual(type, "l") &&
+             (JsonGetElementType(value) == JSON_ELEMENT_TYPE_CONTAINER))
+    {
+        *rval_out = (Rval) { RlistFromContainer(value), RVAL_TYPE_LIST };
+        return true;
+    }
+    else if (StringEqual(type, "c"))
+    {
+        /* RvalNew() makes a copy, the entry is destroyed by the caller */
+        *rval_out = RvalNew(value, RVAL_TYPE_CONTAINER);
+        return true;
+    }
+
+    return false;
+}
+
+bool FunctionCacheGet(const FnCall *fp, const Rlist *args, time_t max_age, Rval *rval_out)
+{
+    assert(fp != NULL);
+    assert(rval_out != NULL);
+
+    const FunctionCacheable *fc = FunctionCacheableGet(fp->name);
+    if (fc == NULL)
+    {
+        return false;
+    }
+
+    char *stamp = FunctionCacheStamp(fc, args);
+    if (stamp == NULL)
+    {
+        return false;
+    }
+
+    CF_DB *dbp;
+    if (!FunctionCacheOpenDB(&dbp))
+    {
+        free(stamp);
+        return false;
+    }
+
+    char *key = FunctionCacheKey(fp, args);
+    const int size = ValueSizeDB(dbp, key, strlen(key) + 1);
+    char *data = NULL;
+    if (size > 0)
+    {
+        data = xmalloc(size + 1);
+        if (!ReadDB(dbp, key, data, size))
+        {
+            free(data);
+            data = NULL;
+        }
+        else
+        {
+            data[size] = '\0';
+        }
+    }
+
+    if (data == NULL)
+    {
+        CloseDB(dbp);
+        free(key);
+        free(stamp);
+        STATS.misses++;
+        return false;
+    }
+
+    JsonElement *entry = NULL;
+    const char *parse_data = data;
+    if (JsonParse(&parse_data, &entry) != JSON_PARSE_OK)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Removing corrupted function cache entry '%s'", key);
+        DeleteDB(dbp, key);
+        CloseDB(dbp);
+        free(data);
+        free(key);
+        free(stamp);
+        STATS.misses++;
+        return false;
+    }
+    free(data);
+
+    bool valid = false;
+    const char *stored_stamp = JsonObjectGetAsString(entry, "stamp");
+    const char *type = JsonObjectGetAsString(entry, "type");
+    JsonElement *time_elem = JsonObjectGet(entry, "time");
+    JsonElement *value = JsonObjectGet(entry, "value");
+
+    if ((stored_stamp != NULL) && (type != NULL) &&
+        (time_elem != NULL) && (value != NULL))
+    {
+        const time_t now = time(NULL);
+        const time_t stored = (time_t) JsonPrimitiveGetAsInteger(time_elem);
+
+        if ((stored <= now) && ((now - stored) < max_age) &&
+            StringEqual(stamp, stored_stamp))
+        {
+            valid = RvalFromCacheJson(type, value, rval_out);
+        }
+    }
+
+    if (valid)
+    {
+        STATS.hits++;
+        Log(LOG_LEVEL_DEBUG, "Function cache hit for '%s'", key);
+    }
+    else
+    {
+        DeleteDB(dbp, key);
+        STATS.invalidations++;
+        STATS.misses++;
+        Log(LOG_LEVEL_DEBUG, "Function cache entry '%s' is stale", key);
+    }
+
+    JsonDestroy(entry);
+    CloseDB(dbp);
+    free(key);
+    free(stamp);
+
+    return valid;
+}
+
+void FunctionCachePut(const FnCall *fp, const Rlist *args, Rval rval)
+{
+    assert(fp != NULL);
+
+    const FunctionCacheable *fc = FunctionCacheableGet(fp->name);
+    if ((fc == NULL) || (rval.type == RVAL_TYPE_FNCALL) ||
+        (rval.type == RVAL_TYPE_NOPROMISEE))
+    {
+        return;
+    }
+
+    char *stamp = FunctionCacheStamp(fc, args);
+    if (stamp == NULL)
+    {
+        return;
+    }
+
+    CF_DB *dbp;
+    if (!FunctionCacheOpenDB(&dbp))
+    {
+        free(stamp);
+        return;
+    }
+
+    JsonElement *entry = JsonObjectCreate(4);
+    JsonObjectAppendInteger64(entry, "time", (int64_t) time(NULL));
+    char type[2] = { (char) rval.type, '\0' };
+    JsonObjectAppendString(entry, "type", type);
+    JsonObjectAppendElement(entry, "value", RvalToJson(rval));
+    JsonObjectAppendString(entry, "stamp", stamp);
+    free(stamp);
+
+    Writer *w = StringWriter();
+    JsonWriteCompact(w, entry);
+    JsonDestroy(entry);
+
+    char *key = FunctionCacheKey(fp, args);
+    const char *data = StringWriterData(w);
+    if (WriteDB(dbp, key, data, strlen(data) + 1))
+    {
+        STATS.stores++;
+    }
+    else
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to store the result of function '%s' in the function cache",
+            fp->name);
+    }
+
+    WriterClose(w);
+    free(key);
+    CloseDB(dbp);
+}
+
+const FunctionCacheStats *FunctionCacheGetStats(void)
+{
+    return &STATS;
+}
+
+void FunctionCacheLogStats(void)
+{
+    if ((STATS.hits + STATS.misses + STATS.stores) == 0)
+    {
+        return;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Persistent function cache: %zu hits, %zu misses (%zu stale), %zu stored",
+        STATS.hits, STATS.misses, STATS.invalidations, STATS.stores);
+}
@@ -0,0 +1,75 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_FUNCTION_CACHE_H
+#define CFENGINE_FUNCTION_CACHE_H
+
+/*
+ * Persistent cache of the results of expensive functions (reading files,
+ * running commands, ...), kept across agent runs in the cf_function_cache
+ * database. Entries of functions reading files are invalidated when the
+ * device, inode, size or mtime of the files change, entries of findfiles()
+ * when the mtime of the directory it lists changes. All entries expire after
+ * the TTL given by 'persistent_function_cache_ttl' in body common control.
+ */
+
+#include <cf3.defs.h>
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t invalidations;
+    size_t stores;
+} FunctionCacheStats;
+
+/**
+ * @return whether the results of #fp can be kept in the persistent cache
+ */
+bool FunctionCacheIsPersistent(const FnCall *fp);
+
+/**
+ * @brief Looks up the result of #fp called with #args
+ * @param max_age maximum age of the entry in seconds
+ * @param rval_out set to a newly allocated copy of the result in case of a hit
+ * @return whether a valid entry was found
+ */
+bool FunctionCacheGet(const FnCall *fp, const Rlist *args, time_t max_age, Rval *rval_out);
+
+/**
+ * @brief Stores the result of #fp called with #args together with the
+ *        invalidation stamps of the files it depends on
+ */
+void FunctionCachePut(const FnCall *fp, const Rlist *args, Rval rval);
+
+/**
+ * @brief Releases the database, which stays open from the first lookup on so
+ *        that an evaluation does not open it for every function call
+ */
+void FunctionCacheClose(void);
+
+const FunctionCacheStats *FunctionCacheGetStats(void);
+void FunctionCacheLogStats(void);
+
+#endif
@@ -73,6 +73,8 @@
 #include <libgen.h>
 #include <cleanup.h>
 #include <cmdb.h>               /* LoadCMDBData() */
+#include <function_cache.h>     /* FunctionCacheClose(), FunctionCacheLogStats() */
+#include <regex_cache.h>        /* RegexCacheLogStats() */
 #include "cf3.defs.h"
 
 #define AUGMENTS_VARIABLES_TAGS "tags"
@@ -101,6 +103,7 @@ static bool GeneratePolicyReleaseID(char *release_id_out, size_t out_size,
 static char* ReadReleaseIdFromReleaseIdFileMasterfiles(const char *maybe_dirname);
 
 static bool MissingInputFile(const char *input_file);
+static bool IsPolicyPrecheckNeeded(GenericAgentConfig *config, bool force_validation);
 
 static bool LoadAugmentsFiles(EvalContext *ctx, const char* filename);
 
@@ -192,15 +195,45 @@ void MarkAsPolicyServer(EvalContext *ctx)
     Log(LOG_LEVEL_VERBOSE, "Additional class defined: policy_server");
 }
 
+/**
+ * @return whether the policy needs to be validated and it can be done by
+ *         the agent itself instead of running cf-promises
+ */
+static bool IsInProcessValidationPossible(GenericAgentConfig *config, bool force_validation)
+{
+    if (!config->validate_in_process ||
+        (config->agent_type != AGENT_TYPE_AGENT) ||
+        (config->agent_specific.agent.bootstrap_argument != NULL) ||
+        MissingInputFile(config->input_file))
+    {
+        /* Bootstrap proceeds even with invalid policy, see
+         * GenericAgentCheckPolicy() */
+        return false;
+    }
+
+    return IsPolicyPrecheckNeeded(config, force_validation);
+}
+
 Policy *SelectAndLoadPolicy(GenericAgentConfig *config, EvalContext *ctx, bool validate_policy, bool write_validated_file)
 {
     Policy *policy = NULL;
 
-    if (GenericAgentCheckPolicy(config, validate_policy, write_validated_file))
+    if (IsInProcessValidationPossible(config, validate_policy))
+    {
+        /* Parse and check the policy only once, in this process */
+        policy = LoadAndValidatePolicy(ctx, config, write_validated_file);
+    }
+    else if (GenericAgentCheckPolicy(config, validate_policy, write_validated_file))
     {
         policy = LoadPolicy(ctx, config);
     }
-    else if (config->tty_interactive)
+
+    if (policy != NULL)
+    {
+        return policy;
+    }
+
+    if (config->tty_interactive)
     {
         Log(LOG_LEVEL_ERR,
                "Failsafe condition triggered. Interactive session detected, skipping failsafe.cf execution.");
@@ -1806,6 +1839,9 @@ void GenericAgentFinalize(EvalContext *ctx, GenericAgentConfig *config)
     {
         cfnet_shut();
     }
+    FunctionCacheClose();
+    FunctionCacheLogStats();
+    RegexCacheLogStats();
     CryptoDeInitialize();
     GenericAgentConfigDestroy(config);
     EvalContextDestroy(ctx);
@@ -2593,6 +2629,7 @@ GenericAgentConfig *GenericAgentConfigNewDefault(AgentType agent_type, bool tty_
     config->ignore_missing_bundles = false;
     config->ignore_missing_inputs = false;
     config->ignore_preferred_augments = false;
+    config->validate_in_process = false;
 
     config->heap_soft = NULL;
     config->heap_negated = NULL;
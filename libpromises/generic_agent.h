@@ -69,6 +69,7 @@ typedef struct
     bool ignore_missing_bundles;
     bool ignore_missing_inputs;
     bool ignore_preferred_augments; // --ignore-preferred-augments
+    bool validate_in_process;       // --validate-in-process
 
     struct
     {
@@ -28,7 +28,8 @@
 #include <addr_lib.h>
 #include <matching.h>
 #include <misc_lib.h>
-#include <regex.h> /* StringMatchFull,CompileRegex,StringMatchWithPrecompiledRegex */
+#include <regex.h> /* StringMatchWithPrecompiledRegex */
+#include <regex_cache.h> /* RegexCacheGet,RegexCacheStringMatchFull */
 #include <file_lib.h>
 #include <files_interfaces.h>
 
@@ -791,7 +792,7 @@ bool IsMatchItemIn(const Item *list, const char *item)
     {
         if (FuzzySetMatch(ptr->name, item) == 0 ||
             (IsRegex(ptr->name) &&
-             StringMatchFull(ptr->name, item)))
+             RegexCacheStringMatchFull(ptr->name, item)))
         {
             return true;
         }
@@ -879,7 +880,7 @@ bool DeleteItemGeneral(Item **list, const char *string, ItemMatchType type)
     if (type == ITEM_MATCH_TYPE_REGEX_COMPLETE_NOT ||
         type == ITEM_MATCH_TYPE_REGEX_COMPLETE)
     {
-        rx = CompileRegex(string);
+        rx = RegexCacheGet(string);
         if (!rx)
         {
             return false;
@@ -947,7 +948,7 @@ bool DeleteItemGeneral(Item **list, const char *string, ItemMatchType type)
                 free(ip);
                 if (rx)
                 {
-                    RegexDestroy(rx);
+                    RegexCacheRelease(rx);
                 }
 
                 return true;
@@ -960,7 +961,7 @@ bool DeleteItemGeneral(Item **list, const char *string, ItemMatchType type)
 
     if (rx)
     {
-        RegexDestroy(rx);
+        RegexCacheRelease(rx);
     }
 
     return false;
@@ -43,6 +43,9 @@
 // TODO: remove
 #include <vars.h>                                         /* IsCf3VarString */
 #include <audit.h>                                        /* FatalError */
+#include <bootstrap.h>                                    /* GetAmPolicyHub */
+#include <policy_image.h>
+#include <function_cache.h>                               /* FunctionCacheClose */
 
 
 static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, const char *policy_file,
@@ -56,7 +59,12 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
  * The difference between filename and input_input file is that the latter is the file specified by -f or
  * equivalently the file containing body common control. This will hopefully be squashed in later refactoring.
  */
-Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+/**
+ * @param digest digest of the contents of the file to use its stored image
+ *               instead of parsing it if possible, NULL to always parse it
+ */
+static Policy *ParsePolicyFile(const GenericAgentConfig *config, const char *input_path,
+                               const char *digest)
 {
     struct stat statbuf;
 
@@ -129,15 +137,25 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
         JsonDestroy(json_policy);
         WriterClose(contents);
     }
+    else if (config->agent_type == AGENT_TYPE_COMMON)
+    {
+        /* No images for cf-promises, it has to report parser warnings */
+        policy = ParserParseFile(config->agent_type, input_path, config->agent_specific.common.parser_warnings, config->agent_specific.common.parser_warnings_error);
+    }
     else
     {
-        if (config->agent_type == AGENT_TYPE_COMMON)
+        if (digest != NULL)
         {
-            policy = ParserParseFile(config->agent_type, input_path, config->agent_specific.common.parser_warnings, config->agent_specific.common.parser_warnings_error);
+            policy = PolicyImageLoad(config->agent_type, input_path, digest);
         }
-        else
+
+        if (policy == NULL)
         {
             policy = ParserParseFile(config->agent_type, input_path, 0, 0);
+            if ((policy != NULL) && (digest != NULL))
+            {
+                PolicyImageStore(policy, config->agent_type, input_path, digest);
+            }
         }
     }
 
@@ -145,6 +163,11 @@ Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
     return policy;
 }
 
+Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path)
+{
+    return ParsePolicyFile(config, input_path, NULL);
+}
+
 static Policy *LoadPolicyInputFiles(EvalContext *ctx, GenericAgentConfig *config, const Rlist *inputs,
                                     StringMap *policy_files_hashes, StringSet *parsed_files_checksums,
                                     StringSet *failed_files)
@@ -340,7 +363,7 @@ static Policy *LoadPolicyFile(EvalContext *ctx, GenericAgentConfig *config, cons
         Log(LOG_LEVEL_DEBUG, "Loading policy file %s", policy_file);
     }
 
-    Policy *policy = Cf3ParseFile(config, policy_file);
+    Policy *policy = ParsePolicyFile(config, policy_file, hashbuffer);
 
     StringMapInsert(policy_files_hashes, xstrdup(policy_file), xstrdup(hashbuffer));
     StringSetAdd(parsed_files_checksums, xstrdup(hashbuffer));
@@ -492,7 +515,28 @@ static JsonElement *ReadReleaseIdFileFromInputs()
     return validated_doc;
 }
 
-Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
+/**
+ * @brief Drops everything the evaluation of a rejected policy put in #ctx,
+ *        which refers to the promises of that policy, and sets the context up
+ *        again as it was before the policy was loaded
+ * @note Same as what the daemons do before they reload policy.
+ */
+static void ResetEvaluatedContext(EvalContext *ctx, GenericAgentConfig *config)
+{
+    EvalContextClear(ctx);
+    strcpy(VDOMAIN, "undefined.domain");
+
+    GenericAgentConfigApply(ctx, config);
+    GenericAgentDiscoverContext(ctx, config, NULL);
+}
+
+/**
+ * @param validate if true, errors in the policy are reported by returning
+ *                 NULL instead of exiting and the release directory is tagged
+ *                 as validated once the policy has passed all the checks
+ */
+static Policy *LoadPolicyInternal(EvalContext *ctx, GenericAgentConfig *config,
+                                  bool validate, bool write_validated_file)
 {
     StringMap *policy_files_hashes = StringMapNew();
     StringSet *parsed_files_checksums = StringSetNew();
@@ -504,10 +548,26 @@ Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
                                     policy_files_hashes, parsed_files_checksums,
                                     failed_files);
 
+    if (config->agent_type != AGENT_TYPE_COMMON)
+    {
+        PolicyImagePurgeOld();
+    }
+
     if (StringSetSize(failed_files) > 0)
     {
         Log(LOG_LEVEL_ERR, "There are syntax errors in policy files");
-        DoCleanupAndExit(EXIT_FAILURE);
+        if (!validate)
+        {
+            DoCleanupAndExit(EXIT_FAILURE);
+        }
+
+        /* The files parsed before the broken one have been resolved */
+        ResetEvaluatedContext(ctx, config);
+        PolicyDestroy(policy);
+        StringMapDestroy(policy_files_hashes);
+        StringSetDestroy(parsed_files_checksums);
+        StringSetDestroy(failed_files);
+        return NULL;
     }
 
     StringSetDestroy(parsed_files_checksums);
@@ -544,12 +604,24 @@ Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
             }
             WriterClose(writer);
             SeqDestroy(errors);
-            DoCleanupAndExit(EXIT_FAILURE); // TODO: do not exit
+            if (!validate)
+            {
+                DoCleanupAndExit(EXIT_FAILURE);
+            }
+
+            ResetEvaluatedContext(ctx, config);
+            PolicyDestroy(policy);
+            return NULL;
         }
 
         SeqDestroy(errors);
     }
 
+    if (validate && (policy == NULL))
+    {
+        return NULL;
+    }
+
     if (LogGetGlobalLevel() >= LOG_LEVEL_VERBOSE)
     {
         Legend();
@@ -610,12 +682,31 @@ Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
             {
                 if (!VerifyBundleSequence(ctx, policy, config))
                 {
-                    FatalError(ctx, "Errors in promise bundles: could not verify bundlesequence");
+                    if (!validate)
+                    {
+                        FatalError(ctx, "Errors in promise bundles: could not verify bundlesequence");
+                    }
+
+                    Log(LOG_LEVEL_ERR, "Errors in promise bundles: could not verify bundlesequence");
+                    /* The context must not outlive the promises it refers to */
+                    ResetEvaluatedContext(ctx, config);
+                    PolicyDestroy(policy);
+                    return NULL;
                 }
             }
         }
     }
 
+    if (validate && write_validated_file)
+    {
+        /* Same as after a successful cf-promises run, done before reading
+         * the release ID below so that a new one written on the hub is used */
+        GenericAgentTagReleaseDirectory(config,
+                                        NULL, // use GetAutotagDir
+                                        write_validated_file, // true
+                                        GetAmPolicyHub()); // write release ID?
+    }
+
     if (config->agent_type == AGENT_TYPE_AGENT &&
         config->agent_specific.agent.bootstrap_argument != NULL)
     {
@@ -656,3 +747,21 @@ Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
 
     return policy;
 }
+
+Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config)
+{
+    Policy *policy = LoadPolicyInternal(ctx, config, false, false);
+
+    /* Done evaluating while loading, daemons may not evaluate again soon */
+    FunctionCacheClose();
+    return policy;
+}
+
+Policy *LoadAndValidatePolicy(EvalContext *ctx, GenericAgentConfig *config,
+                              bool write_validated_file)
+{
+    Log(LOG_LEVEL_VERBOSE, "Validating the policy in-process");
+    Policy *policy = LoadPolicyInternal(ctx, config, true, write_validated_file);
+    FunctionCacheClose();
+    return policy;
+}
@@ -29,6 +29,18 @@
 #include <generic_agent.h>
 
 Policy *LoadPolicy(EvalContext *ctx, GenericAgentConfig *config);
+
+/**
+ * @brief Loads the policy like LoadPolicy(), but validates it in-process
+ *        instead of relying on a prior cf-promises run
+ * @param write_validated_file whether to tag the release directory (write
+ *                             promises_validated) if the policy is valid
+ * @return the policy or NULL if it is not valid
+ * @note Policy files are evaluated while they are loaded, so any failure
+ *       resets #ctx to the state it had before.
+ */
+Policy *LoadAndValidatePolicy(EvalContext *ctx, GenericAgentConfig *config,
+                              bool write_validated_file);
 Policy *Cf3ParseFile(const GenericAgentConfig *config, const char *input_path);
 
 #endif
@@ -195,55 +195,54 @@ static bool WriteLockDataCurrent(CF_DB *dbp, const char *lock_id)
     return WriteLockData(dbp, lock_id, &lock_data);
 }
 
-static int WriteLock(const char *name)
+static bool ReadLockData(CF_DB *dbp, const char *lock_id, LockData *lock_data)
 {
-    CF_DB *dbp = OpenLock();
-
-    if (dbp == NULL)
-    {
-        return -1;
-    }
+    bool ret;
 
-    ThreadLock(cft_lock);
-    WriteLockDataCurrent(dbp, name);
+#ifdef LMDB
+    unsigned char ohash[LMDB_MAX_KEY_SIZE];
+    HashLockKeyIfNecessary(lock_id, ohash);
 
-    CloseLock(dbp);
-    ThreadUnlock(cft_lock);
+    LOG_LOCK_ENTRY(lock_id, ohash, lock_data);
+    ret = ReadDB(dbp, ohash, lock_data, sizeof(LockData));
+    LOG_LOCK_EXIT(lock_id, ohash, lock_data);
+#else
+    ret = ReadDB(dbp, lock_id, lock_data, sizeof(LockData));
+#endif
 
-    return 0;
+    return ret;
 }
 
-static time_t FindLockTime(const char *name)
+static bool DeleteLockData(CF_DB *dbp, const char *lock_id)
 {
     bool ret;
-    CF_DB *dbp = OpenLock();
-    if (dbp == NULL)
-    {
-        return -1;
-    }
-
-    LockData entry = { 0 };
-    entry.process_start_time = PROCESS_START_TIME_UNKNOWN;
 
 #ifdef LMDB
-    unsigned char ohash[LMDB_MAX_KEY_SIZE];
-    HashLockKeyIfNecessary(name, ohash);
+    unsigned char digest2[LMDB_MAX_KEY_SIZE];
+
+    HashLockKeyIfNecessary(lock_id, digest2);
 
-    LOG_LOCK_ENTRY(name, ohash, &entry);
-    ret = ReadDB(dbp, ohash, &entry, sizeof(entry));
-    LOG_LOCK_EXIT(name, ohash, &entry);
+    LOG_LOCK_ENTRY(lock_id, digest2, NULL);
+    ret = DeleteDB(dbp, digest2);
+    LOG_LOCK_EXIT(lock_id, digest2, NULL);
 #else
-    ret = ReadDB(dbp, name, &entry, sizeof(entry));
+    ret = DeleteDB(dbp, lock_id);
 #endif
 
-    if (ret)
+    return ret;
+}
+
+static time_t FindLockTime(CF_DB *dbp, const char *name)
+{
+    LockData entry = { 0 };
+    entry.process_start_time = PROCESS_START_TIME_UNKNOWN;
+
+    if (ReadLockData(dbp, name, &entry))
     {
-        CloseLock(dbp);
         return entry.time;
     }
     else
     {
-        CloseLock(dbp);
         return -1;
     }
 }
@@ -315,133 +314,80 @@ static void RemoveDates(char *s)
     }
 }
 
-static int RemoveLock(const char *name)
+/**
+ * Path of the file whose fcntl() lock implements the given critical section.
+ */
+static char *CriticalSectionLockPath(const char *section_id)
 {
-    CF_DB *dbp = OpenLock();
-    if (dbp == NULL)
-    {
-        return -1;
-    }
-
-    ThreadLock(cft_lock);
-#ifdef LMDB
-    unsigned char digest2[LMDB_MAX_KEY_SIZE];
-
-    HashLockKeyIfNecessary(name, digest2);
+    char *canonified = xstrdup(section_id);
+    CanonifyNameInPlace(canonified);
 
-    LOG_LOCK_ENTRY(name, digest2, NULL);
-    DeleteDB(dbp, digest2);
-    LOG_LOCK_EXIT(name, digest2, NULL);
-#else
-    DeleteDB(dbp, name);
-#endif
-    ThreadUnlock(cft_lock);
+    char *path;
+    xasprintf(&path, "%s%c%s.lock", GetStateDir(), FILE_SEPARATOR, canonified);
+    free(canonified);
 
-    CloseLock(dbp);
-    return 0;
+    return path;
 }
 
-static bool NoOrObsoleteLock(LockData *entry, ARG_UNUSED size_t entry_size, size_t *max_old)
-{
-    assert((entry == NULL) || (entry_size == sizeof(LockData)));
-
-    if (entry == NULL)
-    {
-        return true;
-    }
-
-    time_t now = time(NULL);
-    if ((now - entry->time) <= (time_t) *max_old)
-    {
-        Log(LOG_LEVEL_DEBUG, "Giving time to process '%d' (holding lock for %jd s)", entry->pid, (intmax_t) (now - entry->time));
-    }
-    return ((now - entry->time) > (time_t) *max_old);
-}
+/* Critical sections are mutually exclusive between processes thanks to an
+ * fcntl() lock, which the kernel drops if the holder dies, so there is no
+ * crash detritus to wait for. fcntl() locks are per-process, the mutex makes
+ * them exclusive between threads as well. Critical sections don't nest. */
+static pthread_mutex_t critical_section_mutex = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+static FileLock CRITICAL_SECTION_LOCK = EMPTY_FILE_LOCK; /* GLOBAL_X */
 
 void WaitForCriticalSection(const char *section_id)
 {
-    ThreadLock(cft_lock);
+    ThreadLock(&critical_section_mutex);
 
-    CF_DB *dbp = OpenLock();
-    if (dbp == NULL)
-    {
-        Log(LOG_LEVEL_CRIT, "Failed to open lock database when waiting for critical section");
-        ThreadUnlock(cft_lock);
-        return;
-    }
-
-    time_t started = time(NULL);
-    LockData entry = { 0 };
-    entry.pid = getpid();
-    entry.process_start_time = PROCESS_START_TIME_UNKNOWN;
-
-#ifdef LMDB
-    unsigned char ohash[LMDB_MAX_KEY_SIZE];
-    HashLockKeyIfNecessary(section_id, ohash);
-    Log(LOG_LEVEL_DEBUG, "Hashed critical section lock '%s' to '%s'", section_id, ohash);
-    section_id = ohash;
-#endif
-
-    /* If another agent has been waiting more than a minute, it means there
-       is likely crash detritus to clear up... After a minute we take our
-       chances ... */
-    size_t max_old = 60;
+    char *path = CriticalSectionLockPath(section_id);
 
     Log(LOG_LEVEL_DEBUG, "Acquiring critical section lock '%s'", section_id);
-    bool got_lock = false;
-    while (!got_lock && ((time(NULL) - started) <= (time_t) max_old))
-    {
-        entry.time = time(NULL);
-        got_lock = OverwriteDB(dbp, section_id, &entry, sizeof(entry),
-                               (OverwriteCondition) NoOrObsoleteLock, &max_old);
-        if (!got_lock)
-        {
-            Log(LOG_LEVEL_DEBUG, "Waiting for critical section lock '%s'", section_id);
-            sleep(1);
-        }
-    }
-
-    /* If we still haven't gotten the lock, let's try the biggest hammer we
-     * have. */
-    if (!got_lock)
+    if (ExclusiveFileLockPath(&CRITICAL_SECTION_LOCK, path, true) == 0)
     {
-        Log(LOG_LEVEL_NOTICE, "Failed to wait for critical section lock '%s', force-writing new lock", section_id);
-        if (!WriteDB(dbp, section_id, &entry, sizeof(entry)))
-        {
-            Log(LOG_LEVEL_CRIT, "Failed to force-write critical section lock '%s'", section_id);
-        }
+        Log(LOG_LEVEL_DEBUG, "Acquired critical section lock '%s'", section_id);
     }
     else
     {
-        Log(LOG_LEVEL_DEBUG, "Acquired critical section lock '%s'", section_id);
+        /* Same as when the lock could not be force-written into the lock
+         * database before, we carry on unprotected. */
+        Log(LOG_LEVEL_CRIT, "Failed to acquire critical section lock '%s' on '%s'",
+            section_id, path);
+        CRITICAL_SECTION_LOCK.fd = -1;
     }
 
-    CloseLock(dbp);
-    ThreadUnlock(cft_lock);
+    free(path);
 }
 
 void ReleaseCriticalSection(const char *section_id)
 {
     Log(LOG_LEVEL_DEBUG, "Releasing critical section lock '%s'", section_id);
-    if (RemoveLock(section_id) == 0)
-    {
-        Log(LOG_LEVEL_DEBUG, "Released critical section lock '%s'", section_id);
-    }
-    else
+
+    if (CRITICAL_SECTION_LOCK.fd >= 0)
     {
-        Log(LOG_LEVEL_DEBUG, "Failed to release critical section lock '%s'", section_id);
+        if (ExclusiveFileUnlock(&CRITICAL_SECTION_LOCK, true) == 0)
+        {
+            Log(LOG_LEVEL_DEBUG, "Released critical section lock '%s'", section_id);
+        }
+        else
+        {
+            Log(LOG_LEVEL_DEBUG, "Failed to release critical section lock '%s'", section_id);
+        }
+        CRITICAL_SECTION_LOCK.fd = -1;
     }
+
+    ThreadUnlock(&critical_section_mutex);
 }
 
-static time_t FindLock(char *last)
+static time_t FindLock(CF_DB *dbp, const char *last)
 {
     time_t mtime;
 
-    if ((mtime = FindLockTime(last)) == -1)
+    if ((mtime = FindLockTime(dbp, last)) == -1)
     {
         /* Do this to prevent deadlock loops from surviving if IfElapsed > T_sched */
 
-        if (WriteLock(last) == -1)
+        if (!WriteLockDataCurrent(dbp, last))
         {
             Log(LOG_LEVEL_ERR, "Unable to lock %s", last);
             return 0;
@@ -587,39 +533,17 @@ static bool IsCfengineLockHolder(pid_t pid)
     return false;
 }
 
-static bool KillLockHolder(const char *lock)
+static bool KillLockHolder(CF_DB *dbp, const char *lock)
 {
-    bool ret;
-    CF_DB *dbp = OpenLock();
-    if (dbp == NULL)
-    {
-        Log(LOG_LEVEL_ERR, "Unable to open locks database");
-        return false;
-    }
-
     LockData lock_data = { 0 };
     lock_data.process_start_time = PROCESS_START_TIME_UNKNOWN;
 
-#ifdef LMDB
-    unsigned char ohash[LMDB_MAX_KEY_SIZE];
-    HashLockKeyIfNecessary(lock, ohash);
-
-    LOG_LOCK_ENTRY(lock, ohash, &lock_data);
-    ret = ReadDB(dbp, ohash, &lock_data, sizeof(lock_data));
-    LOG_LOCK_EXIT(lock, ohash, &lock_data);
-#else
-    ret = ReadDB(dbp, lock, &lock_data, sizeof(lock_data));
-#endif
-
-    if (!ret)
+    if (!ReadLockData(dbp, lock, &lock_data))
     {
         /* No lock found */
-        CloseLock(dbp);
         return true;
     }
 
-    CloseLock(dbp);
-
     if (!IsCfengineLockHolder(lock_data.pid)) {
         Log(LOG_LEVEL_VERBOSE,
             "Lock holder with PID %ju was replaced by a non CFEngine process, ignoring request to kill it",
@@ -911,8 +835,20 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
     // Now see if we can get exclusivity to edit the locks
     WaitForCriticalSection(CF_CRITIAL_SECTION);
 
+    /* All the reads and writes below use the same handle, so they end up in
+     * a single transaction which is committed by CloseLock(), before leaving
+     * the critical section. */
+    CF_DB *dbp = OpenLock();
+    if (dbp == NULL)
+    {
+        Log(LOG_LEVEL_ERR, "Unable to open locks database, not locking %s", cflock);
+        ReleaseCriticalSection(CF_CRITIAL_SECTION);
+        PushLock(cflock, cflast);
+        return CfLockNew(cflast, cflock, false);
+    }
+
     // Look for non-existent (old) processes
-    time_t lastcompleted = FindLock(cflast);
+    time_t lastcompleted = FindLock(dbp, cflast);
     time_t elapsedtime = (time_t) (now - lastcompleted) / 60;
 
     // For promises/locks with ifelapsed == 0, skip all detection logic of
@@ -925,6 +861,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
                 "Another cf-agent seems to have done this since I started "
                 "(elapsed=%jd)",
                 (intmax_t) elapsedtime);
+            CloseLock(dbp);
             ReleaseCriticalSection(CF_CRITIAL_SECTION);
             return CfLockNull();
         }
@@ -934,13 +871,14 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
             Log(LOG_LEVEL_VERBOSE,
                 "Nothing promised here [%.40s] (%jd/%u minutes elapsed)",
                 cflast, (intmax_t) elapsedtime, ifelapsed);
+            CloseLock(dbp);
             ReleaseCriticalSection(CF_CRITIAL_SECTION);
             return CfLockNull();
         }
     }
 
     // Look for existing (current) processes
-    lastcompleted = FindLock(cflock);
+    lastcompleted = FindLock(dbp, cflock);
     if (!ignoreProcesses)
     {
         elapsedtime = (time_t) (now - lastcompleted) / 60;
@@ -953,7 +891,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
                     "Lock expired after %jd/%u minutes: %s",
                     (intmax_t) elapsedtime, expireafter, cflock);
 
-                if (KillLockHolder(cflock))
+                if (KillLockHolder(dbp, cflock))
                 {
                     Log(LOG_LEVEL_VERBOSE,
                         "Lock successfully expired: %s", cflock);
@@ -966,6 +904,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
             }
             else
             {
+                CloseLock(dbp);
                 ReleaseCriticalSection(CF_CRITIAL_SECTION);
                 Log(LOG_LEVEL_VERBOSE,
                     "Couldn't obtain lock for %s (already running!)",
@@ -974,8 +913,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
             }
         }
 
-        int ret = WriteLock(cflock);
-        if (ret != -1)
+        if (WriteLockDataCurrent(dbp, cflock))
         {
             /* Register a cleanup handler *after* having opened the DB, so that
              * CloseAllDB() atexit() handler is registered in advance, and it
@@ -987,6 +925,7 @@ CfLock AcquireLock(EvalContext *ctx, const char *operand, const char *host,
         }
     }
 
+    CloseLock(dbp);
     ReleaseCriticalSection(CF_CRITIAL_SECTION);
 
     // Keep this as a global for signal handling
@@ -1010,7 +949,8 @@ void YieldCurrentLock(CfLock lock)
 
     Log(LOG_LEVEL_DEBUG, "Yielding lock '%s'", lock.lock);
 
-    if (RemoveLock(lock.lock) == -1)
+    CF_DB *dbp = OpenLock();
+    if (dbp == NULL)
     {
         Log(LOG_LEVEL_VERBOSE, "Unable to remove lock %s", lock.lock);
         free(lock.last);
@@ -1018,7 +958,15 @@ void YieldCurrentLock(CfLock lock)
         return;
     }
 
-    if (WriteLock(lock.last) == -1)
+    /* Removing the lock and recording the completion time is one
+     * transaction, committed by CloseLock(). */
+    ThreadLock(cft_lock);
+    DeleteLockData(dbp, lock.lock);
+    bool written = WriteLockDataCurrent(dbp, lock.last);
+    CloseLock(dbp);
+    ThreadUnlock(cft_lock);
+
+    if (!written)
     {
         Log(LOG_LEVEL_ERR, "Unable to create '%s'. (create: %s)",
             lock.last, GetErrorStr());
@@ -27,7 +27,7 @@
 #include <matching.h>
 #include <eval_context.h>
 #include <string_lib.h>                                   /* StringFromLong */
-#include <regex.h>                                        /* CompileRegex */
+#include <regex_cache.h>                                  /* RegexCacheGet */
 
 
 /* Sets variables */
@@ -69,7 +69,6 @@ static bool RegExMatchSubString(EvalContext *ctx, Regex *regex, const char *test
     }
 
     pcre2_match_data_free(match_data);
-    RegexDestroy(regex);
     return result > 0;
 }
 
@@ -96,46 +95,36 @@ bool FullTextMatch(EvalContext *ctx, const char *regexp, const char *teststring)
         return true;
     }
 
-    Regex *rx = CompileRegex(regexp);
+    Regex *rx = RegexCacheGet(regexp);
     if (rx == NULL)
     {
         return false;
     }
 
-    if (RegExMatchFullString(ctx, rx, teststring))
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    bool matched = RegExMatchFullString(ctx, rx, teststring);
+    RegexCacheRelease(rx);
+    return matched;
 }
 
 bool ValidateRegEx(const char *regex)
 {
-    Regex *rx = CompileRegex(regex);
+    Regex *rx = RegexCacheGet(regex);
     bool regex_valid = rx != NULL;
 
-    RegexDestroy(rx);
+    RegexCacheRelease(rx);
     return regex_valid;
 }
 
 bool BlockTextMatch(EvalContext *ctx, const char *regexp, const char *teststring, int *start, int *end)
 {
-    Regex *rx = CompileRegex(regexp);
+    Regex *rx = RegexCacheGet(regexp);
 
     if (rx == NULL)
     {
         return false;
     }
 
-    if (RegExMatchSubString(ctx, rx, teststring, start, end))
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    bool matched = RegExMatchSubString(ctx, rx, teststring, start, end);
+    RegexCacheRelease(rx);
+    return matched;
 }
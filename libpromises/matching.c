@@ -32,7 +32,7 @@
 #include <scope.h>
 #include <misc_lib.h>
 #include <rlist.h>
-#include <regex.h>                          /* CompileRegex,StringMatchFull */
+#include <regex_cache.h>                    /* RegexCacheGet,RegexCacheStringMatchFull */
 #include <string_lib.h>
 
 
@@ -56,7 +56,7 @@ static char *FirstBackReference(Regex *regex, const char *teststring)
             /* There was no match */
             strlcpy(backreference, "CF_NOMATCH", CF_MAXVARSIZE);
             pcre2_match_data_free(match_data);
-            RegexDestroy(regex);
+            RegexCacheRelease(regex);
             return backreference;
         }
 
@@ -72,7 +72,7 @@ static char *FirstBackReference(Regex *regex, const char *teststring)
     }
 
     pcre2_match_data_free(match_data);
-    RegexDestroy(regex);
+    RegexCacheRelease(regex);
     return backreference;
 }
 
@@ -85,7 +85,7 @@ char *ExtractFirstReference(const char *regexp, const char *teststring)
         return "";
     }
 
-    Regex *rx = CompileRegex(regexp);
+    Regex *rx = RegexCacheGet(regexp);
     if (rx == NULL)
     {
         return "";
@@ -258,7 +258,8 @@ bool IsRegexItemIn(const EvalContext *ctx, const Item *list, const char *regex)
 
         /* Make it commutative */
 
-        if (StringMatchFull(regex, ptr->name) || StringMatchFull(ptr->name, regex))
+        if (RegexCacheStringMatchFull(regex, ptr->name) ||
+            RegexCacheStringMatchFull(ptr->name, regex))
         {
             return true;
         }
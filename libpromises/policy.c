@@ -1520,6 +1520,7 @@ void PromiseDestroy(Promise *pp)
         free(pp->comment);
 
         SeqDestroy(pp->conlist);
+        MapDestroy(pp->conindex);
 
         free(pp);
     }
@@ -1546,67 +1547,85 @@ Constraint *PromiseAppendConstraint(Promise *pp, const char *lval, Rval rval, bo
     cp->type = POLICY_ELEMENT_TYPE_PROMISE;
     cp->parent.promise = pp;
 
-    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    /* Promise constraints are unique by lval, so the lookups by lval (there
+     * are hundreds of them for each promise in attributes.c) go through the
+     * index instead of scanning the whole conlist. */
+    if (pp->conindex == NULL)
     {
-        Constraint *old_cp = SeqAt(pp->conlist, i);
-        if (strcmp(old_cp->lval, lval) == 0)
+        pp->conindex = MapNew(StringHash_untyped, StringEqual_untyped, NULL, NULL);
+    }
+
+    Constraint *old_cp = MapGet(pp->conindex, lval);
+    if (old_cp != NULL)
+    {
+        if (strcmp(old_cp->lval, "ifvarclass") == 0 ||
+            strcmp(old_cp->lval, "if") == 0)
         {
-            if (strcmp(old_cp->lval, "ifvarclass") == 0 ||
-                strcmp(old_cp->lval, "if") == 0)
+            // merge two if/ifvarclass promise attributes this
+            // only happens in a variable context when we have a
+            // scalar already in the attribute (old_cp)
+            switch (rval.type)
             {
-                // merge two if/ifvarclass promise attributes this
-                // only happens in a variable context when we have a
-                // scalar already in the attribute (old_cp)
-                switch (rval.type)
-                {
-                case RVAL_TYPE_FNCALL: // case 1: merge FnCall with scalar
-                {
-                    char * rval_string = RvalToString(old_cp->rval);
-                    Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: merging PREVIOUS %s string context rval %s", old_cp->lval, rval_string);
-                    Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: merging NEW %s rval %s", old_cp->lval, rval_string);
-                    free(rval_string);
+            case RVAL_TYPE_FNCALL: // case 1: merge FnCall with scalar
+            {
+                char * rval_string = RvalToString(old_cp->rval);
+                Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: merging PREVIOUS %s string context rval %s", old_cp->lval, rval_string);
+                Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: merging NEW %s rval %s", old_cp->lval, rval_string);
+                free(rval_string);
 
-                    Rlist *synthetic_args = NULL;
-                    RlistAppendScalar(&synthetic_args, RvalScalarValue(old_cp->rval));
+                Rlist *synthetic_args = NULL;
+                RlistAppendScalar(&synthetic_args, RvalScalarValue(old_cp->rval));
 
-                    // append the old Rval (a function call) under the arguments of the new one
-                    RlistAppend(&synthetic_args, rval.item, RVAL_TYPE_FNCALL);
+                // append the old Rval (a function call) under the arguments of the new one
+                RlistAppend(&synthetic_args, rval.item, RVAL_TYPE_FNCALL);
 
-                    Rval replacement = (Rval) { FnCallNew("and", synthetic_args), RVAL_TYPE_FNCALL };
-                    rval_string = RvalToString(replacement);
-                    Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: MERGED %s rval %s", old_cp->lval, rval_string);
-                    free(rval_string);
+                Rval replacement = (Rval) { FnCallNew("and", synthetic_args), RVAL_TYPE_FNCALL };
+                rval_string = RvalToString(replacement);
+                Log(LOG_LEVEL_DEBUG, "PromiseAppendConstraint: MERGED %s rval %s", old_cp->lval, rval_string);
+                free(rval_string);
 
-                    // overwrite the old Constraint rval with its replacement
-                    RvalDestroy(cp->rval);
-                    cp->rval = replacement;
-                }
-                break;
+                // overwrite the old Constraint rval with its replacement
+                RvalDestroy(cp->rval);
+                cp->rval = replacement;
+            }
+            break;
 
-                case RVAL_TYPE_SCALAR:  // case 2: merge scalar with scalar
-                {
-                    Buffer *grow = BufferNew();
-                    BufferAppendF(grow, "(%s).(%s)",
-                                  RvalScalarValue(old_cp->rval),
-                                  RvalScalarValue(rval));
-                    RvalDestroy(cp->rval);
-                    rval = RvalNew(BufferData(grow), RVAL_TYPE_SCALAR);
-                    BufferDestroy(grow);
-                    cp->rval = rval;
-                }
+            case RVAL_TYPE_SCALAR:  // case 2: merge scalar with scalar
+            {
+                Buffer *grow = BufferNew();
+                BufferAppendF(grow, "(%s).(%s)",
+                              RvalScalarValue(old_cp->rval),
+                              RvalScalarValue(rval));
+                RvalDestroy(cp->rval);
+                rval = RvalNew(BufferData(grow), RVAL_TYPE_SCALAR);
+                BufferDestroy(grow);
+                cp->rval = rval;
+            }
+            break;
+
+            default:
+                ProgrammingError("PromiseAppendConstraint: unexpected rval type: %c", rval.type);
                 break;
+            }
+        }
 
-                default:
-                    ProgrammingError("PromiseAppendConstraint: unexpected rval type: %c", rval.type);
-                    break;
-                }
+        /* The index is keyed by the lval of the constraint, drop the entry
+         * before SeqSet() destroys the old one. */
+        MapRemove(pp->conindex, lval);
+        for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+        {
+            if (SeqAt(pp->conlist, i) == old_cp)
+            {
+                SeqSet(pp->conlist, i, cp);
+                break;
             }
-            SeqSet(pp->conlist, i, cp);
-            return cp;
         }
+        MapInsert(pp->conindex, cp->lval, cp);
+        return cp;
     }
 
     SeqAppend(pp->conlist, cp);
+    MapInsert(pp->conindex, cp->lval, cp);
     return cp;
 }
 
@@ -2533,43 +2552,26 @@ int PromiseGetConstraintAsBooleanWithDefault(const EvalContext *ctx, const char
 
     int retval = CF_UNDEFINED;
 
-    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    /* Constraints of a promise are unique by lval (see
+     * PromiseAppendConstraint()), so there is at most one to look at. */
+    const Constraint *cp = PromiseGetConstraint(pp, lval);
+    if (cp != NULL && IsDefinedClass(ctx, cp->classes))
     {
-        Constraint *cp = SeqAt(pp->conlist, i);
-
-        if (strcmp(cp->lval, lval) == 0)
+        if (cp->rval.type != RVAL_TYPE_SCALAR)
         {
-            if (IsDefinedClass(ctx, cp->classes))
-            {
-                if (retval != CF_UNDEFINED)
-                {
-                    Log(LOG_LEVEL_ERR, "Multiple '%s' (boolean) constraints break this promise", lval);
-                    PromiseRef(LOG_LEVEL_ERR, pp);
-                }
-            }
-            else
-            {
-                continue;
-            }
-
-            if (cp->rval.type != RVAL_TYPE_SCALAR)
-            {
-                Log(LOG_LEVEL_ERR, "Type mismatch on rhs - expected type %c for boolean constraint '%s'",
-                    cp->rval.type, lval);
-                PromiseRef(LOG_LEVEL_ERR, pp);
-                FatalError(ctx, "Aborted");
-            }
-
-            if (strcmp(cp->rval.item, "true") == 0 || strcmp(cp->rval.item, "yes") == 0)
-            {
-                retval = true;
-                continue;
-            }
+            Log(LOG_LEVEL_ERR, "Type mismatch on rhs - expected type %c for boolean constraint '%s'",
+                cp->rval.type, lval);
+            PromiseRef(LOG_LEVEL_ERR, pp);
+            FatalError(ctx, "Aborted");
+        }
 
-            if (strcmp(cp->rval.item, "false") == 0 || strcmp(cp->rval.item, "no") == 0)
-            {
-                retval = false;
-            }
+        if (strcmp(cp->rval.item, "true") == 0 || strcmp(cp->rval.item, "yes") == 0)
+        {
+            retval = true;
+        }
+        else if (strcmp(cp->rval.item, "false") == 0 || strcmp(cp->rval.item, "no") == 0)
+        {
+            retval = false;
         }
     }
 
@@ -2648,38 +2650,42 @@ int ConstraintsGetAsBoolean(const EvalContext *ctx, const char *lval, const Seq
 
 /*****************************************************************************/
 
-bool PromiseBundleOrBodyConstraintExists(const EvalContext *ctx, const char *lval, const Promise *pp)
+static bool RvalContainsFnCall(Rval rval)
 {
-    int retval = CF_UNDEFINED;
-
-    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    switch (rval.type)
     {
-        const Constraint *cp = SeqAt(pp->conlist, i);
+    case RVAL_TYPE_FNCALL:
+        return true;
 
-        if (strcmp(cp->lval, lval) == 0)
+    case RVAL_TYPE_LIST:
+        for (const Rlist *rp = RvalRlistValue(rval); rp != NULL; rp = rp->next)
         {
-            if (IsDefinedClass(ctx, cp->classes))
+            if (RvalContainsFnCall(rp->val))
             {
-                if (retval != CF_UNDEFINED)
-                {
-                    Log(LOG_LEVEL_ERR, "Multiple '%s' constraints break this promise", lval);
-                    PromiseRef(LOG_LEVEL_ERR, pp);
-                }
-            }
-            else
-            {
-                continue;
+                return true;
             }
+        }
+        return false;
 
-            if (!(cp->rval.type == RVAL_TYPE_FNCALL || cp->rval.type == RVAL_TYPE_SCALAR))
-            {
-                Log(LOG_LEVEL_ERR,
-                    "Anomalous type mismatch - type %c for bundle constraint '%s' did not match internals",
-                    cp->rval.type, lval);
-                PromiseRef(LOG_LEVEL_ERR, pp);
-                FatalError(ctx, "Aborted");
-            }
+    default:
+        return false;
+    }
+}
+
+bool PromiseContainsFnCall(const Promise *pp)
+{
+    assert(pp != NULL);
+
+    if (RvalContainsFnCall(pp->promisee))
+    {
+        return true;
+    }
 
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (RvalContainsFnCall(cp->rval))
+        {
             return true;
         }
     }
@@ -2687,6 +2693,28 @@ bool PromiseBundleOrBodyConstraintExists(const EvalContext *ctx, const char *lva
     return false;
 }
 
+/*****************************************************************************/
+
+bool PromiseBundleOrBodyConstraintExists(const EvalContext *ctx, const char *lval, const Promise *pp)
+{
+    const Constraint *cp = PromiseGetConstraint(pp, lval);
+    if (cp == NULL || !IsDefinedClass(ctx, cp->classes))
+    {
+        return false;
+    }
+
+    if (!(cp->rval.type == RVAL_TYPE_FNCALL || cp->rval.type == RVAL_TYPE_SCALAR))
+    {
+        Log(LOG_LEVEL_ERR,
+            "Anomalous type mismatch - type %c for bundle constraint '%s' did not match internals",
+            cp->rval.type, lval);
+        PromiseRef(LOG_LEVEL_ERR, pp);
+        FatalError(ctx, "Aborted");
+    }
+
+    return true;
+}
+
 static inline bool CheckScalarNotEmptyVarRef(const char *scalar)
 {
     return (!StringEqual("$()", scalar) && !StringEqual("${}", scalar));
@@ -3060,38 +3088,21 @@ Rlist *PromiseGetConstraintAsList(const EvalContext *ctx, const char *lval, cons
  */
 Constraint *PromiseGetConstraint(const Promise *pp, const char *lval)
 {
-    if (!pp)
+    if (!pp || pp->conindex == NULL)
     {
         return NULL;
     }
 
-    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
-    {
-        Constraint *cp = SeqAt(pp->conlist, i);
-
-        if (strcmp(cp->lval, lval) == 0)
-        {
-            return cp;
-        }
-    }
-
-    return NULL;
+    return MapGet(pp->conindex, lval);
 }
 
 Constraint *PromiseGetConstraintWithType(const Promise *pp, const char *lval, RvalType type)
 {
     assert(pp);
-    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    Constraint *cp = PromiseGetConstraint(pp, lval);
+    if (cp != NULL && cp->rval.type == type)
     {
-        Constraint *cp = SeqAt(pp->conlist, i);
-        if (cp->rval.type != type) {
-            continue;
-        }
-
-        if (strcmp(cp->lval, lval) == 0)
-        {
-            return cp;
-        }
+        return cp;
     }
 
     return NULL;
@@ -3108,30 +3119,15 @@ Constraint *PromiseGetConstraintWithType(const Promise *pp, const char *lval, Rv
  */
 Constraint *PromiseGetImmediateConstraint(const Promise *pp, const char *lval)
 {
-    if (pp == NULL)
-    {
-        return NULL;
-    }
+    /* It would be nice to check whether the constraint we have asked
+       for is defined in promise (not in referenced body), but there
+       seem to be no way to do it easily.
 
-    for (size_t i = 0; i < SeqLength(pp->conlist); ++i)
-    {
-        Constraint *cp = SeqAt(pp->conlist, i);
+       Checking for absence of classes does not work, as constrains
+       obtain classes defined on promise itself.
+    */
 
-        if (strcmp(cp->lval, lval) == 0)
-        {
-            /* It would be nice to check whether the constraint we have asked
-               for is defined in promise (not in referenced body), but there
-               seem to be no way to do it easily.
-
-               Checking for absence of classes does not work, as constrains
-               obtain classes defined on promise itself.
-            */
-
-            return cp;
-        }
-    }
-
-    return NULL;
+    return PromiseGetConstraint(pp, lval);
 }
 
 /**
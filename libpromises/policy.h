@@ -31,6 +31,7 @@
 #include <sequence.h>
 #include <json.h>
 #include <set.h>
+#include <map.h>
 #include <file_lib.h>                   /* FileLock */
 
 typedef enum
@@ -121,6 +122,7 @@ struct Promise_
     char *promiser;
     Rval promisee;
     Seq *conlist;
+    Map *conindex;           /* lval -> Constraint in conlist, see PromiseAppendConstraint() */
 
     const Promise *org_pp;            /* A ptr to the unexpanded raw promise */
 
@@ -236,6 +238,11 @@ Constraint *PromiseGetConstraint(const Promise *promise, const char *lval);
 
 bool PromiseBundleOrBodyConstraintExists(const EvalContext *ctx, const char *lval, const Promise *pp);
 
+/**
+ * @brief Whether any constraint or the promisee of #pp calls a function
+ */
+bool PromiseContainsFnCall(const Promise *pp);
+
 void PromiseRecheckAllConstraints(const EvalContext *ctx, const Promise *pp);
 
 void ConstraintDestroy(Constraint *cp);
@@ -0,0 +1,728 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <policy_image.h>
+
+#include <rlist.h>
+#include <fncall.h>
+#include <json.h>
+#include <writer.h>
+#include <string_lib.h>
+#include <file_lib.h>
+#include <files_names.h>                                  /* MakeParentDirectory */
+#include <known_dirs.h>
+#include <hash.h>                                         /* SkipHashType */
+#include <dir.h>
+
+/*
+ * Layout of an image, all integers are in host byte order (images are never
+ * shared between hosts):
+ *
+ *   "CFPI" FORMAT BYTE_ORDER version agent_type source_path digest
+ *   bundles bodies custom_promise_types
+ *
+ * Strings are stored as their length followed by the characters and a
+ * terminating '\0' so that they can be used in place, NULL strings have the
+ * length NULL_STRING. Lists of elements are stored as their length followed
+ * by the elements.
+ */
+
+#define POLICY_IMAGE_MAGIC "CFPI"
+#define POLICY_IMAGE_FORMAT 1
+#define POLICY_IMAGE_BYTE_ORDER 0x01020304
+#define NULL_STRING UINT32_MAX
+
+/* Images not used for this long are removed by PolicyImagePurgeOld() */
+#define POLICY_IMAGE_MAX_AGE (7 * SECONDS_PER_DAY)
+/* The modification time of an image in use is updated this often */
+#define POLICY_IMAGE_REFRESH_AGE SECONDS_PER_DAY
+
+typedef struct
+{
+    const char *data;
+    size_t size;
+    size_t pos;
+    bool error;
+} ImageReader;
+
+/*******************************************************************/
+/* Serialization                                                   */
+/*******************************************************************/
+
+static void WriteUInt32(Buffer *buf, uint32_t value)
+{
+    BufferAppend(buf, (const char *) &value, sizeof(value));
+}
+
+static void WriteUInt64(Buffer *buf, uint64_t value)
+{
+    BufferAppend(buf, (const char *) &value, sizeof(value));
+}
+
+static void WriteString(Buffer *buf, const char *str)
+{
+    if (str == NULL)
+    {
+        WriteUInt32(buf, NULL_STRING);
+        return;
+    }
+
+    const size_t length = strlen(str);
+    WriteUInt32(buf, length);
+    BufferAppend(buf, str, length + 1);
+}
+
+static void WriteOffset(Buffer *buf, const SourceOffset *offset)
+{
+    WriteUInt64(buf, offset->start);
+    WriteUInt64(buf, offset->end);
+    WriteUInt64(buf, offset->line);
+    WriteUInt64(buf, offset->context);
+}
+
+static void WriteRval(Buffer *buf, Rval rval);
+
+static void WriteRlist(Buffer *buf, const Rlist *list)
+{
+    WriteUInt32(buf, RlistLen(list));
+    for (const Rlist *rp = list; rp != NULL; rp = rp->next)
+    {
+        WriteRval(buf, rp->val);
+    }
+}
+
+static void WriteRval(Buffer *buf, Rval rval)
+{
+    const char type = rval.type;
+    BufferAppend(buf, &type, 1);
+
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+        WriteString(buf, RvalScalarValue(rval));
+        break;
+
+    case RVAL_TYPE_LIST:
+        WriteRlist(buf, RvalRlistValue(rval));
+        break;
+
+    case RVAL_TYPE_FNCALL:
+    {
+        const FnCall *fp = RvalFnCallValue(rval);
+        WriteString(buf, fp->name);
+        WriteRlist(buf, fp->args);
+        break;
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        Writer *w = StringWriter();
+        JsonWriteCompact(w, RvalContainerValue(rval));
+        WriteString(buf, StringWriterData(w));
+        WriterClose(w);
+        break;
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        break;
+    }
+}
+
+static void WriteConstraint(Buffer *buf, const Constraint *cp)
+{
+    WriteString(buf, cp->lval);
+    WriteRval(buf, cp->rval);
+    WriteString(buf, cp->classes);
+    WriteUInt32(buf, cp->references_body);
+    WriteOffset(buf, &cp->offset);
+}
+
+static void WriteConstraints(Buffer *buf, const Seq *conlist)
+{
+    const size_t length = SeqLength(conlist);
+    WriteUInt32(buf, length);
+    for (size_t i = 0; i < length; i++)
+    {
+        WriteConstraint(buf, SeqAt(conlist, i));
+    }
+}
+
+static void WriteBundle(Buffer *buf, const Bundle *bp)
+{
+    WriteString(buf, bp->type);
+    WriteString(buf, bp->name);
+    WriteString(buf, bp->ns);
+    WriteUInt32(buf, bp->evaluation_order);
+    WriteRlist(buf, bp->args);
+    WriteString(buf, bp->source_path);
+    WriteOffset(buf, &bp->offset);
+
+    /* Sections are numbered in the order of bp->sections followed by
+     * bp->custom_sections, the promises refer to them by their number. */
+    const size_t num_sections = SeqLength(bp->sections);
+    const size_t num_custom = SeqLength(bp->custom_sections);
+    WriteUInt32(buf, num_sections + num_custom);
+    for (size_t i = 0; i < num_sections + num_custom; i++)
+    {
+        const BundleSection *sp = (i < num_sections) ?
+            SeqAt(bp->sections, i) : SeqAt(bp->custom_sections, i - num_sections);
+        WriteString(buf, sp->promise_type);
+        WriteOffset(buf, &sp->offset);
+    }
+
+    /* Promises are stored in the order they were parsed, which is the order
+     * of bp->all_promises and also of the promises of each section. */
+    const size_t num_promises = SeqLength(bp->all_promises);
+    WriteUInt32(buf, num_promises);
+    for (size_t i = 0; i < num_promises; i++)
+    {
+        const Promise *pp = SeqAt(bp->all_promises, i);
+
+        uint32_t section_index = 0;
+        while (section_index < num_sections + num_custom)
+        {
+            const BundleSection *sp = (section_index < num_sections) ?
+                SeqAt(bp->sections, section_index) :
+                SeqAt(bp->custom_sections, section_index - num_sections);
+            if (sp == pp->parent_section)
+            {
+                break;
+            }
+            section_index++;
+        }
+
+        WriteUInt32(buf, section_index);
+        WriteString(buf, pp->promiser);
+        WriteRval(buf, pp->promisee);
+        WriteString(buf, pp->classes);
+        WriteString(buf, pp->comment);
+        WriteOffset(buf, &pp->offset);
+        WriteConstraints(buf, pp->conlist);
+    }
+}
+
+static void WriteBody(Buffer *buf, const Body *body)
+{
+    WriteString(buf, body->type);
+    WriteString(buf, body->name);
+    WriteString(buf, body->ns);
+    WriteRlist(buf, body->args);
+    WriteString(buf, body->source_path);
+    WriteUInt32(buf, body->is_custom);
+    WriteOffset(buf, &body->offset);
+    WriteConstraints(buf, body->conlist);
+}
+
+Buffer *PolicyImageSerialize(const Policy *policy, AgentType agent_type,
+                             const char *source_path, const char *digest)
+{
+    assert(policy != NULL);
+
+    Buffer *buf = BufferNew();
+
+    BufferAppend(buf, POLICY_IMAGE_MAGIC, strlen(POLICY_IMAGE_MAGIC));
+    WriteUInt32(buf, POLICY_IMAGE_FORMAT);
+    WriteUInt32(buf, POLICY_IMAGE_BYTE_ORDER);
+    WriteString(buf, VERSION);
+    WriteUInt32(buf, agent_type);
+    WriteString(buf, source_path);
+    WriteString(buf, digest);
+
+    WriteUInt32(buf, SeqLength(policy->bundles));
+    for (size_t i = 0; i < SeqLength(policy->bundles); i++)
+    {
+        WriteBundle(buf, SeqAt(policy->bundles, i));
+    }
+
+    WriteUInt32(buf, SeqLength(policy->bodies));
+    for (size_t i = 0; i < SeqLength(policy->bodies); i++)
+    {
+        WriteBody(buf, SeqAt(policy->bodies, i));
+    }
+
+    WriteUInt32(buf, SeqLength(policy->custom_promise_types));
+    for (size_t i = 0; i < SeqLength(policy->custom_promise_types); i++)
+    {
+        WriteBody(buf, SeqAt(policy->custom_promise_types, i));
+    }
+
+    return buf;
+}
+
+/*******************************************************************/
+/* Deserialization                                                 */
+/*******************************************************************/
+
+static const char *ReadBytes(ImageReader *reader, size_t length)
+{
+    if (reader->error || (length > reader->size - reader->pos))
+    {
+        reader->error = true;
+        return NULL;
+    }
+
+    const char *bytes = reader->data + reader->pos;
+    reader->pos += length;
+    return bytes;
+}
+
+static uint32_t ReadUInt32(ImageReader *reader)
+{
+    uint32_t value = 0;
+    const char *bytes = ReadBytes(reader, sizeof(value));
+    if (bytes != NULL)
+    {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+static uint64_t ReadUInt64(ImageReader *reader)
+{
+    uint64_t value = 0;
+    const char *bytes = ReadBytes(reader, sizeof(value));
+    if (bytes != NULL)
+    {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+/**
+ * @return a pointer to the string in the image, NULL for NULL strings and
+ *         in case of errors
+ */
+static const char *ReadString(ImageReader *reader)
+{
+    const uint32_t length = ReadUInt32(reader);
+    if (length == NULL_STRING)
+    {
+        return NULL;
+    }
+
+    const char *str = ReadBytes(reader, (size_t) length + 1);
+    if ((str != NULL) && (str[length] != '\0'))
+    {
+        reader->error = true;
+        return NULL;
+    }
+    return str;
+}
+
+/**
+ * @return a string which is never NULL, for the values the policy requires
+ */
+static const char *ReadRequiredString(ImageReader *reader)
+{
+    const char *str = ReadString(reader);
+    if (str == NULL)
+    {
+        reader->error = true;
+        return "";
+    }
+    return str;
+}
+
+static void ReadOffset(ImageReader *reader, SourceOffset *offset)
+{
+    offset->start = ReadUInt64(reader);
+    offset->end = ReadUInt64(reader);
+    offset->line = ReadUInt64(reader);
+    offset->context = ReadUInt64(reader);
+}
+
+static Rval ReadRval(ImageReader *reader);
+
+static Rlist *ReadRlist(ImageReader *reader)
+{
+    Rlist *list = NULL;
+    Rlist **tail = &list;
+
+    const uint32_t length = ReadUInt32(reader);
+    for (uint32_t i = 0; (i < length) && !reader->error; i++)
+    {
+        Rlist *rp = xmalloc(sizeof(Rlist));
+        rp->val = ReadRval(reader);
+        rp->next = NULL;
+        *tail = rp;
+        tail = &rp->next;
+    }
+
+    return list;
+}
+
+static Rval ReadRval(ImageReader *reader)
+{
+    const char *type = ReadBytes(reader, 1);
+    if (type == NULL)
+    {
+        return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+    }
+
+    switch (*type)
+    {
+    case RVAL_TYPE_SCALAR:
+        return RvalNew(ReadRequiredString(reader), RVAL_TYPE_SCALAR);
+
+    case RVAL_TYPE_LIST:
+        return (Rval) { ReadRlist(reader), RVAL_TYPE_LIST };
+
+    case RVAL_TYPE_FNCALL:
+    {
+        const char *name = ReadRequiredString(reader);
+        Rlist *args = ReadRlist(reader);
+        return (Rval) { FnCallNew(name, args), RVAL_TYPE_FNCALL };
+    }
+
+    case RVAL_TYPE_CONTAINER:
+    {
+        const char *data = ReadRequiredString(reader);
+        JsonElement *json = NULL;
+        if (JsonParse(&data, &json) != JSON_PARSE_OK)
+        {
+            reader->error = true;
+            return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+        }
+        return (Rval) { json, RVAL_TYPE_CONTAINER };
+    }
+
+    case RVAL_TYPE_NOPROMISEE:
+        return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+
+    default:
+        reader->error = true;
+        return (Rval) { NULL, RVAL_TYPE_NOPROMISEE };
+    }
+}
+
+static void ReadPromiseConstraints(ImageReader *reader, Promise *pp)
+{
+    const uint32_t length = ReadUInt32(reader);
+    for (uint32_t i = 0; (i < length) && !reader->error; i++)
+    {
+        const char *lval = ReadRequiredString(reader);
+        Rval rval = ReadRval(reader);
+        ReadString(reader);          /* always "any" for promise constraints */
+        const bool references_body = ReadUInt32(reader);
+
+        Constraint *cp = PromiseAppendConstraint(pp, lval, rval, references_body);
+        ReadOffset(reader, &cp->offset);
+    }
+}
+
+static void ReadBodyConstraints(ImageReader *reader, Body *body)
+{
+    const uint32_t length = ReadUInt32(reader);
+    for (uint32_t i = 0; (i < length) && !reader->error; i++)
+    {
+        const char *lval = ReadRequiredString(reader);
+        Rval rval = ReadRval(reader);
+        const char *classes = ReadRequiredString(reader);
+        const bool references_body = ReadUInt32(reader);
+
+        Constraint *cp = BodyAppendConstraint(body, lval, rval, classes, references_body);
+        ReadOffset(reader, &cp->offset);
+    }
+}
+
+static void ReadBundle(ImageReader *reader, Policy *policy)
+{
+    const char *type = ReadRequiredString(reader);
+    const char *name = ReadRequiredString(reader);
+    const char *ns = ReadRequiredString(reader);
+    const EvalOrder evaluation_order = ReadUInt32(reader);
+    Rlist *args = ReadRlist(reader);
+    const char *source_path = ReadString(reader);
+
+    Bundle *bp = PolicyAppendBundle(policy, ns, name, type, args, source_path,
+                                    evaluation_order);
+    RlistDestroy(args);
+    ReadOffset(reader, &bp->offset);
+
+    const uint32_t num_sections = ReadUInt32(reader);
+    if (reader->error || (num_sections > reader->size))
+    {
+        reader->error = true;
+        return;
+    }
+
+    BundleSection **sections = xcalloc(num_sections + 1, sizeof(BundleSection *));
+    for (uint32_t i = 0; (i < num_sections) && !reader->error; i++)
+    {
+        sections[i] = BundleAppendSection(bp, ReadRequiredString(reader));
+        ReadOffset(reader, &sections[i]->offset);
+    }
+
+    const uint32_t num_promises = ReadUInt32(reader);
+    for (uint32_t i = 0; (i < num_promises) && !reader->error; i++)
+    {
+        const uint32_t section_index = ReadUInt32(reader);
+        const char *promiser = ReadRequiredString(reader);
+        Rval promisee = ReadRval(reader);
+        const char *classes = ReadString(reader);
+        const char *comment = ReadString(reader);
+
+        if (reader->error || (section_index >= num_sections))
+        {
+            reader->error = true;
+            RvalDestroy(promisee);
+            break;
+        }
+
+        Promise *pp = BundleSectionAppendPromise(sections[section_index], promiser,
+                                                 promisee, classes, NULL);
+        pp->comment = SafeStringDuplicate(comment);
+        ReadOffset(reader, &pp->offset);
+        ReadPromiseConstraints(reader, pp);
+    }
+
+    free(sections);
+}
+
+static void ReadBody(ImageReader *reader, Policy *policy, bool promise_block)
+{
+    const char *type = ReadRequiredString(reader);
+    const char *name = ReadRequiredString(reader);
+    const char *ns = ReadRequiredString(reader);
+    Rlist *args = ReadRlist(reader);
+    const char *source_path = ReadString(reader);
+    const bool is_custom = ReadUInt32(reader);
+
+    Body *body;
+    if (promise_block)
+    {
+        body = PolicyAppendPromiseBlock(policy, ns, name, type, args, source_path);
+    }
+    else
+    {
+        body = PolicyAppendBody(policy, ns, name, type, args, source_path, is_custom);
+    }
+    RlistDestroy(args);
+
+    ReadOffset(reader, &body->offset);
+    ReadBodyConstraints(reader, body);
+}
+
+Policy *PolicyImageDeserialize(const char *data, size_t size, AgentType agent_type,
+                               const char *source_path, const char *digest)
+{
+    assert(data != NULL);
+
+    ImageReader reader = { data, size, 0, false };
+
+    const char *magic = ReadBytes(&reader, strlen(POLICY_IMAGE_MAGIC));
+    if ((magic == NULL) ||
+        (memcmp(magic, POLICY_IMAGE_MAGIC, strlen(POLICY_IMAGE_MAGIC)) != 0) ||
+        (ReadUInt32(&reader) != POLICY_IMAGE_FORMAT) ||
+        (ReadUInt32(&reader) != POLICY_IMAGE_BYTE_ORDER) ||
+        !StringSafeEqual(ReadString(&reader), VERSION) ||
+        (ReadUInt32(&reader) != (uint32_t) agent_type) ||
+        !StringSafeEqual(ReadString(&reader), source_path) ||
+        !StringSafeEqual(ReadString(&reader), digest) ||
+        reader.error)
+    {
+        Log(LOG_LEVEL_DEBUG, "Policy image for '%s' does not match the policy file",
+            source_path);
+        return NULL;
+    }
+
+    Policy *policy = PolicyNew();
+
+    const uint32_t num_bundles = ReadUInt32(&reader);
+    for (uint32_t i = 0; (i < num_bundles) && !reader.error; i++)
+    {
+        ReadBundle(&reader, policy);
+    }
+
+    const uint32_t num_bodies = ReadUInt32(&reader);
+    for (uint32_t i = 0; (i < num_bodies) && !reader.error; i++)
+    {
+        ReadBody(&reader, policy, false);
+    }
+
+    const uint32_t num_promise_blocks = ReadUInt32(&reader);
+    for (uint32_t i = 0; (i < num_promise_blocks) && !reader.error; i++)
+    {
+        ReadBody(&reader, policy, true);
+    }
+
+    if (reader.error || (reader.pos != reader.size))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Policy image for '%s' is corrupted", source_path);
+        PolicyDestroy(policy);
+        return NULL;
+    }
+
+    return policy;
+}
+
+/*******************************************************************/
+/* Storage                                                         */
+/*******************************************************************/
+
+static void GetPolicyImageDir(char *dirname, size_t max_size)
+{
+    xsnprintf(dirname, max_size, "%s%cpolicy_images", GetStateDir(), FILE_SEPARATOR);
+    MapName(dirname);
+}
+
+static void GetPolicyImagePath(char *filename, size_t max_size,
+                               AgentType agent_type, const char *digest)
+{
+    char dirname[PATH_MAX];
+    GetPolicyImageDir(dirname, sizeof(dirname));
+    xsnprintf(filename, max_size, "%s%c%s_%s.img", dirname, FILE_SEPARATOR,
+              CF_AGENTTYPES[agent_type], SkipHashType(digest));
+}
+
+Policy *PolicyImageLoad(AgentType agent_type, const char *source_path, const char *digest)
+{
+    char filename[PATH_MAX];
+    GetPolicyImagePath(filename, sizeof(filename), agent_type, digest);
+
+    int fd = safe_open(filename, O_RDONLY | O_BINARY);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    struct stat sb;
+    if ((fstat(fd, &sb) == -1) || (sb.st_size <= 0))
+    {
+        close(fd);
+        return NULL;
+    }
+    const time_t mtime = sb.st_mtime;
+
+    const size_t size = sb.st_size;
+    char *data = xmalloc(size);
+    const bool read_ok = (FullRead(fd, data, size) == (ssize_t) size);
+    close(fd);
+
+    Policy *policy = NULL;
+    if (read_ok)
+    {
+        policy = PolicyImageDeserialize(data, size, agent_type, source_path, digest);
+    }
+    free(data);
+
+    if (policy != NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Loaded policy file '%s' from its image '%s'",
+            source_path, filename);
+
+        /* Mark the image as in use, see PolicyImagePurgeOld() */
+        if ((time(NULL) - mtime) > POLICY_IMAGE_REFRESH_AGE &&
+            utime(filename, NULL) == -1)
+        {
+            Log(LOG_LEVEL_DEBUG, "Could not update the modification time of policy image '%s' (utime: %s)",
+                filename, GetErrorStr());
+        }
+    }
+    return policy;
+}
+
+void PolicyImagePurgeOld(void)
+{
+    char dirname[PATH_MAX];
+    GetPolicyImageDir(dirname, sizeof(dirname));
+
+    Dir *dir = DirOpen(dirname);
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    const time_t now = time(NULL);
+    for (const struct dirent *entry = DirRead(dir); entry != NULL; entry = DirRead(dir))
+    {
+        if (!StringEndsWith(entry->d_name, ".img"))
+        {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        xsnprintf(path, sizeof(path), "%s%c%s", dirname, FILE_SEPARATOR, entry->d_name);
+
+        struct stat sb;
+        if ((stat(path, &sb) != -1) && ((now - sb.st_mtime) > POLICY_IMAGE_MAX_AGE))
+        {
+            Log(LOG_LEVEL_DEBUG, "Removing old policy image '%s'", path);
+            unlink(path);
+        }
+    }
+
+    DirClose(dir);
+}
+
+bool PolicyImageStore(const Policy *policy, AgentType agent_type,
+                      const char *source_path, const char *digest)
+{
+    char filename[PATH_MAX];
+    GetPolicyImagePath(filename, sizeof(filename), agent_type, digest);
+
+    if (!MakeParentDirectory(filename, true, NULL))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not create the directory for policy image '%s'",
+            filename);
+        return false;
+    }
+
+    Buffer *image = PolicyImageSerialize(policy, agent_type, source_path, digest);
+
+    /* Write a temporary file and rename it so that other agents never read
+     * an incomplete image */
+    char tmp_filename[PATH_MAX];
+    xsnprintf(tmp_filename, sizeof(tmp_filename), "%s.%ju.tmp", filename,
+              (uintmax_t) getpid());
+
+    bool success = false;
+    int fd = safe_open_create_perms(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                                    CF_PERMS_DEFAULT);
+    if (fd != -1)
+    {
+        const size_t size = BufferSize(image);
+        success = (FullWrite(fd, BufferData(image), size) == (int) size);
+        success = (close(fd) == 0) && success;
+        success = success && (rename(tmp_filename, filename) == 0);
+        if (!success)
+        {
+            unlink(tmp_filename);
+        }
+    }
+
+    if (success)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Stored the image of policy file '%s' in '%s'",
+            source_path, filename);
+    }
+    else
+    {
+        Log(LOG_LEVEL_VERBOSE, "Failed to store the image of policy file '%s' in '%s' (%s)",
+            source_path, filename, GetErrorStr());
+    }
+
+    BufferDestroy(image);
+    return success;
+}
@@ -0,0 +1,78 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_POLICY_IMAGE_H
+#define CFENGINE_POLICY_IMAGE_H
+
+/*
+ * Binary images of parsed policy files, kept in the state directory so that
+ * the agents don't have to run the parser again over policy files which did
+ * not change. An image is keyed by the digest of the contents of the policy
+ * file and by the agent type (the parser skips bundles not relevant to the
+ * agent), and is only valid for the version of CFEngine that wrote it.
+ */
+
+#include <cf3.defs.h>
+#include <buffer.h>
+#include <policy.h>
+
+/**
+ * @brief Serializes #policy into a binary image
+ * @param source_path path of the policy file #policy was parsed from
+ * @param digest digest of the contents of the policy file
+ * @return a new buffer with the image
+ */
+Buffer *PolicyImageSerialize(const Policy *policy, AgentType agent_type,
+                             const char *source_path, const char *digest);
+
+/**
+ * @brief Reconstructs the policy from an image made by PolicyImageSerialize()
+ * @return the policy or NULL if the image is corrupted or was made for
+ *         another file, digest, agent type or version of CFEngine
+ */
+Policy *PolicyImageDeserialize(const char *data, size_t size, AgentType agent_type,
+                               const char *source_path, const char *digest);
+
+/**
+ * @brief Loads the image of the policy file #source_path with contents
+ *        matching #digest, if one was stored before
+ * @return the policy or NULL if there is no valid image
+ */
+Policy *PolicyImageLoad(AgentType agent_type, const char *source_path, const char *digest);
+
+/**
+ * @brief Stores the image of #policy, freshly parsed from #source_path
+ */
+bool PolicyImageStore(const Policy *policy, AgentType agent_type,
+                      const char *source_path, const char *digest);
+
+/**
+ * @brief Removes the images which were neither stored nor loaded for a week,
+ *        they most likely belong to policy files which changed since
+ * @note Meant to be called once per policy load, after the images in use
+ *       were loaded or stored.
+ */
+void PolicyImagePurgeOld(void);
+
+#endif
@@ -27,25 +27,41 @@
 #include <process_lib.h>
 #include <process_unix_priv.h>
 #include <files_lib.h>
+#include <file_lib.h>                                   /* FullRead() */
+#include <dir.h>                          /* DirOpen(), DirRead(), DirClose() */
+#include <string_lib.h>                                  /* StringToLong() */
+#include <map.h>                                            /* StringMap */
+#include <printsize.h>
 
 
 typedef struct
 {
-    time_t starttime;
+    time_t starttime;           /* seconds since boot */
     char state;
+    char comm[32];              /* task name, truncated */
+    pid_t ppid;
+    pid_t pgrp;
+    int tty_nr;
+    unsigned long long utime;   /* clock ticks */
+    unsigned long long stime;   /* clock ticks */
+    long nice;
+    long num_threads;
+    unsigned long long vsize;   /* bytes */
+    long long rss;              /* pages */
 } ProcessStat;
 
-static bool GetProcessStat(pid_t pid, ProcessStat *state)
+/* Returns -1 if the file cannot be opened, e.g. because the process is gone. */
+static int OpenProcFile(pid_t pid, const char *entry)
 {
     char filename[64];
-    xsnprintf(filename, sizeof(filename), "/proc/%jd/stat", (intmax_t) pid);
+    xsnprintf(filename, sizeof(filename), "/proc/%jd/%s", (intmax_t) pid, entry);
 
     int fd;
     for (;;)
     {
         if ((fd = open(filename, O_RDONLY)) != -1)
         {
-            break;
+            return fd;
         }
 
         if (errno == EINTR)
@@ -53,78 +69,122 @@ static bool GetProcessStat(pid_t pid, ProcessStat *state)
             continue;
         }
 
-        if (errno == ENOENT || errno == ENOTDIR)
+        if (errno == ENOENT || errno == ENOTDIR || errno == ESRCH)
         {
-            return false;
+            return -1;
         }
 
         if (errno == EACCES)
         {
-            return false;
+            return -1;
         }
 
-        assert (fd != -1 && "Unable to open /proc/<pid>/stat");
-    }
-
-    char stat[CF_BUFSIZE];
-    int res = FullRead(fd, stat, sizeof(stat) - 1); /* -1 for the '\0', below */
-    close(fd);
-
-    if (res < 0)
-    {
-        return false;
+        Log(LOG_LEVEL_VERBOSE, "Unable to open '%s' (open: %s)",
+            filename, GetErrorStr());
+        return -1;
     }
-    assert(res < CF_BUFSIZE);
-    stat[res] = '\0'; /* read() doesn't '\0'-terminate */
+}
 
+static bool ParseProcessStat(char *stat, int len, ProcessStat *state)
+{
     /* stat entry is of form: <pid> (<task name>) <various info...>
      * To avoid choking on weird task names, we search for the closing
      * parenthesis first: */
-    char *p = memrchr(stat, ')', res);
+    char *p = memrchr(stat, ')', len);
     if (p == NULL)
     {
         /* Wrong field format! */
         return false;
     }
 
+    const char *comm = memchr(stat, '(', p - stat);
+    if (comm != NULL)
+    {
+        comm++;
+        size_t comm_len = MIN((size_t) (p - comm), sizeof(state->comm) - 1);
+        memcpy(state->comm, comm, comm_len);
+        state->comm[comm_len] = '\0';
+    }
+    else
+    {
+        state->comm[0] = '\0';
+    }
+
     p++; // Skip the parenthesis
 
     char proc_state[2];
-    unsigned long long starttime;
+    long ppid, pgrp;
+    int tty_nr;
+    unsigned long long utime, stime, starttime, vsize;
+    long nice, num_threads;
+    long long rss;
 
     if (sscanf(p,
                "%1s" /* state */
-               "%*s" /* ppid */
-               "%*s" /* pgrp */
+               "%ld" /* ppid */
+               "%ld" /* pgrp */
                "%*s" /* session */
-               "%*s" /* tty_nr */
+               "%d" /* tty_nr */
                "%*s" /* tpgid */
                "%*s" /* flags */
                "%*s" /* minflt */
                "%*s" /* cminflt */
                "%*s" /* majflt */
                "%*s" /* cmajflt */
-               "%*s" /* utime */
-               "%*s" /* stime */
+               "%llu" /* utime */
+               "%llu" /* stime */
                "%*s" /* cutime */
                "%*s" /* cstime */
                "%*s" /* priority */
-               "%*s" /* nice */
-               "%*s" /* num_threads */
+               "%ld" /* nice */
+               "%ld" /* num_threads */
                "%*s" /* itrealvalue */
-               "%llu" /* starttime */,
-               proc_state,
-               &starttime) != 2)
+               "%llu" /* starttime */
+               "%llu" /* vsize */
+               "%lld" /* rss */,
+               proc_state, &ppid, &pgrp, &tty_nr, &utime, &stime,
+               &nice, &num_threads, &starttime, &vsize, &rss) != 11)
     {
         return false;
     }
 
     state->state = proc_state[0];
     state->starttime = (time_t)(starttime / sysconf(_SC_CLK_TCK));
+    state->ppid = (pid_t) ppid;
+    state->pgrp = (pid_t) pgrp;
+    state->tty_nr = tty_nr;
+    state->utime = utime;
+    state->stime = stime;
+    state->nice = nice;
+    state->num_threads = num_threads;
+    state->vsize = vsize;
+    state->rss = rss;
 
     return true;
 }
 
+static bool GetProcessStat(pid_t pid, ProcessStat *state)
+{
+    int fd = OpenProcFile(pid, "stat");
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    char stat[CF_BUFSIZE];
+    int res = FullRead(fd, stat, sizeof(stat) - 1); /* -1 for the '\0', below */
+    close(fd);
+
+    if (res < 0)
+    {
+        return false;
+    }
+    assert(res < CF_BUFSIZE);
+    stat[res] = '\0'; /* read() doesn't '\0'-terminate */
+
+    return ParseProcessStat(stat, res, state);
+}
+
 time_t GetProcessStartTime(pid_t pid)
 {
     ProcessStat st;
@@ -158,3 +218,294 @@ ProcessState GetProcessState(pid_t pid)
         return PROCESS_STATE_DOES_NOT_EXIST;
     }
 }
+
+/*************************************************************************/
+/* Native process table                                                  */
+/*************************************************************************/
+
+static time_t GetBootTime(void)
+{
+    FILE *fp = safe_fopen("/proc/stat", "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+
+    time_t boot_time = 0;
+    size_t line_size = CF_SMALLBUF;
+    char *line = xmalloc(line_size);
+
+    while (CfReadLine(&line, &line_size, fp) != -1)
+    {
+        unsigned long long btime;
+        if (sscanf(line, "btime %llu", &btime) == 1)
+        {
+            boot_time = (time_t) btime;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return boot_time;
+}
+
+static bool GetProcessEffectiveUid(pid_t pid, uid_t *uid)
+{
+    int fd = OpenProcFile(pid, "status");
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    char status[CF_BUFSIZE];
+    int res = FullRead(fd, status, sizeof(status) - 1);
+    close(fd);
+
+    if (res < 0)
+    {
+        return false;
+    }
+    status[res] = '\0';
+
+    /* Uid:	<real>	<effective>	<saved set>	<filesystem> */
+    const char *uid_line = strstr(status, "\nUid:");
+    uintmax_t euid;
+    if (uid_line == NULL || sscanf(uid_line, "\nUid: %*u %ju", &euid) != 1)
+    {
+        return false;
+    }
+
+    *uid = (uid_t) euid;
+    return true;
+}
+
+/* Returns the arguments joined by spaces, or NULL for kernel threads and
+ * zombies, which have an empty command line. */
+static char *GetProcessCmdline(pid_t pid)
+{
+    int fd = OpenProcFile(pid, "cmdline");
+    if (fd == -1)
+    {
+        return NULL;
+    }
+
+    size_t size = CF_BUFSIZE;
+    size_t len = 0;
+    char *cmdline = xmalloc(size);
+
+    for (;;)
+    {
+        int res = FullRead(fd, cmdline + len, size - len - 1);
+        if (res < 0)
+        {
+            close(fd);
+            free(cmdline);
+            return NULL;
+        }
+
+        len += res;
+        if (len < size - 1)
+        {
+            break;              /* EOF */
+        }
+
+        size *= 2;
+        cmdline = xrealloc(cmdline, size);
+    }
+    close(fd);
+
+    /* Arguments are '\0'-separated, normally with a trailing '\0'. */
+    while (len > 0 && cmdline[len - 1] == '\0')
+    {
+        len--;
+    }
+
+    if (len == 0)
+    {
+        free(cmdline);
+        return NULL;
+    }
+
+    /* Like ps(1), don't let control characters break the table into lines. */
+    for (size_t i = 0; i < len; i++)
+    {
+        if (cmdline[i] == '\0')
+        {
+            cmdline[i] = ' ';
+        }
+        else if (iscntrl((unsigned char) cmdline[i]))
+        {
+            cmdline[i] = '?';
+        }
+    }
+    cmdline[len] = '\0';
+
+    return cmdline;
+}
+
+/* Name the controlling terminal the way ps(1) does for the common cases. */
+static char *GetTtyName(int tty_nr)
+{
+    const unsigned int major = ((unsigned int) tty_nr >> 8) & 0xfff;
+    const unsigned int minor = ((unsigned int) tty_nr & 0xff) |
+                               (((unsigned int) tty_nr >> 12) & 0xfff00);
+    char *tty;
+
+    if (tty_nr == 0)
+    {
+        tty = xstrdup("?");
+    }
+    else if (major >= 136 && major <= 143)
+    {
+        xasprintf(&tty, "pts/%u", minor + (major - 136) * 256);
+    }
+    else if (major == 4 && minor < 64)
+    {
+        xasprintf(&tty, "tty%u", minor);
+    }
+    else if (major == 4)
+    {
+        xasprintf(&tty, "ttyS%u", minor - 64);
+    }
+    else
+    {
+        xasprintf(&tty, "%u,%u", major, minor);
+    }
+
+    return tty;
+}
+
+/* getpwuid_r() may go to the network (NSS), so only ask once per uid. */
+static char *GetCachedUserName(StringMap *user_names, uid_t uid)
+{
+    char key[PRINTSIZE(uintmax_t)];
+    xsnprintf(key, sizeof(key), "%ju", (uintmax_t) uid);
+
+    const char *name = StringMapGet(user_names, key);
+    if (name == NULL)
+    {
+        char buf[GETPW_R_SIZE_MAX];
+        struct passwd pwd;
+        struct passwd *result = NULL;
+
+        char *new_name;
+        if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &result) == 0 &&
+            result != NULL)
+        {
+            new_name = xstrdup(result->pw_name);
+        }
+        else
+        {
+            new_name = xstrdup(key);
+        }
+
+        StringMapInsert(user_names, xstrdup(key), new_name);
+        name = new_name;
+    }
+
+    return xstrdup(name);
+}
+
+void ProcessRecordDestroy(ProcessRecord *record)
+{
+    if (record != NULL)
+    {
+        free(record->user);
+        free(record->tty);
+        free(record->command);
+        free(record);
+    }
+}
+
+static ProcessRecord *LoadProcessRecord(pid_t pid, time_t boot_time,
+                                        long clk_tck, long page_kb,
+                                        StringMap *user_names)
+{
+    ProcessStat st;
+    uid_t uid;
+
+    /* The process may exit at any point, any failure here means it is
+     * simply not part of the table. */
+    if (!GetProcessStat(pid, &st) || !GetProcessEffectiveUid(pid, &uid))
+    {
+        return NULL;
+    }
+
+    char *command = GetProcessCmdline(pid);
+    if (command == NULL)
+    {
+        xasprintf(&command, "[%s]", st.comm);
+    }
+
+    ProcessRecord *record = xmalloc(sizeof(ProcessRecord));
+    record->pid = pid;
+    record->ppid = st.ppid;
+    record->pgid = st.pgrp;
+    record->uid = uid;
+    record->state = st.state;
+    record->nice = st.nice;
+    record->threads = st.num_threads;
+    record->vsize = (long) (st.vsize / 1024);
+    record->rsize = (long) (st.rss * page_kb);
+    record->start_time = boot_time + st.starttime;
+    record->cpu_time = (time_t) ((st.utime + st.stime) / clk_tck);
+    record->user = GetCachedUserName(user_names, uid);
+    record->tty = GetTtyName(st.tty_nr);
+    record->command = command;
+
+    return record;
+}
+
+Seq *LoadProcessRecordsFromProc(void)
+{
+    const time_t boot_time = GetBootTime();
+    if (boot_time == 0)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not read boot time from /proc/stat");
+        return NULL;
+    }
+
+    Dir *dir = DirOpen("/proc");
+    if (dir == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Could not open /proc (opendir: %s)",
+            GetErrorStr());
+        return NULL;
+    }
+
+    const long clk_tck = sysconf(_SC_CLK_TCK);
+    const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    StringMap *user_names = StringMapNew();
+    Seq *records = SeqNew(1024, ProcessRecordDestroy);
+
+    for (const struct dirent *entry = DirRead(dir); entry != NULL; entry = DirRead(dir))
+    {
+        long pid;
+        if (!isdigit((unsigned char) entry->d_name[0]) ||
+            StringToLong(entry->d_name, &pid) != 0)
+        {
+            continue;
+        }
+
+        ProcessRecord *record = LoadProcessRecord((pid_t) pid, boot_time,
+                                                  clk_tck, page_kb,
+                                                  user_names);
+        if (record != NULL)
+        {
+            SeqAppend(records, record);
+        }
+    }
+
+    DirClose(dir);
+    StringMapDestroy(user_names);
+
+    if (SeqLength(records) == 0)
+    {
+        /* At least we should be there, /proc is not what we expect. */
+        SeqDestroy(records);
+        return NULL;
+    }
+
+    return records;
+}
@@ -51,4 +51,41 @@ typedef enum
  */
 ProcessState GetProcessState(pid_t pid);
 
+#ifdef __linux__
+
+#include <sequence.h>
+
+/*
+ * One process table entry, read directly from /proc/<pid>/{stat,status,cmdline}
+ * instead of being parsed out of ps(1) output. Units match the corresponding
+ * ps(1) columns so that process_select bodies behave the same either way.
+ */
+typedef struct
+{
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgid;
+    uid_t uid;                  /* effective uid */
+    char state;                 /* R, S, D, T, Z, ... */
+    long nice;
+    long threads;
+    long vsize;                 /* KiB (VSZ) */
+    long rsize;                 /* KiB (RSS) */
+    time_t start_time;          /* Unix timestamp */
+    time_t cpu_time;            /* seconds of user + system time (TIME) */
+    char *user;                 /* login name, or the uid if it has none */
+    char *tty;                  /* e.g. "pts/3", or "?" if none */
+    char *command;              /* arguments joined by spaces, or "[comm]" */
+} ProcessRecord;
+
+/*
+ * Read the whole process table from /proc.
+ *
+ * @return Seq of ProcessRecord, or NULL if /proc cannot be used.
+ */
+Seq *LoadProcessRecordsFromProc(void);
+void ProcessRecordDestroy(ProcessRecord *record);
+
+#endif /* __linux__ */
+
 #endif
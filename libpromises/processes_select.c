@@ -32,7 +32,7 @@
 #include <matching.h>
 #include <systype.h>
 #include <string_lib.h>                                         /* Chop */
-#include <regex.h> /* CompileRegex,StringMatchWithPrecompiledRegex,StringMatchFull */
+#include <regex_cache.h> /* RegexCacheStringMatch,RegexCacheStringMatchFull */
 #include <item_lib.h>
 #include <file_lib.h>   // SetUmask(), RestoreUmask()
 #include <pipes.h>
@@ -48,6 +48,10 @@
 #define MAX_ZONENAME_SIZE 64
 # endif
 
+#ifdef __linux__
+#include <process_unix_priv.h>             /* LoadProcessRecordsFromProc() */
+#endif
+
 #ifdef _WIN32
 #define TABLE_STORAGE
 #else
@@ -55,6 +59,16 @@
 #endif
 TABLE_STORAGE Item *PROCESSTABLE = NULL;
 
+#ifdef __linux__
+/* Process table read natively from /proc. When loaded, PROCESSTABLE only
+ * holds the legend followed by one formatted line per record (in the same
+ * order), for reporting; selection is done on the records themselves. */
+static Seq *PROCESSRECORDS = NULL;
+
+static const char *const PROCESSRECORDS_LEGEND =
+    "USER                 PID    PPID    PGID       VSZ  NI       RSS TT       NLWP S STIME     ELAPSED        TIME COMMAND";
+#endif
+
 typedef enum
 {
     /*
@@ -134,6 +148,47 @@ static void ApplyPlatformExtraTable(char **names, char **columns);
 
 /***************************************************************************/
 
+static bool EvalProcessSelectAttributes(const ProcessSelect *a,
+                                        StringSet *process_select_attributes,
+                                        bool unmatched_attribute)
+{
+    bool result;
+
+    if (!a->process_result)
+    {
+        if (StringSetSize(process_select_attributes) == 0)
+        {
+            result = EvalProcessResult("", process_select_attributes);
+        }
+        else if (unmatched_attribute)
+        {
+            result = EvalProcessResult("", process_select_attributes);
+        }
+        else
+        {
+            Writer *w = StringWriter();
+            StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
+            char *attr = StringSetIteratorNext(&iter);
+            WriterWrite(w, attr);
+
+            while ((attr = StringSetIteratorNext(&iter)))
+            {
+                WriterWriteChar(w, '.');
+                WriterWrite(w, attr);
+            }
+
+            result = EvalProcessResult(StringWriterData(w), process_select_attributes);
+            WriterClose(w);
+        }
+    }
+    else
+    {
+        result = EvalProcessResult(a->process_result, process_select_attributes);
+    }
+
+    return result;
+}
+
 static bool SelectProcess(const char *procentry,
                           time_t pstime,
                           char **names,
@@ -311,48 +366,262 @@ static bool SelectProcess(const char *procentry,
         unmatched_attribute = true;
     }
 
-    if (!a->process_result)
+    result = EvalProcessSelectAttributes(a, process_select_attributes,
+                                         unmatched_attribute);
+
+cleanup:
+    StringSetDestroy(process_select_attributes);
+
+    for (int i = 0; column[i] != NULL; i++)
     {
-        if (StringSetSize(process_select_attributes) == 0)
+        free(column[i]);
+    }
+
+    return result;
+}
+
+#ifdef __linux__
+static bool SelectRecordRangeMatch(const char *name, long value, long min, long max)
+{
+    if ((min == CF_NOINT) || (max == CF_NOINT))
+    {
+        return false;
+    }
+
+    if ((min <= value) && (value <= max))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Selection filter matched absolute '%s' = '%jd' in [%jd,%jd]",
+            name, (intmax_t) value, (intmax_t) min, (intmax_t) max);
+        return true;
+    }
+
+    return false;
+}
+
+static bool SelectRecordTimeRangeMatch(const char *name, time_t value, time_t min, time_t max)
+{
+    if ((min == CF_NOINT) || (max == CF_NOINT))
+    {
+        return false;
+    }
+
+    if ((min <= value) && (value <= max))
+    {
+        Log(LOG_LEVEL_VERBOSE, "Selection filter matched time range '%s' = '%jd' in [%jd,%jd]",
+            name, (intmax_t) value, (intmax_t) min, (intmax_t) max);
+        return true;
+    }
+
+    return false;
+}
+
+static bool SelectRecordRegexMatch(const char *regex, bool anchored, const char *value)
+{
+    if (regex == NULL)
+    {
+        return false;
+    }
+
+    if (anchored)
+    {
+        return RegexCacheStringMatchFull(regex, value);
+    }
+    else
+    {
+        size_t s, e;
+        return RegexCacheStringMatch(regex, value, &s, &e);
+    }
+}
+
+/**
+ * Same selection as SelectProcess(), but on the fields of a ProcessRecord
+ * instead of on the columns of a ps(1) line.
+ */
+static bool SelectProcessRecord(const ProcessRecord *record,
+                                const char *process_regex,
+                                const ProcessSelect *a,
+                                bool attrselect)
+{
+    assert(record != NULL);
+    assert(process_regex != NULL);
+    assert(a != NULL);
+
+    if (!SelectRecordRegexMatch(process_regex, false, record->command))
+    {
+        return false;
+    }
+
+    if (!attrselect)
+    {
+        // If we are not considering attributes, then the matching is done.
+        return true;
+    }
+
+    StringSet *process_select_attributes = StringSetNew();
+    bool unmatched_attribute = false;
+
+    char uid_str[PRINTSIZE(uintmax_t)];
+    xsnprintf(uid_str, sizeof(uid_str), "%ju", (uintmax_t) record->uid);
+
+    for (const Rlist *rp = a->owner; rp != NULL; rp = rp->next)
+    {
+        if (rp->val.type == RVAL_TYPE_FNCALL)
         {
-            result = EvalProcessResult("", process_select_attributes);
+            Log(LOG_LEVEL_VERBOSE,
+                "Function call '%s' in process_select body was not resolved, skipping",
+                RlistFnCallValue(rp)->name);
         }
-        else if (unmatched_attribute)
+        else if (SelectRecordRegexMatch(RlistScalarValue(rp), true, record->user) ||
+                 SelectRecordRegexMatch(RlistScalarValue(rp), true, uid_str))
         {
-            result = EvalProcessResult("", process_select_attributes);
+            StringSetAdd(process_select_attributes, xstrdup("process_owner"));
+            break;
         }
-        else
-        {
-            Writer *w = StringWriter();
-            StringSetIterator iter = StringSetIteratorInit(process_select_attributes);
-            char *attr = StringSetIteratorNext(&iter);
-            WriterWrite(w, attr);
+    }
 
-            while ((attr = StringSetIteratorNext(&iter)))
-            {
-                WriterWriteChar(w, '.');
-                WriterWrite(w, attr);
-            }
+    if (a->owner && !StringSetContains(process_select_attributes, "process_owner"))
+    {
+        unmatched_attribute = true;
+    }
 
-            result = EvalProcessResult(StringWriterData(w), process_select_attributes);
-            WriterClose(w);
-        }
+    if (SelectRecordRangeMatch("PID", record->pid, a->min_pid, a->max_pid))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("pid"));
     }
-    else
+    else if (a->min_pid != CF_NOINT)
     {
-        result = EvalProcessResult(a->process_result, process_select_attributes);
+        unmatched_attribute = true;
     }
 
-cleanup:
+    if (SelectRecordRangeMatch("PPID", record->ppid, a->min_ppid, a->max_ppid))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("ppid"));
+    }
+    else if (a->min_ppid != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRangeMatch("PGID", record->pgid, a->min_pgid, a->max_pgid))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("pgid"));
+    }
+    else if (a->min_pgid != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRangeMatch("VSZ", record->vsize, a->min_vsize, a->max_vsize))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("vsize"));
+    }
+    else if (a->min_vsize != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRangeMatch("RSS", record->rsize, a->min_rsize, a->max_rsize))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("rsize"));
+    }
+    else if (a->min_rsize != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordTimeRangeMatch("TIME", record->cpu_time, a->min_ttime, a->max_ttime))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("ttime"));
+    }
+    else if (a->min_ttime != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordTimeRangeMatch("STIME", record->start_time, a->min_stime, a->max_stime))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("stime"));
+    }
+    else if (a->min_stime != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRangeMatch("NI", record->nice, a->min_pri, a->max_pri))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("priority"));
+    }
+    else if (a->min_pri != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRangeMatch("NLWP", record->threads, a->min_thread, a->max_thread))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("threads"));
+    }
+    else if (a->min_thread != CF_NOINT)
+    {
+        unmatched_attribute = true;
+    }
+
+    const char state[2] = { record->state, '\0' };
+    if (SelectRecordRegexMatch(a->status, true, state))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("status"));
+    }
+    else if (a->status)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRegexMatch(a->command, true, record->command))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("command"));
+    }
+    else if (a->command)
+    {
+        unmatched_attribute = true;
+    }
+
+    if (SelectRecordRegexMatch(a->tty, true, record->tty))
+    {
+        StringSetAdd(process_select_attributes, xstrdup("tty"));
+    }
+    else if (a->tty)
+    {
+        unmatched_attribute = true;
+    }
+
+    bool result = EvalProcessSelectAttributes(a, process_select_attributes,
+                                              unmatched_attribute);
     StringSetDestroy(process_select_attributes);
 
-    for (int i = 0; column[i] != NULL; i++)
+    return result;
+}
+
+static Item *SelectProcessRecords(const char *process_name, const ProcessSelect *a, bool attrselect)
+{
+    Item *result = NULL;
+
+    /* PROCESSTABLE has the legend, then one line per record in order. */
+    const Item *ip = PROCESSTABLE->next;
+    const size_t length = SeqLength(PROCESSRECORDS);
+    for (size_t i = 0; i < length; i++, ip = ip->next)
     {
-        free(column[i]);
+        assert(ip != NULL);
+        const ProcessRecord *record = SeqAt(PROCESSRECORDS, i);
+
+        if (SelectProcessRecord(record, process_name, a, attrselect))
+        {
+            PrependItem(&result, ip->name, "");
+            result->counter = (int) record->pid;
+        }
     }
 
     return result;
 }
+#endif /* __linux__ */
 
 Item *SelectProcesses(const char *process_name, const ProcessSelect *a, bool attrselect)
 {
@@ -365,6 +634,13 @@ Item *SelectProcesses(const char *process_name, const ProcessSelect *a, bool att
         return result;
     }
 
+#ifdef __linux__
+    if (PROCESSRECORDS != NULL)
+    {
+        return SelectProcessRecords(process_name, a, attrselect);
+    }
+#endif
+
     char *names[CF_PROCCOLS];
     int start[CF_PROCCOLS];
     int end[CF_PROCCOLS];
@@ -650,12 +926,12 @@ static bool SelectProcRegexMatch(const char *name1, const char *name2,
     {
         if (anchored)
         {
-            return StringMatchFull(regex, line[i]);
+            return RegexCacheStringMatchFull(regex, line[i]);
         }
         else
         {
             size_t s, e;
-            return StringMatch(regex, line[i], &s, &e);
+            return RegexCacheStringMatch(regex, line[i], &s, &e);
         }
     }
 
@@ -1089,6 +1365,23 @@ bool IsProcessNameRunning(char *procNameRegex)
         Log(LOG_LEVEL_ERR, "IsProcessNameRunning: PROCESSTABLE is empty");
         return false;
     }
+
+#ifdef __linux__
+    if (PROCESSRECORDS != NULL)
+    {
+        const size_t length = SeqLength(PROCESSRECORDS);
+        for (size_t i = 0; i < length; i++)
+        {
+            const ProcessRecord *record = SeqAt(PROCESSRECORDS, i);
+            if (RegexCacheStringMatchFull(procNameRegex, record->command))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+
     /* TODO: use actual time of ps-run, not time(NULL), which may be later. */
     time_t pstime = time(NULL);
 
@@ -1664,6 +1957,156 @@ static inline void ApplyPlatformExtraTable(ARG_UNUSED char **names, ARG_UNUSED c
 #endif
 
 #ifndef _WIN32
+/* Save the process table to the state directory, for use in policy. Takes
+ * ownership of the lists of root's and other users' processes. */
+static void SaveProcessTable(Item *rootprocs, Item *otherprocs)
+{
+    const char* const statedir = GetStateDir();
+    char filename[CF_BUFSIZE];
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_procs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(PROCESSTABLE, filename, NewLineMode_Unix);
+
+    if (otherprocs)
+    {
+        PrependItem(&rootprocs, otherprocs->name, NULL);
+    }
+
+    // TODO: Change safe_fopen() to default to 0600, then remove this.
+    const mode_t old_umask = SetUmask(0077);
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_rootprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(rootprocs, filename, NewLineMode_Unix);
+    DeleteItemList(rootprocs);
+
+    xsnprintf(filename, sizeof(filename), "%s%ccf_otherprocs", statedir, FILE_SEPARATOR);
+    RawSaveItemList(otherprocs, filename, NewLineMode_Unix);
+    DeleteItemList(otherprocs);
+
+    RestoreUmask(old_umask);
+}
+
+# ifdef __linux__
+/* Format a duration like ps(1) does for ELAPSED ([[dd-]hh:]mm:ss) and, with
+ * always_hours, for TIME ([dd-]hh:mm:ss). */
+static void FormatProcessDuration(char *buf, size_t size, time_t duration, bool always_hours)
+{
+    const intmax_t secs = (duration > 0) ? (intmax_t) duration : 0;
+    const intmax_t days = secs / 86400;
+    const intmax_t hours = (secs / 3600) % 24;
+    const intmax_t minutes = (secs / 60) % 60;
+    const intmax_t seconds = secs % 60;
+
+    if (days > 0)
+    {
+        snprintf(buf, size, "%jd-%02jd:%02jd:%02jd", days, hours, minutes, seconds);
+    }
+    else if (hours > 0 || always_hours)
+    {
+        snprintf(buf, size, "%02jd:%02jd:%02jd", hours, minutes, seconds);
+    }
+    else
+    {
+        snprintf(buf, size, "%02jd:%02jd", minutes, seconds);
+    }
+}
+
+/* Format the start time like ps(1) does for STIME. */
+static void FormatProcessStartTime(char *buf, size_t size, time_t start_time, time_t pstime)
+{
+    struct tm start_tm, now_tm;
+    localtime_r(&start_time, &start_tm);
+    localtime_r(&pstime, &now_tm);
+
+    const char *format;
+    if (pstime - start_time < 24 * 3600)
+    {
+        format = "%H:%M";
+    }
+    else if (start_tm.tm_year == now_tm.tm_year)
+    {
+        format = "%b%d";
+    }
+    else
+    {
+        format = "%Y";
+    }
+
+    if (strftime(buf, size, format, &start_tm) == 0)
+    {
+        buf[0] = '\0';
+    }
+}
+
+static char *FormatProcessRecord(const ProcessRecord *record, time_t pstime)
+{
+    char stime[16];
+    char elapsed[32];
+    char cpu_time[32];
+
+    FormatProcessStartTime(stime, sizeof(stime), record->start_time, pstime);
+    FormatProcessDuration(elapsed, sizeof(elapsed), pstime - record->start_time, false);
+    FormatProcessDuration(cpu_time, sizeof(cpu_time), record->cpu_time, true);
+
+    char *line;
+    xasprintf(&line, "%-15s %8jd %7jd %7jd %9ld %3ld %9ld %-8s %4ld %c %-5s %11s %11s %s",
+              record->user, (intmax_t) record->pid, (intmax_t) record->ppid,
+              (intmax_t) record->pgid, record->vsize, record->nice,
+              record->rsize, record->tty, record->threads, record->state,
+              stime, elapsed, cpu_time, record->command);
+    return line;
+}
+
+/**
+ * Load the process table natively from /proc instead of parsing ps(1).
+ *
+ * @return false if /proc cannot be used, so that the caller falls back to ps.
+ */
+static bool LoadProcessTableFromProc(void)
+{
+    /* On OpenVZ hosts vzps also lists the containers' processes, which we
+     * can't see in our /proc. */
+    if (VPSHARDCLASS != PLATFORM_CONTEXT_LINUX &&
+        VPSHARDCLASS != PLATFORM_CONTEXT_BUSYBOX)
+    {
+        return false;
+    }
+
+    Seq *records = LoadProcessRecordsFromProc();
+    if (records == NULL)
+    {
+        Log(LOG_LEVEL_VERBOSE, "Unable to read process table from /proc, falling back to ps");
+        return false;
+    }
+
+    Log(LOG_LEVEL_VERBOSE, "Observed process table in /proc (%zu processes)",
+        SeqLength(records));
+
+    const time_t pstime = time(NULL);
+    Item *rootprocs = NULL;
+    Item *otherprocs = NULL;
+
+    /* Build the lists backwards, appending is O(n). */
+    const size_t length = SeqLength(records);
+    for (size_t i = length; i > 0; i--)
+    {
+        const ProcessRecord *record = SeqAt(records, i - 1);
+        char *line = FormatProcessRecord(record, pstime);
+
+        PrependItem(&PROCESSTABLE, line, "");
+        PrependItem((record->uid == 0) ? &rootprocs : &otherprocs, line, NULL);
+        free(line);
+    }
+
+    PrependItem(&PROCESSTABLE, PROCESSRECORDS_LEGEND, "");
+    PrependItem(&otherprocs, PROCESSRECORDS_LEGEND, NULL);
+    PROCESSRECORDS = records;
+
+    SaveProcessTable(rootprocs, otherprocs);
+    return true;
+}
+# endif /* __linux__ */
+
 bool LoadProcessTable()
 {
     FILE *prp;
@@ -1678,6 +2121,13 @@ bool LoadProcessTable()
         return true;
     }
 
+# ifdef __linux__
+    if (LoadProcessTableFromProc())
+    {
+        return true;
+    }
+# endif
+
     LoadPlatformExtraTable();
 
     CheckPsLineLimitations();
@@ -1766,13 +2216,7 @@ bool LoadProcessTable()
     }
 
     cf_pclose(prp);
-
-/* Now save the data */
-    const char* const statedir = GetStateDir();
-
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_procs", statedir, FILE_SEPARATOR);
-
-    RawSaveItemList(PROCESSTABLE, vbuff, NewLineMode_Unix);
+    free(vbuff);
 
 # ifdef HAVE_GETZONEID
     if (global_zone) /* pidlist and rootpidlist are empty if we're not in the global zone */
@@ -1806,25 +2250,8 @@ bool LoadProcessTable()
         {
         }
     }
-    if (otherprocs)
-    {
-        PrependItem(&rootprocs, otherprocs->name, NULL);
-    }
-
-    // TODO: Change safe_fopen() to default to 0600, then remove this.
-    const mode_t old_umask = SetUmask(0077);
-
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_rootprocs", statedir, FILE_SEPARATOR);
-    RawSaveItemList(rootprocs, vbuff, NewLineMode_Unix);
-    DeleteItemList(rootprocs);
-
-    snprintf(vbuff, CF_MAXVARSIZE, "%s%ccf_otherprocs", statedir, FILE_SEPARATOR);
-    RawSaveItemList(otherprocs, vbuff, NewLineMode_Unix);
-    DeleteItemList(otherprocs);
 
-    RestoreUmask(old_umask);
-
-    free(vbuff);
+    SaveProcessTable(rootprocs, otherprocs);
     return true;
 }
 # endif
@@ -1833,6 +2260,11 @@ void ClearProcessTable(void)
 {
     ClearPlatformExtraTable();
 
+#ifdef __linux__
+    SeqDestroy(PROCESSRECORDS);
+    PROCESSRECORDS = NULL;
+#endif
+
     DeleteItemList(PROCESSTABLE);
     PROCESSTABLE = NULL;
 }
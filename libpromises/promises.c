@@ -279,6 +279,79 @@ static Rval GetExpandedBodyAsContainer(EvalContext *ctx,
  * 3. flatten '@' slists everywhere
  * 4. handle body inheritance
  */
+static bool RvalNeedsDeRefCopy(Rval rval)
+{
+    switch (rval.type)
+    {
+    case RVAL_TYPE_SCALAR:
+    {
+        const char *scalar = RvalScalarValue(rval);
+        return (strchr(scalar, '$') != NULL) || (strchr(scalar, '@') != NULL);
+    }
+    case RVAL_TYPE_LIST:
+        for (const Rlist *rp = RvalRlistValue(rval); rp != NULL; rp = rp->next)
+        {
+            if (RvalNeedsDeRefCopy(rp->val))
+            {
+                return true;
+            }
+        }
+        return false;
+    case RVAL_TYPE_NOPROMISEE:
+        return false;
+    default:
+        /* Function calls may be body references */
+        return true;
+    }
+}
+
+/**
+ * Tells whether DeRefCopyPromise() is needed before expanding the promise.
+ * It is not if the promise has no body references, default bodies, '@'
+ * lists or class guarded constraints, since the copy would be the same as
+ * the promise, and no variable references either, since the iteration
+ * engine mangles them in place.
+ */
+bool PromiseNeedsDeRefCopy(const Promise *pp)
+{
+    assert(pp != NULL);
+
+    if (RvalNeedsDeRefCopy((Rval) { pp->promiser, RVAL_TYPE_SCALAR }) ||
+        RvalNeedsDeRefCopy(pp->promisee))
+    {
+        return true;
+    }
+
+    for (size_t i = 0; i < SeqLength(pp->conlist); i++)
+    {
+        const Constraint *cp = SeqAt(pp->conlist, i);
+        if (cp->references_body ||
+            !StringEqual(cp->classes, "any") ||
+            RvalNeedsDeRefCopy(cp->rval))
+        {
+            return true;
+        }
+    }
+
+    /* Default bodies are named <promise_type>_<body_type>, see
+     * AddDefaultBodiesToPromise() */
+    const Policy *policy = PolicyFromPromise(pp);
+    const char *promise_type = PromiseGetPromiseType(pp);
+    const size_t promise_type_len = strlen(promise_type);
+    for (size_t i = 0; i < SeqLength(policy->bodies); i++)
+    {
+        const Body *bp = SeqAt(policy->bodies, i);
+        if (StringEqual(bp->ns, "bodydefault") &&
+            StringStartsWith(bp->name, promise_type) &&
+            (bp->name[promise_type_len] == '_'))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 Promise *DeRefCopyPromise(EvalContext *ctx, const Promise *pp)
 {
     Log(LOG_LEVEL_DEBUG,
@@ -32,6 +32,7 @@
 #include <sequence.h>
 
 
+bool PromiseNeedsDeRefCopy(const Promise *pp);
 Promise *DeRefCopyPromise(EvalContext *ctx, const Promise *pp);
 Promise *ExpandDeRefPromise(EvalContext *ctx, const Promise *pp, bool *excluded);
 void PromiseRef(LogLevel level, const Promise *pp);
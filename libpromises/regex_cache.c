@@ -0,0 +1,271 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#include <regex_cache.h>
+
+#include <map.h>
+#include <mutex.h>                                               /* ThreadLock */
+#include <string_lib.h>                                          /* StringHash */
+
+typedef struct RegexCacheEntry_ RegexCacheEntry;
+
+struct RegexCacheEntry_
+{
+    char *pattern;
+    Regex *regex;
+    unsigned int users;        /* callers holding #regex at the moment */
+    bool evicted;                 /* destroy once the last user is done */
+    RegexCacheEntry *prev;                  /* more recently used entry */
+    RegexCacheEntry *next;                  /* less recently used entry */
+};
+
+static pthread_mutex_t regex_cache_lock = PTHREAD_MUTEX_INITIALIZER; /* GLOBAL_T */
+
+static Map *BY_PATTERN = NULL;           /* pattern -> entry, GLOBAL_X */
+static Map *BY_REGEX = NULL;          /* Regex * -> entry, GLOBAL_X */
+static RegexCacheEntry *MOST_RECENT = NULL;  /* GLOBAL_X */
+static RegexCacheEntry *LEAST_RECENT = NULL; /* GLOBAL_X */
+static RegexCacheStats STATS = { 0 };    /* GLOBAL_X */
+
+static unsigned RegexPointerHash_untyped(const void *p, unsigned seed)
+{
+    const uintptr_t value = (uintptr_t) p;
+    return (unsigned) ((value >> 4) ^ (value >> 20)) ^ seed;
+}
+
+static bool RegexPointerEqual_untyped(const void *a, const void *b)
+{
+    return a == b;
+}
+
+static void RegexCacheEntryDestroy(RegexCacheEntry *entry)
+{
+    RegexDestroy(entry->regex);
+    free(entry->pattern);
+    free(entry);
+}
+
+/* The functions below must be called with regex_cache_lock held. */
+
+static void LRUUnlink(RegexCacheEntry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        MOST_RECENT = entry->next;
+    }
+
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        LEAST_RECENT = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void LRUPushFront(RegexCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = MOST_RECENT;
+    if (MOST_RECENT != NULL)
+    {
+        MOST_RECENT->prev = entry;
+    }
+    MOST_RECENT = entry;
+    if (LEAST_RECENT == NULL)
+    {
+        LEAST_RECENT = entry;
+    }
+}
+
+static void EvictLeastRecent(void)
+{
+    RegexCacheEntry *entry = LEAST_RECENT;
+    assert(entry != NULL);
+
+    LRUUnlink(entry);
+    MapRemove(BY_PATTERN, entry->pattern);
+    STATS.evictions++;
+
+    if (entry->users == 0)
+    {
+        MapRemove(BY_REGEX, entry->regex);
+        RegexCacheEntryDestroy(entry);
+    }
+    else
+    {
+        /* Still in use by another thread, RegexCacheRelease() destroys it. */
+        entry->evicted = true;
+    }
+}
+
+static Regex *Compile(const char *pattern)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Regex *regex = CompileRegex(pattern);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    STATS.compile_seconds += (double) (end.tv_sec - start.tv_sec) +
+                             (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    return regex;
+}
+
+Regex *RegexCacheGet(const char *pattern)
+{
+    assert(pattern != NULL);
+
+    ThreadLock(&regex_cache_lock);
+
+    if (BY_PATTERN == NULL)
+    {
+        BY_PATTERN = MapNew(StringHash_untyped, StringEqual_untyped, NULL, NULL);
+        BY_REGEX = MapNew(RegexPointerHash_untyped, RegexPointerEqual_untyped, NULL, NULL);
+    }
+
+    RegexCacheEntry *entry = MapGet(BY_PATTERN, pattern);
+    if (entry != NULL)
+    {
+        STATS.hits++;
+        LRUUnlink(entry);
+        LRUPushFront(entry);
+    }
+    else
+    {
+        STATS.misses++;
+
+        /* Invalid patterns are not cached, so that their errors keep being
+         * reported where they are used. */
+        Regex *regex = Compile(pattern);
+        if (regex != NULL)
+        {
+            if (MapSize(BY_PATTERN) >= REGEX_CACHE_SIZE)
+            {
+                EvictLeastRecent();
+            }
+
+            entry = xcalloc(1, sizeof(RegexCacheEntry));
+            entry->pattern = xstrdup(pattern);
+            entry->regex = regex;
+            MapInsert(BY_PATTERN, entry->pattern, entry);
+            MapInsert(BY_REGEX, entry->regex, entry);
+            LRUPushFront(entry);
+        }
+    }
+
+    Regex *regex = NULL;
+    if (entry != NULL)
+    {
+        entry->users++;
+        regex = entry->regex;
+    }
+
+    ThreadUnlock(&regex_cache_lock);
+
+    return regex;
+}
+
+void RegexCacheRelease(Regex *regex)
+{
+    if (regex == NULL)
+    {
+        return;
+    }
+
+    ThreadLock(&regex_cache_lock);
+
+    RegexCacheEntry *entry = MapGet(BY_REGEX, regex);
+    if (entry == NULL)
+    {
+        ThreadUnlock(&regex_cache_lock);
+        ProgrammingError("Releasing a regex which is not from the regex cache");
+    }
+
+    assert(entry->users > 0);
+    entry->users--;
+    if (entry->evicted && entry->users == 0)
+    {
+        MapRemove(BY_REGEX, entry->regex);
+        RegexCacheEntryDestroy(entry);
+    }
+
+    ThreadUnlock(&regex_cache_lock);
+}
+
+bool RegexCacheStringMatch(const char *pattern, const char *str, size_t *start, size_t *end)
+{
+    Regex *regex = RegexCacheGet(pattern);
+    if (regex == NULL)
+    {
+        return false;
+    }
+
+    bool ret = StringMatchWithPrecompiledRegex(regex, str, start, end);
+    RegexCacheRelease(regex);
+    return ret;
+}
+
+bool RegexCacheStringMatchFull(const char *pattern, const char *str)
+{
+    Regex *regex = RegexCacheGet(pattern);
+    if (regex == NULL)
+    {
+        return false;
+    }
+
+    bool ret = StringMatchFullWithPrecompiledRegex(regex, str);
+    RegexCacheRelease(regex);
+    return ret;
+}
+
+RegexCacheStats RegexCacheGetStats(void)
+{
+    ThreadLock(&regex_cache_lock);
+    RegexCacheStats stats = STATS;
+    ThreadUnlock(&regex_cache_lock);
+
+    return stats;
+}
+
+void RegexCacheLogStats(void)
+{
+    RegexCacheStats stats = RegexCacheGetStats();
+    if ((stats.hits + stats.misses) == 0)
+    {
+        return;
+    }
+
+    Log(LOG_LEVEL_VERBOSE,
+        "Regex cache: %zu hits, %zu misses, %zu evicted, %.3f seconds spent compiling",
+        stats.hits, stats.misses, stats.evictions, stats.compile_seconds);
+}
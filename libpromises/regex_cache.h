@@ -0,0 +1,70 @@
+/*
+  Copyright 2024 Northern.tech AS
+
+  This file is part of CFEngine 3 - written and maintained by Northern.tech AS.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; version 3.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA
+
+  To the extent this program is licensed as part of the Enterprise
+  versions of CFEngine, the applicable Commercial Open Source License
+  (COSL) may apply to this file if you as a licensee so wish it. See
+  included file COSL.txt.
+*/
+
+#ifndef CFENGINE_REGEX_CACHE_H
+#define CFENGINE_REGEX_CACHE_H
+
+/*
+ * Process-wide cache of compiled regular expressions. Most patterns in policy
+ * (file_select, edit_line selections, process_select, server ACLs, ...) are
+ * matched against many strings, so compile them only once. The cache holds
+ * at most REGEX_CACHE_SIZE patterns, dropping the least recently used ones,
+ * and can be used from multiple threads.
+ */
+
+#include <cf3.defs.h>
+#include <regex.h>                                                /* Regex */
+
+#define REGEX_CACHE_SIZE 1024
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    double compile_seconds;                /* total time spent compiling */
+} RegexCacheStats;
+
+/**
+ * @brief Gets the compiled #pattern, compiling it if it is not cached yet
+ * @return the compiled pattern, to be given back with RegexCacheRelease(),
+ *         or NULL if #pattern is not a valid regular expression
+ */
+Regex *RegexCacheGet(const char *pattern);
+
+/**
+ * @brief Gives back a regex from RegexCacheGet(), it must not be used after
+ */
+void RegexCacheRelease(Regex *regex);
+
+/**
+ * @brief Cached equivalents of StringMatch() and StringMatchFull()
+ */
+bool RegexCacheStringMatch(const char *pattern, const char *str, size_t *start, size_t *end);
+bool RegexCacheStringMatchFull(const char *pattern, const char *str);
+
+RegexCacheStats RegexCacheGetStats(void);
+void RegexCacheLogStats(void);
+
+#endif
@@ -31,7 +31,8 @@
 #include <scope.h>
 #include <fncall.h>
 #include <string_lib.h>                                       /* StringHash */
-#include <regex.h>          /* StringMatchWithPrecompiledRegex,CompileRegex */
+#include <regex.h>          /* StringMatchWithPrecompiledRegex */
+#include <regex_cache.h>    /* RegexCacheGet,RegexCacheStringMatchFull */
 #include <misc_lib.h>
 #include <assoc.h>
 #include <eval_context.h>
@@ -259,7 +260,7 @@ bool RlistMatchesRegex(const Rlist *list, const char *regex)
         return false;
     }
 
-    Regex *rx = CompileRegex(regex);
+    Regex *rx = RegexCacheGet(regex);
     if (!rx)
     {
         return false;
@@ -270,12 +271,12 @@ bool RlistMatchesRegex(const Rlist *list, const char *regex)
         if (rp->val.type == RVAL_TYPE_SCALAR &&
             StringMatchFullWithPrecompiledRegex(rx, RlistScalarValue(rp)))
         {
-            RegexDestroy(rx);
+            RegexCacheRelease(rx);
             return true;
         }
     }
 
-    RegexDestroy(rx);
+    RegexCacheRelease(rx);
     return false;
 }
 
@@ -298,7 +299,7 @@ bool RlistIsInListOfRegex(const Rlist *list, const char *str)
     for (const Rlist *rp = list; rp != NULL; rp = rp->next)
     {
         if (rp->val.type == RVAL_TYPE_SCALAR &&
-            StringMatchFull(RlistScalarValue(rp), str))
+            RegexCacheStringMatchFull(RlistScalarValue(rp), str))
         {
             return true;
         }
@@ -1205,7 +1206,7 @@ Rlist *RlistFromSplitRegex(const char *string, const char *regex, size_t max_ent
     Rlist *result = NULL;
     Buffer *buffer = BufferNewWithCapacity(CF_MAXVARSIZE);
 
-    Regex *rx = CompileRegex(regex);
+    Regex *rx = RegexCacheGet(regex);
     if (rx)
     {
         while ((entry_count < max_entries) &&
@@ -1228,7 +1229,7 @@ Rlist *RlistFromSplitRegex(const char *string, const char *regex, size_t max_ent
             sp += end;
         }
 
-        RegexDestroy(rx);
+        RegexCacheRelease(rx);
     }
 
     if (entry_count < max_entries)
@@ -1268,7 +1269,7 @@ Rlist *RlistFromRegexSplitNoOverflow(const char *string, const char *regex, int
 
     const char *sp = string;
     // We will avoid compiling regex multiple times.
-    Regex *pattern = CompileRegex(regex);
+    Regex *pattern = RegexCacheGet(regex);
 
     if (pattern == NULL)
     {
@@ -1299,7 +1300,7 @@ Rlist *RlistFromRegexSplitNoOverflow(const char *string, const char *regex, int
     assert(count < max);
     RlistAppendScalar(&liststart, sp);
 
-    RegexDestroy(pattern);
+    RegexCacheRelease(pattern);
 
     return liststart;
 }
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <time.h>
+#include <cf3.defs.h>
+#include <class.h>
+#include <map.h>
+#include <string_lib.h>
+
+/* Microbenchmark of class lookups, comparing ClassTableGet() with looking
+ * up the qualified "ns:name" string built for every lookup, which is what
+ * ClassTableGet() used to do. */
+
+#define NUM_CLASSES 10000
+#define NUM_LOOKUPS 10000000
+
+static double Elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main()
+{
+    ClassTable *table = ClassTableNew();
+    StringMap *strings = StringMapNew();
+    char **names = xmalloc(NUM_CLASSES * sizeof(char *));
+
+    for (int i = 0; i < NUM_CLASSES; i++)
+    {
+        xasprintf(&names[i], "class_%d_%x", i, i * 7919);
+        ClassTablePut(table, "benchmark", names[i], true,
+                      CONTEXT_SCOPE_NAMESPACE, NULL, NULL);
+        StringMapInsert(strings, StringConcatenate(3, "benchmark", ":", names[i]),
+                        xstrdup(names[i]));
+    }
+
+    struct timespec start, end;
+    size_t found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < NUM_LOOKUPS; i++)
+    {
+        const char *ns = "benchmark";
+        const char *name = names[i % NUM_CLASSES];
+        char fullname[ strlen(ns) + 1 + strlen(name) + 1 ];
+        xsnprintf(fullname, sizeof(fullname), "%s:%s", ns, name);
+        if (StringMapGet(strings, fullname) != NULL)
+        {
+            found++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double string_time = Elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < NUM_LOOKUPS; i++)
+    {
+        if (ClassTableGet(table, "benchmark", names[i % NUM_CLASSES]) != NULL)
+        {
+            found++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double table_time = Elapsed(&start, &end);
+
+    if (found != 2 * NUM_LOOKUPS)
+    {
+        fprintf(stderr, "Only %zu of %d lookups succeeded\n", found, 2 * NUM_LOOKUPS);
+        return 1;
+    }
+
+    printf("%d lookups in %d classes\n", NUM_LOOKUPS, NUM_CLASSES);
+    printf("qualified name string: %.1f ns/lookup\n", string_time * 1e9 / NUM_LOOKUPS);
+    printf("ClassTableGet():       %.1f ns/lookup\n", table_time * 1e9 / NUM_LOOKUPS);
+
+    for (int i = 0; i < NUM_CLASSES; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    StringMapDestroy(strings);
+    ClassTableDestroy(table);
+
+    return 0;
+}
@@ -106,6 +106,44 @@ static void test_put_replace(void)
     ClassTableDestroy(t);
 }
 
+static void test_remove(void)
+{
+    ClassTable *t = ClassTableNew();
+    assert_false(ClassTablePut(t, NULL, "test", false, CONTEXT_SCOPE_NAMESPACE, NULL, NULL));
+    assert_false(ClassTablePut(t, "ns", "test", true, CONTEXT_SCOPE_NAMESPACE, NULL, NULL));
+
+    assert_false(ClassTableRemove(t, "other", "test"));
+    assert_true(ClassTableRemove(t, "default", "test"));
+    assert_true(ClassTableGet(t, NULL, "test") == NULL);
+
+    Class *cls = ClassTableGet(t, "ns", "test");
+    assert_true(cls != NULL);
+    assert_string_equal("ns", cls->ns);
+
+    assert_true(ClassTableRemove(t, "ns", "test"));
+    assert_true(ClassTableGet(t, "ns", "test") == NULL);
+
+    ClassTableDestroy(t);
+}
+
+static void test_serial(void)
+{
+    ClassTable *t = ClassTableNew();
+    assert_int_equal(0, ClassTableSerial(t));
+
+    ClassTablePut(t, NULL, "test", true, CONTEXT_SCOPE_NAMESPACE, NULL, NULL);
+    const unsigned long serial = ClassTableSerial(t);
+    assert_int_equal(serial, ClassTableGet(t, NULL, "test")->serial);
+
+    /* Defined again after being removed */
+    ClassTableRemove(t, NULL, "test");
+    ClassTablePut(t, NULL, "test", true, CONTEXT_SCOPE_NAMESPACE, NULL, NULL);
+    assert_true(ClassTableGet(t, NULL, "test")->serial > serial);
+    assert_int_equal(ClassTableSerial(t), ClassTableGet(t, NULL, "test")->serial);
+
+    ClassTableDestroy(t);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -115,6 +153,8 @@ int main()
         unit_test(test_ns),
         unit_test(test_class_ref),
         unit_test(test_put_replace),
+        unit_test(test_remove),
+        unit_test(test_serial),
     };
 
     return run_tests(tests);
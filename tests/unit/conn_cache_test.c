@@ -0,0 +1,94 @@
+#include <test.h>
+
+#include <conn_cache.c>                                /* ConnCacheRetryDelay */
+#include <communication.h>                                  /* NewAgentConn */
+
+static const ConnectionFlags FLAGS = {
+    .protocol_version = CF_PROTOCOL_TLS,
+    .cache_connection = true,
+};
+
+static AgentConnection *NewConnectedAgentConn(const char *server, int *peer)
+{
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    *peer = sv[1];
+
+    AgentConnection *conn = NewAgentConn(server, "5308", FLAGS);
+    conn->conn_info->sd = sv[0];
+    return conn;
+}
+
+static void test_find_idle(void)
+{
+    ConnCache_Init();
+
+    int peer1, peer2;
+    AgentConnection *conn1 = NewConnectedAgentConn("server1", &peer1);
+    AgentConnection *conn2 = NewConnectedAgentConn("server2", &peer2);
+    ConnCache_Add(conn1, CONNCACHE_STATUS_BUSY);
+    ConnCache_Add(conn2, CONNCACHE_STATUS_BUSY);
+
+    /* Busy connections are not handed out */
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == NULL);
+
+    ConnCache_MarkNotBusy(conn1);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == conn1);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", FLAGS) == NULL);
+    ConnCache_MarkNotBusy(conn1);
+
+    /* Port and flags are part of the identity of a connection */
+    ConnectionFlags other_flags = FLAGS;
+    other_flags.force_ipv4 = true;
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5309", FLAGS) == NULL);
+    assert_true(ConnCache_FindIdleMarkBusy("server1", "5308", other_flags) == NULL);
+
+    ConnCache_MarkNotBusy(conn2);
+    assert_true(ConnCache_FindIdleMarkBusy("server2", "5308", FLAGS) == conn2);
+
+    ConnCache_Destroy();
+    close(peer1);
+    close(peer2);
+}
+
+static void test_offline(void)
+{
+    ConnCache_Init();
+
+    assert_false(ConnCache_IsOffline("server1", "5308", FLAGS));
+    ConnCache_MarkOffline("server1", "5308", FLAGS);
+    assert_true(ConnCache_IsOffline("server1", "5308", FLAGS));
+    assert_false(ConnCache_IsOffline("server2", "5308", FLAGS));
+    assert_false(ConnCache_IsOffline("server1", "5309", FLAGS));
+
+    /* A working connection makes the server online again */
+    int peer;
+    AgentConnection *conn = NewConnectedAgentConn("server1", &peer);
+    ConnCache_Add(conn, CONNCACHE_STATUS_BUSY);
+    assert_false(ConnCache_IsOffline("server1", "5308", FLAGS));
+
+    ConnCache_Destroy();
+    close(peer);
+}
+
+static void test_retry_delay(void)
+{
+    assert_int_equal(ConnCacheRetryDelay(1), CONNCACHE_OFFLINE_RETRY_SECONDS);
+    assert_int_equal(ConnCacheRetryDelay(2), 2 * CONNCACHE_OFFLINE_RETRY_SECONDS);
+    assert_int_equal(ConnCacheRetryDelay(3), 4 * CONNCACHE_OFFLINE_RETRY_SECONDS);
+    assert_int_equal(ConnCacheRetryDelay(20), CONNCACHE_OFFLINE_RETRY_MAX_SECONDS);
+    assert_int_equal(ConnCacheRetryDelay(UINT_MAX), CONNCACHE_OFFLINE_RETRY_MAX_SECONDS);
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_find_idle),
+        unit_test(test_offline),
+        unit_test(test_retry_delay),
+    };
+
+    return run_tests(tests);
+}
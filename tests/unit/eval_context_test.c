@@ -197,6 +197,156 @@ static void test_persistent_class_timer_policy(void)
     EvalContextDestroy(ctx);
 }
 
+static void test_class_expression_cache(void)
+{
+    EvalContext *ctx = EvalContextNew();
+
+    assert_int_equal(CheckClassExpression(ctx, "any"), EXPRESSION_VALUE_TRUE);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_FALSE);
+
+    /* Cached values must not survive changes of the classes */
+    EvalContextClassPutSoft(ctx, "cached_a", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_TRUE);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_TRUE);
+
+    EvalContextClassPutSoft(ctx, "cached_b", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_FALSE);
+
+    EvalContextClassRemove(ctx, NULL, "cached_b");
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_TRUE);
+
+    /* Unqualified names are resolved in the namespace of the current bundle */
+    {
+        Policy *p = PolicyNew();
+        Bundle *bp = PolicyAppendBundle(p, "ns1", "bundle1", "agent", NULL, NULL, EVAL_ORDER_UNDEFINED);
+
+        EvalContextStackPushBundleFrame(ctx, bp, NULL, false, NULL);
+        assert_int_equal(CheckClassExpression(ctx, "cached_a"), EXPRESSION_VALUE_FALSE);
+        assert_int_equal(CheckClassExpression(ctx, "default:cached_a"), EXPRESSION_VALUE_TRUE);
+        EvalContextStackPopFrame(ctx);
+
+        assert_int_equal(CheckClassExpression(ctx, "cached_a"), EXPRESSION_VALUE_TRUE);
+        PolicyDestroy(p);
+    }
+
+    /* Errors are reported every time */
+    assert_int_equal(CheckClassExpression(ctx, "cached_a cached_b"), EXPRESSION_VALUE_ERROR);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a cached_b"), EXPRESSION_VALUE_ERROR);
+
+    /* Many distinct expressions, as expanded from a big list, keep working
+     * when the compiled ones are dropped */
+    char expression[64];
+    for (int i = 0; i < 10000; i++)
+    {
+        xsnprintf(expression, sizeof(expression), "cached_a.item_%d_ok", i);
+        assert_int_equal(CheckClassExpression(ctx, expression), EXPRESSION_VALUE_FALSE);
+    }
+    EvalContextClassPutSoft(ctx, "item_42_ok", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.item_42_ok"), EXPRESSION_VALUE_TRUE);
+    assert_int_equal(CheckClassExpression(ctx, "cached_a.!cached_b"), EXPRESSION_VALUE_TRUE);
+
+    EvalContextDestroy(ctx);
+}
+
+static void *CheckClassExpressionsThread(void *arg)
+{
+    const EvalContext *ctx = arg;
+    char expression[64];
+    for (int i = 0; i < 100; i++)
+    {
+        xsnprintf(expression, sizeof(expression), "thread_a.!thread_%d", i);
+        if (CheckClassExpression(ctx, expression) != EXPRESSION_VALUE_TRUE)
+        {
+            return NULL;
+        }
+    }
+    return (void *) ctx;
+}
+
+static void test_class_expression_other_thread(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    EvalContextClassPutSoft(ctx, "thread_a", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_int_equal(CheckClassExpression(ctx, "thread_a.!thread_1"), EXPRESSION_VALUE_TRUE);
+
+    /* Other threads evaluate without the cache of the creating thread */
+    pthread_t thread;
+    void *result = NULL;
+    assert_int_equal(pthread_create(&thread, NULL, CheckClassExpressionsThread, ctx), 0);
+    assert_int_equal(pthread_join(thread, &result), 0);
+    assert_true(result == ctx);
+
+    EvalContextClassPutSoft(ctx, "thread_1", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_int_equal(CheckClassExpression(ctx, "thread_a.!thread_1"), EXPRESSION_VALUE_FALSE);
+
+    EvalContextDestroy(ctx);
+}
+
+static void test_promise_unchanged(void)
+{
+    EvalContext *ctx = EvalContextNew();
+
+    Policy *p = PolicyNew();
+    Bundle *bp = PolicyAppendBundle(p, "default", "bundle1", "agent", NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bp, "vars");
+    Promise *pp = BundleSectionAppendPromise(section, "copy", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    PromiseAppendConstraint(pp, "string", (Rval) { xstrdup("$(value)"), RVAL_TYPE_SCALAR }, false);
+    Promise *fn_pp = BundleSectionAppendPromise(section, "now", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    PromiseAppendConstraint(fn_pp, "int", (Rval) { FnCallNew("now", NULL), RVAL_TYPE_FNCALL }, false);
+
+    VarRef *ref = VarRefParse("default:bundle1.value");
+    PromiseResult result;
+
+    EvalContextStackPushBundleFrame(ctx, bp, NULL, false, NULL);
+    EvalContextClassPutSoft(ctx, "unchanged_a", CONTEXT_SCOPE_NAMESPACE, NULL);
+
+    unsigned long generation = EvalContextGetStateGeneration(ctx);
+    EvalContextVariablePut(ctx, ref, "a", CF_DATA_TYPE_STRING, NULL);
+    assert_true(EvalContextGetStateGeneration(ctx) != generation);
+
+    /* Evaluations which changed something must be repeated */
+    EvalContextPromiseEvaluated(ctx, pp, generation, PROMISE_RESULT_NOOP);
+    assert_false(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+
+    generation = EvalContextGetStateGeneration(ctx);
+    EvalContextPromiseEvaluated(ctx, pp, generation, PROMISE_RESULT_NOOP);
+    assert_true(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+    assert_int_equal(result, PROMISE_RESULT_NOOP);
+
+    /* Setting the same value again changes nothing */
+    EvalContextVariablePut(ctx, ref, "a", CF_DATA_TYPE_STRING, NULL);
+    EvalContextClassPutSoft(ctx, "unchanged_a", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_true(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+
+    EvalContextVariablePut(ctx, ref, "b", CF_DATA_TYPE_STRING, NULL);
+    assert_false(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+
+    generation = EvalContextGetStateGeneration(ctx);
+    EvalContextPromiseEvaluated(ctx, pp, generation, PROMISE_RESULT_NOOP);
+    EvalContextClassPutSoft(ctx, "unchanged_b", CONTEXT_SCOPE_NAMESPACE, NULL);
+    assert_false(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+
+    /* Function calls may return something else every time */
+    generation = EvalContextGetStateGeneration(ctx);
+    EvalContextPromiseEvaluated(ctx, fn_pp, generation, PROMISE_RESULT_NOOP);
+    assert_false(EvalContextPromiseIsUnchanged(ctx, fn_pp, &result));
+
+    EvalContextStackPopFrame(ctx);
+
+    /* Nor does another invocation of the bundle see the same state */
+    generation = EvalContextGetStateGeneration(ctx);
+    EvalContextStackPushBundleFrame(ctx, bp, NULL, false, NULL);
+    EvalContextPromiseEvaluated(ctx, pp, generation, PROMISE_RESULT_NOOP);
+    EvalContextStackPopFrame(ctx);
+    EvalContextStackPushBundleFrame(ctx, bp, NULL, false, NULL);
+    assert_false(EvalContextPromiseIsUnchanged(ctx, pp, &result));
+    EvalContextStackPopFrame(ctx);
+
+    VarRefDestroy(ref);
+    PolicyDestroy(p);
+    EvalContextDestroy(ctx);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -208,6 +358,9 @@ int main()
         unit_test(test_persistent_class_timer_policy),
         unit_test(test_changes_chroot),
         unit_test(test_eval_with_token_from_list),
+        unit_test(test_class_expression_cache),
+        unit_test(test_class_expression_other_thread),
+        unit_test(test_promise_unchanged),
     };
 
     int ret = run_tests(tests);
@@ -5,6 +5,7 @@
 #include <scope.h>
 #include <eval_context.h>
 #include <vars.h>
+#include <promises.h>
 
 static void test_extract_scalar_prefix()
 {
@@ -280,6 +281,38 @@ static void test_expand_scalar_two_scalars_concat(void **state)
     BufferDestroy(res);
 }
 
+static void *ExpandScalarThread(void *ctx)
+{
+    return ExpandScalar(ctx, "default", "bundle", "a $(one) b $(two)c", NULL);
+}
+
+static void test_expand_scalar_other_thread(void **state)
+{
+    EvalContext *ctx = *state;
+    {
+        VarRef *lval = VarRefParse("default:bundle.one");
+        EvalContextVariablePut(ctx, lval, "first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    {
+        VarRef *lval = VarRefParse("default:bundle.two");
+        EvalContextVariablePut(ctx, lval, "second", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+
+    /* Cache the template in this thread first */
+    char *res = ExpandScalar(ctx, "default", "bundle", "a $(one) b $(two)c", NULL);
+    assert_string_equal("a first b secondc", res);
+    free(res);
+
+    /* Expanded without the cache in another thread */
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, ExpandScalarThread, ctx), 0);
+    assert_int_equal(pthread_join(thread, (void **) &res), 0);
+    assert_string_equal("a first b secondc", res);
+    free(res);
+}
+
 static void test_expand_scalar_two_scalars_nested(void **state)
 {
     EvalContext *ctx = *state;
@@ -370,6 +403,43 @@ static void test_expand_scalar_nested_inner_undefined(void **state)
     BufferDestroy(res);
 }
 
+static void test_expand_scalar_repeated(void **state)
+{
+    EvalContext *ctx = *state;
+    {
+        VarRef *lval = VarRefParse("default:bundle.foo[one]");
+        EvalContextVariablePut(ctx, lval, "first", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    {
+        VarRef *lval = VarRefParse("default:other.foo[one]");
+        EvalContextVariablePut(ctx, lval, "other", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+
+    /* The string is compiled once, the values are looked up every time and
+     * the references follow the scope they are expanded in */
+    const char *string = "a$(foo[one])b${foo[$(bar)]}c";
+    Buffer *res = BufferNew();
+    ExpandScalar(ctx, "default", "bundle", string, res);
+    assert_string_equal("afirstb${foo[$(bar)]}c", BufferData(res));
+
+    {
+        VarRef *lval = VarRefParse("default:bundle.bar");
+        EvalContextVariablePut(ctx, lval, "one", CF_DATA_TYPE_STRING, NULL);
+        VarRefDestroy(lval);
+    }
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "bundle", string, res);
+    assert_string_equal("afirstbfirstc", BufferData(res));
+
+    BufferClear(res);
+    ExpandScalar(ctx, "default", "other", string, res);
+    assert_string_equal("aotherb${foo[$(bar)]}c", BufferData(res));
+
+    BufferDestroy(res);
+}
+
 static void test_expand_list_nested(void **state)
 {
     EvalContext *ctx = *state;
@@ -559,6 +629,70 @@ static void test_expand_promise_array_with_slist_arg(void **state)
     PolicyDestroy(policy);
 }
 
+static PromiseResult actuator_expand_promise_literal(
+    ARG_UNUSED EvalContext *ctx, const Promise *pp, ARG_UNUSED void *param)
+{
+    assert_string_equal("literal", pp->promiser);
+    assert_string_equal("value", PromiseGetConstraintAsRval(pp, "string", RVAL_TYPE_SCALAR));
+    actuator_state++;
+    return PROMISE_RESULT_NOOP;
+}
+
+static void test_expand_promise_literal(void **state)
+{
+    actuator_state = 0;
+
+    EvalContext *ctx = *state;
+    Policy *policy = PolicyNew();
+    Bundle *bundle = PolicyAppendBundle(policy, NamespaceDefault(), "bundle", "agent", NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bundle, "vars");
+    Promise *promise = BundleSectionAppendPromise(section, "literal", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    PromiseAppendConstraint(promise, "string", (Rval) { xstrdup("value"), RVAL_TYPE_SCALAR }, false);
+
+    /* Nothing to expand, the promise is used without a copy */
+    assert_false(PromiseNeedsDeRefCopy(promise));
+
+    EvalContextStackPushBundleFrame(ctx, bundle, NULL, false, NULL);
+    EvalContextStackPushBundleSectionFrame(ctx, section);
+    ExpandPromise(ctx, promise, actuator_expand_promise_literal, NULL);
+    EvalContextStackPopFrame(ctx);
+    EvalContextStackPopFrame(ctx);
+
+    assert_int_equal(1, actuator_state);
+    assert_string_equal("literal", promise->promiser);
+
+    PolicyDestroy(policy);
+}
+
+static void test_promise_needs_deref_copy(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bundle = PolicyAppendBundle(policy, NamespaceDefault(), "bundle", "agent", NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bundle, "files");
+
+    Promise *literal = BundleSectionAppendPromise(section, "/tmp/file", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    PromiseAppendConstraint(literal, "create", (Rval) { xstrdup("true"), RVAL_TYPE_SCALAR }, false);
+    assert_false(PromiseNeedsDeRefCopy(literal));
+
+    Promise *variable = BundleSectionAppendPromise(section, "/tmp/$(name)", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    assert_true(PromiseNeedsDeRefCopy(variable));
+
+    Promise *body = BundleSectionAppendPromise(section, "/tmp/body", (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+    PromiseAppendConstraint(body, "perms", (Rval) { xstrdup("mog"), RVAL_TYPE_SCALAR }, true);
+    assert_true(PromiseNeedsDeRefCopy(body));
+
+    Rlist *list = NULL;
+    RlistAppendScalar(&list, "@(names)");
+    Promise *at_list = BundleSectionAppendPromise(section, "/tmp/list", (Rval) { list, RVAL_TYPE_LIST }, "any", NULL);
+    assert_true(PromiseNeedsDeRefCopy(at_list));
+
+    /* Default bodies are added by the copy */
+    PolicyAppendBody(policy, "bodydefault", "files_perms", "perms", NULL, NULL, false);
+    assert_true(PromiseNeedsDeRefCopy(literal));
+
+    PolicyDestroy(policy);
+}
+
 static void test_setup(void **state)
 {
     *state = EvalContextNew();
@@ -578,6 +712,7 @@ int main()
         unit_test(test_extract_scalar_prefix),
         unit_test(test_extract_reference),
         unit_test(test_isnakedvar),
+        unit_test(test_promise_needs_deref_copy),
 #if 0
         unit_test_setup_teardown(test_map_iterators_from_rval_empty, test_setup, test_teardown),
         unit_test_setup_teardown(test_map_iterators_from_rval_literal, test_setup, test_teardown),
@@ -585,15 +720,18 @@ int main()
         unit_test_setup_teardown(test_map_iterators_from_rval_naked_list_var_namespace, test_setup, test_teardown),
 #endif
         unit_test_setup_teardown(test_expand_scalar_two_scalars_concat, test_setup, test_teardown),
+        unit_test_setup_teardown(test_expand_scalar_other_thread, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_two_scalars_nested, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_array_concat, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_undefined, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_scalar_nested_inner_undefined, test_setup, test_teardown),
+        unit_test_setup_teardown(test_expand_scalar_repeated, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_list_nested, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_array_with_scalar_arg, test_setup, test_teardown),
         unit_test_setup_teardown(test_expand_promise_slist, test_setup, test_teardown),
-        unit_test_setup_teardown(test_expand_promise_array_with_slist_arg, test_setup, test_teardown)
+        unit_test_setup_teardown(test_expand_promise_array_with_slist_arg, test_setup, test_teardown),
+        unit_test_setup_teardown(test_expand_promise_literal, test_setup, test_teardown)
     };
 
     return run_tests(tests);
@@ -0,0 +1,100 @@
+#include <test.h>
+
+#include <files_changes.c>                         /* ChecksumValue, OpenChangesDB */
+
+static char TEST_FILE[PATH_MAX];
+
+static void test_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/files_changes_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert_true(mkdtemp(workdir) != NULL);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+
+    xsnprintf(TEST_FILE, sizeof(TEST_FILE), "%s/file", workdir);
+    FILE *f = fopen(TEST_FILE, "w");
+    assert_true(f != NULL);
+    fputs("content\n", f);
+    fclose(f);
+}
+
+/* Stores a digest that does not match the content of TEST_FILE, along with
+ * its current stat() information, as if it changed without stat() telling */
+static void StoreStaleHash(HashMethod type)
+{
+    struct stat sb;
+    assert_int_equal(stat(TEST_FILE, &sb), 0);
+
+    ChecksumValue value = {
+        .have_stat = 1,
+        .dev = sb.st_dev,
+        .ino = sb.st_ino,
+        .size = sb.st_size,
+        .mtime_ns = STAT_MTIME_NS(&sb),
+        .ctime_ns = STAT_CTIME_NS(&sb),
+    };
+    memset(value.mess_digest, 0xaa, HashSizeFromId(type));
+
+    CF_DB *db;
+    assert_true(OpenChangesDB(&db));
+    int key_size;
+    char *key = NewIndexKey(type, TEST_FILE, &key_size);
+    assert_true(WriteComplexKeyDB(db, key, key_size, &value, sizeof(value)));
+    DeleteIndexKey(key);
+    CloseDB(db);
+}
+
+static void test_paranoid_hashing(void)
+{
+    EvalContext *ctx = EvalContextNew();
+    Policy *policy = PolicyNew();
+    Bundle *bundle = PolicyAppendBundle(policy, NamespaceDefault(), "bundle", "agent", NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bundle, "files");
+    Promise *pp = BundleSectionAppendPromise(section, TEST_FILE, (Rval) { NULL, RVAL_TYPE_NOPROMISEE }, "any", NULL);
+
+    Attributes attr = { 0 };
+    attr.change.update = true;
+    PromiseResult result = PROMISE_RESULT_NOOP;
+
+    /* The recorded stat() information is trusted */
+    StoreStaleHash(HASH_METHOD_SHA256);
+    assert_false(FileChangesCheckAndUpdateHash(ctx, TEST_FILE, HASH_METHOD_SHA256, &attr, pp, &result));
+    assert_int_equal(result, PROMISE_RESULT_NOOP);
+
+    /* Unless the file is always hashed */
+    attr.change.paranoid_hashing = true;
+    assert_true(FileChangesCheckAndUpdateHash(ctx, TEST_FILE, HASH_METHOD_SHA256, &attr, pp, &result));
+    assert_int_equal(result, PROMISE_RESULT_CHANGE);
+
+    /* And the actual digest was recorded */
+    result = PROMISE_RESULT_NOOP;
+    assert_false(FileChangesCheckAndUpdateHash(ctx, TEST_FILE, HASH_METHOD_SHA256, &attr, pp, &result));
+    assert_int_equal(result, PROMISE_RESULT_NOOP);
+
+    PolicyDestroy(policy);
+    EvalContextDestroy(ctx);
+}
+
+static void test_teardown(void)
+{
+    DeleteDirectoryTree(GetWorkDir());
+    rmdir(GetWorkDir());
+}
+
+int main()
+{
+    const UnitTest tests[] =
+        {
+            unit_test(test_setup),
+            unit_test(test_paranoid_hashing),
+            unit_test(test_teardown),
+        };
+
+    PRINT_TEST_BANNER();
+    int ret = run_tests(tests);
+
+    return ret;
+}
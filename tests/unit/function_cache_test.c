@@ -0,0 +1,195 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <dbm_api.h>
+#include <fncall.h>
+#include <rlist.h>
+#include <function_cache.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <known_dirs.h>
+
+
+static char WORKDIR[CF_BUFSIZE];
+static char TEST_FILE[CF_BUFSIZE];
+
+static void tests_setup(void)
+{
+    static char env[] = /* Needs to be static for putenv() */
+        "CFENGINE_TEST_OVERRIDE_WORKDIR=/tmp/function_cache_test.XXXXXX";
+
+    char *workdir = strchr(env, '=') + 1; /* start of the path */
+    assert(workdir - 1 && workdir[0] == '/');
+
+    mkdtemp(workdir);
+    strlcpy(WORKDIR, workdir, CF_BUFSIZE);
+    putenv(env);
+    mkdir(GetStateDir(), (S_IRWXU | S_IRWXG | S_IRWXO));
+
+    xsnprintf(TEST_FILE, sizeof(TEST_FILE), "%s/input.txt", WORKDIR);
+}
+
+static void tests_teardown(void)
+{
+    char cmd[CF_BUFSIZE];
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", GetStateDir());
+    system(cmd);
+    xsnprintf(cmd, CF_BUFSIZE, "rm -rf '%s'", GetWorkDir());
+    system(cmd);
+}
+
+static void WriteTestFile(const char *contents)
+{
+    FILE *f = fopen(TEST_FILE, "w");
+    assert_true(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+static FnCall *ReadFileCall(void)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, TEST_FILE);
+    RlistAppendScalar(&args, "1024");
+    return FnCallNew("readfile", args);
+}
+
+static void test_not_persistent(void)
+{
+    FnCall *fp = FnCallNew("canonify", NULL);
+    assert_false(FunctionCacheIsPersistent(fp));
+
+    Rval rval;
+    assert_false(FunctionCacheGet(fp, NULL, 300, &rval));
+    FnCallDestroy(fp);
+}
+
+static void test_hit_and_file_invalidation(void)
+{
+    WriteTestFile("one");
+    FnCall *fp = ReadFileCall();
+    assert_true(FunctionCacheIsPersistent(fp));
+
+    Rval rval;
+    const size_t misses = FunctionCacheGetStats()->misses;
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    assert_int_equal(FunctionCacheGetStats()->misses, misses + 1);
+
+    FunctionCachePut(fp, fp->args, (Rval) { "one", RVAL_TYPE_SCALAR });
+
+    const size_t hits = FunctionCacheGetStats()->hits;
+    assert_true(FunctionCacheGet(fp, fp->args, 300, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_SCALAR);
+    assert_string_equal(RvalScalarValue(rval), "one");
+    assert_int_equal(FunctionCacheGetStats()->hits, hits + 1);
+    RvalDestroy(rval);
+
+    /* Changing the size of the file invalidates the entry */
+    WriteTestFile("three");
+    const size_t invalidations = FunctionCacheGetStats()->invalidations;
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    assert_int_equal(FunctionCacheGetStats()->invalidations, invalidations + 1);
+
+    /* Stale entries are removed */
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    assert_int_equal(FunctionCacheGetStats()->invalidations, invalidations + 1);
+
+    FnCallDestroy(fp);
+}
+
+static void test_ttl_and_list(void)
+{
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, "/bin/ls /");
+    RlistAppendScalar(&args, "noshell");
+    FnCall *fp = FnCallNew("execresult", args);
+
+    Rlist *result = NULL;
+    RlistAppendScalar(&result, "bin");
+    RlistAppendScalar(&result, "etc");
+    FunctionCachePut(fp, fp->args, (Rval) { result, RVAL_TYPE_LIST });
+    RlistDestroy(result);
+
+    Rval rval;
+    assert_true(FunctionCacheGet(fp, fp->args, 300, &rval));
+    assert_int_equal(rval.type, RVAL_TYPE_LIST);
+    assert_int_equal(RlistLen(RvalRlistValue(rval)), 2);
+    assert_string_equal(RlistScalarValue(RvalRlistValue(rval)), "bin");
+    RvalDestroy(rval);
+
+    /* Expired */
+    assert_false(FunctionCacheGet(fp, fp->args, 0, &rval));
+
+    FnCallDestroy(fp);
+}
+
+static FnCall *FindFilesCall(const char *pattern)
+{
+    char path[CF_BUFSIZE];
+    xsnprintf(path, sizeof(path), "%s/%s", WORKDIR, pattern);
+
+    Rlist *args = NULL;
+    RlistAppendScalar(&args, path);
+    return FnCallNew("findfiles", args);
+}
+
+static void test_findfiles(void)
+{
+    WriteTestFile("one");
+    FnCall *fp = FindFilesCall("*.txt");
+
+    Rlist *result = NULL;
+    RlistAppendScalar(&result, TEST_FILE);
+    FunctionCachePut(fp, fp->args, (Rval) { result, RVAL_TYPE_LIST });
+    RlistDestroy(result);
+
+    Rval rval;
+    assert_true(FunctionCacheGet(fp, fp->args, 300, &rval));
+    RvalDestroy(rval);
+
+    /* Still there once the database was closed */
+    FunctionCacheClose();
+    assert_true(FunctionCacheGet(fp, fp->args, 300, &rval));
+    RvalDestroy(rval);
+
+    /* A new file in the directory invalidates the entry, even within the
+     * same second */
+    char other[CF_BUFSIZE];
+    xsnprintf(other, sizeof(other), "%s/other.txt", WORKDIR);
+    FILE *f = fopen(other, "w");
+    assert_true(f != NULL);
+    fclose(f);
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    FnCallDestroy(fp);
+
+    /* Patterns matching in several directories are not cached */
+    fp = FindFilesCall("*/input.txt");
+    FunctionCachePut(fp, fp->args, (Rval) { NULL, RVAL_TYPE_LIST });
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    FnCallDestroy(fp);
+
+    fp = FindFilesCall("**");
+    FunctionCachePut(fp, fp->args, (Rval) { NULL, RVAL_TYPE_LIST });
+    assert_false(FunctionCacheGet(fp, fp->args, 300, &rval));
+    FnCallDestroy(fp);
+}
+
+int main()
+{
+    tests_setup();
+
+    const UnitTest tests[] =
+        {
+            unit_test(test_not_persistent),
+            unit_test(test_hit_and_file_invalidation),
+            unit_test(test_ttl_and_list),
+            unit_test(test_findfiles),
+        };
+
+    PRINT_TEST_BANNER();
+    int ret = run_tests(tests);
+
+    FunctionCacheClose();
+    tests_teardown();
+
+    return ret;
+}
@@ -78,6 +78,111 @@ void test_dont_have_tty_interactive_failsafe_is_created(void)
 
 }
 
+void test_in_process_validation_of_invalid_policy(void)
+{
+    CryptoInitialize();
+
+    EvalContext *ctx = EvalContextNew();
+    GenericAgentConfig *config = GenericAgentConfigNewDefault(AGENT_TYPE_AGENT, true);
+    config->validate_in_process = true;
+
+    char *input_file = StringFormat("%s%cinvalid.cf", GetInputDir(), FILE_SEPARATOR);
+    FILE *f = fopen(input_file, "w");
+    assert_true(f != NULL);
+    fputs("bundle agent main\n{\n  reports:\n    \"missing semicolon\"\n}\n", f);
+    fclose(f);
+    GenericAgentConfigSetInputFile(config, NULL, input_file);
+
+    /* Errors are reported instead of exiting and nothing is tagged */
+    assert_true(LoadAndValidatePolicy(ctx, config, true) == NULL);
+
+    char validated_file[PATH_MAX];
+    xsnprintf(validated_file, sizeof(validated_file), "%s%ccf_promises_validated",
+              GetMasterDir(), FILE_SEPARATOR);
+    struct stat buf;
+    assert_int_equal(stat(validated_file, &buf), -1);
+
+    unlink(input_file);
+    free(input_file);
+    GenericAgentFinalize(ctx, config);
+}
+
+void test_in_process_validation_of_unrunnable_policy(void)
+{
+    CryptoInitialize();
+
+    EvalContext *ctx = EvalContextNew();
+    GenericAgentConfig *config = GenericAgentConfigNewDefault(AGENT_TYPE_AGENT, true);
+    config->validate_in_process = true;
+
+    /* Parses, but only the evaluated bundlesequence tells it is invalid */
+    char *input_file = StringFormat("%s%cunrunnable.cf", GetInputDir(), FILE_SEPARATOR);
+    FILE *f = fopen(input_file, "w");
+    assert_true(f != NULL);
+    fputs("body common control\n{\n  bundlesequence => { \"main\", \"undefined_bundle\" };\n}\n"
+          "bundle agent main\n{\n  vars:\n    \"rejected\" string => \"value\";\n}\n", f);
+    fclose(f);
+    GenericAgentConfigSetInputFile(config, NULL, input_file);
+
+    assert_true(LoadAndValidatePolicy(ctx, config, true) == NULL);
+
+    /* Nothing from the rejected policy is left, the discovered context is */
+    VarRef *ref = VarRefParse("default:main.rejected");
+    assert_true(EvalContextVariableGet(ctx, ref, NULL) == NULL);
+    VarRefDestroy(ref);
+    assert_int_equal(StringSetSize(EvalContextGetBundleNames(ctx)), 0);
+    assert_true(EvalContextClassGet(ctx, NULL, "agent") != NULL);
+
+    unlink(input_file);
+    free(input_file);
+    GenericAgentFinalize(ctx, config);
+}
+
+void test_failsafe_after_syntax_error_in_input(void)
+{
+    CryptoInitialize();
+
+    EvalContext *ctx = EvalContextNew();
+    GenericAgentConfig *config = GenericAgentConfigNewDefault(AGENT_TYPE_AGENT, false);
+    config->validate_in_process = true;
+
+    /* The common bundle is resolved before the broken input is parsed */
+    char *input_file = StringFormat("%s%crejected.cf", GetInputDir(), FILE_SEPARATOR);
+    char *broken_file = StringFormat("%s%cbroken.cf", GetInputDir(), FILE_SEPARATOR);
+    FILE *f = fopen(input_file, "w");
+    assert_true(f != NULL);
+    fputs("body common control\n{\n  inputs => { \"broken.cf\" };\n}\n"
+          "bundle common rejected\n{\n  vars:\n    \"var\" string => \"value\";\n"
+          "  classes:\n    \"rejected_class\" expression => \"any\";\n}\n", f);
+    fclose(f);
+    f = fopen(broken_file, "w");
+    assert_true(f != NULL);
+    fputs("bundle agent main\n{\n  reports:\n    \"missing semicolon\"\n}\n", f);
+    fclose(f);
+    GenericAgentConfigSetInputFile(config, NULL, input_file);
+
+    char *failsafe_file = StringFormat("%s%cfailsafe.cf", GetInputDir(), FILE_SEPARATOR);
+    Policy *policy = SelectAndLoadPolicy(config, ctx, true, false);
+    assert_true(policy != NULL);
+    assert_true(EvalContextClassGet(ctx, NULL, "failsafe_fallback") != NULL);
+
+    /* Nothing from the rejected policy is left next to the failsafe one */
+    VarRef *ref = VarRefParse("default:rejected.var");
+    assert_true(EvalContextVariableGet(ctx, ref, NULL) == NULL);
+    VarRefDestroy(ref);
+    assert_true(EvalContextClassGet(ctx, NULL, "rejected_class") == NULL);
+    assert_false(StringSetContains(EvalContextGetBundleNames(ctx), "rejected"));
+
+    unlink(failsafe_file);
+    unlink(broken_file);
+    unlink(input_file);
+    free(failsafe_file);
+    free(broken_file);
+    free(input_file);
+    PolicyDestroy(policy);
+    GenericAgentFinalize(ctx, config);
+}
+
 void test_resolve_absolute_input_path(void)
 {
     assert_string_equal("/abs/aux.cf", GenericAgentResolveInputPath(NULL, "/abs/aux.cf"));
@@ -149,6 +254,9 @@ int main()
         unit_test(test_resolve_relative_base_path),
         unit_test(test_have_tty_interactive_failsafe_is_not_created),
         unit_test(test_dont_have_tty_interactive_failsafe_is_created),
+        unit_test(test_in_process_validation_of_invalid_policy),
+        unit_test(test_in_process_validation_of_unrunnable_policy),
+        unit_test(test_failsafe_after_syntax_error_in_input),
     };
 
     int ret = run_tests(tests);
@@ -0,0 +1,257 @@
+#include <test.h>
+
+#include <mon_network_sniffer.c>                               /* AnalyzePacket */
+
+#define LOCAL_IPV4 "192.168.1.10"
+#define REMOTE_IPV4 "10.0.0.1"
+#define LOCAL_IPV6 "2001:db8::a"
+#define REMOTE_IPV6 "2001:db8::b"
+
+static Item *IP_ADDRESSES = NULL;
+static double cf_this[CF_OBSERVABLES];
+
+static void setup(void)
+{
+    memset(cf_this, 0, sizeof(cf_this));
+    for (int i = 0; i < CF_NETATTR; i++)
+    {
+        DeleteItemList(NETIN_DIST[i]);
+        DeleteItemList(NETOUT_DIST[i]);
+        NETIN_DIST[i] = NULL;
+        NETOUT_DIST[i] = NULL;
+    }
+}
+
+/* Builds an IPv4 header followed by the first bytes of a transport header,
+ * returns the packet length */
+static size_t BuildIPv4(unsigned char *packet, unsigned char proto, const char *src, const char *dest,
+                        const unsigned char *l4, size_t l4_length)
+{
+    memset(packet, 0, 20);
+    packet[0] = 0x45;                                    /* version 4, IHL 5 */
+    packet[9] = proto;
+    assert_int_equal(inet_pton(AF_INET, src, packet + 12), 1);
+    assert_int_equal(inet_pton(AF_INET, dest, packet + 16), 1);
+    memcpy(packet + 20, l4, l4_length);
+    return 20 + l4_length;
+}
+
+static size_t BuildIPv6(unsigned char *packet, unsigned char proto, const char *src, const char *dest,
+                        const unsigned char *l4, size_t l4_length)
+{
+    memset(packet, 0, 40);
+    packet[0] = 0x60;                                            /* version 6 */
+    packet[6] = proto;
+    assert_int_equal(inet_pton(AF_INET6, src, packet + 8), 1);
+    assert_int_equal(inet_pton(AF_INET6, dest, packet + 24), 1);
+    memcpy(packet + 40, l4, l4_length);
+    return 40 + l4_length;
+}
+
+static void BuildTCP(unsigned char *tcp, unsigned char flags)
+{
+    memset(tcp, 0, 20);
+    tcp[0] = 0xc0; tcp[1] = 0x00;                              /* port 49152 */
+    tcp[2] = 0x00; tcp[3] = 0x16;                                  /* port 22 */
+    tcp[12] = 0x50;                                        /* data offset 5 */
+    tcp[13] = flags;
+}
+
+static void BuildUDP(unsigned char *udp, unsigned int src_port, unsigned int dest_port)
+{
+    memset(udp, 0, 8);
+    udp[0] = src_port >> 8; udp[1] = src_port & 0xff;
+    udp[2] = dest_port >> 8; udp[3] = dest_port & 0xff;
+}
+
+static int CounterIn(Item *list, const char *name)
+{
+    Item *ip = ReturnItemIn(list, name);
+    return (ip == NULL) ? 0 : ip->counter;
+}
+
+static void test_ipv4_tcp(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    unsigned char tcp[20];
+    size_t length;
+
+    setup();
+
+    BuildTCP(tcp, 0x02);                                               /* SYN */
+    length = BuildIPv4(packet, IPPROTO_TCP, REMOTE_IPV4, LOCAL_IPV4, tcp, sizeof(tcp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    BuildTCP(tcp, 0x12);                                           /* SYN+ACK */
+    length = BuildIPv4(packet, IPPROTO_TCP, LOCAL_IPV4, REMOTE_IPV4, tcp, sizeof(tcp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    BuildTCP(tcp, 0x10);                                               /* ACK */
+    length = BuildIPv4(packet, IPPROTO_TCP, REMOTE_IPV4, LOCAL_IPV4, tcp, sizeof(tcp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    BuildTCP(tcp, 0x11);                                           /* FIN+ACK */
+    length = BuildIPv4(packet, IPPROTO_TCP, LOCAL_IPV4, REMOTE_IPV4, tcp, sizeof(tcp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    assert_int_equal(cf_this[ob_tcpsyn_in], 1);
+    assert_int_equal(cf_this[ob_tcpsyn_out], 1);
+    assert_int_equal(cf_this[ob_tcpack_in], 1);
+    assert_int_equal(cf_this[ob_tcpack_out], 0);
+    assert_int_equal(cf_this[ob_tcpfin_in], 0);
+    assert_int_equal(cf_this[ob_tcpfin_out], 1);
+
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_TCP_SYN], REMOTE_IPV4), 1);
+    assert_int_equal(CounterIn(NETOUT_DIST[IP_TYPES_TCP_SYN], REMOTE_IPV4), 1);
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_TCP_ACK], REMOTE_IPV4), 1);
+    assert_int_equal(CounterIn(NETOUT_DIST[IP_TYPES_TCP_FIN], REMOTE_IPV4), 1);
+}
+
+static void test_ipv4_udp(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    unsigned char udp[8];
+    size_t length;
+
+    setup();
+
+    BuildUDP(udp, 40000, 53);
+    length = BuildIPv4(packet, IPPROTO_UDP, LOCAL_IPV4, REMOTE_IPV4, udp, sizeof(udp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    BuildUDP(udp, 53, 40000);
+    length = BuildIPv4(packet, IPPROTO_UDP, REMOTE_IPV4, LOCAL_IPV4, udp, sizeof(udp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    BuildUDP(udp, 40000, 123);
+    length = BuildIPv4(packet, IPPROTO_UDP, REMOTE_IPV4, LOCAL_IPV4, udp, sizeof(udp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    assert_int_equal(cf_this[ob_dns_out], 1);
+    assert_int_equal(cf_this[ob_dns_in], 1);
+    assert_int_equal(cf_this[ob_udp_in], 1);
+    assert_int_equal(cf_this[ob_udp_out], 0);
+
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_DNS], REMOTE_IPV4), 1);
+    assert_int_equal(CounterIn(NETOUT_DIST[IP_TYPES_DNS], REMOTE_IPV4), 1);
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_UDP], REMOTE_IPV4), 1);
+}
+
+static void test_ipv4_icmp(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    const unsigned char echo[8] = { 8, 0 };
+    size_t length;
+
+    setup();
+
+    length = BuildIPv4(packet, IPPROTO_ICMP, REMOTE_IPV4, LOCAL_IPV4, echo, sizeof(echo));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    assert_int_equal(cf_this[ob_icmp_in], 1);
+    assert_int_equal(cf_this[ob_icmp_out], 0);
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_ICMP], REMOTE_IPV4), 1);
+}
+
+static void test_ipv6(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    unsigned char tcp[20];
+    unsigned char udp[8];
+    const unsigned char echo[8] = { 128, 0 };
+    size_t length;
+
+    setup();
+
+    BuildTCP(tcp, 0x02);                                               /* SYN */
+    length = BuildIPv6(packet, IPPROTO_TCP, REMOTE_IPV6, LOCAL_IPV6, tcp, sizeof(tcp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IPV6, packet, length, cf_this);
+
+    BuildUDP(udp, 40000, 53);
+    length = BuildIPv6(packet, IPPROTO_UDP, LOCAL_IPV6, REMOTE_IPV6, udp, sizeof(udp));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IPV6, packet, length, cf_this);
+
+    length = BuildIPv6(packet, IPPROTO_ICMPV6, REMOTE_IPV6, LOCAL_IPV6, echo, sizeof(echo));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IPV6, packet, length, cf_this);
+
+    assert_int_equal(cf_this[ob_tcpsyn_in], 1);
+    assert_int_equal(cf_this[ob_dns_out], 1);
+    assert_int_equal(cf_this[ob_icmp_in], 1);
+
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_TCP_SYN], REMOTE_IPV6), 1);
+    assert_int_equal(CounterIn(NETOUT_DIST[IP_TYPES_DNS], REMOTE_IPV6), 1);
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_ICMP], REMOTE_IPV6), 1);
+}
+
+static void test_other_protocols(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    const unsigned char gre[4] = { 0 };
+    size_t length;
+
+    setup();
+
+    length = BuildIPv4(packet, 47, REMOTE_IPV4, LOCAL_IPV4, gre, sizeof(gre));
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    assert_int_equal(cf_this[ob_tcpmisc_in], 1);
+    assert_int_equal(CounterIn(NETIN_DIST[IP_TYPES_TCP_MISC], REMOTE_IPV4), 1);
+}
+
+static void test_malformed_packets(void)
+{
+    unsigned char packet[PACKET_SNAPLEN];
+    unsigned char tcp[20];
+    size_t length;
+
+    setup();
+
+    BuildTCP(tcp, 0x02);
+    length = BuildIPv4(packet, IPPROTO_TCP, REMOTE_IPV4, LOCAL_IPV4, tcp, sizeof(tcp));
+
+    /* Truncated IP header */
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, 19, cf_this);
+
+    /* Header length beyond the captured data */
+    packet[0] = 0x4f;
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, 40, cf_this);
+
+    /* IPv6 packet on an IPv4 protocol */
+    packet[0] = 0x65;
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IP, packet, length, cf_this);
+
+    /* IPv4 packet on an IPv6 protocol */
+    packet[0] = 0x45;
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_IPV6, packet, length, cf_this);
+
+    /* Neither IPv4 nor IPv6 */
+    AnalyzePacket(IP_ADDRESSES, 1, ETH_P_ARP, packet, length, cf_this);
+
+    for (int i = 0; i < CF_OBSERVABLES; i++)
+    {
+        assert_int_equal(cf_this[i], 0);
+    }
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+
+    AppendItem(&IP_ADDRESSES, LOCAL_IPV4, NULL);
+    AppendItem(&IP_ADDRESSES, LOCAL_IPV6, NULL);
+
+    const UnitTest tests[] =
+    {
+        unit_test(test_ipv4_tcp),
+        unit_test(test_ipv4_udp),
+        unit_test(test_ipv4_icmp),
+        unit_test(test_ipv6),
+        unit_test(test_other_protocols),
+        unit_test(test_malformed_packets),
+    };
+
+    int ret = run_tests(tests);
+
+    DeleteItemList(IP_ADDRESSES);
+    return ret;
+}
@@ -0,0 +1,167 @@
+#include <test.h>
+
+#include <policy.h>
+#include <policy_image.h>
+#include <parser.h>
+#include <json.h>
+#include <writer.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <known_dirs.h>
+#include <utime.h>
+
+#define DIGEST "SHA=0123456789abcdef"
+
+char TEMPDIR[] = "/tmp/policy_image_test_XXXXXX";
+
+static Policy *TestParsePolicy(const char *filename, char *path, size_t path_size)
+{
+    xsnprintf(path, path_size, "%s/%s", TESTDATADIR, filename);
+
+    return ParserParseFile(AGENT_TYPE_AGENT, path, 0, 0);
+}
+
+static char *PolicyToJsonString(const Policy *policy)
+{
+    JsonElement *json = PolicyToJson(policy);
+    Writer *w = StringWriter();
+    JsonWriteCompact(w, json);
+    JsonDestroy(json);
+    return StringWriterClose(w);
+}
+
+static void AssertRoundTrip(const char *filename)
+{
+    char path[PATH_MAX];
+    Policy *original = TestParsePolicy(filename, path, sizeof(path));
+    assert_true(original != NULL);
+
+    Buffer *image = PolicyImageSerialize(original, AGENT_TYPE_AGENT, path, DIGEST);
+    Policy *loaded = PolicyImageDeserialize(BufferData(image), BufferSize(image),
+                                            AGENT_TYPE_AGENT, path, DIGEST);
+    assert_true(loaded != NULL);
+
+    char *original_json = PolicyToJsonString(original);
+    char *loaded_json = PolicyToJsonString(loaded);
+    assert_string_equal(original_json, loaded_json);
+    free(original_json);
+    free(loaded_json);
+
+    assert_int_equal(SeqLength(original->custom_promise_types),
+                     SeqLength(loaded->custom_promise_types));
+    for (size_t i = 0; i < SeqLength(original->bundles); i++)
+    {
+        const Bundle *a = SeqAt(original->bundles, i);
+        const Bundle *b = SeqAt(loaded->bundles, i);
+        assert_int_equal(a->offset.line, b->offset.line);
+        assert_int_equal(SeqLength(a->all_promises), SeqLength(b->all_promises));
+        for (size_t j = 0; j < SeqLength(a->all_promises); j++)
+        {
+            const Promise *pa = SeqAt(a->all_promises, j);
+            const Promise *pb = SeqAt(b->all_promises, j);
+            assert_string_equal(pa->promiser, pb->promiser);
+            assert_string_equal(pa->parent_section->promise_type,
+                                pb->parent_section->promise_type);
+            assert_int_equal(pa->offset.line, pb->offset.line);
+            assert_int_equal(pa->promisee.type, pb->promisee.type);
+        }
+    }
+
+    BufferDestroy(image);
+    PolicyDestroy(original);
+    PolicyDestroy(loaded);
+}
+
+static void test_round_trip(void)
+{
+    AssertRoundTrip("benchmark.cf");
+    AssertRoundTrip("bundle_custom_promise_type.cf");
+}
+
+static void test_mismatch(void)
+{
+    char path[PATH_MAX];
+    Policy *original = TestParsePolicy("benchmark.cf", path, sizeof(path));
+    Buffer *image = PolicyImageSerialize(original, AGENT_TYPE_AGENT, path, DIGEST);
+    const char *data = BufferData(image);
+    const size_t size = BufferSize(image);
+
+    /* Another digest, file or agent type */
+    assert_true(PolicyImageDeserialize(data, size, AGENT_TYPE_AGENT, path, "SHA=00") == NULL);
+    assert_true(PolicyImageDeserialize(data, size, AGENT_TYPE_AGENT, "/other.cf", DIGEST) == NULL);
+    assert_true(PolicyImageDeserialize(data, size, AGENT_TYPE_SERVER, path, DIGEST) == NULL);
+
+    /* Truncated images */
+    assert_true(PolicyImageDeserialize(data, size - 1, AGENT_TYPE_AGENT, path, DIGEST) == NULL);
+    assert_true(PolicyImageDeserialize(data, size / 2, AGENT_TYPE_AGENT, path, DIGEST) == NULL);
+    assert_true(PolicyImageDeserialize(data, 3, AGENT_TYPE_AGENT, path, DIGEST) == NULL);
+
+    BufferDestroy(image);
+    PolicyDestroy(original);
+}
+
+static void SetAge(const char *filename, time_t age)
+{
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - age;
+    assert_int_equal(utime(filename, &times), 0);
+}
+
+static void test_store_load_purge(void)
+{
+    char path[PATH_MAX];
+    Policy *original = TestParsePolicy("benchmark.cf", path, sizeof(path));
+    assert_true(PolicyImageStore(original, AGENT_TYPE_AGENT, path, DIGEST));
+
+    char image[PATH_MAX];
+    xsnprintf(image, sizeof(image), "%s/policy_images/agent_0123456789abcdef.img",
+              GetStateDir());
+    struct stat sb;
+    assert_int_equal(stat(image, &sb), 0);
+
+    /* Loading an image in use keeps it from being purged */
+    SetAge(image, 8 * SECONDS_PER_DAY);
+    Policy *loaded = PolicyImageLoad(AGENT_TYPE_AGENT, path, DIGEST);
+    assert_true(loaded != NULL);
+    PolicyImagePurgeOld();
+    assert_int_equal(stat(image, &sb), 0);
+    assert_true(sb.st_mtime > time(NULL) - SECONDS_PER_DAY);
+
+    /* Unused ones are purged */
+    SetAge(image, 8 * SECONDS_PER_DAY);
+    PolicyImagePurgeOld();
+    assert_int_equal(stat(image, &sb), -1);
+
+    PolicyDestroy(loaded);
+    PolicyDestroy(original);
+}
+
+int main()
+{
+    if (mkdtemp(TEMPDIR) == NULL)
+    {
+        fprintf(stderr, "Could not create temporary directory\n");
+        return 1;
+    }
+
+    char *env_var = NULL;
+    xasprintf(&env_var, "CFENGINE_TEST_OVERRIDE_WORKDIR=%s", TEMPDIR);
+    // Will leak, but that's how crappy putenv() is.
+    putenv(env_var);
+
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_round_trip),
+        unit_test(test_mismatch),
+        unit_test(test_store_load_purge),
+    };
+
+    int ret = run_tests(tests);
+
+    char rm_rf[] = "rm -rf ";
+    char cmd[sizeof(rm_rf) + sizeof(TEMPDIR)];
+    xsnprintf(cmd, sizeof(cmd), "%s%s", rm_rf, TEMPDIR);
+    ARG_UNUSED int ignore = system(cmd);
+
+    return ret;
+}
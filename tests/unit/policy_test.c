@@ -455,6 +455,34 @@ static void test_body_action_with_log_repaired_needs_log_string(void)
     }
 }
 
+static void test_promise_constraint_lookup(void)
+{
+    Policy *policy = PolicyNew();
+    Bundle *bundle = PolicyAppendBundle(policy, NamespaceDefault(), "main", "agent",
+                                        NULL, NULL, EVAL_ORDER_UNDEFINED);
+    BundleSection *section = BundleAppendSection(bundle, "files");
+    Promise *pp = BundleSectionAppendPromise(section, "/tmp/foo",
+                                             (Rval) { NULL, RVAL_TYPE_NOPROMISEE },
+                                             "any", NULL);
+
+    assert_true(PromiseGetConstraint(pp, "create") == NULL);
+
+    PromiseAppendConstraint(pp, "create", RvalNew("true", RVAL_TYPE_SCALAR), false);
+    PromiseAppendConstraint(pp, "perms", RvalNew("p", RVAL_TYPE_SCALAR), true);
+    Constraint *cp = PromiseAppendConstraint(pp, "create", RvalNew("false", RVAL_TYPE_SCALAR), false);
+
+    /* Appending an existing lval replaces the constraint in place */
+    assert_int_equal(2, SeqLength(pp->conlist));
+    assert_true(SeqAt(pp->conlist, 0) == cp);
+    assert_true(PromiseGetConstraint(pp, "create") == cp);
+    assert_string_equal("false", RvalScalarValue(PromiseGetConstraint(pp, "create")->rval));
+    assert_string_equal("p", PromiseGetConstraintAsRval(pp, "perms", RVAL_TYPE_SCALAR));
+    assert_true(PromiseGetConstraintWithType(pp, "perms", RVAL_TYPE_LIST) == NULL);
+    assert_true(PromiseGetConstraint(pp, "delete") == NULL);
+
+    PolicyDestroy(policy);
+}
+
 int main()
 {
     PRINT_TEST_BANNER();
@@ -469,6 +497,7 @@ int main()
         unit_test(test_vars_multiple_types),
         unit_test(test_methods_invalid_arity),
         unit_test(test_promise_duplicate_handle),
+        unit_test(test_promise_constraint_lookup),
 
         unit_test(test_policy_json_to_from),
         unit_test(test_policy_json_offsets),
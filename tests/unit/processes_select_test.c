@@ -33,12 +33,77 @@ static void test_SplitProcLine_windows(void)
     }
 }
 
+#ifdef __linux__
+static void test_FormatProcessDuration(void)
+{
+    char buf[32];
+
+    FormatProcessDuration(buf, sizeof(buf), 59, false);
+    assert_string_equal(buf, "00:59");
+    FormatProcessDuration(buf, sizeof(buf), 59, true);
+    assert_string_equal(buf, "00:00:59");
+    FormatProcessDuration(buf, sizeof(buf), 3661, false);
+    assert_string_equal(buf, "01:01:01");
+    FormatProcessDuration(buf, sizeof(buf), 90061, false);
+    assert_string_equal(buf, "1-01:01:01");
+}
+
+static void test_SelectProcessRecord(void)
+{
+    ProcessRecord record = {
+        .pid = 4242,
+        .ppid = 1,
+        .pgid = 4242,
+        .uid = 0,
+        .state = 'S',
+        .nice = 0,
+        .threads = 3,
+        .vsize = 10240,
+        .rsize = 2048,
+        .start_time = 1000,
+        .cpu_time = 90,
+        .user = "root",
+        .tty = "?",
+        .command = "/usr/sbin/sshd -D",
+    };
+
+    ProcessSelect ps = PROCESS_SELECT_INIT;
+
+    /* Unanchored match on the command, like for the ps(1) COMMAND column. */
+    assert_true(SelectProcessRecord(&record, "sshd", &ps, false));
+    assert_false(SelectProcessRecord(&record, "cf-execd", &ps, false));
+
+    ps.min_ppid = 1;
+    ps.max_ppid = 1;
+    assert_true(SelectProcessRecord(&record, "sshd", &ps, true));
+
+    ps.min_ppid = 2;
+    ps.max_ppid = 10;
+    assert_false(SelectProcessRecord(&record, "sshd", &ps, true));
+
+    ps.min_ppid = CF_NOINT;
+    ps.max_ppid = CF_NOINT;
+    ps.min_ttime = 60;
+    ps.max_ttime = 120;
+    ps.status = "S";
+    ps.command = "/usr/sbin/sshd.*";
+    assert_true(SelectProcessRecord(&record, "sshd", &ps, true));
+
+    ps.tty = "pts/.*";
+    assert_false(SelectProcessRecord(&record, "sshd", &ps, true));
+}
+#endif
+
 int main()
 {
     PRINT_TEST_BANNER();
     const UnitTest tests[] =
     {
           unit_test(test_SplitProcLine_windows),
+#ifdef __linux__
+          unit_test(test_FormatProcessDuration),
+          unit_test(test_SelectProcessRecord),
+#endif
     };
 
     return run_tests(tests);
@@ -0,0 +1,78 @@
+#include <test.h>
+
+#include <cf3.defs.h>
+#include <regex_cache.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+
+
+static void test_match(void)
+{
+    assert_true(RegexCacheStringMatchFull("ab+c", "abbbc"));
+    assert_false(RegexCacheStringMatchFull("ab+c", "abbbcd"));
+
+    size_t start, end;
+    assert_true(RegexCacheStringMatch("b+", "abbbc", &start, &end));
+    assert_int_equal(start, 1);
+    assert_int_equal(end, 4);
+    assert_false(RegexCacheStringMatch("x", "abbbc", &start, &end));
+
+    /* Invalid patterns never match */
+    assert_false(RegexCacheStringMatchFull("(unbalanced", "(unbalanced"));
+    assert_true(RegexCacheGet("(unbalanced") == NULL);
+}
+
+static void test_reuse(void)
+{
+    RegexCacheStats before = RegexCacheGetStats();
+
+    Regex *a = RegexCacheGet("^reused[0-9]+$");
+    Regex *b = RegexCacheGet("^reused[0-9]+$");
+    assert_true(a != NULL);
+    assert_true(a == b);
+    assert_true(StringMatchFullWithPrecompiledRegex(a, "reused42"));
+    RegexCacheRelease(a);
+    RegexCacheRelease(b);
+
+    RegexCacheStats after = RegexCacheGetStats();
+    assert_int_equal(after.misses - before.misses, 1);
+    assert_int_equal(after.hits - before.hits, 1);
+}
+
+static void test_eviction(void)
+{
+    /* Held across the evictions below, must stay usable */
+    Regex *held = RegexCacheGet("^held$");
+    assert_true(held != NULL);
+
+    RegexCacheStats before = RegexCacheGetStats();
+
+    char pattern[64];
+    for (int i = 0; i < 2 * REGEX_CACHE_SIZE; i++)
+    {
+        xsnprintf(pattern, sizeof(pattern), "^pattern%d$", i);
+        xsnprintf(pattern + 32, sizeof(pattern) - 32, "pattern%d", i);
+        assert_true(RegexCacheStringMatchFull(pattern, pattern + 32));
+    }
+
+    RegexCacheStats after = RegexCacheGetStats();
+    assert_true(after.evictions - before.evictions >= REGEX_CACHE_SIZE);
+
+    assert_true(StringMatchFullWithPrecompiledRegex(held, "held"));
+    RegexCacheRelease(held);
+
+    /* Recompiled after having been evicted */
+    assert_true(RegexCacheStringMatchFull("^held$", "held"));
+}
+
+int main()
+{
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_match),
+        unit_test(test_reuse),
+        unit_test(test_eviction),
+    };
+
+    return run_tests(tests);
+}
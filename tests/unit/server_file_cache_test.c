@@ -0,0 +1,110 @@
+#include <test.h>
+
+#include <server_file_cache.h>
+#include <misc_lib.h>                                          /* xsnprintf */
+#include <utime.h>
+
+
+static char TEST_DIR[] = "/tmp/server_file_cache_test.XXXXXX";
+static char TEST_FILE[CF_BUFSIZE];
+
+static void WriteTestFile(const char *contents)
+{
+    FILE *f = fopen(TEST_FILE, "w");
+    assert_true(f != NULL);
+    fputs(contents, f);
+    fclose(f);
+}
+
+/* Files modified during the current second are never cached, pretend the
+ * test file was written a while ago. */
+static void AgeTestFile(void)
+{
+    struct utimbuf times = { .actime = time(NULL) - 10, .modtime = time(NULL) - 10 };
+    assert_int_equal(utime(TEST_FILE, &times), 0);
+}
+
+static void test_hit_and_invalidation(void)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE + 1] = { 0 };
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+
+    WriteTestFile("one");
+    AgeTestFile();
+    /* ctime is bumped by utime() too */
+    sleep(1);
+    HashFile(TEST_FILE, expected, HASH_METHOD_MD5, false);
+
+    const ServerFileCacheStats *stats = ServerFileCacheGetStats();
+    const size_t misses = stats->misses;
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_MD5);
+    assert_int_equal(stats->misses, misses + 1);
+    assert_memory_equal(digest, expected, EVP_MAX_MD_SIZE + 1);
+
+    const size_t hits = stats->hits;
+    memset(digest, 0, sizeof(digest));
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_MD5);
+    assert_int_equal(stats->hits, hits + 1);
+    assert_memory_equal(digest, expected, EVP_MAX_MD_SIZE + 1);
+
+    /* Another hash method is not answered from the cache */
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_SHA256);
+    assert_int_equal(stats->hits, hits + 1);
+
+    /* Same size and timestamps, but the file was replaced */
+    char replacement[CF_BUFSIZE];
+    xsnprintf(replacement, sizeof(replacement), "%s/replacement", TEST_DIR);
+    FILE *f = fopen(replacement, "w");
+    assert_true(f != NULL);
+    fputs("two", f);
+    fclose(f);
+    assert_int_equal(rename(replacement, TEST_FILE), 0);
+    AgeTestFile();
+    sleep(1);
+
+    HashFile(TEST_FILE, expected, HASH_METHOD_SHA256, false);
+    const size_t invalidations = stats->invalidations;
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_SHA256);
+    assert_int_equal(stats->invalidations, invalidations + 1);
+    assert_memory_equal(digest, expected, EVP_MAX_MD_SIZE + 1);
+}
+
+static void test_recently_modified(void)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE + 1] = { 0 };
+    unsigned char digest[EVP_MAX_MD_SIZE + 1] = { 0 };
+
+    ServerFileCacheClear();
+    WriteTestFile("three");
+    HashFile(TEST_FILE, expected, HASH_METHOD_MD5, false);
+
+    const ServerFileCacheStats *stats = ServerFileCacheGetStats();
+    const size_t hits = stats->hits;
+    const size_t misses = stats->misses;
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_MD5);
+    ServerFileCacheHashFile(TEST_FILE, digest, HASH_METHOD_MD5);
+    assert_int_equal(stats->hits, hits);
+    assert_int_equal(stats->misses, misses);
+    assert_memory_equal(digest, expected, EVP_MAX_MD_SIZE + 1);
+}
+
+int main()
+{
+    assert_true(mkdtemp(TEST_DIR) != NULL);
+    xsnprintf(TEST_FILE, sizeof(TEST_FILE), "%s/file", TEST_DIR);
+
+    PRINT_TEST_BANNER();
+    const UnitTest tests[] =
+    {
+        unit_test(test_hit_and_invalidation),
+        unit_test(test_recently_modified),
+    };
+
+    int ret = run_tests(tests);
+
+    ServerFileCacheClear();
+    unlink(TEST_FILE);
+    rmdir(TEST_DIR);
+
+    return ret;
+}